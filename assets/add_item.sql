@@ -0,0 +1,2 @@
+select str_val, json_val, blob_val, version, inserted
+	from servo_add_items(array[$1::uuid], array[$2::varchar(255)], array[$3::bigint])
\ No newline at end of file
@@ -0,0 +1 @@
+select client, key, inserted from servo_add_items($1, $2, $3)
\ No newline at end of file
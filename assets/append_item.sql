@@ -0,0 +1,2 @@
+select str_val, json_val, blob_val, version
+	from servo_append_item($1, $2, $3, $4::integer, $5::integer)
\ No newline at end of file
@@ -1 +1,4 @@
-delete from item where client = $1 and key = $2
\ No newline at end of file
+delete from item where client = $1 and key = $2
+	and ($3::bigint is null or version = $3::bigint)
+	returning key, octet_length(str_val), octet_length(json_val::text),
+		coalesce(octet_length(blob_val), servo_blob_size(blob_hash))
\ No newline at end of file
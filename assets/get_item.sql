@@ -1 +1 @@
-select str_val, json_val, blob_val from servo_get_item($1, $2)
\ No newline at end of file
+select str_val, json_val, blob_val, version from servo_get_item($1, $2)
\ No newline at end of file
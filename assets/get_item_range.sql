@@ -0,0 +1,2 @@
+select str_val, json_val, blob_val, version, size, first
+	from servo_get_item_range($1, $2, $3, $4, $5)
\ No newline at end of file
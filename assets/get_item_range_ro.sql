@@ -0,0 +1,3 @@
+select str_val, json_val, blob_val, version, size, first,
+	(select i.idle_ttl from item i where i.client = $1 and i.key = $2)
+	from servo_item_range($1, $2, $3, $4, $5)
\ No newline at end of file
@@ -0,0 +1,5 @@
+select str_val, json_val,
+	coalesce(blob_val, (select b.data from blob b where b.hash = item.blob_hash)), version,
+	idle_ttl
+	from item where client = $1 and key = $2
+	and (expires_at is null or expires_at > now())
\ No newline at end of file
@@ -1,2 +1,2 @@
-insert into item (client, key, last_read, last_write, str_val, json_val, blob_val)
-	values ($1, $2, now(), now(), $3, $4, $5)
\ No newline at end of file
+select version, inserted, str_size, json_size, blob_size
+	from servo_post_item($1, $2, $3, $4, $5, $6::integer, $7::integer)
\ No newline at end of file
@@ -0,0 +1,7 @@
+with b as (delete from blob where hash = any(array(
+	select hash from blob where refs <= 0 limit $1::integer for update skip locked)))
+delete from item where ctid = any(array(
+	select ctid from item where expires_at <= now()
+		order by expires_at limit $1::integer for update skip locked))
+	returning client, key, octet_length(str_val), octet_length(json_val::text),
+		coalesce(octet_length(blob_val), servo_blob_size(blob_hash))
\ No newline at end of file
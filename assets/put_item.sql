@@ -1,2 +1,2 @@
-update item set str_val = $3, json_val = $4, blob_val = $5, last_write = now(),
-	where client = $1 and key = $2
\ No newline at end of file
+select version, inserted, str_size, json_size, blob_size
+	from servo_put_item($1, $2, $3, $4, $5, $6::integer, $7::integer, $8::bigint)
\ No newline at end of file
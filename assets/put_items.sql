@@ -0,0 +1,2 @@
+select client, key, version, inserted, str_size, json_size, blob_size
+	from servo_put_items($1, $2, $3, $4, $5, $6, $7)
\ No newline at end of file
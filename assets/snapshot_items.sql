@@ -0,0 +1 @@
+select client, key from servo_snapshot_items($1::text[])
\ No newline at end of file
@@ -0,0 +1 @@
+select servo_touch_items($1::uuid[], $2::varchar(255)[])
\ No newline at end of file
@@ -0,0 +1,2 @@
+select version, inserted, str_size, json_size, blob_size
+	from servo_upsert_item($1, $2, $3, $4, $5, $6::integer, $7::integer)
\ No newline at end of file
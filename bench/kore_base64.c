@@ -0,0 +1,56 @@
+/*
+ * Base64 encoder vendored for the benchmarks, following Kore 3's
+ * kore_base64_encode(): three bytes at a time into a buffer grown as
+ * it goes, one character appended at a time. Kore is built as a
+ * program, not a library, so its own can't be linked in here; keep
+ * this in step with the Kore release Servo builds against.
+ */
+
+#include "shim.h"
+
+static const char   b64table[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+int
+kore_base64_encode(const void *data, size_t len, char **out)
+{
+    struct kore_buf     *result;
+    const u_int8_t      *ptr;
+    u_int32_t            bytes;
+    size_t               nb;
+    u_int8_t             n;
+
+    ptr = data;
+    result = kore_buf_alloc((len / 3) * 4 + 4);
+
+    while (len > 0) {
+        if (len > 2) {
+            nb = 3;
+            bytes = *ptr++ << 16;
+            bytes |= *ptr++ << 8;
+            bytes |= *ptr++;
+        }
+        else if (len > 1) {
+            nb = 2;
+            bytes = *ptr++ << 16;
+            bytes |= *ptr++ << 8;
+        }
+        else {
+            nb = 1;
+            bytes = *ptr++ << 16;
+        }
+
+        for (n = 0; n < 4; n++) {
+            if (n <= nb)
+                kore_buf_append(result,
+                    &b64table[(bytes >> (18 - n * 6)) & 0x3f], 1);
+            else
+                kore_buf_append(result, "=", 1);
+        }
+        len -= nb;
+    }
+
+    *out = kore_strdup(kore_buf_stringify(result, NULL));
+    kore_buf_free(result);
+    return (KORE_RESULT_OK);
+}
@@ -0,0 +1,167 @@
+#!/usr/bin/env node
+/*
+ * Servo end-to-end load generator.
+ *
+ * Drives a mixed GET/POST/PUT/DELETE workload against a running
+ * Servo (and thus its PostgreSQL) from a number of concurrent client
+ * sessions and prints throughput and latency percentiles as JSON.
+ *
+ *   node bench/load.js --url https://localhost:8080 --clients 32 \
+ *        --duration 30 --mix get=70,post=10,put=15,delete=5
+ */
+
+'use strict';
+
+var https = require('https'),
+    http = require('http'),
+    url = require('url');
+
+var opts = {
+  url: 'https://localhost:8080',
+  clients: 16,
+  duration: 10,
+  keys: 64,
+  size: 128,
+  mix: 'get=70,post=10,put=15,delete=5',
+  commit: 'unknown'
+};
+
+process.argv.slice(2).forEach(function(arg, i, args) {
+  if (arg.substr(0, 2) === '--' && i + 1 < args.length) {
+    var name = arg.substr(2);
+    opts[name] = typeof opts[name] === 'number' ? Number(args[i + 1]) : args[i + 1];
+  }
+});
+
+var target = url.parse(opts.url),
+    transport = target.protocol === 'https:' ? https : http,
+    agent = new transport.Agent({ keepAlive: true, maxSockets: opts.clients }),
+    payload = new Array(opts.size + 1).join('x'),
+    methods = [],
+    stats = {},
+    deadline = Date.now() + opts.duration * 1000,
+    started = process.hrtime();
+
+opts.mix.split(',').forEach(function(part) {
+  var kv = part.split('='),
+      method = kv[0].toUpperCase();
+  for (var i = 0; i < Number(kv[1]); i++)
+    methods.push(method);
+  stats[method] = { latencies: [], errors: 0, codes: {} };
+});
+
+function request(session, method, key, done) {
+  var headers = {
+        'Content-Type': 'text/plain',
+        'Accept': 'text/plain'
+      },
+      body = (method === 'POST' || method === 'PUT') ? payload : null,
+      start = process.hrtime();
+
+  if (session.token)
+    headers['Authorization'] = session.token;
+  if (body)
+    headers['Content-Length'] = Buffer.byteLength(body);
+
+  var req = transport.request({
+    hostname: target.hostname,
+    port: target.port,
+    path: key,
+    method: method,
+    headers: headers,
+    agent: agent,
+    rejectUnauthorized: false
+  }, function(res) {
+    res.on('data', function() {});
+    res.on('end', function() {
+      var t = process.hrtime(start);
+      if (res.headers['authorization'])
+        session.token = res.headers['authorization'];
+      done(null, res.statusCode, t[0] * 1e6 + t[1] / 1e3);
+    });
+  });
+  req.on('error', function(err) { done(err); });
+  if (body)
+    req.write(body);
+  req.end();
+}
+
+function pick(arr) {
+  return arr[Math.floor(Math.random() * arr.length)];
+}
+
+function loop(session, finished) {
+  if (Date.now() >= deadline)
+    return finished();
+
+  var method = pick(methods),
+      key = '/bench-' + Math.floor(Math.random() * opts.keys);
+
+  request(session, method, key, function(err, code, usec) {
+    var s = stats[method];
+    if (err) {
+      s.errors++;
+    }
+    else {
+      s.latencies.push(usec);
+      s.codes[code] = (s.codes[code] || 0) + 1;
+    }
+    loop(session, finished);
+  });
+}
+
+function percentile(sorted, q) {
+  if (sorted.length === 0)
+    return 0;
+  return sorted[Math.min(sorted.length - 1, Math.floor(q * sorted.length))];
+}
+
+function summarize(latencies) {
+  var sorted = latencies.slice().sort(function(a, b) { return a - b; }),
+      sum = sorted.reduce(function(a, b) { return a + b; }, 0);
+  return {
+    count: sorted.length,
+    mean_us: sorted.length ? sum / sorted.length : 0,
+    p50_us: percentile(sorted, 0.50),
+    p99_us: percentile(sorted, 0.99),
+    p999_us: percentile(sorted, 0.999),
+    max_us: sorted.length ? sorted[sorted.length - 1] : 0
+  };
+}
+
+function report() {
+  var t = process.hrtime(started),
+      elapsed = t[0] + t[1] / 1e9,
+      all = [],
+      result = {
+        suite: 'load',
+        commit: opts.commit,
+        timestamp: Math.floor(Date.now() / 1000),
+        config: opts,
+        elapsed_sec: elapsed,
+        operations: {}
+      };
+
+  Object.keys(stats).forEach(function(method) {
+    var s = stats[method],
+        summary = summarize(s.latencies);
+    summary.errors = s.errors;
+    summary.codes = s.codes;
+    summary.throughput = s.latencies.length / elapsed;
+    result.operations[method] = summary;
+    all = all.concat(s.latencies);
+  });
+
+  result.total = summarize(all);
+  result.total.throughput = all.length / elapsed;
+  console.log(JSON.stringify(result, null, 2));
+  agent.destroy();
+}
+
+var running = opts.clients;
+for (var i = 0; i < opts.clients; i++) {
+  loop({ token: null }, function() {
+    if (--running === 0)
+      report();
+  });
+}
@@ -0,0 +1,371 @@
+/*
+ * Servo hot path microbenchmarks.
+ *
+ * Each benchmark runs in batches; the reported figures are per
+ * operation: mean over all batches plus p50/p99 over batch means.
+ * Output is a single JSON document on stdout.
+ */
+
+#include <getopt.h>
+#include <time.h>
+
+#include "shim.h"
+#include "../src/servo.h"
+#include "../src/util.h"
+#include "../src/codec.h"
+
+#define BENCH_BATCHES       100
+#define BENCH_WARMUP        1000
+
+struct bench {
+    const char      *name;
+    void            (*setup)(void);
+    void            (*run)(void);
+    void            (*teardown)(void);
+};
+
+static struct http_request       bench_req;
+static struct connection         bench_conn;
+static struct servo_context     *bench_ctx;
+static char                     *bench_token = NULL;
+static char                     *bench_json_doc = NULL;
+static u_int8_t                  bench_blob[4096];
+static struct kore_buf          *bench_cbor = NULL;
+
+static struct shim_header        hdrs_content[] = {
+    { "content-type",   "application/json; charset=utf-8" },
+    { "accept",         "text/html,application/xhtml+xml,application/json" },
+};
+
+static struct shim_header        hdrs_auth[] = {
+    { "authorization",  NULL },
+};
+
+static u_int64_t
+now_ns(void)
+{
+    struct timespec     ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((u_int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec);
+}
+
+static void
+ctx_reset(void)
+{
+    memset(bench_ctx, 0, sizeof(struct servo_context));
+}
+
+static void
+setup_context(void)
+{
+    ctx_reset();
+    if (!servo_init_context(bench_ctx))
+        abort();
+}
+
+static void
+teardown_context(void)
+{
+    if (bench_ctx->token != NULL)
+        jwt_free(bench_ctx->token);
+    ctx_reset();
+}
+
+static void
+run_content_types(void)
+{
+    servo_read_content_types(&bench_req);
+}
+
+static void
+setup_content_types(void)
+{
+    ctx_reset();
+    shim_set_headers(hdrs_content, 2);
+}
+
+static void
+run_init_context(void)
+{
+    setup_context();
+    teardown_context();
+}
+
+static void
+run_write_token(void)
+{
+    servo_write_context_token(&bench_req);
+}
+
+static void
+setup_read_token(void)
+{
+    struct kore_buf *buf;
+    char            *token;
+
+    setup_context();
+    token = jwt_encode_str(bench_ctx->token);
+    buf = kore_buf_alloc(HTTP_HEADER_MAX_LEN);
+    kore_buf_append(buf, AUTH_TYPE_PREFIX, strlen(AUTH_TYPE_PREFIX));
+    kore_buf_append(buf, token, strlen(token));
+    bench_token = kore_strdup(kore_buf_stringify(buf, NULL));
+    kore_buf_free(buf);
+    free(token);
+    teardown_context();
+
+    hdrs_auth[0].value = bench_token;
+    shim_set_headers(hdrs_auth, 1);
+}
+
+static void
+run_read_token(void)
+{
+    if (!servo_read_context_token(&bench_req))
+        abort();
+    teardown_context();
+}
+
+static void
+teardown_read_token(void)
+{
+    kore_free(bench_token);
+    bench_token = NULL;
+    shim_set_headers(NULL, 0);
+}
+
+static void
+run_response_json(void)
+{
+    servo_response_status(&bench_req, 200, http_status_text(200));
+}
+
+static void
+setup_json(void)
+{
+    struct kore_buf *buf;
+    int              i;
+
+    ctx_reset();
+    buf = kore_buf_alloc(1024);
+    kore_buf_append(buf, "{\"cart\":[", 9);
+    for (i = 0; i < 16; i++) {
+        kore_buf_appendf(buf, "%s{\"sku\":\"item-%04d\",\"qty\":%d,"
+                         "\"price\":%d.99,\"gift\":%s}",
+                         i > 0 ? "," : "", i, i + 1, i * 3,
+                         i % 2 ? "true" : "false");
+    }
+    kore_buf_append(buf, "],\"total\":123.45}", 17);
+    bench_json_doc = kore_strdup(kore_buf_stringify(buf, NULL));
+    kore_buf_free(buf);
+    bench_ctx->in_content_type = SERVO_CONTENT_JSON;
+}
+
+static void
+run_json(void)
+{
+    json_error_t     jerr;
+
+    /* parse as on write and read, serialize as on response */
+    bench_ctx->val_json = json_loads(bench_json_doc, JSON_ALLOW_NUL, &jerr);
+    if (bench_ctx->val_json == NULL)
+        abort();
+    free(servo_item_to_json(bench_ctx));
+    json_decref(bench_ctx->val_json);
+    bench_ctx->val_json = NULL;
+}
+
+static void
+teardown_json(void)
+{
+    kore_free(bench_json_doc);
+    bench_json_doc = NULL;
+    ctx_reset();
+}
+
+static void
+setup_blob(void)
+{
+    size_t  i;
+
+    ctx_reset();
+    for (i = 0; i < sizeof(bench_blob); i++)
+        bench_blob[i] = (u_int8_t)(i * 31);
+}
+
+/* a blob item read back as JSON, base64 by the vendored encoder */
+static void
+setup_item_base64(void)
+{
+    setup_blob();
+    bench_ctx->in_content_type = SERVO_CONTENT_FORMDATA;
+    bench_ctx->val_bin = bench_blob;
+    bench_ctx->val_sz = sizeof(bench_blob);
+}
+
+static void
+run_item_base64(void)
+{
+    free(servo_item_to_string(bench_ctx));
+}
+
+/* {"b": h'...'} as CBOR, the byte string becomes a base64 JSON string */
+static void
+setup_cbor_base64(void)
+{
+    setup_blob();
+    bench_cbor = kore_buf_alloc(sizeof(bench_blob) + 16);
+    kore_buf_append(bench_cbor, "\xa1\x61" "b" "\x59\x10\x00", 6);
+    kore_buf_append(bench_cbor, bench_blob, sizeof(bench_blob));
+}
+
+static void
+run_cbor_base64(void)
+{
+    struct kore_buf *out;
+    int              kind;
+
+    out = kore_buf_alloc(sizeof(bench_blob) * 2);
+    if (!servo_codec_read(SERVO_CONTENT_CBOR, bench_cbor->data,
+                          bench_cbor->offset, out, &kind))
+        abort();
+    kore_buf_free(out);
+}
+
+static void
+teardown_cbor_base64(void)
+{
+    kore_buf_free(bench_cbor);
+    bench_cbor = NULL;
+    ctx_reset();
+}
+
+static struct bench  benchmarks[] = {
+    { "read_content_types",  setup_content_types, run_content_types, ctx_reset },
+    { "init_context",        NULL,                run_init_context,  NULL },
+    { "write_context_token", setup_context,       run_write_token,   teardown_context },
+    { "read_context_token",  setup_read_token,    run_read_token,    teardown_read_token },
+    { "response_json",       ctx_reset,           run_response_json, ctx_reset },
+    { "json_load_dump",      setup_json,          run_json,          teardown_json },
+    { "item_base64_4k",      setup_item_base64,   run_item_base64,   ctx_reset },
+    { "cbor_base64_4k",      setup_cbor_base64,   run_cbor_base64,   teardown_cbor_base64 },
+};
+
+#define benchmarks_size (sizeof(benchmarks) / sizeof(benchmarks[0]))
+
+static int
+cmp_double(const void *a, const void *b)
+{
+    double  x = *(const double *)a, y = *(const double *)b;
+
+    return (x > y) - (x < y);
+}
+
+static json_t *
+bench_run(struct bench *b, size_t iterations)
+{
+    double           samples[BENCH_BATCHES], total;
+    size_t           batch, i, n;
+    u_int64_t        start;
+
+    batch = iterations / BENCH_BATCHES;
+    if (batch == 0)
+        batch = 1;
+
+    if (b->setup != NULL)
+        b->setup();
+
+    for (i = 0; i < BENCH_WARMUP; i++)
+        b->run();
+
+    total = 0;
+    for (n = 0; n < BENCH_BATCHES; n++) {
+        start = now_ns();
+        for (i = 0; i < batch; i++)
+            b->run();
+        samples[n] = (double)(now_ns() - start) / batch;
+        total += samples[n];
+    }
+
+    if (b->teardown != NULL)
+        b->teardown();
+
+    qsort(samples, BENCH_BATCHES, sizeof(double), cmp_double);
+    return json_pack("{s:s s:I s:f s:f s:f s:f}",
+                     "name", b->name,
+                     "iterations", (json_int_t)(batch * BENCH_BATCHES),
+                     "ns_per_op", total / BENCH_BATCHES,
+                     "p50_ns", samples[BENCH_BATCHES / 2],
+                     "p99_ns", samples[BENCH_BATCHES * 99 / 100],
+                     "ops_per_sec", 1e9 / (total / BENCH_BATCHES));
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr, "usage: servo-bench [-n iterations] [-f filter] "
+                    "[-c commit]\n");
+    exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+    int          ch;
+    size_t       i, iterations;
+    const char  *filter, *commit;
+    json_t      *report, *results;
+    char        *out;
+
+    iterations = 100000;
+    filter = NULL;
+    commit = "unknown";
+
+    while ((ch = getopt(argc, argv, "n:f:c:h")) != -1) {
+        switch (ch) {
+        case 'n':
+            iterations = strtoul(optarg, NULL, 10);
+            break;
+        case 'f':
+            filter = optarg;
+            break;
+        case 'c':
+            commit = optarg;
+            break;
+        default:
+            usage();
+        }
+    }
+
+    CONFIG = kore_calloc(1, sizeof(struct servo_config));
+    CONFIG->jwt_alg = JWT_ALG_HS256;
+    CONFIG->jwt_key = "servo-bench-key";
+    CONFIG->jwt_key_len = strlen(CONFIG->jwt_key);
+
+    bench_ctx = kore_calloc(1, sizeof(struct servo_context));
+    memset(&bench_req, 0, sizeof(bench_req));
+    memset(&bench_conn, 0, sizeof(bench_conn));
+    bench_req.owner = &bench_conn;
+    bench_req.method = HTTP_METHOD_GET;
+    bench_req.path = "/bench";
+    bench_req.hdlr_extra = bench_ctx;
+
+    results = json_array();
+    for (i = 0; i < benchmarks_size; i++) {
+        if (filter != NULL && strstr(benchmarks[i].name, filter) == NULL)
+            continue;
+        json_array_append_new(results, bench_run(&benchmarks[i], iterations));
+    }
+
+    report = json_pack("{s:s s:s s:I s:o}",
+                       "suite", "micro",
+                       "commit", commit,
+                       "timestamp", (json_int_t)time(NULL),
+                       "results", results);
+    out = json_dumps(report, JSON_INDENT(2));
+    printf("%s\n", out);
+    free(out);
+    json_decref(report);
+
+    return 0;
+}
@@ -0,0 +1,199 @@
+/*
+ * Minimal stand-in for the parts of the Kore runtime reached by the
+ * benchmarked servo functions, so they can run outside of a worker.
+ * Logging is a no-op and buffers are plain heap memory; everything
+ * else on the measured paths is servo, jansson and libjwt code.
+ */
+
+#include "shim.h"
+
+u_int64_t            http_body_max = 1024 * 1024;
+u_int16_t            worker_count = 1;
+struct kore_worker  *worker = NULL;
+
+static struct shim_header   *shim_headers = NULL;
+static size_t                shim_nheaders = 0;
+size_t                       shim_response_len = 0;
+
+void
+shim_set_headers(struct shim_header *hdrs, size_t n)
+{
+    shim_headers = hdrs;
+    shim_nheaders = n;
+}
+
+void
+kore_log(int prio, const char *fmt, ...)
+{
+    (void)prio;
+    (void)fmt;
+}
+
+void *
+kore_malloc(size_t len)
+{
+    void    *p;
+
+    if ((p = malloc(len)) == NULL)
+        abort();
+    return p;
+}
+
+void *
+kore_calloc(size_t n, size_t len)
+{
+    void    *p;
+
+    if ((p = calloc(n, len)) == NULL)
+        abort();
+    return p;
+}
+
+void *
+kore_realloc(void *ptr, size_t len)
+{
+    void    *p;
+
+    if ((p = realloc(ptr, len)) == NULL)
+        abort();
+    return p;
+}
+
+void
+kore_free(void *ptr)
+{
+    free(ptr);
+}
+
+char *
+kore_strdup(const char *str)
+{
+    return strcpy(kore_malloc(strlen(str) + 1), str);
+}
+
+int
+kore_split_string(char *input, const char *delim, char **out, size_t ele)
+{
+    int      count;
+    char   **ap;
+
+    if (ele == 0)
+        return 0;
+
+    count = 0;
+    for (ap = out; ap < &out[ele - 1] &&
+        (*ap = strsep(&input, delim)) != NULL;) {
+        if (**ap != '\0') {
+            ap++;
+            count++;
+        }
+    }
+    *ap = NULL;
+    return count;
+}
+
+struct kore_buf *
+kore_buf_alloc(size_t initial)
+{
+    struct kore_buf     *buf;
+
+    buf = kore_malloc(sizeof(*buf));
+    buf->data = kore_malloc(initial > 0 ? initial : 128);
+    buf->length = initial > 0 ? initial : 128;
+    buf->offset = 0;
+    buf->flags = 0;
+    return buf;
+}
+
+void
+kore_buf_free(struct kore_buf *buf)
+{
+    free(buf->data);
+    free(buf);
+}
+
+void
+kore_buf_append(struct kore_buf *buf, const void *d, size_t len)
+{
+    if (buf->offset + len + 1 > buf->length) {
+        buf->length = (buf->offset + len + 1) * 2;
+        buf->data = kore_realloc(buf->data, buf->length);
+    }
+    memcpy(buf->data + buf->offset, d, len);
+    buf->offset += len;
+}
+
+void
+kore_buf_appendf(struct kore_buf *buf, const char *fmt, ...)
+{
+    va_list  args;
+    char     str[2048];
+    int      len;
+
+    va_start(args, fmt);
+    len = vsnprintf(str, sizeof(str), fmt, args);
+    va_end(args);
+
+    if (len > 0)
+        kore_buf_append(buf, str, MIN((size_t)len, sizeof(str) - 1));
+}
+
+char *
+kore_buf_stringify(struct kore_buf *buf, size_t *len)
+{
+    kore_buf_append(buf, "", 1);
+    buf->offset--;
+    if (len != NULL)
+        *len = buf->offset;
+    return (char *)buf->data;
+}
+
+int
+http_request_header(struct http_request *req, const char *name, char **out)
+{
+    size_t  i;
+
+    (void)req;
+    for (i = 0; i < shim_nheaders; i++) {
+        if (strcasecmp(shim_headers[i].name, name) == 0) {
+            *out = shim_headers[i].value;
+            return (KORE_RESULT_OK);
+        }
+    }
+    return (KORE_RESULT_ERROR);
+}
+
+void
+http_response_header(struct http_request *req, const char *name,
+                     const char *value)
+{
+    (void)req;
+    shim_response_len += strlen(name) + strlen(value);
+}
+
+void
+http_response(struct http_request *req, int status, const void *d, size_t len)
+{
+    (void)d;
+    req->status = status;
+    shim_response_len += len;
+}
+
+const char *
+http_status_text(int status)
+{
+    switch (status) {
+    case 200:
+        return "OK";
+    case 201:
+        return "Created";
+    default:
+        return "";
+    }
+}
+
+void *
+http_state_get(struct http_request *req)
+{
+    return req->hdlr_extra;
+}
@@ -0,0 +1,24 @@
+#ifndef _SERVO_BENCH_SHIM_H_
+#define _SERVO_BENCH_SHIM_H_
+
+#include <sys/param.h>
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include <kore/kore.h>
+#include <kore/http.h>
+
+struct shim_header {
+    char    *name;
+    char    *value;
+};
+
+/* response bytes "sent" through the shim, keeps results observable */
+extern size_t        shim_response_len;
+
+void                 shim_set_headers(struct shim_header *, size_t);
+
+#endif //_SERVO_BENCH_SHIM_H_
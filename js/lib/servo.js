@@ -82,12 +82,15 @@
 			self = this;
 
 		var requestCallback = function(err, xhr, body) {
-			if (!self.authHeader) {
-				if (xhr && xhr.getResponseHeader)
-					self.authHeader = xhr.getResponseHeader('authorization');
-				if (xhr && xhr.headers)
-					self.authHeader = xhr.headers['authorization'];
-			}
+			// every response carries the newest token, with the time
+			// of the last write that routes reads to the primary
+			var authHeader;
+			if (xhr && xhr.getResponseHeader)
+				authHeader = xhr.getResponseHeader('authorization');
+			if (xhr && xhr.headers)
+				authHeader = xhr.headers['authorization'];
+			if (authHeader)
+				self.authHeader = authHeader;
 
 			if (!err && self.authHeader == undefined) {
 				throw 'No auth header assigned';
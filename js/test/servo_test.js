@@ -2,6 +2,8 @@
 
 var servo = require('../lib/servo.js');
 var uuidV4 = require('uuid/v4');
+var request = require('request');
+var WebSocket = require('ws');
 
 /*
   ======== A Handy Little Nodeunit Reference ========
@@ -28,6 +30,9 @@ var servoUrl = 'https://localhost:8080',
   appKey = uuidV4(),
   authMode = 'HS512';
 
+// set when the server runs with [writeback] flush, upserts answer 202
+var writeBehind = !!process.env.SERVO_WRITE_BEHIND;
+
 
 var sleepFor = function(duration) {
     var now = new Date().getTime();
@@ -38,6 +43,117 @@ function sleep(ms) {
   return new Promise(resolve => setTimeout(resolve, ms));
 }
 
+/*
+  Plain HTTP requests for the cases the client has no options for.
+  A step has the method, key, headers and body to send, the expected
+  status and an optional check(res, body). Headers may be a function,
+  called when the step is sent, to pass on what an earlier response
+  returned. Bodies are Buffers when the step sets binary. Requests go
+  with the session token of the last response.
+*/
+function send(session, step, callback) {
+  var headers = typeof step.headers == 'function' ?
+        step.headers() : (step.headers || {}),
+      req = {
+        method: step.method,
+        url: servoUrl + '/' + step.key,
+        rejectUnauthorized: false,
+        agent: false,
+        headers: {}
+      };
+  for (var h in headers) {
+    req.headers[h] = headers[h];
+  }
+  if (session.authHeader) {
+    req.headers['Authorization'] = session.authHeader;
+  }
+  if (step.body !== undefined) {
+    req.body = step.body;
+  }
+  if (step.binary) {
+    req.encoding = null;
+  }
+
+  request(req, function(err, res, body) {
+    if (res && res.headers['authorization']) {
+      session.authHeader = res.headers['authorization'];
+    }
+    callback(err, res, body);
+  });
+}
+
+/*
+  Each step is sent after the previous one answered, a step with a
+  delay that many milliseconds later.
+*/
+function series(test, steps) {
+  var session = {};
+
+  var next = function(i) {
+    if (i == steps.length) {
+      test.done();
+      return;
+    }
+    var step = steps[i];
+    setTimeout(function() {
+      send(session, step, function(err, res, body) {
+        if (err) {
+          test.ok(false, step.method + ' ' + step.key + ' failed: ' + err);
+          test.done();
+          return;
+        }
+        test.equal(res.statusCode, step.status, 'unexpected status on ' +
+          step.method + ' ' + step.key);
+        if (step.check) {
+          step.check(res, body);
+        }
+        next(i + 1);
+      });
+    }, step.delay || 0);
+  };
+  next(0);
+}
+
+/*
+  Sends the same step n times at once, the responses are passed to
+  callback in the order they came, errors left out.
+*/
+function burst(session, step, n, callback) {
+  var responses = [],
+      pending = n;
+
+  for (var i = 0; i < n; i++) {
+    send(session, step, function(err, res) {
+      if (!err) {
+        responses.push(res);
+      }
+      if (--pending == 0) {
+        callback(responses);
+      }
+    });
+  }
+}
+
+/*
+  Calls back once the Bloom filter of the server is rebuilt, as reported
+  in /_metrics, false if it isn't within tries half seconds.
+*/
+function bloomReady(tries, callback) {
+  request({url: servoUrl + '/_metrics', rejectUnauthorized: false,
+           agent: false},
+    function(err, res, body) {
+      if (!err && /^servo_bloom_ready 1$/m.test(body)) {
+        callback(true);
+      }
+      else if (tries <= 1) {
+        callback(false);
+      }
+      else {
+        setTimeout(function() { bloomReady(tries - 1, callback); }, 500);
+      }
+    });
+}
+
 exports['servo_tests'] = {
 
   constuct: function(test) {
@@ -188,6 +304,579 @@ exports['servo_tests'] = {
         test.done();
       }
     });
+  },
+
+  conditional_writes: function(test) {
+    var key = 'test-match-' + uuidV4(),
+        text = {'Content-Type': 'text/plain', 'Accept': 'text/plain'},
+        first, second;
+
+    var match = function(name, etag) {
+      return function() {
+        var h = {'Content-Type': 'text/plain'};
+        h[name] = etag();
+        return h;
+      };
+    };
+
+    series(test, [
+      { method: 'POST', key: key, headers: text, body: 'one', status: 201,
+        check: function(res) {
+          first = res.headers['etag'];
+          test.ok(first, 'no etag on post');
+        } },
+      { method: 'POST', key: key, headers: text, body: 'again', status: 409 },
+      { method: 'PUT', key: key, body: 'two', status: 200,
+        headers: match('If-Match', function() { return first; }),
+        check: function(res) {
+          second = res.headers['etag'];
+          test.notEqual(second, first, 'etag should change on put');
+        } },
+      { method: 'PUT', key: key, body: 'stale', status: 412,
+        headers: match('If-Match', function() { return first; }) },
+      { method: 'PUT', key: key, body: 'exists', status: 412,
+        headers: match('If-None-Match', function() { return '*'; }) },
+      { method: 'GET', key: key, headers: text, status: 200,
+        check: function(res, body) {
+          test.equal(body, 'two', 'failed writes should leave the item');
+        } },
+      { method: 'DELETE', key: key, status: 412,
+        headers: match('If-Match', function() { return first; }) },
+      { method: 'DELETE', key: key, status: 200,
+        headers: match('If-Match', function() { return second; }) },
+      { method: 'PUT', key: key, body: 'three', status: 201,
+        headers: match('If-None-Match', function() { return '*'; }) }
+    ]);
+  },
+
+  // expects write behind to be off, it answers upserts with 202
+  put_upsert: function(test) {
+    var key = 'test-upsert-' + uuidV4(),
+        text = {'Content-Type': 'text/plain', 'Accept': 'text/plain'};
+
+    series(test, [
+      { method: 'PUT', key: key, headers: text, body: 'one', status: 404 },
+      { method: 'PUT', key: key + '?upsert=1', headers: text, body: 'one',
+        status: 201 },
+      { method: 'PUT', key: key + '?upsert=1', headers: text, body: 'two',
+        status: 200 },
+      { method: 'GET', key: key, headers: text, status: 200,
+        check: function(res, body) {
+          test.equal(body, 'two', 'upsert should replace the item');
+        } }
+    ]);
+  },
+
+  get_range: function(test) {
+    var key = 'test-range-' + uuidV4(),
+        data = 'abcdefghijklmnopqrstuvwxyz',
+        etag;
+
+    var range = function(spec, ifRange) {
+      return function() {
+        var h = {'Range': 'bytes=' + spec};
+        if (ifRange) {
+          h['If-Range'] = ifRange();
+        }
+        return h;
+      };
+    };
+
+    series(test, [
+      { method: 'POST', key: key, status: 201,
+        headers: {'Content-Type': 'application/base64'},
+        body: new Buffer(data).toString('base64'),
+        check: function(res) { etag = res.headers['etag']; } },
+      { method: 'GET', key: key, headers: range('0-3'), binary: true,
+        status: 206,
+        check: function(res, body) {
+          test.equal(body.toString(), 'abcd', 'unexpected first bytes');
+          test.equal(res.headers['content-range'], 'bytes 0-3/26',
+            'unexpected content-range of first bytes');
+        } },
+      { method: 'GET', key: key, headers: range('-4'), binary: true,
+        status: 206,
+        check: function(res, body) {
+          test.equal(body.toString(), 'wxyz', 'unexpected last bytes');
+          test.equal(res.headers['content-range'], 'bytes 22-25/26',
+            'unexpected content-range of last bytes');
+        } },
+      { method: 'GET', key: key, headers: range('24-'), binary: true,
+        status: 206,
+        check: function(res, body) {
+          test.equal(body.toString(), 'yz', 'unexpected open range');
+        } },
+      { method: 'GET', key: key, headers: range('30-'), status: 416,
+        check: function(res) {
+          test.equal(res.headers['content-range'], 'bytes */26',
+            '416 should carry the size');
+        } },
+      { method: 'GET', key: key, binary: true, status: 206,
+        headers: range('4-7', function() { return etag; }),
+        check: function(res, body) {
+          test.equal(body.toString(), 'efgh', 'unexpected if-range bytes');
+        } },
+      { method: 'GET', key: key, status: 200,
+        headers: range('4-7', function() { return '"0"'; }),
+        check: function(res) {
+          test.equal(res.headers['content-range'], undefined,
+            'a stale if-range should return the whole item');
+        } }
+    ]);
+  },
+
+  cbor_msgpack: function(test) {
+    var mapKey = 'test-cbor-' + uuidV4(),
+        textKey = 'test-msgpack-' + uuidV4(),
+        blobKey = 'test-bytes-' + uuidV4(),
+        cbor = {'Content-Type': 'application/cbor'},
+        msgpack = {'Content-Type': 'application/msgpack'};
+
+    var bytes = function(expected, what) {
+      return function(res, body) {
+        test.equal(body.toString('hex'), new Buffer(expected).toString('hex'),
+          'unexpected ' + what);
+      };
+    };
+
+    series(test, [
+      // {"a": 1} as CBOR, read back in every format
+      { method: 'POST', key: mapKey, headers: cbor,
+        body: new Buffer([0xa1, 0x61, 0x61, 0x01]), status: 201 },
+      { method: 'GET', key: mapKey, headers: {'Accept': 'application/json'},
+        status: 200,
+        check: function(res, body) {
+          test.deepEqual(JSON.parse(body), {a: 1}, 'unexpected json of cbor');
+        } },
+      { method: 'GET', key: mapKey, headers: {'Accept': 'application/cbor'},
+        binary: true, status: 200,
+        check: bytes([0xa1, 0x61, 0x61, 0x01], 'cbor map') },
+      { method: 'GET', key: mapKey, headers: {'Accept': 'application/msgpack'},
+        binary: true, status: 200,
+        check: bytes([0x81, 0xa1, 0x61, 0x01], 'msgpack map') },
+
+      // "hi" as MessagePack is a text item
+      { method: 'POST', key: textKey, headers: msgpack,
+        body: new Buffer([0xa2, 0x68, 0x69]), status: 201 },
+      { method: 'GET', key: textKey, headers: {'Accept': 'text/plain'},
+        status: 200,
+        check: function(res, body) {
+          test.equal(body, 'hi', 'unexpected text of msgpack');
+        } },
+      { method: 'GET', key: textKey, headers: {'Accept': 'application/cbor'},
+        binary: true, status: 200,
+        check: bytes([0x62, 0x68, 0x69], 'cbor text') },
+
+      // a byte string is a blob, returned raw
+      { method: 'POST', key: blobKey, headers: cbor,
+        body: new Buffer([0x43, 0x01, 0x02, 0x03]), status: 201 },
+      { method: 'GET', key: blobKey, headers: {'Accept': 'application/msgpack'},
+        binary: true, status: 200,
+        check: bytes([0xc4, 0x03, 0x01, 0x02, 0x03], 'msgpack bytes') },
+
+      // a text string cut short
+      { method: 'POST', key: 'test-broken-' + uuidV4(), headers: cbor,
+        body: new Buffer([0x62, 0x68]), status: 400 }
+    ]);
+  },
+
+  expiry: function(test) {
+    var ttlKey = 'test-ttl-' + uuidV4(),
+        idleKey = 'test-idle-' + uuidV4(),
+        text = {'Content-Type': 'text/plain', 'Accept': 'text/plain'};
+
+    series(test, [
+      { method: 'POST', key: ttlKey + '?ttl=1', headers: text, body: 'gone',
+        status: 201 },
+      { method: 'GET', key: ttlKey, headers: text, status: 200 },
+      { method: 'GET', key: ttlKey, headers: text, status: 404, delay: 2000 },
+
+      // each read pushes an idle expiry back
+      { method: 'POST', key: idleKey + '?idle=2', headers: text, body: 'kept',
+        status: 201 },
+      { method: 'GET', key: idleKey, headers: text, status: 200, delay: 1000 },
+      { method: 'GET', key: idleKey, headers: text, status: 200, delay: 1000 },
+      { method: 'GET', key: idleKey, headers: text, status: 200, delay: 1000 },
+      { method: 'GET', key: idleKey, headers: text, status: 404, delay: 3000 },
+
+      // an expired key may be taken again
+      { method: 'POST', key: ttlKey, headers: text, body: 'back', status: 201 }
+    ]);
+  },
+
+  // expects a [limit] client_burst below 100, as in the Readme example
+  rate_limit: function(test) {
+    var session = {},
+        key = 'test-limit-' + uuidV4(),
+        text = {'Content-Type': 'text/plain', 'Accept': 'text/plain'};
+
+    send(session, {method: 'POST', key: key, headers: text, body: 'x'},
+      function(err, res) {
+        test.equal(res && res.statusCode, 201, 'unexpected status on post');
+        burst(session, {method: 'GET', key: key, headers: text}, 100,
+          function(responses) {
+            var limited = responses.filter(function(r) {
+              return r.statusCode == 429;
+            });
+            test.ok(limited.length > 0, 'no request of the burst was limited');
+            limited.forEach(function(r) {
+              test.ok(parseInt(r.headers['retry-after'], 10) > 0,
+                '429 without a retry-after');
+            });
+            responses.forEach(function(r) {
+              test.ok(r.statusCode == 200 || r.statusCode == 429,
+                'unexpected status ' + r.statusCode + ' in a burst');
+            });
+            test.done();
+          });
+      });
+  },
+
+  // expects a [pool] queue_depth well below 100, new sessions each
+  pool_overload: function(test) {
+    // short, within string_size, the burst is what overloads the pool
+    burst({}, {method: 'POST', key: 'test-pool-' + uuidV4(), body: 'x',
+               headers: {'Content-Type': 'text/plain'}}, 100,
+      function(responses) {
+        var rejected = responses.filter(function(r) {
+          return r.statusCode == 503;
+        });
+        test.ok(rejected.length > 0, 'no request of the burst was rejected');
+        rejected.forEach(function(r) {
+          test.ok(parseInt(r.headers['retry-after'], 10) > 0,
+            '503 without a retry-after');
+        });
+        responses.forEach(function(r) {
+          test.ok(r.statusCode == 201 || r.statusCode == 503,
+            'unexpected status ' + r.statusCode + ' in a burst');
+        });
+        test.done();
+      });
+  },
+
+  // expects [counter] flush on, at most 500 ms
+  patch_incr_append: function(test) {
+    var counter = 'test-counter-' + uuidV4(),
+        textKey = 'test-append-' + uuidV4(),
+        listKey = 'test-append-list-' + uuidV4(),
+        text = {'Content-Type': 'text/plain', 'Accept': 'text/plain'},
+        json = {'Content-Type': 'application/json',
+                'Accept': 'application/json'};
+
+    series(test, [
+      // summed up in the worker, answered before the flush
+      { method: 'PATCH', key: counter + '?op=incr&by=2', status: 202 },
+      { method: 'PATCH', key: counter + '?op=incr&by=3', status: 202 },
+      { method: 'PATCH', key: counter + '?op=decr', status: 202 },
+      { method: 'GET', key: counter, headers: text, status: 200, delay: 1000,
+        check: function(res, body) {
+          test.equal(body, '4', 'increments should be summed by the flush');
+        } },
+
+      { method: 'POST', key: textKey, headers: text, body: 'ab', status: 201 },
+      { method: 'PATCH', key: textKey + '?op=append', headers: text,
+        body: 'cd', status: 200 },
+      { method: 'GET', key: textKey, headers: text, status: 200,
+        check: function(res, body) {
+          test.equal(body, 'abcd', 'unexpected text after append');
+        } },
+
+      { method: 'POST', key: listKey, headers: json, body: '[1]', status: 201 },
+      { method: 'PATCH', key: listKey + '?op=append', headers: json,
+        body: '{"b": 2}', status: 200 },
+      { method: 'GET', key: listKey, headers: json, status: 200,
+        check: function(res, body) {
+          test.deepEqual(JSON.parse(body), [1, {b: 2}],
+            'unexpected array after append');
+        } },
+
+      // refused before and by the database
+      { method: 'PATCH', key: textKey + '?op=nope', headers: text, body: 'x',
+        status: 400 },
+      { method: 'PATCH', key: textKey + '?op=append',
+        headers: {'Content-Type': 'application/cbor'},
+        body: new Buffer([0x43, 0x01, 0x02, 0x03]), status: 400 },
+      { method: 'PATCH', key: listKey + '?op=append', headers: json,
+        body: '{broken', status: 400 },
+      { method: 'PATCH', key: textKey + '?op=append', headers: text,
+        body: new Array(201).join('x'), status: 200 },
+      { method: 'PATCH', key: textKey + '?op=append', headers: text,
+        body: new Array(101).join('x'), status: 403 },
+      { method: 'GET', key: textKey, headers: text, status: 200,
+        check: function(res, body) {
+          test.equal(body.length, 204, 'a refused append should change nothing');
+        } }
+    ]);
+  },
+
+  // expects [writeback] flush on, at most 500 ms, see writeBehind
+  write_behind: function(test) {
+    var key = 'test-behind-' + uuidV4(),
+        text = {'Content-Type': 'text/plain', 'Accept': 'text/plain'},
+        etag;
+
+    series(test, [
+      { method: 'PUT', key: key + '?upsert=1', headers: text, body: 'one',
+        status: 202,
+        check: function(res) {
+          test.equal(res.headers['etag'], undefined,
+            'a write behind has no version yet');
+        } },
+      { method: 'GET', key: key, headers: text, status: 200,
+        check: function(res, body) {
+          test.equal(body, 'one', 'a pending write should be read back');
+          test.equal(res.headers['etag'], undefined,
+            'a pending write has no version yet');
+        } },
+      { method: 'GET', key: key, headers: text, status: 200, delay: 1000,
+        check: function(res, body) {
+          etag = res.headers['etag'];
+          test.ok(etag, 'no etag once flushed');
+          test.equal(body, 'one', 'unexpected value once flushed');
+        } },
+
+      // waits for the flush of the pending write, which moves the version
+      { method: 'PUT', key: key + '?upsert=1', headers: text, body: 'two',
+        status: 202 },
+      { method: 'PUT', key: key, body: 'three', status: 412,
+        headers: function() {
+          return {'Content-Type': 'text/plain', 'If-Match': etag};
+        } },
+      { method: 'GET', key: key, headers: text, status: 200,
+        check: function(res, body) {
+          test.equal(body, 'two', 'the write behind should have gone first');
+        } }
+    ]);
+  },
+
+  // expects a [quota] of items = 3 and bytes = 200
+  session_quota: function(test) {
+    var key = 'test-quota-' + uuidV4(),
+        text = {'Content-Type': 'text/plain', 'Accept': 'text/plain'},
+        value = new Array(51).join('a');
+
+    var usage = function(items, bytes) {
+      return function(res, body) {
+        var stats = JSON.parse(body);
+        test.deepEqual(stats.quota, {items: 3, bytes: 200},
+          'unexpected quota in the session stats');
+        test.equal(stats.usage && stats.usage.items, items,
+          'unexpected items in the session usage');
+        test.equal(stats.usage && stats.usage.bytes.text, bytes,
+          'unexpected text bytes in the session usage');
+      };
+    };
+
+    series(test, [
+      { method: 'GET', key: '', status: 200, check: usage(0, 0) },
+      { method: 'POST', key: key + '-1', headers: text, body: value,
+        status: 201 },
+      { method: 'POST', key: key + '-2', headers: text, body: value,
+        status: 201 },
+      { method: 'POST', key: key + '-3', headers: text, body: value,
+        status: 201 },
+
+      // only writes that must create an item are held to the item quota
+      { method: 'POST', key: key + '-4', headers: text, body: 'x',
+        status: 403 },
+      { method: 'PUT', key: key + '-4', body: 'x', status: 403,
+        headers: {'Content-Type': 'text/plain', 'If-None-Match': '*'} },
+      { method: 'PUT', key: key + '-1?upsert=1', headers: text, body: value,
+        status: writeBehind ? 202 : 200 },
+
+      // the new value counts on top of the usage
+      { method: 'PUT', key: key + '-2?upsert=1', headers: text,
+        body: value + value, status: 403 },
+      { method: 'GET', key: '', status: 200, delay: writeBehind ? 1000 : 0,
+        check: usage(3, 150) }
+    ]);
+  },
+
+  long_poll: function(test) {
+    var session = {},
+        key = 'test-wait-' + uuidV4(),
+        text = {'Content-Type': 'text/plain', 'Accept': 'text/plain'},
+        etag, started, pending = 2;
+
+    var finish = function() {
+      if (--pending == 0) {
+        test.done();
+      }
+    };
+
+    var watch = function(timeout) {
+      return {method: 'GET', headers: text,
+              key: key + '?wait=' + etag.replace(/"/g, '') +
+                   '&timeout=' + timeout};
+    };
+
+    send(session, {method: 'POST', key: key, headers: text, body: 'one'},
+      function(err, res) {
+        test.equal(res && res.statusCode, 201, 'unexpected status on post');
+        etag = res.headers['etag'];
+
+        // nothing written, back when the timeout is up
+        started = Date.now();
+        send(session, watch(1), function(err, res) {
+          test.equal(res && res.statusCode, 304, 'unexpected status on timeout');
+          test.ok(Date.now() - started >= 900, 'watch returned too early');
+
+          // woken by a write well before the timeout
+          started = Date.now();
+          send(session, watch(10), function(err, res, body) {
+            test.equal(res && res.statusCode, 200, 'unexpected status on wake');
+            test.equal(body, 'two', 'watch should return the new value');
+            test.ok(Date.now() - started < 5000, 'watch was not woken');
+            finish();
+          });
+          setTimeout(function() {
+            send(session, {method: 'PUT', key: key, body: 'two',
+                           headers: {'Content-Type': 'text/plain',
+                                     'If-Match': etag}},
+              function(err, res) {
+                test.equal(res && res.statusCode, 200, 'unexpected status on put');
+                finish();
+              });
+          }, 300);
+        });
+      });
+  },
+
+  // one socket, its operations answered in the order sent
+  websocket: function(test) {
+    var ws = new WebSocket(servoUrl.replace(/^http/, 'ws') + '/_ws',
+                           {rejectUnauthorized: false}),
+        key = '/test-ws-' + uuidV4(),
+        version, changed = null, waiting = false, step = 0, op;
+
+    var steps = [
+      { msg: {op: 'put', key: key, value: {a: 1}, upsert: true}, status: 200 },
+      { msg: {op: 'get', key: key}, status: 200,
+        check: function(reply) {
+          test.deepEqual(reply.value, {a: 1}, 'unexpected value on get');
+          version = reply.version;
+        } },
+      { msg: {op: 'watch', key: key}, status: 200 },
+      // the change is pushed once the write is notified
+      { msg: function() {
+          return {op: 'put', key: key, value: {a: 2}, version: version};
+        }, status: 200, change: true,
+        check: function(reply) { version = reply.version; } },
+      { msg: {op: 'unwatch', key: key}, status: 200,
+        check: function() {
+          test.deepEqual(changed.value, {a: 2},
+            'unexpected value in the change event');
+        } },
+      { msg: function() {
+          return {op: 'delete', key: key, version: version};
+        }, status: 200 },
+      { msg: {op: 'get', key: key}, status: 404 }
+    ];
+
+    var next = function() {
+      var msg;
+
+      if (step == steps.length) {
+        ws.close();
+        return;
+      }
+      msg = steps[step].msg;
+      msg = typeof msg == 'function' ? msg() : msg;
+      msg.id = step + 1;
+      op = msg.op;
+      ws.send(JSON.stringify(msg));
+    };
+
+    ws.on('message', function(data) {
+      var reply = JSON.parse(data);
+
+      if (reply.event == 'session') {
+        test.ok(reply.client && reply.token, 'no session on connect');
+        next();
+        return;
+      }
+      if (reply.event == 'change') {
+        test.equal(reply.key, key, 'change event of another key');
+        changed = reply;
+        if (waiting) {
+          waiting = false;
+          next();
+        }
+        return;
+      }
+      test.equal(reply.id, step + 1, 'replies should come in order');
+      test.equal(reply.status, steps[step].status, 'unexpected status on ' + op);
+      if (steps[step].check) {
+        steps[step].check(reply);
+      }
+      waiting = steps[step].change && changed === null;
+      step++;
+      if (!waiting) {
+        next();
+      }
+    });
+    ws.on('error', function(err) {
+      test.ok(false, 'websocket failed: ' + err);
+    });
+    ws.on('close', function() {
+      test.equal(step, steps.length, 'websocket closed early');
+      test.done();
+    });
+  },
+
+  // expects no [filter] origin list, or one allowing http://localhost
+  preflight: function(test) {
+    series(test, [
+      { method: 'OPTIONS', key: 'test-preflight-' + uuidV4(), status: 204,
+        headers: {'Origin': 'http://localhost',
+                  'Access-Control-Request-Method': 'PUT',
+                  'Access-Control-Request-Headers': 'if-match'},
+        check: function(res) {
+          var methods = res.headers['access-control-allow-methods'] || '';
+          test.ok(methods.indexOf('PUT') != -1, 'PUT is not allowed');
+          test.ok((res.headers['access-control-allow-headers'] || '')
+            .indexOf('if-match') != -1, 'if-match is not allowed');
+          test.ok(parseInt(res.headers['access-control-max-age'], 10) > 0,
+            'no max age to cache the preflight');
+          test.equal(res.headers['authorization'], undefined,
+            'a preflight should not start a session');
+        } }
+    ]);
+  },
+
+  // expects [bloom] on and [counter] flush on, at most 500 ms
+  bloom_filter: function(test) {
+    var key = 'test-bloom-' + uuidV4(),
+        text = {'Content-Type': 'text/plain', 'Accept': 'text/plain'};
+
+    bloomReady(60, function(ready) {
+      test.ok(ready, 'bloom filter was not rebuilt in time');
+      series(test, [
+        { method: 'GET', key: key + '-missing', headers: text, status: 404 },
+
+        // in the filter before the flush that creates them
+        { method: 'PUT', key: key + '-upsert?upsert=1', headers: text,
+          body: 'x', status: writeBehind ? 202 : 201 },
+        { method: 'PATCH', key: key + '-counter?op=incr', status: 202 },
+        { method: 'GET', key: key + '-upsert', headers: text, status: 200,
+          delay: 1000,
+          check: function(res, body) {
+            test.equal(body, 'x', 'unexpected value of the upsert');
+          } },
+        { method: 'GET', key: key + '-counter', headers: text, status: 200,
+          check: function(res, body) {
+            test.equal(body, '1', 'unexpected value of the counter');
+          } }
+      ]);
+    });
   }
 
 };
+
+// upserts are answered either way, each test expects one
+if (writeBehind) {
+  delete exports['servo_tests'].put_upsert;
+}
+else {
+  delete exports['servo_tests'].write_behind;
+}
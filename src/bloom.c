@@ -0,0 +1,340 @@
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <math.h>
+#include <signal.h>
+
+#include <libpq-fe.h>
+
+#include "bloom.h"
+#include "util.h"
+
+/*
+ * Negative lookup index for item reads.
+ *
+ * The first worker to find a filter left by a former run of servo
+ * resets it and rebuilds it in the background, streaming every key
+ * from every shard. Until then each lookup is a maybe.
+ *
+ * Inserts count their key before the query is sent, so a key whose
+ * insert may have committed is never missing, and only take it back
+ * out when the insert definitely failed. Deletes are counted once the
+ * filter is ready only: a decrement racing the rebuild could clear a
+ * counter shared with a key that was already scanned. Keys the filter
+ * keeps too long just cost a query, like any false positive.
+ *
+ * Each shard is scanned in key order, without blocking the worker on
+ * its connection. A scan that fails is retried with backoff from the
+ * last key counted, so no key is counted twice, and the counters of
+ * concurrent inserts are kept.
+ */
+
+#define BLOOM_BUILD_INTERVAL    10
+#define BLOOM_BUILD_BATCH       5000
+#define BLOOM_RETRY_MIN         1000
+#define BLOOM_RETRY_MAX         60000
+
+static struct servo_bloom_header    *bloom = NULL;
+static u_int8_t                     *bloom_counters = NULL;
+static size_t                        bloom_size = 0;
+
+/* rebuild progress, in the worker doing it */
+static PGconn                       *bloom_conn = NULL;
+static int                           bloom_scanning = 0;
+static size_t                        bloom_shard = 0;
+static u_int64_t                     bloom_scanned = 0;
+static u_int64_t                     bloom_retry = BLOOM_RETRY_MIN;
+
+/* last key counted in the shard, a retry resumes after it */
+static int                           bloom_resume = 0;
+static char                          bloom_last_client[CLIENT_UUID_LEN];
+static char                          bloom_last_key[1024];  /* 255 chars */
+
+static void     bloom_build(void *, u_int64_t);
+
+int
+servo_bloom_init(const char *path, size_t items, double fp_rate)
+{
+    int          fd;
+    size_t       len;
+    u_int32_t    k;
+    pid_t        main_pid;
+    void        *map;
+
+    /* workers only, the filter is rebuilt by one of them */
+    if (items == 0 || path == NULL || worker == NULL)
+        return (KORE_RESULT_OK);
+
+    if (fp_rate <= 0 || fp_rate >= 1)
+        fp_rate = 0.01;
+
+    /* optimal number of counters and hashes for expected items */
+    bloom_size = (size_t)ceil(-(double)items * log(fp_rate) /
+                              (M_LN2 * M_LN2));
+    k = (u_int32_t)round((double)bloom_size / items * M_LN2);
+    if (k == 0)
+        k = 1;
+    len = sizeof(struct servo_bloom_header) + bloom_size;
+
+    fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd == -1) {
+        kore_log(LOG_ERR, "%s: failed to open '%s': %s",
+                 __FUNCTION__, path, errno_s);
+        return (KORE_RESULT_ERROR);
+    }
+
+    if (flock(fd, LOCK_EX) == -1 || ftruncate(fd, len) == -1) {
+        kore_log(LOG_ERR, "%s: failed to prepare '%s': %s",
+                 __FUNCTION__, path, errno_s);
+        close(fd);
+        return (KORE_RESULT_ERROR);
+    }
+
+    map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        kore_log(LOG_ERR, "%s: failed to map '%s': %s",
+                 __FUNCTION__, path, errno_s);
+        close(fd);
+        return (KORE_RESULT_ERROR);
+    }
+    bloom = map;
+    bloom_counters = (u_int8_t *)(bloom + 1);
+
+    /* keys may have changed since the filter was built */
+    main_pid = getppid();
+    if (bloom->owner != main_pid ||
+        bloom->size != bloom_size ||
+        bloom->k != k) {
+        memset(map, 0, len);
+        bloom->size = bloom_size;
+        bloom->k = k;
+        bloom->owner = main_pid;
+    }
+
+    /* build it, or take over from a builder that died */
+    if (!bloom->ready && (bloom->builder == 0 ||
+        (kill(bloom->builder, 0) == -1 && errno == ESRCH))) {
+        bloom->builder = getpid();
+        kore_log(LOG_NOTICE, "building bloom filter, %zu counters, %u hashes",
+                 bloom_size, k);
+        kore_timer_add(bloom_build, BLOOM_BUILD_INTERVAL, NULL,
+                       KORE_TIMER_ONESHOT);
+    }
+
+    flock(fd, LOCK_UN);
+    close(fd);
+    return (KORE_RESULT_OK);
+}
+
+static void
+bloom_hash(const uuid_t client_id, const char *key,
+           u_int64_t *h1, u_int64_t *h2)
+{
+    *h1 = servo_item_hash(client_id, key);
+    *h2 = (((*h1 >> 32) | (*h1 << 32)) * 0x9e3779b97f4a7c15ULL) | 1;
+}
+
+static void
+bloom_update(const uuid_t client_id, const char *key, int delta)
+{
+    u_int64_t    h1, h2;
+    u_int32_t    i;
+    u_int8_t    *c, old, val;
+
+    bloom_hash(client_id, key, &h1, &h2);
+    for (i = 0; i < bloom->k; i++) {
+        c = &bloom_counters[(h1 + i * h2) % bloom_size];
+        old = __atomic_load_n(c, __ATOMIC_RELAXED);
+        do {
+            /* saturated counters stick, empty ones stay empty */
+            if (old == UINT8_MAX || (delta < 0 && old == 0))
+                break;
+            val = old + delta;
+        } while (!__atomic_compare_exchange_n(c, &old, val, 1,
+                                              __ATOMIC_RELAXED,
+                                              __ATOMIC_RELAXED));
+    }
+    __atomic_add_fetch(&bloom->items, delta, __ATOMIC_RELAXED);
+}
+
+int
+servo_bloom_ready(void)
+{
+    return bloom != NULL && __atomic_load_n(&bloom->ready, __ATOMIC_ACQUIRE);
+}
+
+int
+servo_bloom_maybe(const uuid_t client_id, const char *key)
+{
+    u_int64_t    h1, h2;
+    u_int32_t    i;
+
+    if (!servo_bloom_ready())
+        return 1;
+
+    bloom_hash(client_id, key, &h1, &h2);
+    for (i = 0; i < bloom->k; i++) {
+        if (__atomic_load_n(&bloom_counters[(h1 + i * h2) % bloom_size],
+                            __ATOMIC_RELAXED) == 0)
+            return 0;
+    }
+    return 1;
+}
+
+void
+servo_bloom_add(const uuid_t client_id, const char *key)
+{
+    if (bloom != NULL)
+        bloom_update(client_id, key, 1);
+}
+
+void
+servo_bloom_undo(const uuid_t client_id, const char *key)
+{
+    if (bloom != NULL)
+        bloom_update(client_id, key, -1);
+}
+
+void
+servo_bloom_remove(const uuid_t client_id, const char *key)
+{
+    if (servo_bloom_ready())
+        bloom_update(client_id, key, -1);
+}
+
+int
+servo_bloom_estimate(int *ready, u_int64_t *items, double *fp_rate)
+{
+    int64_t      n;
+
+    if (bloom == NULL)
+        return (KORE_RESULT_ERROR);
+
+    n = __atomic_load_n(&bloom->items, __ATOMIC_RELAXED);
+    *ready = servo_bloom_ready();
+    *items = n > 0 ? (u_int64_t)n : 0;
+    *fp_rate = pow(1 - exp(-(double)bloom->k * *items / bloom_size),
+                   bloom->k);
+    return (KORE_RESULT_OK);
+}
+
+static void
+bloom_build_fail(const char *what)
+{
+    kore_log(LOG_ERR, "bloom filter rebuild failed to %s: %s, retry in %llu ms",
+             what, bloom_conn != NULL ? PQerrorMessage(bloom_conn) : "",
+             (unsigned long long)bloom_retry);
+    if (bloom_conn != NULL)
+        PQfinish(bloom_conn);
+    bloom_conn = NULL;
+    bloom_scanning = 0;
+    kore_timer_add(bloom_build, bloom_retry, NULL, KORE_TIMER_ONESHOT);
+    bloom_retry = MIN(bloom_retry * 2, BLOOM_RETRY_MAX);
+}
+
+/* keys of the shard in order, after the last one counted */
+static int
+bloom_scan(void)
+{
+    const char  *params[2];
+
+    if (!bloom_resume)
+        return PQsendQuery(bloom_conn,
+            "select client, key from item order by key, client");
+
+    params[0] = bloom_last_key;
+    params[1] = bloom_last_client;
+    return PQsendQueryParams(bloom_conn,
+        "select client, key from item where (key, client) > ($1, $2::uuid) "
+        "order by key, client", 2, NULL, params, NULL, NULL, 0);
+}
+
+/* stream keys of one shard after another in batches */
+static void
+bloom_build(void *arg, u_int64_t now)
+{
+    PGresult    *res;
+    uuid_t       client_id;
+    int          n;
+
+    (void)arg;
+    (void)now;
+
+    if (bloom_conn == NULL) {
+        if (bloom_shard == CONFIG->ndatabases) {
+            __atomic_store_n(&bloom->ready, 1, __ATOMIC_RELEASE);
+            bloom->builder = 0;
+            kore_log(LOG_NOTICE, "bloom filter ready, %llu keys",
+                     (unsigned long long)bloom_scanned);
+            return;
+        }
+
+        bloom_conn = PQconnectStart(CONFIG->databases[bloom_shard]);
+        if (bloom_conn == NULL || PQstatus(bloom_conn) == CONNECTION_BAD) {
+            bloom_build_fail("connect");
+            return;
+        }
+    }
+
+    /* connect without blocking the worker, as in watch.c */
+    if (!bloom_scanning) {
+        switch (PQconnectPoll(bloom_conn)) {
+        case PGRES_POLLING_OK:
+            break;
+        case PGRES_POLLING_FAILED:
+            bloom_build_fail("connect");
+            return;
+        default:
+            kore_timer_add(bloom_build, BLOOM_BUILD_INTERVAL, NULL,
+                           KORE_TIMER_ONESHOT);
+            return;
+        }
+        if (!bloom_scan() || !PQsetSingleRowMode(bloom_conn)) {
+            bloom_build_fail("query");
+            return;
+        }
+        bloom_scanning = 1;
+    }
+
+    if (!PQconsumeInput(bloom_conn)) {
+        bloom_build_fail("read");
+        return;
+    }
+
+    for (n = 0; n < BLOOM_BUILD_BATCH && !PQisBusy(bloom_conn); n++) {
+        res = PQgetResult(bloom_conn);
+        if (res == NULL) {
+            PQfinish(bloom_conn);
+            bloom_conn = NULL;
+            bloom_scanning = 0;
+            bloom_resume = 0;
+            bloom_retry = BLOOM_RETRY_MIN;
+            bloom_shard++;
+            break;
+        }
+
+        switch (PQresultStatus(res)) {
+        case PGRES_SINGLE_TUPLE:
+            if (uuid_parse(PQgetvalue(res, 0, 0), client_id) == 0) {
+                bloom_update(client_id, PQgetvalue(res, 0, 1), 1);
+                bloom_scanned++;
+            }
+            kore_strlcpy(bloom_last_client, PQgetvalue(res, 0, 0),
+                         sizeof(bloom_last_client));
+            kore_strlcpy(bloom_last_key, PQgetvalue(res, 0, 1),
+                         sizeof(bloom_last_key));
+            bloom_resume = 1;
+            break;
+        case PGRES_TUPLES_OK:
+            break;
+        default:
+            PQclear(res);
+            bloom_build_fail("scan");
+            return;
+        }
+        PQclear(res);
+    }
+
+    kore_timer_add(bloom_build, BLOOM_BUILD_INTERVAL, NULL,
+                   KORE_TIMER_ONESHOT);
+}
@@ -0,0 +1,33 @@
+#ifndef _SERVO_BLOOM_H_
+#define _SERVO_BLOOM_H_
+
+#include <sys/types.h>
+
+#include <kore/kore.h>
+#include <kore/http.h>
+
+#include "servo.h"
+
+/*
+ * Counting Bloom filter of existing (client, key) pairs, shared by
+ * all workers through a memory mapped file. Counters are 8 bit and
+ * updated atomically, a saturated counter sticks.
+ */
+struct servo_bloom_header {
+    size_t               size;
+    u_int32_t            k;
+    pid_t                owner;
+    pid_t                builder;
+    int                  ready;
+    int64_t              items;
+};
+
+int                  servo_bloom_init(const char *, size_t, double);
+int                  servo_bloom_ready(void);
+int                  servo_bloom_maybe(const uuid_t, const char *);
+void                 servo_bloom_add(const uuid_t, const char *);
+void                 servo_bloom_undo(const uuid_t, const char *);
+void                 servo_bloom_remove(const uuid_t, const char *);
+int                  servo_bloom_estimate(int *, u_int64_t *, double *);
+
+#endif //_SERVO_BLOOM_H_
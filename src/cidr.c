@@ -0,0 +1,266 @@
+#include <sys/stat.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#include "cidr.h"
+
+/*
+ * Client address allowlist.
+ *
+ * The ranges of [filter] ip_address and of the lines in ip_file are
+ * compiled into a binary trie, one bit of the address per level, with
+ * node 0 the root of IPv4 and node 1 of IPv6. A peer is allowed when
+ * the walk down its address meets a node ending a range, so a lookup
+ * takes at most 32 or 128 steps and never formats the address.
+ *
+ * Workers check the file for changes and swap in a new trie, one that
+ * doesn't parse leaves the old one in place.
+ */
+
+#define CIDR_ROOT_V4            0
+#define CIDR_ROOT_V6            1
+#define CIDR_RELOAD_INTERVAL    5000
+
+static struct servo_cidr    *cidr_allow = NULL;
+static time_t                cidr_mtime = 0;
+static off_t                 cidr_size = 0;
+
+static void     cidr_reload(void *, u_int64_t);
+
+struct servo_cidr *
+servo_cidr_alloc(void)
+{
+    struct servo_cidr   *t;
+
+    t = kore_calloc(1, sizeof(struct servo_cidr));
+    t->cap = 64;
+    t->nodes = kore_calloc(t->cap, sizeof(struct cidr_node));
+    t->nnodes = 2;
+    return t;
+}
+
+void
+servo_cidr_free(struct servo_cidr *t)
+{
+    if (t == NULL)
+        return;
+    kore_free(t->nodes);
+    kore_free(t);
+}
+
+static u_int32_t
+cidr_node_new(struct servo_cidr *t)
+{
+    if (t->nnodes == t->cap) {
+        t->cap *= 2;
+        t->nodes = kore_realloc(t->nodes, t->cap * sizeof(struct cidr_node));
+        memset(t->nodes + t->nnodes, 0,
+               (t->cap - t->nnodes) * sizeof(struct cidr_node));
+    }
+    return t->nnodes++;
+}
+
+/* address/prefix or a single address, IPv4 or IPv6 */
+int
+servo_cidr_add(struct servo_cidr *t, const char *range)
+{
+    u_int8_t     addr[16];
+    char         buf[INET6_ADDRSTRLEN + 5], *p, *end;
+    long         bits, maxbits;
+    u_int32_t    n, next;
+    int          i, bit;
+
+    if (strlen(range) >= sizeof(buf))
+        return (KORE_RESULT_ERROR);
+    kore_strlcpy(buf, range, sizeof(buf));
+
+    maxbits = strchr(buf, ':') != NULL ? 128 : 32;
+    bits = maxbits;
+    if ((p = strchr(buf, '/')) != NULL) {
+        *p++ = '\0';
+        errno = 0;
+        bits = strtol(p, &end, 10);
+        if (errno != 0 || end == p || *end != '\0' ||
+            bits < 0 || bits > maxbits)
+            return (KORE_RESULT_ERROR);
+    }
+    if (inet_pton(maxbits == 32 ? AF_INET : AF_INET6, buf, addr) != 1)
+        return (KORE_RESULT_ERROR);
+
+    n = maxbits == 32 ? CIDR_ROOT_V4 : CIDR_ROOT_V6;
+    for (i = 0; i < bits; i++) {
+        /* covered by a shorter range already */
+        if (t->nodes[n].match)
+            break;
+        bit = (addr[i / 8] >> (7 - i % 8)) & 1;
+        if (t->nodes[n].child[bit] == 0) {
+            next = cidr_node_new(t);
+            t->nodes[n].child[bit] = next;
+        }
+        n = t->nodes[n].child[bit];
+    }
+    t->nodes[n].match = 1;
+    t->nranges++;
+    return (KORE_RESULT_OK);
+}
+
+int
+servo_cidr_match(const struct servo_cidr *t, int family, const u_int8_t *addr)
+{
+    u_int32_t    n;
+    int          i, nbits;
+
+    if (family == AF_INET) {
+        n = CIDR_ROOT_V4;
+        nbits = 32;
+    }
+    else if (family == AF_INET6) {
+        n = CIDR_ROOT_V6;
+        nbits = 128;
+    }
+    else
+        return 0;
+
+    for (i = 0; i < nbits; i++) {
+        if (t->nodes[n].match)
+            return 1;
+        n = t->nodes[n].child[(addr[i / 8] >> (7 - i % 8)) & 1];
+        if (n == 0)
+            return 0;
+    }
+    return t->nodes[n].match != 0;
+}
+
+/* ranges separated by commas or blanks */
+static int
+cidr_add_list(struct servo_cidr *t, char *list, const char *where)
+{
+    char        *range, *last;
+
+    for (range = strtok_r(list, ", \t\r\n", &last); range != NULL;
+         range = strtok_r(NULL, ", \t\r\n", &last)) {
+        if (!servo_cidr_add(t, range)) {
+            kore_log(LOG_ERR, "invalid address range '%s' in %s",
+                     range, where);
+            return (KORE_RESULT_ERROR);
+        }
+    }
+    return (KORE_RESULT_OK);
+}
+
+/* one or more ranges a line, # starts a comment */
+static int
+cidr_add_file(struct servo_cidr *t, const char *path)
+{
+    FILE        *fp;
+    char         line[1024], *p;
+    int          rc;
+
+    if ((fp = fopen(path, "r")) == NULL) {
+        kore_log(LOG_ERR, "failed to open %s: %s", path, errno_s);
+        return (KORE_RESULT_ERROR);
+    }
+    rc = KORE_RESULT_OK;
+    while (rc == KORE_RESULT_OK && fgets(line, sizeof(line), fp) != NULL) {
+        if ((p = strchr(line, '#')) != NULL)
+            *p = '\0';
+        rc = cidr_add_list(t, line, path);
+    }
+    fclose(fp);
+    return rc;
+}
+
+static struct servo_cidr *
+cidr_compile(void)
+{
+    struct servo_cidr   *t;
+    char                *list;
+    int                  rc;
+
+    t = servo_cidr_alloc();
+    rc = KORE_RESULT_OK;
+    if (CONFIG->allow_ipaddr != NULL) {
+        list = kore_strdup(CONFIG->allow_ipaddr);
+        rc = cidr_add_list(t, list, "[filter] ip_address");
+        kore_free(list);
+    }
+    if (rc == KORE_RESULT_OK && CONFIG->allow_ipfile != NULL)
+        rc = cidr_add_file(t, CONFIG->allow_ipfile);
+    if (rc != KORE_RESULT_OK) {
+        servo_cidr_free(t);
+        return NULL;
+    }
+    return t;
+}
+
+static int
+cidr_file_changed(void)
+{
+    struct stat     st;
+
+    if (stat(CONFIG->allow_ipfile, &st) == -1)
+        return 0;
+    if (st.st_mtime == cidr_mtime && st.st_size == cidr_size)
+        return 0;
+    cidr_mtime = st.st_mtime;
+    cidr_size = st.st_size;
+    return 1;
+}
+
+int
+servo_cidr_init(void)
+{
+    if (CONFIG->allow_ipaddr == NULL && CONFIG->allow_ipfile == NULL)
+        return (KORE_RESULT_OK);
+
+    if (CONFIG->allow_ipfile != NULL)
+        cidr_file_changed();
+    if ((cidr_allow = cidr_compile()) == NULL)
+        return (KORE_RESULT_ERROR);
+    kore_log(LOG_NOTICE, "  allowed address ranges: %zu", cidr_allow->nranges);
+
+    if (CONFIG->allow_ipfile != NULL)
+        kore_timer_add(cidr_reload, CIDR_RELOAD_INTERVAL, NULL, 0);
+    return (KORE_RESULT_OK);
+}
+
+static void
+cidr_reload(void *arg, u_int64_t now)
+{
+    struct servo_cidr   *t;
+
+    (void)arg;
+    (void)now;
+
+    if (!cidr_file_changed())
+        return;
+    if ((t = cidr_compile()) == NULL) {
+        kore_log(LOG_ERR, "keeping previous address ranges");
+        return;
+    }
+    servo_cidr_free(cidr_allow);
+    cidr_allow = t;
+    kore_log(LOG_NOTICE, "reloaded %zu address ranges from %s",
+             t->nranges, CONFIG->allow_ipfile);
+}
+
+int
+servo_cidr_allowed(struct connection *c)
+{
+    const u_int8_t  *a;
+
+    if (cidr_allow == NULL)
+        return 1;
+
+    if (c->addrtype == AF_INET)
+        return servo_cidr_match(cidr_allow, AF_INET,
+                   (const u_int8_t *)&c->addr.ipv4.sin_addr);
+    if (c->addrtype != AF_INET6)
+        return 0;
+
+    /* IPv4 peers of dual stack sockets, ::ffff:a.b.c.d */
+    a = (const u_int8_t *)&c->addr.ipv6.sin6_addr;
+    if (IN6_IS_ADDR_V4MAPPED(&c->addr.ipv6.sin6_addr))
+        return servo_cidr_match(cidr_allow, AF_INET, a + 12);
+    return servo_cidr_match(cidr_allow, AF_INET6, a);
+}
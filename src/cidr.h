@@ -0,0 +1,34 @@
+#ifndef _SERVO_CIDR_H_
+#define _SERVO_CIDR_H_
+
+#include <sys/types.h>
+
+#include <kore/kore.h>
+#include <kore/http.h>
+
+#include "servo.h"
+
+/* trie node, children are indices into the node array, 0 for none */
+struct cidr_node {
+    u_int32_t                        child[2];
+    u_int32_t                        match;
+};
+
+/* address ranges compiled into a binary prefix trie per family */
+struct servo_cidr {
+    struct cidr_node                *nodes;
+    size_t                           nnodes;
+    size_t                           cap;
+    size_t                           nranges;
+};
+
+struct servo_cidr   *servo_cidr_alloc(void);
+void                 servo_cidr_free(struct servo_cidr *);
+int                  servo_cidr_add(struct servo_cidr *, const char *);
+int                  servo_cidr_match(const struct servo_cidr *, int,
+                                      const u_int8_t *);
+
+int                  servo_cidr_init(void);
+int                  servo_cidr_allowed(struct connection *);
+
+#endif //_SERVO_CIDR_H_
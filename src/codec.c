@@ -0,0 +1,1103 @@
+#include <errno.h>
+#include <math.h>
+
+#include "codec.h"
+#include "util.h"
+
+/*
+ * CBOR and MessagePack items.
+ *
+ * A body is read straight into the value it carries: a top level text
+ * string is a TEXT item, a byte string a BLOB, anything else is written
+ * out as JSON text while it is read, without a document in between.
+ * Nested byte strings become base64 strings in JSON, NaN and infinities
+ * null, integer map keys strings.
+ *
+ * JSON items are encoded from their stored text in two passes over it,
+ * the first counts the members of each object and array, since both
+ * formats put the count in front of them. Blobs go out as byte strings.
+ */
+
+/* what the bytes of a string are written as */
+#define CODEC_RAW       0
+#define CODEC_JSON      1
+#define CODEC_HEX       2
+
+/* kinds of heads, the CBOR major types */
+#define CODEC_UINT      0
+#define CODEC_NEGINT    1
+#define CODEC_BYTES     2
+#define CODEC_TEXT      3
+#define CODEC_ARRAY     4
+#define CODEC_MAP       5
+
+/* MessagePack values, as far as JSON tells them apart */
+#define MP_NIL          0
+#define MP_BOOL         1
+#define MP_UINT         2
+#define MP_INT          3
+#define MP_FLOAT        4
+#define MP_STR          5
+#define MP_BIN          6
+#define MP_ARRAY        7
+#define MP_MAP          8
+
+struct codec_reader {
+    const u_int8_t      *p;
+    const u_int8_t      *end;
+    struct kore_buf     *out;
+};
+
+struct codec_writer {
+    const char          *p;
+    const char          *end;
+    int                  type;
+    struct kore_buf     *out;       /* NULL while counting */
+    struct kore_buf     *str;       /* a string unescaped */
+    struct kore_buf     *counts;    /* members, in order of the opening */
+    size_t               next;
+};
+
+static int
+codec_take(struct codec_reader *r, u_int64_t n, const u_int8_t **s)
+{
+    if ((u_int64_t)(r->end - r->p) < n)
+        return (KORE_RESULT_ERROR);
+    *s = r->p;
+    r->p += n;
+    return (KORE_RESULT_OK);
+}
+
+/* big endian unsigned of n bytes */
+static int
+codec_uint(struct codec_reader *r, size_t n, u_int64_t *v)
+{
+    const u_int8_t  *s;
+    size_t           i;
+
+    if (!codec_take(r, n, &s))
+        return (KORE_RESULT_ERROR);
+    for (*v = 0, i = 0; i < n; i++)
+        *v = *v << 8 | s[i];
+    return (KORE_RESULT_OK);
+}
+
+static void
+codec_put(struct kore_buf *out, const u_int8_t *s, size_t len, int how)
+{
+    static const char    hex[] = "0123456789abcdef";
+    char                 esc[8];
+    size_t               i, run;
+
+    switch (how) {
+        case CODEC_RAW:
+            kore_buf_append(out, s, len);
+            break;
+
+        case CODEC_HEX:
+            for (i = 0; i < len; i++) {
+                esc[0] = hex[s[i] >> 4];
+                esc[1] = hex[s[i] & 0x0f];
+                kore_buf_append(out, esc, 2);
+            }
+            break;
+
+        case CODEC_JSON:
+            for (i = 0, run = 0; i < len; i++) {
+                if (s[i] >= 0x20 && s[i] != '"' && s[i] != '\\')
+                    continue;
+                kore_buf_append(out, s + run, i - run);
+                if (s[i] == '"' || s[i] == '\\')
+                    snprintf(esc, sizeof(esc), "\\%c", s[i]);
+                else
+                    snprintf(esc, sizeof(esc), "\\u%04x", s[i]);
+                kore_buf_append(out, esc, strlen(esc));
+                run = i + 1;
+            }
+            kore_buf_append(out, s + run, len - run);
+            break;
+    }
+}
+
+static void
+codec_put_base64(struct kore_buf *out, const u_int8_t *s, size_t len)
+{
+    char        *b64;
+
+    kore_buf_append(out, "\"", 1);
+    if (len > 0 && kore_base64_encode(s, len, &b64)) {
+        kore_buf_append(out, b64, strlen(b64));
+        kore_free(b64);
+    }
+    kore_buf_append(out, "\"", 1);
+}
+
+/* -1 - v, which may be one below the least int64 */
+static void
+codec_put_negative(struct kore_buf *out, u_int64_t v)
+{
+    if (v == UINT64_MAX)
+        kore_buf_appendf(out, "-18446744073709551616");
+    else
+        kore_buf_appendf(out, "-%llu", (unsigned long long)v + 1);
+}
+
+static void
+codec_put_double(struct kore_buf *out, double d)
+{
+    char        num[32];
+
+    if (isnan(d) || isinf(d)) {
+        kore_buf_append(out, "null", 4);
+        return;
+    }
+    /* shortest of the two that reads back the same */
+    snprintf(num, sizeof(num), "%.15g", d);
+    if (strtod(num, NULL) != d)
+        snprintf(num, sizeof(num), "%.17g", d);
+    kore_buf_append(out, num, strlen(num));
+}
+
+static double
+codec_half(u_int16_t h)
+{
+    int          e, m;
+    double       d;
+
+    e = (h >> 10) & 0x1f;
+    m = h & 0x3ff;
+    if (e == 0)
+        d = ldexp(m, -24);
+    else if (e != 31)
+        d = ldexp(m + 1024, e - 25);
+    else
+        d = m == 0 ? INFINITY : NAN;
+    return (h & 0x8000) ? -d : d;
+}
+
+static double
+codec_single(u_int32_t bits)
+{
+    float        f;
+
+    memcpy(&f, &bits, sizeof(f));
+    return f;
+}
+
+static int
+cbor_head(struct codec_reader *r, int *major, int *info, u_int64_t *v)
+{
+    const u_int8_t  *b;
+
+    if (!codec_take(r, 1, &b))
+        return (KORE_RESULT_ERROR);
+    *major = *b >> 5;
+    *info = *b & 0x1f;
+    *v = *info;
+    if (*info < 24 || *info == 31)
+        return (KORE_RESULT_OK);
+    if (*info > 27)
+        return (KORE_RESULT_ERROR);
+    return codec_uint(r, (size_t)1 << (*info - 24), v);
+}
+
+static int
+cbor_break(struct codec_reader *r)
+{
+    if (r->p < r->end && *r->p == 0xff) {
+        r->p++;
+        return 1;
+    }
+    return 0;
+}
+
+/* a text or byte string, of definite chunks up to a break for info 31 */
+static int
+cbor_string(struct codec_reader *r, int major, int info, u_int64_t len,
+            struct kore_buf *out, int how)
+{
+    const u_int8_t  *s;
+    int              m, i;
+
+    if (info != 31) {
+        if (!codec_take(r, len, &s))
+            return (KORE_RESULT_ERROR);
+        codec_put(out, s, len, how);
+        return (KORE_RESULT_OK);
+    }
+
+    while (!cbor_break(r)) {
+        if (!cbor_head(r, &m, &i, &len) || m != major || i == 31 ||
+            !codec_take(r, len, &s))
+            return (KORE_RESULT_ERROR);
+        codec_put(out, s, len, how);
+    }
+    return (KORE_RESULT_OK);
+}
+
+static int
+cbor_key(struct codec_reader *r)
+{
+    u_int64_t        v;
+    int              major, info;
+
+    if (!cbor_head(r, &major, &info, &v))
+        return (KORE_RESULT_ERROR);
+
+    kore_buf_append(r->out, "\"", 1);
+    if (major == 3) {
+        if (!cbor_string(r, major, info, v, r->out, CODEC_JSON))
+            return (KORE_RESULT_ERROR);
+    }
+    else if (major == 0 && info != 31)
+        kore_buf_appendf(r->out, "%llu", (unsigned long long)v);
+    else if (major == 1 && info != 31)
+        codec_put_negative(r->out, v);
+    else
+        return (KORE_RESULT_ERROR);
+    kore_buf_append(r->out, "\":", 2);
+    return (KORE_RESULT_OK);
+}
+
+static int
+cbor_value(struct codec_reader *r, int depth)
+{
+    struct kore_buf     *bytes;
+    u_int64_t            v, n;
+    int                  major, info, rc;
+    double               d;
+
+    if (depth > SERVO_CODEC_DEPTH || !cbor_head(r, &major, &info, &v))
+        return (KORE_RESULT_ERROR);
+    if (info == 31 && (major < 2 || major > 5))
+        return (KORE_RESULT_ERROR);
+
+    switch (major) {
+        case 0:
+            kore_buf_appendf(r->out, "%llu", (unsigned long long)v);
+            return (KORE_RESULT_OK);
+
+        case 1:
+            codec_put_negative(r->out, v);
+            return (KORE_RESULT_OK);
+
+        case 2:
+            bytes = kore_buf_alloc(128);
+            rc = cbor_string(r, major, info, v, bytes, CODEC_RAW);
+            if (rc)
+                codec_put_base64(r->out, bytes->data, bytes->offset);
+            kore_buf_free(bytes);
+            return rc;
+
+        case 3:
+            kore_buf_append(r->out, "\"", 1);
+            if (!cbor_string(r, major, info, v, r->out, CODEC_JSON))
+                return (KORE_RESULT_ERROR);
+            kore_buf_append(r->out, "\"", 1);
+            return (KORE_RESULT_OK);
+
+        case 4:
+        case 5:
+            kore_buf_append(r->out, major == 4 ? "[" : "{", 1);
+            for (n = 0; info == 31 || n < v; n++) {
+                if (info == 31 && cbor_break(r))
+                    break;
+                if (n > 0)
+                    kore_buf_append(r->out, ",", 1);
+                if ((major == 5 && !cbor_key(r)) || !cbor_value(r, depth + 1))
+                    return (KORE_RESULT_ERROR);
+            }
+            kore_buf_append(r->out, major == 4 ? "]" : "}", 1);
+            return (KORE_RESULT_OK);
+
+        case 6:
+            /* tags add nothing JSON would keep */
+            return cbor_value(r, depth + 1);
+    }
+
+    switch (info) {
+        case 20:
+            kore_buf_append(r->out, "false", 5);
+            return (KORE_RESULT_OK);
+        case 21:
+            kore_buf_append(r->out, "true", 4);
+            return (KORE_RESULT_OK);
+        case 22:
+        case 23:
+            kore_buf_append(r->out, "null", 4);
+            return (KORE_RESULT_OK);
+        case 25:
+            codec_put_double(r->out, codec_half((u_int16_t)v));
+            return (KORE_RESULT_OK);
+        case 26:
+            codec_put_double(r->out, codec_single((u_int32_t)v));
+            return (KORE_RESULT_OK);
+        case 27:
+            memcpy(&d, &v, sizeof(d));
+            codec_put_double(r->out, d);
+            return (KORE_RESULT_OK);
+    }
+    return (KORE_RESULT_ERROR);
+}
+
+static int
+mp_head(struct codec_reader *r, int *kind, u_int64_t *v, double *d)
+{
+    const u_int8_t  *b;
+    size_t           n;
+    u_int8_t         c;
+
+    if (!codec_take(r, 1, &b))
+        return (KORE_RESULT_ERROR);
+    c = *b;
+    *v = 0;
+
+    if (c <= 0x7f) {
+        *kind = MP_UINT;
+        *v = c;
+        return (KORE_RESULT_OK);
+    }
+    if (c >= 0xe0) {
+        *kind = MP_INT;
+        *v = (u_int64_t)(int64_t)(int8_t)c;
+        return (KORE_RESULT_OK);
+    }
+    if (c >= 0xa0 && c <= 0xbf) {
+        *kind = MP_STR;
+        *v = c & 0x1f;
+        return (KORE_RESULT_OK);
+    }
+    if (c >= 0x80 && c <= 0x9f) {
+        *kind = c >= 0x90 ? MP_ARRAY : MP_MAP;
+        *v = c & 0x0f;
+        return (KORE_RESULT_OK);
+    }
+
+    switch (c) {
+        case 0xc0:
+            *kind = MP_NIL;
+            return (KORE_RESULT_OK);
+
+        case 0xc2:
+        case 0xc3:
+            *kind = MP_BOOL;
+            *v = c & 1;
+            return (KORE_RESULT_OK);
+
+        case 0xc4:
+        case 0xc5:
+        case 0xc6:
+            *kind = MP_BIN;
+            return codec_uint(r, (size_t)1 << (c - 0xc4), v);
+
+        case 0xca:
+            *kind = MP_FLOAT;
+            if (!codec_uint(r, 4, v))
+                return (KORE_RESULT_ERROR);
+            *d = codec_single((u_int32_t)*v);
+            return (KORE_RESULT_OK);
+
+        case 0xcb:
+            *kind = MP_FLOAT;
+            if (!codec_uint(r, 8, v))
+                return (KORE_RESULT_ERROR);
+            memcpy(d, v, sizeof(*d));
+            return (KORE_RESULT_OK);
+
+        case 0xcc:
+        case 0xcd:
+        case 0xce:
+        case 0xcf:
+            *kind = MP_UINT;
+            return codec_uint(r, (size_t)1 << (c - 0xcc), v);
+
+        case 0xd0:
+        case 0xd1:
+        case 0xd2:
+        case 0xd3:
+            *kind = MP_INT;
+            n = (size_t)1 << (c - 0xd0);
+            if (!codec_uint(r, n, v))
+                return (KORE_RESULT_ERROR);
+            if (n < 8 && (*v >> (n * 8 - 1)) & 1)
+                *v |= ~(u_int64_t)0 << (n * 8);
+            return (KORE_RESULT_OK);
+
+        case 0xd9:
+        case 0xda:
+        case 0xdb:
+            *kind = MP_STR;
+            return codec_uint(r, (size_t)1 << (c - 0xd9), v);
+
+        case 0xdc:
+        case 0xdd:
+            *kind = MP_ARRAY;
+            return codec_uint(r, (size_t)2 << (c - 0xdc), v);
+
+        case 0xde:
+        case 0xdf:
+            *kind = MP_MAP;
+            return codec_uint(r, (size_t)2 << (c - 0xde), v);
+    }
+
+    /* never used and extension types */
+    return (KORE_RESULT_ERROR);
+}
+
+static int
+mp_key(struct codec_reader *r)
+{
+    const u_int8_t  *s;
+    u_int64_t        v;
+    double           d;
+    int              kind;
+
+    if (!mp_head(r, &kind, &v, &d))
+        return (KORE_RESULT_ERROR);
+
+    kore_buf_append(r->out, "\"", 1);
+    if (kind == MP_STR) {
+        if (!codec_take(r, v, &s))
+            return (KORE_RESULT_ERROR);
+        codec_put(r->out, s, v, CODEC_JSON);
+    }
+    else if (kind == MP_UINT)
+        kore_buf_appendf(r->out, "%llu", (unsigned long long)v);
+    else if (kind == MP_INT)
+        kore_buf_appendf(r->out, "%lld", (long long)(int64_t)v);
+    else
+        return (KORE_RESULT_ERROR);
+    kore_buf_append(r->out, "\":", 2);
+    return (KORE_RESULT_OK);
+}
+
+static int
+mp_value(struct codec_reader *r, int depth)
+{
+    const u_int8_t  *s;
+    u_int64_t        v, n;
+    double           d;
+    int              kind;
+
+    if (depth > SERVO_CODEC_DEPTH || !mp_head(r, &kind, &v, &d))
+        return (KORE_RESULT_ERROR);
+
+    switch (kind) {
+        case MP_NIL:
+            kore_buf_append(r->out, "null", 4);
+            break;
+
+        case MP_BOOL:
+            if (v)
+                kore_buf_append(r->out, "true", 4);
+            else
+                kore_buf_append(r->out, "false", 5);
+            break;
+
+        case MP_UINT:
+            kore_buf_appendf(r->out, "%llu", (unsigned long long)v);
+            break;
+
+        case MP_INT:
+            kore_buf_appendf(r->out, "%lld", (long long)(int64_t)v);
+            break;
+
+        case MP_FLOAT:
+            codec_put_double(r->out, d);
+            break;
+
+        case MP_STR:
+        case MP_BIN:
+            if (!codec_take(r, v, &s))
+                return (KORE_RESULT_ERROR);
+            if (kind == MP_BIN) {
+                codec_put_base64(r->out, s, v);
+                break;
+            }
+            kore_buf_append(r->out, "\"", 1);
+            codec_put(r->out, s, v, CODEC_JSON);
+            kore_buf_append(r->out, "\"", 1);
+            break;
+
+        case MP_ARRAY:
+        case MP_MAP:
+            kore_buf_append(r->out, kind == MP_ARRAY ? "[" : "{", 1);
+            for (n = 0; n < v; n++) {
+                if (n > 0)
+                    kore_buf_append(r->out, ",", 1);
+                if ((kind == MP_MAP && !mp_key(r)) ||
+                    !mp_value(r, depth + 1))
+                    return (KORE_RESULT_ERROR);
+            }
+            kore_buf_append(r->out, kind == MP_ARRAY ? "]" : "}", 1);
+            break;
+    }
+    return (KORE_RESULT_OK);
+}
+
+/*
+ * Reads a CBOR or MessagePack body into out, as the item kind it
+ * carries: the text of a TEXT item, the hex input of bytea for a BLOB,
+ * or JSON text.
+ */
+int
+servo_codec_read(int type, const u_int8_t *data, size_t len,
+                 struct kore_buf *out, int *kind)
+{
+    struct codec_reader  r;
+    const u_int8_t      *start, *s;
+    u_int64_t            v;
+    double               d;
+    int                  major, info, head, rc;
+
+    r.p = data;
+    r.end = data + len;
+    r.out = out;
+    *kind = SERVO_CONTENT_JSON;
+
+    if (type == SERVO_CONTENT_CBOR) {
+        /* tags on the top value, as the self-described CBOR one */
+        do {
+            start = r.p;
+            if (!cbor_head(&r, &major, &info, &v))
+                return (KORE_RESULT_ERROR);
+        } while (major == 6 && info != 31);
+
+        if (major == 3) {
+            *kind = SERVO_CONTENT_STRING;
+            rc = cbor_string(&r, major, info, v, out, CODEC_RAW);
+        }
+        else if (major == 2) {
+            *kind = SERVO_CONTENT_FORMDATA;
+            kore_buf_append(out, "\\x", 2);
+            rc = cbor_string(&r, major, info, v, out, CODEC_HEX);
+        }
+        else {
+            r.p = start;
+            rc = cbor_value(&r, 0);
+        }
+    }
+    else {
+        start = r.p;
+        if (!mp_head(&r, &head, &v, &d))
+            return (KORE_RESULT_ERROR);
+
+        if (head == MP_STR || head == MP_BIN) {
+            if (!codec_take(&r, v, &s))
+                return (KORE_RESULT_ERROR);
+            *kind = head == MP_STR ? SERVO_CONTENT_STRING
+                                   : SERVO_CONTENT_FORMDATA;
+            if (head == MP_BIN)
+                kore_buf_append(out, "\\x", 2);
+            codec_put(out, s, v, head == MP_STR ? CODEC_RAW : CODEC_HEX);
+            rc = KORE_RESULT_OK;
+        }
+        else {
+            r.p = start;
+            rc = mp_value(&r, 0);
+        }
+    }
+
+    return rc && r.p == r.end;
+}
+
+static void
+codec_be(struct kore_buf *out, u_int8_t first, u_int64_t v, size_t n)
+{
+    u_int8_t     b[9];
+    size_t       i;
+
+    b[0] = first;
+    for (i = 0; i < n; i++)
+        b[1 + i] = (u_int8_t)(v >> (8 * (n - 1 - i)));
+    kore_buf_append(out, b, n + 1);
+}
+
+static void
+cbor_put_head(struct kore_buf *out, int kind, u_int64_t v)
+{
+    u_int8_t     m = (u_int8_t)(kind << 5);
+
+    if (v < 24)
+        codec_be(out, m | (u_int8_t)v, 0, 0);
+    else if (v <= 0xff)
+        codec_be(out, m | 24, v, 1);
+    else if (v <= 0xffff)
+        codec_be(out, m | 25, v, 2);
+    else if (v <= 0xffffffff)
+        codec_be(out, m | 26, v, 4);
+    else
+        codec_be(out, m | 27, v, 8);
+}
+
+/*
+ * The smallest of the forms for 1 << from up to 1 << to bytes, numbered
+ * on from first.
+ */
+static void
+mp_put_sized(struct kore_buf *out, u_int8_t first, u_int64_t v,
+             u_int64_t magnitude, int from, int to)
+{
+    int          i;
+
+    for (i = from; i < to; i++) {
+        if (magnitude >> (8 << i) == 0)
+            break;
+    }
+    codec_be(out, first + (i - from), v, (size_t)1 << i);
+}
+
+static void
+mp_put_head(struct kore_buf *out, int kind, u_int64_t v)
+{
+    switch (kind) {
+        case CODEC_UINT:
+            if (v < 0x80)
+                codec_be(out, (u_int8_t)v, 0, 0);
+            else
+                mp_put_sized(out, 0xcc, v, v, 0, 3);
+            break;
+
+        case CODEC_NEGINT:
+            /* -1 - v, v is at most INT64_MAX here */
+            if (v < 32)
+                codec_be(out, (u_int8_t)~v, 0, 0);
+            else
+                mp_put_sized(out, 0xd0, ~v, v << 1, 0, 3);
+            break;
+
+        case CODEC_TEXT:
+            if (v < 32)
+                codec_be(out, 0xa0 | (u_int8_t)v, 0, 0);
+            else
+                mp_put_sized(out, 0xd9, v, v, 0, 2);
+            break;
+
+        case CODEC_BYTES:
+            mp_put_sized(out, 0xc4, v, v, 0, 2);
+            break;
+
+        case CODEC_ARRAY:
+        case CODEC_MAP:
+            if (v < 16)
+                codec_be(out, (kind == CODEC_ARRAY ? 0x90 : 0x80) |
+                              (u_int8_t)v, 0, 0);
+            else
+                mp_put_sized(out, kind == CODEC_ARRAY ? 0xdc : 0xde,
+                             v, v, 1, 2);
+            break;
+    }
+}
+
+static void
+codec_head(int type, struct kore_buf *out, int kind, u_int64_t v)
+{
+    if (type == SERVO_CONTENT_CBOR)
+        cbor_put_head(out, kind, v);
+    else
+        mp_put_head(out, kind, v);
+}
+
+static void
+codec_put_float(int type, struct kore_buf *out, double d)
+{
+    float        f = (float)d;
+    u_int32_t    b32;
+    u_int64_t    b64;
+
+    if ((double)f == d) {
+        memcpy(&b32, &f, sizeof(b32));
+        codec_be(out, type == SERVO_CONTENT_CBOR ? 0xfa : 0xca, b32, 4);
+    }
+    else {
+        memcpy(&b64, &d, sizeof(b64));
+        codec_be(out, type == SERVO_CONTENT_CBOR ? 0xfb : 0xcb, b64, 8);
+    }
+}
+
+static void
+codec_utf8(struct kore_buf *out, u_int32_t cp)
+{
+    u_int8_t     b[4];
+    size_t       n;
+
+    if (cp < 0x80) {
+        b[0] = (u_int8_t)cp;
+        n = 1;
+    }
+    else if (cp < 0x800) {
+        b[0] = 0xc0 | (u_int8_t)(cp >> 6);
+        b[1] = 0x80 | (cp & 0x3f);
+        n = 2;
+    }
+    else if (cp < 0x10000) {
+        b[0] = 0xe0 | (u_int8_t)(cp >> 12);
+        b[1] = 0x80 | ((cp >> 6) & 0x3f);
+        b[2] = 0x80 | (cp & 0x3f);
+        n = 3;
+    }
+    else {
+        b[0] = 0xf0 | (u_int8_t)(cp >> 18);
+        b[1] = 0x80 | ((cp >> 12) & 0x3f);
+        b[2] = 0x80 | ((cp >> 6) & 0x3f);
+        b[3] = 0x80 | (cp & 0x3f);
+        n = 4;
+    }
+    kore_buf_append(out, b, n);
+}
+
+static void
+json_space(struct codec_writer *w)
+{
+    while (w->p < w->end &&
+           (*w->p == ' ' || *w->p == '\t' || *w->p == '\n' || *w->p == '\r'))
+        w->p++;
+}
+
+static int
+json_expect(struct codec_writer *w, char c)
+{
+    json_space(w);
+    if (w->p >= w->end || *w->p != c)
+        return (KORE_RESULT_ERROR);
+    w->p++;
+    return (KORE_RESULT_OK);
+}
+
+static int
+json_hex4(const char *s, const char *end, u_int32_t *cp)
+{
+    int          i;
+
+    if (end - s < 4)
+        return (KORE_RESULT_ERROR);
+    for (*cp = 0, i = 0; i < 4; i++) {
+        if (!isxdigit((unsigned char)s[i]))
+            return (KORE_RESULT_ERROR);
+        *cp = *cp << 4 | (u_int32_t)(isdigit((unsigned char)s[i]) ?
+                                     s[i] - '0' : (s[i] | 0x20) - 'a' + 10);
+    }
+    return (KORE_RESULT_OK);
+}
+
+/* past a string, while counting */
+static int
+json_skip_string(struct codec_writer *w)
+{
+    for (w->p++; w->p < w->end; w->p++) {
+        if (*w->p == '\\')
+            w->p++;
+        else if (*w->p == '"') {
+            w->p++;
+            return (KORE_RESULT_OK);
+        }
+    }
+    return (KORE_RESULT_ERROR);
+}
+
+static int
+json_unescape(struct codec_writer *w)
+{
+    const char  *run;
+    u_int32_t    cp, lo;
+    char         c;
+
+    kore_buf_reset(w->str);
+    for (run = ++w->p; w->p < w->end && *w->p != '"'; ) {
+        if (*w->p != '\\') {
+            w->p++;
+            continue;
+        }
+        kore_buf_append(w->str, run, w->p - run);
+        if (w->end - w->p < 2)
+            return (KORE_RESULT_ERROR);
+
+        switch ((c = w->p[1])) {
+            case '"':
+            case '\\':
+            case '/':
+                kore_buf_append(w->str, &c, 1);
+                break;
+            case 'b':
+                kore_buf_append(w->str, "\b", 1);
+                break;
+            case 'f':
+                kore_buf_append(w->str, "\f", 1);
+                break;
+            case 'n':
+                kore_buf_append(w->str, "\n", 1);
+                break;
+            case 'r':
+                kore_buf_append(w->str, "\r", 1);
+                break;
+            case 't':
+                kore_buf_append(w->str, "\t", 1);
+                break;
+            case 'u':
+                if (!json_hex4(w->p + 2, w->end, &cp))
+                    return (KORE_RESULT_ERROR);
+                w->p += 4;
+                /* a surrogate pair */
+                if (cp >= 0xd800 && cp < 0xdc00 && w->end - w->p >= 8 &&
+                    w->p[2] == '\\' && w->p[3] == 'u' &&
+                    json_hex4(w->p + 4, w->end, &lo) &&
+                    lo >= 0xdc00 && lo < 0xe000) {
+                    cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+                    w->p += 6;
+                }
+                codec_utf8(w->str, cp);
+                break;
+            default:
+                return (KORE_RESULT_ERROR);
+        }
+        w->p += 2;
+        run = w->p;
+    }
+
+    if (w->p >= w->end)
+        return (KORE_RESULT_ERROR);
+    kore_buf_append(w->str, run, w->p - run);
+    w->p++;
+    return (KORE_RESULT_OK);
+}
+
+static int
+json_number(struct codec_writer *w)
+{
+    const char  *s;
+    char        *num, *end, small[32];
+    size_t       len;
+    int          real, rc;
+    long long    i;
+    u_int64_t    u;
+    double       d;
+
+    real = 0;
+    for (s = w->p; w->p < w->end; w->p++) {
+        if (*w->p == '.' || *w->p == 'e' || *w->p == 'E')
+            real = 1;
+        else if (!isdigit((unsigned char)*w->p) &&
+                 *w->p != '-' && *w->p != '+')
+            break;
+    }
+    if ((len = w->p - s) == 0)
+        return (KORE_RESULT_ERROR);
+    if (w->out == NULL)
+        return (KORE_RESULT_OK);
+
+    num = len < sizeof(small) ? small : kore_malloc(len + 1);
+    memcpy(num, s, len);
+    num[len] = '\0';
+
+    rc = KORE_RESULT_ERROR;
+    errno = 0;
+    if (!real && num[0] == '-') {
+        i = strtoll(num, &end, 10);
+        if ((rc = errno == 0 && *end == '\0') && i < 0)
+            codec_head(w->type, w->out, CODEC_NEGINT, (u_int64_t)-(i + 1));
+        else if (rc)
+            codec_head(w->type, w->out, CODEC_UINT, 0);
+    }
+    else if (!real) {
+        u = strtoull(num, &end, 10);
+        if ((rc = errno == 0 && *end == '\0'))
+            codec_head(w->type, w->out, CODEC_UINT, u);
+    }
+
+    /* fractions and integers out of range */
+    if (!rc) {
+        d = strtod(num, &end);
+        if ((rc = *end == '\0'))
+            codec_put_float(w->type, w->out, d);
+    }
+
+    if (num != small)
+        kore_free(num);
+    return rc;
+}
+
+static int
+json_literal(struct codec_writer *w, const char *word, u_int8_t cbor,
+             u_int8_t mp)
+{
+    size_t       len = strlen(word);
+
+    if ((size_t)(w->end - w->p) < len || memcmp(w->p, word, len) != 0)
+        return (KORE_RESULT_ERROR);
+    w->p += len;
+    if (w->out != NULL)
+        codec_be(w->out, w->type == SERVO_CONTENT_CBOR ? cbor : mp, 0, 0);
+    return (KORE_RESULT_OK);
+}
+
+static int      json_value(struct codec_writer *, int);
+
+static int
+json_container(struct codec_writer *w, int depth, int kind)
+{
+    u_int32_t    count;
+    size_t       slot;
+    char         close;
+
+    close = kind == CODEC_MAP ? '}' : ']';
+    w->p++;
+
+    slot = w->counts->offset / sizeof(count);
+    if (w->out == NULL) {
+        count = 0;
+        kore_buf_append(w->counts, &count, sizeof(count));
+    }
+    else {
+        if (w->next >= slot)
+            return (KORE_RESULT_ERROR);
+        memcpy(&count, w->counts->data + w->next++ * sizeof(count),
+               sizeof(count));
+        codec_head(w->type, w->out, kind, count);
+    }
+
+    json_space(w);
+    if (w->p < w->end && *w->p == close) {
+        w->p++;
+        return (KORE_RESULT_OK);
+    }
+
+    for (count = 1;; count++) {
+        if (kind == CODEC_MAP) {
+            json_space(w);
+            if (w->p >= w->end || *w->p != '"' ||
+                !json_value(w, depth + 1) || !json_expect(w, ':'))
+                return (KORE_RESULT_ERROR);
+        }
+        if (!json_value(w, depth + 1))
+            return (KORE_RESULT_ERROR);
+        json_space(w);
+        if (w->p < w->end && *w->p == ',') {
+            w->p++;
+            continue;
+        }
+        if (!json_expect(w, close))
+            return (KORE_RESULT_ERROR);
+        break;
+    }
+
+    if (w->out == NULL)
+        memcpy(w->counts->data + slot * sizeof(count), &count,
+               sizeof(count));
+    return (KORE_RESULT_OK);
+}
+
+static int
+json_value(struct codec_writer *w, int depth)
+{
+    json_space(w);
+    if (w->p >= w->end || depth > SERVO_CODEC_DEPTH)
+        return (KORE_RESULT_ERROR);
+
+    switch (*w->p) {
+        case '{':
+            return json_container(w, depth, CODEC_MAP);
+        case '[':
+            return json_container(w, depth, CODEC_ARRAY);
+        case '"':
+            if (w->out == NULL)
+                return json_skip_string(w);
+            if (!json_unescape(w))
+                return (KORE_RESULT_ERROR);
+            codec_head(w->type, w->out, CODEC_TEXT, w->str->offset);
+            kore_buf_append(w->out, w->str->data, w->str->offset);
+            return (KORE_RESULT_OK);
+        case 't':
+            return json_literal(w, "true", 0xf5, 0xc3);
+        case 'f':
+            return json_literal(w, "false", 0xf4, 0xc2);
+        case 'n':
+            return json_literal(w, "null", 0xf6, 0xc0);
+    }
+    return json_number(w);
+}
+
+/* JSON text into CBOR or MessagePack */
+int
+servo_codec_json(int type, const char *json, size_t len,
+                 struct kore_buf *out)
+{
+    struct codec_writer  w;
+    int                  rc;
+
+    w.p = json;
+    w.end = json + len;
+    w.type = type;
+    w.out = NULL;
+    w.str = kore_buf_alloc(128);
+    w.counts = kore_buf_alloc(64);
+    w.next = 0;
+
+    rc = json_value(&w, 0);
+    json_space(&w);
+    if (rc && w.p == w.end) {
+        w.p = json;
+        w.out = out;
+        rc = json_value(&w, 0);
+    }
+    else
+        rc = KORE_RESULT_ERROR;
+
+    kore_buf_free(w.str);
+    kore_buf_free(w.counts);
+    return rc;
+}
+
+void
+servo_codec_string(int type, const void *s, size_t len, struct kore_buf *out)
+{
+    codec_head(type, out, CODEC_TEXT, len);
+    kore_buf_append(out, s, len);
+}
+
+void
+servo_codec_bytes(int type, const void *s, size_t len, struct kore_buf *out)
+{
+    codec_head(type, out, CODEC_BYTES, len);
+    kore_buf_append(out, s, len);
+}
+
+/* the item read, encoded as type, NULL when its JSON is broken */
+struct kore_buf *
+servo_codec_item(struct servo_context *ctx, int type)
+{
+    struct kore_buf     *out;
+    char                *json;
+    void                *bytes;
+    size_t               len;
+    int                  rc;
+
+    out = kore_buf_alloc(ctx->val_sz + 16);
+    rc = KORE_RESULT_OK;
+
+    if (ctx->val_bin != NULL) {
+        bytes = servo_item_to_bytes(ctx, &len);
+        servo_codec_bytes(type, bytes, len, out);
+        kore_free(bytes);
+    }
+    else if (ctx->val_json_text != NULL) {
+        rc = servo_codec_json(type, ctx->val_json_text,
+                              strlen(ctx->val_json_text), out);
+    }
+    else if (ctx->val_json != NULL) {
+        /* shared by a read that kept the document */
+        json = json_dumps(ctx->val_json, JSON_COMPACT | JSON_ENCODE_ANY);
+        rc = json != NULL && servo_codec_json(type, json, strlen(json), out);
+        free(json);
+    }
+    else {
+        servo_codec_string(type, ctx->val_str,
+                           ctx->val_str != NULL ? strlen(ctx->val_str) : 0,
+                           out);
+    }
+
+    if (!rc) {
+        kore_buf_free(out);
+        return NULL;
+    }
+    return out;
+}
@@ -0,0 +1,24 @@
+#ifndef _SERVO_CODEC_H_
+#define _SERVO_CODEC_H_
+
+#include <sys/types.h>
+
+#include <kore/kore.h>
+#include <kore/http.h>
+
+#include "servo.h"
+
+/* containers nested deeper are refused */
+#define SERVO_CODEC_DEPTH       64
+
+int                  servo_codec_read(int, const u_int8_t *, size_t,
+                                      struct kore_buf *, int *);
+int                  servo_codec_json(int, const char *, size_t,
+                                      struct kore_buf *);
+void                 servo_codec_string(int, const void *, size_t,
+                                        struct kore_buf *);
+void                 servo_codec_bytes(int, const void *, size_t,
+                                       struct kore_buf *);
+struct kore_buf     *servo_codec_item(struct servo_context *, int);
+
+#endif //_SERVO_CODEC_H_
@@ -0,0 +1,272 @@
+#include "counter.h"
+#include "job.h"
+#include "pool.h"
+#include "shard.h"
+#include "stats.h"
+#include "flight.h"
+#include "bloom.h"
+#include "quota.h"
+#include "util.h"
+#include "assets.h"
+
+/*
+ * Aggregated increments of counters.
+ *
+ * PATCH /key?op=incr only adds to the item's pending delta in the
+ * worker and answers 202. Every flush interval the deltas of a shard
+ * go out in one statement, servo_add_items(), adding each to its item
+ * or creating it. The interval is how much acknowledged increments a
+ * crashing worker may lose.
+ *
+ * A flush that fails is merged back and retried, so an error after
+ * the commit, like a dropped connection, may count it twice.
+ *
+ * Flushes take their connection ahead of queued requests. Past
+ * max_pending items waiting or in flight, increments of new ones are
+ * refused until a flush makes room.
+ */
+
+#define COUNTER_BUCKETS         256
+#define COUNTER_BATCH           500
+
+/* flush in flight of a shard */
+struct counter_flush {
+    struct servo_job                 job;
+    TAILQ_HEAD(, servo_counter)      batch;
+};
+
+static LIST_HEAD(, servo_counter)    counter_buckets[COUNTER_BUCKETS];
+static TAILQ_HEAD(servo_counters, servo_counter) *counter_pending = NULL;
+static struct counter_flush         *counter_flushes = NULL;
+static size_t                        counter_count = 0;
+
+static void     counter_flush(void *, u_int64_t);
+static int      counter_send(struct servo_job *);
+static void     counter_read(struct servo_job *);
+static int      counter_done(struct servo_job *, int);
+
+void
+servo_counter_init(void)
+{
+    size_t      i;
+
+    if (CONFIG->counter_flush == 0)
+        return;
+
+    for (i = 0; i < COUNTER_BUCKETS; i++)
+        LIST_INIT(&counter_buckets[i]);
+
+    counter_pending = kore_calloc(CONFIG->ndatabases,
+                                  sizeof(struct servo_counters));
+    counter_flushes = kore_calloc(CONFIG->ndatabases,
+                                  sizeof(struct counter_flush));
+    for (i = 0; i < CONFIG->ndatabases; i++) {
+        TAILQ_INIT(&counter_pending[i]);
+        TAILQ_INIT(&counter_flushes[i].batch);
+        servo_job_init(&counter_flushes[i].job, "flush of counters",
+                       SERVO_POOL_WRITE, i, &counter_flushes[i]);
+        counter_flushes[i].job.flush = 1;
+        counter_flushes[i].job.send = counter_send;
+        counter_flushes[i].job.read = counter_read;
+        counter_flushes[i].job.done = counter_done;
+    }
+    kore_timer_add(counter_flush, CONFIG->counter_flush, NULL, 0);
+}
+
+static struct servo_counter *
+counter_lookup(u_int64_t hash, const uuid_t client_id, const char *key)
+{
+    struct servo_counter    *n;
+
+    LIST_FOREACH(n, &counter_buckets[hash % COUNTER_BUCKETS], list) {
+        if (n->hash == hash &&
+            uuid_compare(n->client_id, client_id) == 0 &&
+            strcmp(n->key, key) == 0)
+            return n;
+    }
+    return NULL;
+}
+
+static void
+counter_free(struct servo_counter *n)
+{
+    kore_free(n->key);
+    kore_free(n);
+    counter_count--;
+}
+
+/* KORE_RESULT_ERROR for a new item past max_pending */
+int
+servo_counter_add(const uuid_t client_id, const char *key, int64_t delta)
+{
+    struct servo_counter    *n;
+    u_int64_t                hash;
+
+    hash = servo_item_hash(client_id, key);
+    if ((n = counter_lookup(hash, client_id, key)) != NULL) {
+        servo_stats_count(STATS_INCR_AGGREGATED, 1);
+        n->delta += delta;
+        return (KORE_RESULT_OK);
+    }
+    if (CONFIG->counter_max > 0 && counter_count >= CONFIG->counter_max) {
+        kore_log(LOG_NOTICE, "%zu counters pending, refusing", counter_count);
+        return (KORE_RESULT_ERROR);
+    }
+    servo_stats_count(STATS_INCR_AGGREGATED, 1);
+
+    /* the flush may create the item, count it before like inserts do */
+    servo_bloom_add(client_id, key);
+
+    n = kore_calloc(1, sizeof(struct servo_counter));
+    n->hash = hash;
+    uuid_copy(n->client_id, client_id);
+    n->key = kore_strdup(key);
+    n->shard = servo_shard_lookup(client_id);
+    n->delta = delta;
+    LIST_INSERT_HEAD(&counter_buckets[hash % COUNTER_BUCKETS], n, list);
+    TAILQ_INSERT_TAIL(&counter_pending[n->shard], n, pending);
+    counter_count++;
+    return (KORE_RESULT_OK);
+}
+
+/* put a failed batch back, to be sent with the next flush */
+static void
+counter_restore(struct counter_flush *f)
+{
+    struct servo_counter    *n, *cur;
+
+    while ((n = TAILQ_FIRST(&f->batch)) != NULL) {
+        TAILQ_REMOVE(&f->batch, n, pending);
+        if ((cur = counter_lookup(n->hash, n->client_id, n->key)) != NULL) {
+            cur->delta += n->delta;
+            servo_bloom_undo(n->client_id, n->key);
+            counter_free(n);
+            continue;
+        }
+        LIST_INSERT_HEAD(&counter_buckets[n->hash % COUNTER_BUCKETS], n, list);
+        TAILQ_INSERT_TAIL(&counter_pending[n->shard], n, pending);
+    }
+}
+
+/* rows of the items created, existing ones give back their count */
+static void
+counter_read(struct servo_job *job)
+{
+    struct counter_flush    *f = job->arg;
+    struct servo_counter    *n;
+    uuid_t                   client_id;
+    const char              *key;
+    int                      i, rows;
+
+    rows = kore_pgsql_ntuples(&job->sql);
+    for (i = 0; i < rows; i++) {
+        if (strcmp(kore_pgsql_getvalue(&job->sql, i, 2), "t") != 0 ||
+            uuid_parse(kore_pgsql_getvalue(&job->sql, i, 0), client_id) != 0)
+            continue;
+        key = kore_pgsql_getvalue(&job->sql, i, 1);
+        TAILQ_FOREACH(n, &f->batch, pending) {
+            if (uuid_compare(n->client_id, client_id) == 0 &&
+                strcmp(n->key, key) == 0) {
+                n->inserted = 1;
+                break;
+            }
+        }
+    }
+}
+
+static int
+counter_done(struct servo_job *job, int failed)
+{
+    struct counter_flush        *f = job->arg;
+    struct servo_counter        *n;
+    struct servo_quota_usage     created;
+
+    if (failed)
+        counter_restore(f);
+
+    memset(&created, 0, sizeof(created));
+    created.items = 1;
+    while ((n = TAILQ_FIRST(&f->batch)) != NULL) {
+        TAILQ_REMOVE(&f->batch, n, pending);
+        if (!n->inserted)
+            servo_bloom_undo(n->client_id, n->key);
+        else
+            servo_quota_add(n->client_id, &created);
+        servo_flight_forget(n->client_id, n->key);
+        counter_free(n);
+    }
+    return 0;
+}
+
+static int
+counter_send(struct servo_job *job)
+{
+    struct counter_flush    *f = job->arg;
+    struct servo_counter    *n;
+    struct kore_buf         *clients, *keys, *deltas;
+    char                     client[CLIENT_UUID_LEN];
+    const char              *sep;
+    size_t                   count;
+    int                      rc;
+
+    clients = kore_buf_alloc(COUNTER_BATCH * CLIENT_UUID_LEN);
+    keys = kore_buf_alloc(COUNTER_BATCH * 32);
+    deltas = kore_buf_alloc(COUNTER_BATCH * 8);
+
+    /* array literals, item keys never need escaping */
+    sep = "{";
+    for (count = 0; count < COUNTER_BATCH &&
+         (n = TAILQ_FIRST(&counter_pending[job->shard])) != NULL; count++) {
+        TAILQ_REMOVE(&counter_pending[job->shard], n, pending);
+        LIST_REMOVE(n, list);
+        TAILQ_INSERT_TAIL(&f->batch, n, pending);
+
+        uuid_unparse(n->client_id, client);
+        kore_buf_appendf(clients, "%s%s", sep, client);
+        kore_buf_appendf(keys, "%s\"%s\"", sep, n->key);
+        kore_buf_appendf(deltas, "%s%lld", sep, (long long)n->delta);
+        sep = ",";
+    }
+    kore_buf_append(clients, "}", 2);
+    kore_buf_append(keys, "}", 2);
+    kore_buf_append(deltas, "}", 2);
+
+    rc = kore_pgsql_query_params(&job->sql,
+                                 (const char *)asset_add_items_sql,
+                                 PGSQL_FORMAT_TEXT,
+                                 3,
+                                 clients->data, clients->offset - 1,
+                                 PGSQL_FORMAT_TEXT,
+                                 keys->data, keys->offset - 1,
+                                 PGSQL_FORMAT_TEXT,
+                                 deltas->data, deltas->offset - 1,
+                                 PGSQL_FORMAT_TEXT);
+    if (rc) {
+        servo_stats_count(STATS_INCR_FLUSHES, 1);
+        kore_log(LOG_DEBUG, "flushing %zu counters to shard %u",
+                 count, job->shard);
+    }
+
+    kore_buf_free(clients);
+    kore_buf_free(keys);
+    kore_buf_free(deltas);
+    return rc;
+}
+
+static void
+counter_flush(void *arg, u_int64_t now)
+{
+    struct counter_flush    *f;
+    size_t                   i;
+
+    (void)arg;
+    (void)now;
+
+    for (i = 0; i < CONFIG->ndatabases; i++) {
+        f = &counter_flushes[i];
+        if (f->job.busy || TAILQ_EMPTY(&counter_pending[i]))
+            continue;
+        if (!servo_job_start(&f->job))
+            return;
+    }
+}
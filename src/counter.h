@@ -0,0 +1,27 @@
+#ifndef _SERVO_COUNTER_H_
+#define _SERVO_COUNTER_H_
+
+#include <sys/queue.h>
+
+#include <kore/kore.h>
+#include <kore/pgsql.h>
+
+#include "servo.h"
+
+/* increments of an item not written yet */
+struct servo_counter {
+    u_int64_t                        hash;
+    uuid_t                           client_id;
+    char                            *key;
+    u_int32_t                        shard;
+    int64_t                          delta;
+    int                              inserted;
+
+    LIST_ENTRY(servo_counter)        list;
+    TAILQ_ENTRY(servo_counter)       pending;
+};
+
+void                 servo_counter_init(void);
+int                  servo_counter_add(const uuid_t, const char *, int64_t);
+
+#endif //_SERVO_COUNTER_H_
@@ -0,0 +1,195 @@
+#include "expire.h"
+#include "job.h"
+#include "pool.h"
+#include "stats.h"
+#include "bloom.h"
+#include "quota.h"
+#include "assets.h"
+
+/*
+ * Purge of expired items.
+ *
+ * Reads and writes never see an item past its expires_at, removing it
+ * is left to this timer. Each shard is purged by one worker, a batch
+ * at a time in expires_at order off the item_expires_at index. A full
+ * batch is followed by the next one right away, otherwise the worker
+ * moves on to its next shard and waits for the interval when done.
+ * Blobs no item refers to anymore go with each batch.
+ *
+ * Reads from replicas can't push back an idle expiry. The items with
+ * one that a worker read there are collected per shard and touched on
+ * the primary every second, in one statement, servo_touch_items().
+ * An idle ttl shorter than that may still run out between touches.
+ */
+
+#define EXPIRE_TOUCH_INTERVAL   1000
+#define EXPIRE_TOUCH_BATCH      1000
+
+/* idle items read from replicas of a shard, touched together */
+struct expire_touch {
+    struct servo_job     job;
+    struct kore_buf     *clients;
+    struct kore_buf     *keys;
+    size_t               count;
+};
+
+static struct servo_job      expire_job;
+static size_t                expire_rows;
+
+static struct expire_touch   *expire_touches = NULL;
+
+static void     expire_timer(void *, u_int64_t);
+static int      expire_send(struct servo_job *);
+static void     expire_read(struct servo_job *);
+static int      expire_done(struct servo_job *, int);
+static int      expire_touch_send(struct servo_job *);
+static void     expire_touch_flush(void *, u_int64_t);
+
+void
+servo_expire_init(void)
+{
+    size_t      i;
+
+    if (CONFIG->nreplicas > 0) {
+        expire_touches = kore_calloc(CONFIG->ndatabases,
+                                     sizeof(struct expire_touch));
+        for (i = 0; i < CONFIG->ndatabases; i++) {
+            servo_job_init(&expire_touches[i].job, "touch of idle items",
+                           SERVO_POOL_WRITE, i, &expire_touches[i]);
+            expire_touches[i].job.send = expire_touch_send;
+        }
+        kore_timer_add(expire_touch_flush, EXPIRE_TOUCH_INTERVAL, NULL, 0);
+    }
+
+    if (CONFIG->expire_interval == 0 || CONFIG->expire_batch == 0)
+        return;
+    servo_job_init(&expire_job, "purge of expired items", SERVO_POOL_BULK,
+                   0, NULL);
+    expire_job.send = expire_send;
+    expire_job.read = expire_read;
+    expire_job.done = expire_done;
+    kore_timer_add(expire_timer, CONFIG->expire_interval, NULL, 0);
+}
+
+/* an item with an idle ttl was read from a replica of the shard */
+void
+servo_expire_touch(const uuid_t client_id, const char *key, u_int32_t shard)
+{
+    struct expire_touch     *t;
+    char                     client[CLIENT_UUID_LEN];
+
+    if (expire_touches == NULL || shard >= CONFIG->ndatabases)
+        return;
+
+    /* a key dropped is touched by its next read */
+    t = &expire_touches[shard];
+    if (t->count >= EXPIRE_TOUCH_BATCH)
+        return;
+    if (t->clients == NULL) {
+        t->clients = kore_buf_alloc(EXPIRE_TOUCH_BATCH * CLIENT_UUID_LEN);
+        t->keys = kore_buf_alloc(EXPIRE_TOUCH_BATCH * 32);
+    }
+
+    /* array literals, item keys never need escaping */
+    uuid_unparse(client_id, client);
+    kore_buf_appendf(t->clients, "%s%s", t->count == 0 ? "{" : ",", client);
+    kore_buf_appendf(t->keys, "%s\"%s\"", t->count == 0 ? "{" : ",", key);
+    t->count++;
+}
+
+static int
+expire_touch_send(struct servo_job *job)
+{
+    struct expire_touch     *t = job->arg;
+    int                      rc;
+
+    kore_buf_append(t->clients, "}", 2);
+    kore_buf_append(t->keys, "}", 2);
+    t->count = 0;
+
+    rc = kore_pgsql_query_params(&job->sql,
+                                 (const char *)asset_touch_items_sql,
+                                 PGSQL_FORMAT_TEXT,
+                                 2,
+                                 t->clients->data, t->clients->offset - 1,
+                                 PGSQL_FORMAT_TEXT,
+                                 t->keys->data, t->keys->offset - 1,
+                                 PGSQL_FORMAT_TEXT);
+    kore_buf_reset(t->clients);
+    kore_buf_reset(t->keys);
+    return rc;
+}
+
+static void
+expire_touch_flush(void *arg, u_int64_t now)
+{
+    struct expire_touch     *t;
+    size_t                   i;
+
+    (void)arg;
+    (void)now;
+
+    for (i = 0; i < CONFIG->ndatabases; i++) {
+        t = &expire_touches[i];
+        if (t->job.busy || t->count == 0)
+            continue;
+        if (!servo_job_start(&t->job))
+            return;
+    }
+}
+
+/* keys of the purged items leave the filter, their sizes the usage */
+static void
+expire_read(struct servo_job *job)
+{
+    uuid_t      client_id;
+    const char *key;
+    int         i, rows;
+
+    rows = kore_pgsql_ntuples(&job->sql);
+    for (i = 0; i < rows; i++) {
+        if (uuid_parse(kore_pgsql_getvalue(&job->sql, i, 0), client_id) != 0)
+            continue;
+        key = kore_pgsql_getvalue(&job->sql, i, 1);
+        servo_bloom_remove(client_id, key);
+        servo_quota_deleted(client_id, &job->sql, i, 2);
+    }
+    expire_rows += rows;
+    servo_stats_count(STATS_ITEMS_EXPIRED, rows);
+}
+
+/* more might be waiting behind a full batch */
+static int
+expire_done(struct servo_job *job, int failed)
+{
+    if (!failed && expire_rows > 0) {
+        kore_log(LOG_DEBUG, "purged %zu expired items in shard %u",
+                 expire_rows, job->shard);
+    }
+    return expire_rows >= CONFIG->expire_batch;
+}
+
+/* a batch of the shard, in expires_at order */
+static int
+expire_send(struct servo_job *job)
+{
+    char         batch[24];
+
+    expire_rows = 0;
+    snprintf(batch, sizeof(batch), "%zu", CONFIG->expire_batch);
+    return kore_pgsql_query_params(&job->sql,
+                                   (const char *)asset_purge_expired_sql,
+                                   PGSQL_FORMAT_TEXT,
+                                   1,
+                                   batch, strlen(batch),
+                                   PGSQL_FORMAT_TEXT);
+}
+
+static void
+expire_timer(void *arg, u_int64_t now)
+{
+    (void)arg;
+    (void)now;
+
+    servo_job_sweep(&expire_job);
+}
@@ -0,0 +1,13 @@
+#ifndef _SERVO_EXPIRE_H_
+#define _SERVO_EXPIRE_H_
+
+#include <kore/kore.h>
+#include <kore/pgsql.h>
+
+#include "servo.h"
+
+void                 servo_expire_init(void);
+void                 servo_expire_touch(const uuid_t, const char *,
+                                        u_int32_t);
+
+#endif //_SERVO_EXPIRE_H_
@@ -0,0 +1,201 @@
+#include "flight.h"
+#include "stats.h"
+#include "util.h"
+
+/*
+ * Single-flight of item reads.
+ *
+ * Concurrent GETs of the same key by the same session in a worker
+ * share one query. The first request leads and runs it, the others
+ * sleep without touching the pgsql pool. When the leader is done its
+ * result is copied into every follower and they are woken up to
+ * render it. If the leader fails or overruns its budget, followers
+ * are woken up empty handed and run the query on their own.
+ *
+ * A write to a key detaches its flight, so reads arriving after the
+ * write never share a query started before it.
+ */
+
+#define FLIGHT_BUCKETS          256
+#define FLIGHT_TIMER_INTERVAL   100
+
+static LIST_HEAD(, servo_flight)     flight_buckets[FLIGHT_BUCKETS];
+
+static void     flight_timer(void *, u_int64_t);
+
+void
+servo_flight_init(void)
+{
+    size_t      i;
+
+    for (i = 0; i < FLIGHT_BUCKETS; i++)
+        LIST_INIT(&flight_buckets[i]);
+    kore_timer_add(flight_timer, FLIGHT_TIMER_INTERVAL, NULL, 0);
+}
+
+static struct servo_flight *
+flight_lookup(u_int64_t hash, const uuid_t client_id, const char *key,
+              int replica)
+{
+    struct servo_flight     *f;
+
+    LIST_FOREACH(f, &flight_buckets[hash % FLIGHT_BUCKETS], list) {
+        if (f->hash == hash &&
+            f->replica == replica &&
+            uuid_compare(f->client_id, client_id) == 0 &&
+            strcmp(f->key, key) == 0)
+            return f;
+    }
+    return NULL;
+}
+
+static void
+flight_unhash(struct servo_flight *f)
+{
+    if (!f->hashed)
+        return;
+    LIST_REMOVE(f, list);
+    f->hashed = 0;
+}
+
+/* a write to the key, later reads must not join a flight started before */
+void
+servo_flight_forget(const uuid_t client_id, const char *key)
+{
+    struct servo_flight     *f;
+    u_int64_t                hash;
+    int                      replica;
+
+    hash = servo_item_hash(client_id, key);
+    for (replica = 0; replica <= 1; replica++) {
+        f = flight_lookup(hash, client_id, key, replica);
+        if (f != NULL)
+            flight_unhash(f);
+    }
+}
+
+/* copy the leader's result into a follower */
+static void
+flight_share(struct servo_context *ctx, struct servo_context *fctx)
+{
+    fctx->status = ctx->status;
+    fctx->in_content_type = ctx->in_content_type;
+    fctx->val_sz = ctx->val_sz;
+    fctx->version = ctx->version;
+    if (ctx->val_str != NULL)
+        fctx->val_str = kore_strdup(ctx->val_str);
+    if (ctx->val_json != NULL)
+        fctx->val_json = json_incref(ctx->val_json);
+    if (ctx->val_json_text != NULL)
+        fctx->val_json_text = kore_strdup(ctx->val_json_text);
+    if (ctx->val_bin != NULL)
+        fctx->val_bin = kore_strdup(ctx->val_bin);
+    fctx->flight_landed = 1;
+}
+
+/* wake all followers, with the leader's result when given */
+static void
+flight_release(struct servo_flight *f, struct servo_context *ctx)
+{
+    struct servo_waiter     *w;
+    struct servo_context    *fctx;
+
+    while ((w = TAILQ_FIRST(&f->followers)) != NULL) {
+        TAILQ_REMOVE(&f->followers, w, list);
+        fctx = http_state_get(w->req);
+        fctx->flight = NULL;
+        fctx->flight_follows = 0;
+        if (ctx != NULL)
+            flight_share(ctx, fctx);
+        http_request_wakeup(w->req);
+    }
+}
+
+int
+servo_flight_join(struct http_request *req, int replica)
+{
+    struct servo_context    *ctx = http_state_get(req);
+    struct servo_flight     *f;
+    u_int64_t                hash;
+
+    hash = servo_item_hash(ctx->client_id, req->path);
+    f = flight_lookup(hash, ctx->client_id, req->path, replica);
+    if (f != NULL) {
+        ctx->follower.req = req;
+        ctx->follower.deadline = f->deadline;
+        TAILQ_INSERT_TAIL(&f->followers, &ctx->follower, list);
+        ctx->flight = f;
+        ctx->flight_follows = 1;
+        servo_stats_count(STATS_COALESCED, 1);
+        kore_log(LOG_DEBUG, "{%s} joined read of '%s' in flight",
+                            ctx->client,
+                            req->path);
+        http_request_sleep(req);
+        return (SERVO_FLIGHT_FOLLOW);
+    }
+
+    f = kore_calloc(1, sizeof(struct servo_flight));
+    f->hash = hash;
+    uuid_copy(f->client_id, ctx->client_id);
+    f->key = kore_strdup(req->path);
+    f->replica = replica;
+    f->deadline = kore_time_ms() +
+                  CONFIG->pool_wait_timeout + CONFIG->timeout_read;
+    TAILQ_INIT(&f->followers);
+    LIST_INSERT_HEAD(&flight_buckets[hash % FLIGHT_BUCKETS], f, list);
+    f->hashed = 1;
+
+    ctx->flight = f;
+    return (SERVO_FLIGHT_LEAD);
+}
+
+void
+servo_flight_leave(struct http_request *req)
+{
+    struct servo_context    *ctx = http_state_get(req);
+    struct servo_flight     *f = ctx->flight;
+
+    if (req->method == HTTP_METHOD_POST ||
+        req->method == HTTP_METHOD_PUT ||
+        req->method == HTTP_METHOD_PATCH ||
+        req->method == HTTP_METHOD_DELETE) {
+        servo_flight_forget(ctx->client_id, req->path);
+        return;
+    }
+
+    if (f == NULL)
+        return;
+    ctx->flight = NULL;
+
+    if (ctx->flight_follows) {
+        TAILQ_REMOVE(&f->followers, &ctx->follower, list);
+        ctx->flight_follows = 0;
+        return;
+    }
+
+    /* only definite answers are shared, failures are retried */
+    flight_unhash(f);
+    flight_release(f, ctx->status == 200 || ctx->status == 404 ? ctx : NULL);
+    kore_free(f->key);
+    kore_free(f);
+}
+
+static void
+flight_timer(void *arg, u_int64_t now)
+{
+    struct servo_flight     *f, *next;
+    size_t                   i;
+
+    (void)arg;
+
+    /* leader overran, let followers query on their own */
+    for (i = 0; i < FLIGHT_BUCKETS; i++) {
+        for (f = LIST_FIRST(&flight_buckets[i]); f != NULL; f = next) {
+            next = LIST_NEXT(f, list);
+            if (f->deadline > now)
+                continue;
+            flight_unhash(f);
+            flight_release(f, NULL);
+        }
+    }
+}
@@ -0,0 +1,33 @@
+#ifndef _SERVO_FLIGHT_H_
+#define _SERVO_FLIGHT_H_
+
+#include <sys/queue.h>
+
+#include <kore/kore.h>
+#include <kore/http.h>
+
+#include "servo.h"
+
+/* servo_flight_join results */
+#define SERVO_FLIGHT_LEAD       0
+#define SERVO_FLIGHT_FOLLOW     1
+
+/* item read in progress, shared by identical concurrent reads */
+struct servo_flight {
+    u_int64_t                        hash;
+    uuid_t                           client_id;
+    char                            *key;
+    int                              replica;
+    int                              hashed;
+    u_int64_t                        deadline;
+
+    TAILQ_HEAD(, servo_waiter)       followers;
+    LIST_ENTRY(servo_flight)         list;
+};
+
+void                 servo_flight_init(void);
+int                  servo_flight_join(struct http_request *, int);
+void                 servo_flight_leave(struct http_request *);
+void                 servo_flight_forget(const uuid_t, const char *);
+
+#endif //_SERVO_FLIGHT_H_
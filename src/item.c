@@ -1,53 +1,74 @@
 #include "servo.h"
 #include "util.h"
+#include "stats.h"
+#include "pool.h"
+#include "shard.h"
+#include "flight.h"
+#include "bloom.h"
+#include "watch.h"
+#include "counter.h"
+#include "origin.h"
+#include "ratelimit.h"
+#include "quota.h"
+#include "codec.h"
+#include "writeback.h"
+#include "expire.h"
 #include "assets.h"
 
-int item_sql_update(const char*, struct http_request *, struct kore_buf *, struct http_file *);
+int item_sql_update(const char*, struct http_request *, struct kore_buf *, struct http_file *, int);
 int item_sql_query(const char*, struct http_request *);
 
+/*
+ * CORS preflights carry no session, they are answered from the config
+ * before any token work and cached by browsers for max age.
+ */
+static int
+item_preflight(struct http_request *req, const char *allow)
+{
+    servo_origin_headers(req, allow);
+    http_response_header(req, CORS_ALLOW_METHODS_HEADER, CORS_ALLOW_METHODS);
+    http_response_header(req, CORS_ALLOW_HEADER, CORS_ALLOW_HEADERS);
+    if (CONFIG->preflight_max_age_hdr != NULL)
+        http_response_header(req, CORS_MAX_AGE_HEADER,
+                             CONFIG->preflight_max_age_hdr);
+    http_response(req, 204, NULL, 0);
+
+    kore_log(LOG_DEBUG, "OPTIONS %s preflight", req->path);
+    servo_delete_context(req);
+    return (HTTP_STATE_COMPLETE);
+}
+
 int
 servo_state_init(struct http_request *req)
 {
     struct servo_context    *ctx = http_state_get(req);
-    char                    *origin = NULL;
-    char                     saddr[INET6_ADDRSTRLEN];
+    const char              *allow;
+    u_int64_t                retry_after;
     int                      rc;
 
     /* Filter by Origin header */
-    if (CONFIG->allow_origin != NULL) {
-        if (!http_request_header(req, "Origin", &origin) && !CONFIG->public_mode) {
-            kore_log(LOG_NOTICE, "%s: disallow access - no 'Origin' header sent",
-                __FUNCTION__);
-            servo_response_status(req, 403, "'Origin' header is not found");
-            servo_delete_context(req);
-            return (HTTP_STATE_COMPLETE);
-        }
-        if (strcmp(origin, CONFIG->allow_origin) != 0) {
-            kore_log(LOG_NOTICE, "%s: disallow access - 'Origin' header mismatch %s != %s",
-                __FUNCTION__,
-                origin, CONFIG->allow_origin);
-            servo_response_status(req, 403, "Origin Access Denied");
-            servo_delete_context(req);
-            return (HTTP_STATE_COMPLETE);
-        }
+    if (!servo_origin_check(req, &allow)) {
+        servo_response_status(req, 403, "Origin Access Denied");
+        servo_delete_context(req);
+        return (HTTP_STATE_COMPLETE);
     }
 
     /* Filter by client ip address */
-    if (CONFIG->allow_ipaddr != NULL) {
-        memset(saddr, 0, sizeof(saddr));
-        if (req->owner->addrtype == AF_INET) {
-            inet_ntop(AF_INET, &req->owner->addr.ipv4.sin_addr, saddr, sizeof(saddr));
-        }
-        if (req->owner->addrtype == AF_INET6) {
-            inet_ntop(AF_INET6, &req->owner->addr.ipv6.sin6_addr, saddr, sizeof(saddr));
-        }
-        if (strcmp(saddr, CONFIG->allow_ipaddr) != 0) {
-            kore_log(LOG_NOTICE, "%s: disallow access - Client IP mismatch %s != %s",
-                __FUNCTION__, saddr, CONFIG->allow_ipaddr);
-            servo_response_status(req, 403, "Client Access Denied");
-            servo_delete_context(req);
-            return (HTTP_STATE_COMPLETE);
-        }
+    if (!servo_filter_ipaddr(req)) {
+        servo_response_status(req, 403, "Client Access Denied");
+        servo_delete_context(req);
+        return (HTTP_STATE_COMPLETE);
+    }
+
+    if (req->method == HTTP_METHOD_OPTIONS)
+        return item_preflight(req, allow);
+
+    /* shed abusive clients before any session or database work */
+    if (!servo_ratelimit_address(req->owner, &retry_after)) {
+        servo_origin_headers(req, allow);
+        servo_ratelimit_respond(req, retry_after);
+        servo_delete_context(req);
+        return (HTTP_STATE_COMPLETE);
     }
 
     // read header and parse json web token
@@ -59,6 +80,13 @@ servo_state_init(struct http_request *req)
             return (HTTP_STATE_COMPLETE);
         }
     }
+    else if (!servo_ratelimit_client(ctx->client_id, &retry_after)) {
+        kore_log(LOG_NOTICE, "{%s} rate limited", ctx->client);
+        servo_origin_headers(req, allow);
+        servo_ratelimit_respond(req, retry_after);
+        servo_delete_context(req);
+        return (HTTP_STATE_COMPLETE);
+    }
     kore_log(LOG_DEBUG, "{%s} %s %s started",
                         ctx->client,
                         http_method_text(req->method),
@@ -67,21 +95,14 @@ servo_state_init(struct http_request *req)
     // read & init content types
     servo_read_content_types(req);
 
-    // set Access-Control-Allow-Origin header accoring to config
-    if (CONFIG->allow_origin != NULL) {
-        http_response_header(req, CORS_ALLOWORIGIN_HEADER, CONFIG->allow_origin);
-    }
-    else {
-        http_response_header(req, CORS_ALLOWORIGIN_HEADER, "*");   
-    }
+    // set Access-Control-Allow-Origin header to the matched origin
+    servo_origin_headers(req, allow);
 
-    // finish request now for OPTIONS and HEAD methods
+    // finish request now for HEAD method
     // since we need to respond with CORS *-Allow-* headers
-    if (req->method == HTTP_METHOD_OPTIONS ||
-        req->method == HTTP_METHOD_HEAD) {
+    if (req->method == HTTP_METHOD_HEAD) {
         
-        http_response_header(req, CORS_ALLOW_HEADER, AUTH_HEADER);
-        http_response_header(req, CORS_ALLOW_HEADER, CONTENT_TYPE_HEADER);
+        http_response_header(req, CORS_ALLOW_HEADER, CORS_ALLOW_HEADERS);
         servo_response_status(req, 200, http_status_text(200));
 
         kore_log(LOG_ERR, "%s %s by {%s} authorized with %d: %s",
@@ -98,6 +119,16 @@ servo_state_init(struct http_request *req)
     // set Access-Control-Expose-Headers to allow auth header
     // as indicated by Access-Control-Allow-Headers
     http_response_header(req, CORS_EXPOSE_HEADER, AUTH_HEADER);
+    http_response_header(req, CORS_EXPOSE_HEADER, ETAG_HEADER);
+    http_response_header(req, CORS_EXPOSE_HEADER, CONTENT_RANGE_HEADER);
+
+    // writes keep the session's reads on the primary for a while
+    if (req->method == HTTP_METHOD_POST ||
+        req->method == HTTP_METHOD_PUT ||
+        req->method == HTTP_METHOD_PATCH ||
+        req->method == HTTP_METHOD_DELETE) {
+        servo_mark_context_write(ctx);
+    }
 
     // set Authorization header
     servo_write_context_token(req);
@@ -115,8 +146,326 @@ servo_state_init(struct http_request *req)
     }
 
     // into database io
+    req->fsm_state = REQ_STATE_CONNECT;
+    return (HTTP_STATE_CONTINUE);
+}
+
+/*
+ * Item reads may go to a replica unless the session wrote recently,
+ * then the replica might not have its write yet.
+ */
+static int
+item_read_replica(struct http_request *req)
+{
+    struct servo_context    *ctx = http_state_get(req);
+
+    if (req->method != HTTP_METHOD_GET)
+        return 0;
+    return ctx->last_write + CONFIG->replica_sticky <= servo_wallclock_ms();
+}
+
+/*
+ * PATCH /key?op=incr|decr[&by=n] adds to a number, creating the item
+ * from zero, op=append adds the body to the end of a text item or as
+ * the last element of a JSON array.
+ */
+static int
+item_read_patch(struct http_request *req)
+{
+    struct servo_context    *ctx = http_state_get(req);
+    char                    *op;
+    u_int64_t                by;
+
+    if ((op = servo_query_string(req, "op")) == NULL)
+        return (KORE_RESULT_ERROR);
+    if (!servo_query_number(req, "by", &by))
+        by = 1;
+
+    if (strcmp(op, "incr") == 0 || strcmp(op, "decr") == 0) {
+        ctx->patch_op = SERVO_PATCH_INCR;
+        ctx->patch_delta = (int64_t)MIN(by, (u_int64_t)INT64_MAX);
+        if (op[0] == 'd')
+            ctx->patch_delta = -ctx->patch_delta;
+    }
+    else if (strcmp(op, "append") == 0) {
+        ctx->patch_op = SERVO_PATCH_APPEND;
+    }
+    kore_free(op);
+    return ctx->patch_op != SERVO_PATCH_NONE;
+}
+
+/*
+ * POST and PUT /key?ttl=sec[&idle=sec] expire the item after ttl,
+ * idle alone expires it when not read or written for that long.
+ */
+static int
+item_read_expiry(struct http_request *req, const char *name, u_int64_t *out)
+{
+    char                    *v;
+
+    *out = 0;
+    if ((v = servo_query_string(req, name)) == NULL)
+        return (KORE_RESULT_OK);
+    kore_free(v);
+    if (!servo_query_number(req, name, out) || *out == 0 || *out > INT32_MAX)
+        return (KORE_RESULT_ERROR);
+    return (KORE_RESULT_OK);
+}
+
+/* entity tag of a version, "n" or n */
+static int
+item_read_etag(const char *value, u_int64_t *out)
+{
+    char                    *end;
+
+    if (*value == '"')
+        value++;
+    errno = 0;
+    *out = strtoull(value, &end, 10);
+    if (errno != 0 || end == value)
+        return (KORE_RESULT_ERROR);
+    if (*end == '"')
+        end++;
+    return *end == '\0';
+}
+
+/*
+ * If-Match and If-None-Match make writes conditional on the version of
+ * the item, PUT /key?upsert=1 creates it when missing.
+ */
+static int
+item_read_match(struct http_request *req)
+{
+    struct servo_context    *ctx = http_state_get(req);
+    char                    *value;
+    u_int64_t                upsert;
+
+    if (req->method == HTTP_METHOD_PUT &&
+        servo_query_number(req, "upsert", &upsert))
+        ctx->upsert = upsert != 0;
+
+    if (http_request_header(req, IF_MATCH_HEADER, &value)) {
+        if (strcmp(value, "*") == 0)
+            ctx->match = SERVO_MATCH_ANY;
+        else if (item_read_etag(value, &ctx->match_version))
+            ctx->match = SERVO_MATCH_VERSION;
+        else
+            return (KORE_RESULT_ERROR);
+    }
+    else if (req->method == HTTP_METHOD_PUT &&
+             http_request_header(req, IF_NONE_MATCH_HEADER, &value)) {
+        if (strcmp(value, "*") != 0)
+            return (KORE_RESULT_ERROR);
+        ctx->match = SERVO_MATCH_ABSENT;
+    }
+    return (KORE_RESULT_OK);
+}
+
+/* digits of a byte position, short of overflowing the length after it */
+static int
+item_range_number(char **p, int64_t *out)
+{
+    int64_t                  v;
+
+    if (!isdigit((unsigned char)**p))
+        return (KORE_RESULT_ERROR);
+    for (v = 0; isdigit((unsigned char)**p); (*p)++) {
+        if (v >= INT64_MAX / 10)
+            return (KORE_RESULT_ERROR);
+        v = v * 10 + (**p - '0');
+    }
+    *out = v;
+    return (KORE_RESULT_OK);
+}
+
+/*
+ * Range: bytes=first-last, first- or -suffix reads a span of a blob
+ * item, with If-Range: "n" only while it is at version n. Other ranges,
+ * several of them or If-Range dates read the whole item.
+ */
+static void
+item_read_range(struct http_request *req)
+{
+    struct servo_context    *ctx = http_state_get(req);
+    char                    *value;
+    int64_t                  first, last;
+
+    if (!http_request_header(req, RANGE_HEADER, &value) ||
+        strncmp(value, "bytes=", 6) != 0)
+        return;
+    value += 6;
+
+    last = -1;
+    if (*value == '-') {
+        value++;
+        if (!item_range_number(&value, &last) || last == 0)
+            return;
+        first = -last;
+        last = -1;
+    }
+    else {
+        if (!item_range_number(&value, &first) || *value++ != '-')
+            return;
+        if (*value != '\0' && (!item_range_number(&value, &last) ||
+                                last < first))
+            return;
+    }
+    if (*value != '\0')
+        return;
+
+    if (http_request_header(req, IF_RANGE_HEADER, &value)) {
+        if (!item_read_etag(value, &ctx->range_version))
+            return;
+        ctx->range_if = 1;
+    }
+
+    ctx->range = 1;
+    ctx->range_first = first;
+    ctx->range_len = last >= 0 ? last - first + 1 : 0;
+}
+
+int
+servo_state_connect(struct http_request *req)
+{
+    struct servo_context    *ctx = http_state_get(req);
+    const char              *msg;
+    char                     etag[32], retry_after[16];
+    int                      readonly, quota;
+
+    servo_stats_enter(req);
+
+    /* a write of the key behind in the worker goes first */
+    if (!ctx->behind_checked) {
+        ctx->behind_checked = 1;
+        if (servo_writeback_wait(req))
+            return (HTTP_STATE_RETRY);
+    }
+
+    if (req->method == HTTP_METHOD_PATCH &&
+        ctx->patch_op == SERVO_PATCH_NONE) {
+        if (!item_read_patch(req)) {
+            ctx->status = 400;
+            ctx->err = kore_strdup("Unknown PATCH operation");
+            req->fsm_state = REQ_STATE_ERROR;
+            return (HTTP_STATE_CONTINUE);
+        }
+
+        /* summed up in the worker, written with the next flush */
+        if (ctx->patch_op == SERVO_PATCH_INCR && CONFIG->counter_flush > 0) {
+            if ((quota = servo_quota_check(ctx->client_id,
+                                           SERVO_QUOTA_MAY_CREATE, 0)) !=
+                SERVO_QUOTA_OK) {
+                ctx->status = 403;
+                ctx->err = kore_strdup(servo_quota_text(quota));
+                req->fsm_state = REQ_STATE_ERROR;
+                return (HTTP_STATE_CONTINUE);
+            }
+            if (!servo_counter_add(ctx->client_id, req->path,
+                                   ctx->patch_delta)) {
+                snprintf(retry_after, sizeof(retry_after), "%d",
+                         CONFIG->pool_retry_after);
+                http_response_header(req, RETRY_AFTER_HEADER, retry_after);
+                ctx->status = 503;
+                ctx->err = kore_strdup("Too many increments pending");
+                req->fsm_state = REQ_STATE_ERROR;
+                return (HTTP_STATE_CONTINUE);
+            }
+            msg = http_status_text(202);
+            http_response_header(req, CONTENT_TYPE_HEADER, CONTENT_TYPE_STRING);
+            http_response(req, 202, msg, strlen(msg));
+            servo_delete_context(req);
+            return (HTTP_STATE_COMPLETE);
+        }
+    }
+
+    if ((req->method == HTTP_METHOD_POST || req->method == HTTP_METHOD_PUT) &&
+        (!item_read_expiry(req, "ttl", &ctx->ttl) ||
+         !item_read_expiry(req, "idle", &ctx->idle_ttl))) {
+        ctx->status = 400;
+        ctx->err = kore_strdup("Invalid TTL");
+        req->fsm_state = REQ_STATE_ERROR;
+        return (HTTP_STATE_CONTINUE);
+    }
+
+    if ((req->method == HTTP_METHOD_PUT || req->method == HTTP_METHOD_DELETE) &&
+        ctx->match == SERVO_MATCH_NONE && !item_read_match(req)) {
+        ctx->status = 400;
+        ctx->err = kore_strdup("Invalid precondition, a version or *");
+        req->fsm_state = REQ_STATE_ERROR;
+        return (HTTP_STATE_CONTINUE);
+    }
+
+    /* journaled and answered, written with the next flush */
+    if (req->method == HTTP_METHOD_PUT && ctx->upsert &&
+        ctx->match == SERVO_MATCH_NONE && servo_writeback_enabled()) {
+        ctx->behind = 1;
+        req->fsm_state = REQ_STATE_QUERY;
+        return (HTTP_STATE_CONTINUE);
+    }
+
+    /* woken up with the result of an identical read */
+    if (ctx->flight_landed) {
+        req->fsm_state = servo_is_success(ctx) ? REQ_STATE_DONE
+                                               : REQ_STATE_ERROR;
+        return (HTTP_STATE_CONTINUE);
+    }
+
+    /* watched item did not change in time */
+    if (ctx->watch_expired) {
+        snprintf(etag, sizeof(etag), "\"%llu\"",
+                 (unsigned long long)ctx->watch_version);
+        http_response_header(req, ETAG_HEADER, etag);
+        http_response(req, 304, NULL, 0);
+        servo_delete_context(req);
+        return (HTTP_STATE_COMPLETE);
+    }
+
+    /* written behind and not flushed yet, the worker has the value */
+    if (req->method == HTTP_METHOD_GET && !ctx->watch_checked &&
+        servo_writeback_read(req))
+        return (HTTP_STATE_CONTINUE);
+
+    if (req->method == HTTP_METHOD_GET && !ctx->watch_checked) {
+        ctx->watch_checked = 1;
+        if (servo_watch_begin(req) == SERVO_WATCH_FULL) {
+            ctx->status = 503;
+            ctx->err = kore_strdup("Too many watches");
+            req->fsm_state = REQ_STATE_ERROR;
+            return (HTTP_STATE_CONTINUE);
+        }
+    }
+
+    if (req->method == HTTP_METHOD_GET && !ctx->watch &&
+        !ctx->range_checked) {
+        ctx->range_checked = 1;
+        item_read_range(req);
+    }
+
+    /* definite miss, no need to ask the database */
+    if (req->method == HTTP_METHOD_GET && !ctx->watch &&
+        !ctx->bloom_checked) {
+        ctx->bloom_checked = servo_bloom_ready();
+        if (!servo_bloom_maybe(ctx->client_id, req->path)) {
+            servo_stats_count(STATS_BLOOM_NEGATIVES, 1);
+            ctx->status = 404;
+            req->fsm_state = REQ_STATE_ERROR;
+            return (HTTP_STATE_CONTINUE);
+        }
+    }
+
+    /* watches read the primary, notifications come from it */
+    readonly = !ctx->watch && item_read_replica(req);
+    if (req->method == HTTP_METHOD_GET && !ctx->watch && !ctx->range &&
+        !ctx->flight_joined) {
+        ctx->flight_joined = 1;
+        if (servo_flight_join(req, readonly) == SERVO_FLIGHT_FOLLOW)
+            return (HTTP_STATE_RETRY);
+    }
+
+    if (ctx->dbname == NULL)
+        ctx->dbname = servo_shard_dbname(ctx, readonly);
     return servo_connect_db(req,
-                            REQ_STATE_INIT,
+                            REQ_STATE_CONNECT,
                             REQ_STATE_QUERY,
                             REQ_STATE_ERROR);
 }
@@ -135,31 +484,31 @@ int item_sql_query(const char *asset, struct http_request *req)
                                 PGSQL_FORMAT_TEXT,
                                 2,
                                 // client
-                                ctx->client,
-                                strlen(ctx->client),
-                                PGSQL_FORMAT_TEXT,
+                                ctx->client_id,
+                                sizeof(ctx->client_id),
+                                PGSQL_FORMAT_BINARY,
                                 // key
                                 req->path,
                                 strlen(req->path),
                                 PGSQL_FORMAT_TEXT);
 }
 
-int item_sql_update(const char* asset, struct http_request *req, struct kore_buf *body, struct http_file* file)
+int item_sql_update(const char* asset, struct http_request *req, struct kore_buf *body, struct http_file* file, int with_version)
 {
     /*
         call SQL script [asset] with arguments in order:
-        (client, key, string, json, blob)
+        (client, key, string, json, blob, ttl, idle ttl[, version])
     */
     struct servo_context    *ctx;
     int                      rc;
-    char                    *val_str;
+    char                    *val_str, *val_json_str;
+    char                     ttl[24], idle_ttl[24], version[24];
     json_error_t             jerr;
     json_t                  *val_json;
     struct kore_buf         *val_bin_buf;
     void                    *val_bin;
     size_t                   val_bin_sz;
 
-    rc = KORE_RESULT_OK;
     ctx = (struct servo_context*)http_state_get(req);
     if (body != NULL) {
         kore_log(LOG_NOTICE, "{%s} reading body %zu bytes (%s) from client",
@@ -179,6 +528,12 @@ int item_sql_update(const char* asset, struct http_request *req, struct kore_buf
         return (KORE_RESULT_ERROR);
     }
 
+    val_str = NULL;
+    val_json_str = NULL;
+    val_bin_buf = NULL;
+    val_bin = NULL;
+    val_bin_sz = 0;
+
     switch(ctx->in_content_type) {
         default:
         case SERVO_CONTENT_STRING:
@@ -188,28 +543,6 @@ int item_sql_update(const char* asset, struct http_request *req, struct kore_buf
                 return (KORE_RESULT_ERROR);
             }
             val_str = kore_buf_stringify(body, NULL);
-            rc = kore_pgsql_query_params(&ctx->sql, 
-                                asset, 
-                                PGSQL_FORMAT_TEXT,
-                                5,
-                                // client
-                                ctx->client,
-                                strlen(ctx->client),
-                                PGSQL_FORMAT_TEXT,
-                                // key
-                                req->path,
-                                strlen(req->path),
-                                PGSQL_FORMAT_TEXT,
-                                // string
-                                val_str,
-                                strlen(val_str),
-                                PGSQL_FORMAT_TEXT, 
-                                // json
-                                NULL, 0,
-                                PGSQL_FORMAT_TEXT,
-                                // binary
-                                NULL, 0,
-                                PGSQL_FORMAT_TEXT);
             break;
 
         case SERVO_CONTENT_JSON:
@@ -218,8 +551,8 @@ int item_sql_update(const char* asset, struct http_request *req, struct kore_buf
                           ctx->client);
                 return (KORE_RESULT_ERROR);
             }
-            val_str = kore_buf_stringify(body, NULL);
-            val_json = json_loads(val_str, JSON_ALLOW_NUL, &jerr);
+            val_json_str = kore_buf_stringify(body, NULL);
+            val_json = json_loads(val_json_str, JSON_ALLOW_NUL, &jerr);
             if (val_json == NULL) {
                 ctx->err = kore_malloc(512);
                 snprintf(ctx->err, 512,
@@ -229,34 +562,19 @@ int item_sql_update(const char* asset, struct http_request *req, struct kore_buf
                          ctx->client,
                          ctx->err);
                 kore_log(LOG_ERR, "{%s} --start--", ctx->client);
-                kore_log(LOG_ERR, "{%s} %s", ctx->client, val_str);
+                kore_log(LOG_ERR, "{%s} %s", ctx->client, val_json_str);
                 kore_log(LOG_ERR, "{%s} --end--", ctx->client);
                 return (KORE_RESULT_ERROR);
             }
-            rc = kore_pgsql_query_params(&ctx->sql, 
-                                asset, 
-                                PGSQL_FORMAT_TEXT,
-                                5,
-                                // client
-                                ctx->client,
-                                strlen(ctx->client),
-                                PGSQL_FORMAT_TEXT,
-                                // key
-                                req->path,
-                                strlen(req->path),
-                                PGSQL_FORMAT_TEXT,
-                                // string
-                                NULL, 0,
-                                PGSQL_FORMAT_TEXT, 
-                                // json
-                                val_str, strlen(val_str),
-                                PGSQL_FORMAT_TEXT,
-                                // binary
-                                NULL, 0,
-                                PGSQL_FORMAT_TEXT);
+            json_decref(val_json);
             break;
 
         case SERVO_CONTENT_FORMDATA:
+            /* a blob of CBOR or MessagePack, hex in the body */
+            if (file == NULL && body != NULL) {
+                val_bin = kore_buf_stringify(body, &val_bin_sz);
+                break;
+            }
             if (file == NULL) {
                 kore_log(LOG_ERR, "{%s} no file data in multipart request",
                           ctx->client);
@@ -269,84 +587,253 @@ int item_sql_update(const char* asset, struct http_request *req, struct kore_buf
                 return (KORE_RESULT_ERROR);
             }
             val_bin = kore_buf_stringify(val_bin_buf, &val_bin_sz);
-            rc = kore_pgsql_query_params(&ctx->sql, 
+            break;
+    }
+
+    snprintf(ttl, sizeof(ttl), "%llu", (unsigned long long)ctx->ttl);
+    snprintf(idle_ttl, sizeof(idle_ttl), "%llu",
+             (unsigned long long)ctx->idle_ttl);
+    snprintf(version, sizeof(version), "%llu",
+             (unsigned long long)ctx->match_version);
+    rc = kore_pgsql_query_params(&ctx->sql, 
                                 asset, 
                                 PGSQL_FORMAT_TEXT,
-                                5,
+                                with_version ? 8 : 7,
                                 // client
-                                ctx->client,
-                                strlen(ctx->client),
-                                PGSQL_FORMAT_TEXT,
+                                ctx->client_id,
+                                sizeof(ctx->client_id),
+                                PGSQL_FORMAT_BINARY,
                                 // key
                                 req->path,
                                 strlen(req->path),
                                 PGSQL_FORMAT_TEXT,
                                 // string
-                                NULL, 0,
+                                val_str,
+                                val_str != NULL ? strlen(val_str) : 0,
                                 PGSQL_FORMAT_TEXT, 
                                 // json
-                                NULL, 0,
+                                val_json_str,
+                                val_json_str != NULL ? strlen(val_json_str) : 0,
                                 PGSQL_FORMAT_TEXT,
                                 // binary
                                 val_bin,
                                 val_bin_sz,
+                                PGSQL_FORMAT_TEXT,
+                                // ttl, idle ttl, NULL when not given
+                                ctx->ttl != 0 ? ttl : NULL,
+                                ctx->ttl != 0 ? strlen(ttl) : 0,
+                                PGSQL_FORMAT_TEXT,
+                                ctx->idle_ttl != 0 ? idle_ttl : NULL,
+                                ctx->idle_ttl != 0 ? strlen(idle_ttl) : 0,
+                                PGSQL_FORMAT_TEXT,
+                                // expected version, NULL for any
+                                ctx->match == SERVO_MATCH_VERSION ? version : NULL,
+                                ctx->match == SERVO_MATCH_VERSION ? strlen(version) : 0,
                                 PGSQL_FORMAT_TEXT);
-            kore_buf_free(val_bin_buf);
-            break;
-    }
+    if (val_bin_buf != NULL)
+        kore_buf_free(val_bin_buf);
     return rc;
 }
 
+static int
+item_sql_range(struct http_request *req)
+{
+    struct servo_context    *ctx = http_state_get(req);
+    char                     first[24], len[24], version[24];
+
+    /* get_item_range.sql, get_item_range_ro.sql on replicas
+     * $1 - client
+     * $2 - item key
+     * $3 - first byte, below 0 a suffix length
+     * $4 - length, NULL to the end
+     * $5 - If-Range version, NULL for any
+     */
+    snprintf(first, sizeof(first), "%lld", (long long)ctx->range_first);
+    snprintf(len, sizeof(len), "%lld", (long long)ctx->range_len);
+    snprintf(version, sizeof(version), "%llu",
+             (unsigned long long)ctx->range_version);
+    return kore_pgsql_query_params(&ctx->sql,
+                                ctx->replica ?
+                                (const char*)asset_get_item_range_ro_sql :
+                                (const char*)asset_get_item_range_sql,
+                                PGSQL_FORMAT_TEXT,
+                                5,
+                                ctx->client_id,
+                                sizeof(ctx->client_id),
+                                PGSQL_FORMAT_BINARY,
+                                req->path,
+                                strlen(req->path),
+                                PGSQL_FORMAT_TEXT,
+                                first,
+                                strlen(first),
+                                PGSQL_FORMAT_TEXT,
+                                ctx->range_len != 0 ? len : NULL,
+                                ctx->range_len != 0 ? strlen(len) : 0,
+                                PGSQL_FORMAT_TEXT,
+                                ctx->range_if ? version : NULL,
+                                ctx->range_if ? strlen(version) : 0,
+                                PGSQL_FORMAT_TEXT);
+}
+
 int state_handle_get(struct http_request *req)
 {
-    /* get_item.sql
+    struct servo_context    *ctx = http_state_get(req);
+
+    if (ctx->replica)
+        servo_stats_count(STATS_REPLICA_READS, 1);
+    if (ctx->range)
+        return item_sql_range(req);
+
+    /* get_item.sql, get_item_ro.sql on replicas
      * $1 - client
      * $2 - item key 
      */
+    if (ctx->replica)
+        return item_sql_query((const char*)asset_get_item_ro_sql, req);
     return item_sql_query((const char*)asset_get_item_sql, req);
 }
 
 int state_handle_delete(struct http_request *req)
 {
+    struct servo_context    *ctx = http_state_get(req);
+    char                     version[24];
+
     /* delete_item.sql
      * $1 - client
      * $2 - item key 
+     * $3 - expected version, NULL for any
      */
-    return item_sql_query((const char*)asset_delete_item_sql, req);
+    snprintf(version, sizeof(version), "%llu",
+             (unsigned long long)ctx->match_version);
+    return kore_pgsql_query_params(&ctx->sql,
+                                (const char*)asset_delete_item_sql,
+                                PGSQL_FORMAT_TEXT,
+                                3,
+                                ctx->client_id,
+                                sizeof(ctx->client_id),
+                                PGSQL_FORMAT_BINARY,
+                                req->path,
+                                strlen(req->path),
+                                PGSQL_FORMAT_TEXT,
+                                ctx->match == SERVO_MATCH_VERSION ? version : NULL,
+                                ctx->match == SERVO_MATCH_VERSION ? strlen(version) : 0,
+                                PGSQL_FORMAT_TEXT);
 }
 
 int state_handle_put(struct http_request *req, struct kore_buf *body, struct http_file *file)
 {
-    /* put_item.sql expects 5 arguments: 
-     client, key, string, json, blob
+    struct servo_context    *ctx = http_state_get(req);
+
+    /* If-None-Match: * is an insert, post_item.sql */
+    if (ctx->match == SERVO_MATCH_ABSENT)
+        return item_sql_update((const char*)asset_post_item_sql, req, body, file, 0);
+
+    /* upsert_item.sql expects 7 arguments, as post_item.sql */
+    if (ctx->upsert && ctx->match == SERVO_MATCH_NONE)
+        return item_sql_update((const char*)asset_upsert_item_sql, req, body, file, 0);
+
+    /* put_item.sql expects 8 arguments: 
+     client, key, string, json, blob, ttl, idle ttl, version
     */
-    return item_sql_update((const char*)asset_put_item_sql, req, body, file);
+    return item_sql_update((const char*)asset_put_item_sql, req, body, file, 1);
 }
 
 int state_handle_post(struct http_request *req, struct kore_buf *body, struct http_file *file)
 {
-    /* post_item.sql expects 5 arguments: 
-     client, key, string, json, blob
+    /* post_item.sql expects 7 arguments: 
+     client, key, string, json, blob, ttl, idle ttl
     */
-    return item_sql_update((const char*)asset_post_item_sql, req, body, file);
+    return item_sql_update((const char*)asset_post_item_sql, req, body, file, 0);
+}
+
+int state_handle_patch(struct http_request *req, struct kore_buf *body)
+{
+    struct servo_context    *ctx = http_state_get(req);
+    char                     delta[32], str_max[32], json_max[32];
+    char                    *val;
+
+    if (ctx->patch_op == SERVO_PATCH_INCR) {
+        /* add_item.sql
+         * $1 - client
+         * $2 - item key
+         * $3 - delta
+         */
+        snprintf(delta, sizeof(delta), "%lld", (long long)ctx->patch_delta);
+        return kore_pgsql_query_params(&ctx->sql,
+                                (const char*)asset_add_item_sql,
+                                PGSQL_FORMAT_TEXT,
+                                3,
+                                ctx->client_id,
+                                sizeof(ctx->client_id),
+                                PGSQL_FORMAT_BINARY,
+                                req->path,
+                                strlen(req->path),
+                                PGSQL_FORMAT_TEXT,
+                                delta,
+                                strlen(delta),
+                                PGSQL_FORMAT_TEXT);
+    }
+
+    /* append_item.sql expects 5 arguments:
+     client, key, value, string limit, json limit
+    */
+    val = kore_buf_stringify(body, NULL);
+    snprintf(str_max, sizeof(str_max), "%zu", CONFIG->string_size);
+    snprintf(json_max, sizeof(json_max), "%zu", CONFIG->json_size);
+    return kore_pgsql_query_params(&ctx->sql,
+                                (const char*)asset_append_item_sql,
+                                PGSQL_FORMAT_TEXT,
+                                5,
+                                ctx->client_id,
+                                sizeof(ctx->client_id),
+                                PGSQL_FORMAT_BINARY,
+                                req->path,
+                                strlen(req->path),
+                                PGSQL_FORMAT_TEXT,
+                                val,
+                                strlen(val),
+                                PGSQL_FORMAT_TEXT,
+                                str_max,
+                                strlen(str_max),
+                                PGSQL_FORMAT_TEXT,
+                                json_max,
+                                strlen(json_max),
+                                PGSQL_FORMAT_TEXT);
+}
+
+static u_int64_t
+item_time_budget(struct http_request *req)
+{
+    struct servo_context    *ctx = http_state_get(req);
+
+    if (req->method == HTTP_METHOD_GET)
+        return CONFIG->timeout_read;
+    if (ctx->in_content_type == SERVO_CONTENT_FORMDATA)
+        return CONFIG->timeout_blob;
+    return CONFIG->timeout_write;
 }
 
 int
 servo_state_query(struct http_request *req)
 {
-    int                      rc, too_big;
+    int                      rc, too_big, creates, quota, decoded, kind;
     struct servo_context    *ctx = NULL;
     struct kore_buf         *body = NULL;
+    struct kore_buf         *coded = NULL;
     struct http_file        *file = NULL;
     size_t limit                  = 0;
 
     rc = KORE_RESULT_OK;
     ctx = (struct servo_context*)http_state_get(req);
+    servo_stats_enter(req);
 
     /* Check size limitations for body & multipart */
     too_big = 0;
+    decoded = 0;
     if (req->method == HTTP_METHOD_POST ||
-        req->method == HTTP_METHOD_PUT) {
+        req->method == HTTP_METHOD_PUT ||
+        (req->method == HTTP_METHOD_PATCH &&
+         ctx->patch_op == SERVO_PATCH_APPEND)) {
         
         switch(ctx->in_content_type) {
             /* Read request body */
@@ -396,9 +883,67 @@ servo_state_query(struct http_request *req)
                     too_big = 1;
                 }
                 break;
+
+            /* Read CBOR or MessagePack as the item it carries */
+            case SERVO_CONTENT_CBOR:
+            case SERVO_CONTENT_MSGPACK:
+                coded = servo_read_body(req);
+                if (coded == NULL) {
+                    kore_log(LOG_ERR, "{%s} no request body to handle",
+                                      ctx->client);
+                    ctx->status = 400;
+                    ctx->err = kore_strdup("No request body to handle");
+                    req->fsm_state = REQ_STATE_ERROR;
+                    return (HTTP_STATE_CONTINUE);
+                }
+                servo_stats_bytes_in(ctx->in_content_type, coded->offset);
+
+                body = kore_buf_alloc(coded->offset * 2 + 2);
+                if (!servo_codec_read(ctx->in_content_type, coded->data,
+                                      coded->offset, body, &kind)) {
+                    kore_log(LOG_ERR, "{%s} malformed %s body",
+                                      ctx->client,
+                                      SERVO_CONTENT_NAMES[ctx->in_content_type]);
+                    kore_buf_free(coded);
+                    kore_buf_free(body);
+                    ctx->status = 400;
+                    ctx->err = kore_strdup("Malformed request body");
+                    req->fsm_state = REQ_STATE_ERROR;
+                    return (HTTP_STATE_CONTINUE);
+                }
+                kore_buf_free(coded);
+                ctx->in_content_type = kind;
+                decoded = 1;
+
+                /* blobs are hex, the input of bytea */
+                ctx->quota_size = body->offset;
+                if (ctx->in_content_type == SERVO_CONTENT_FORMDATA)
+                    ctx->quota_size = (body->offset - 2) / 2;
+                limit = ctx->in_content_type == SERVO_CONTENT_STRING ?
+                        CONFIG->string_size :
+                        ctx->in_content_type == SERVO_CONTENT_JSON ?
+                        CONFIG->json_size : CONFIG->blob_size;
+                if (ctx->quota_size > limit) {
+                    kore_log(LOG_ERR, "{%s} decoded size is too large. %lu > %lu",
+                                      ctx->client,
+                                      ctx->quota_size,
+                                      limit);
+                    too_big = 1;
+                }
+                break;
         };
     }
 
+    if (req->method == HTTP_METHOD_PATCH &&
+        ctx->patch_op == SERVO_PATCH_APPEND &&
+        ctx->in_content_type == SERVO_CONTENT_FORMDATA) {
+        if (body != NULL) kore_buf_free(body);
+        ctx->status = 400;
+        ctx->err = kore_strdup("Only text and JSON can be appended");
+        req->fsm_state = REQ_STATE_ERROR;
+        return (HTTP_STATE_CONTINUE);
+    }
+
     /* Size limitations */
     if (too_big) {
         kore_log(LOG_ERR, "{%s} request forbidden.",
@@ -410,18 +955,75 @@ servo_state_query(struct http_request *req)
         return (HTTP_STATE_CONTINUE);
     }
 
+    if (body != NULL && !decoded)
+        servo_stats_bytes_in(ctx->in_content_type, body->offset);
+    if (file != NULL)
+        servo_stats_bytes_in(ctx->in_content_type, file->length);
+
+    /* Session quotas, the new value counts on top of the usage */
+    if (req->method == HTTP_METHOD_POST ||
+        req->method == HTTP_METHOD_PUT ||
+        req->method == HTTP_METHOD_PATCH) {
+        if (!decoded)
+            ctx->quota_size = body != NULL ? body->offset :
+                              file != NULL ? file->length : 0;
+        if (req->method == HTTP_METHOD_POST ||
+            ctx->match == SERVO_MATCH_ABSENT)
+            creates = SERVO_QUOTA_CREATES;
+        else if ((ctx->upsert && ctx->match == SERVO_MATCH_NONE) ||
+                 ctx->patch_op == SERVO_PATCH_INCR || ctx->behind)
+            creates = SERVO_QUOTA_MAY_CREATE;
+        else
+            creates = SERVO_QUOTA_UPDATES;
+        quota = servo_quota_check(ctx->client_id, creates, ctx->quota_size);
+        if (quota != SERVO_QUOTA_OK) {
+            kore_log(LOG_NOTICE, "{%s} %s", ctx->client,
+                     servo_quota_text(quota));
+            if (body != NULL) kore_buf_free(body);
+            ctx->status = 403;
+            ctx->err = kore_strdup(servo_quota_text(quota));
+            req->fsm_state = REQ_STATE_ERROR;
+            return (HTTP_STATE_CONTINUE);
+        }
+    }
+
+    /* PUT without precondition, to the journal instead */
+    if (ctx->behind) {
+        rc = servo_writeback_put(req, body, file);
+        if (body != NULL) kore_buf_free(body);
+        return (rc);
+    }
+
     /* Handle item operation in http method */
     switch(req->method) {
         case HTTP_METHOD_POST:
+            servo_bloom_add(ctx->client_id, req->path);
+            ctx->bloom_added = 1;
             rc = state_handle_post(req, body, file);
             if (body != NULL) kore_buf_free(body);
             break;
 
         case HTTP_METHOD_PUT:
+            /* may create the item, like POST */
+            if (ctx->match == SERVO_MATCH_ABSENT ||
+                (ctx->upsert && ctx->match == SERVO_MATCH_NONE)) {
+                servo_bloom_add(ctx->client_id, req->path);
+                ctx->bloom_added = 1;
+            }
             rc = state_handle_put(req, body, file);
             if (body != NULL) kore_buf_free(body);
             break;
 
+        case HTTP_METHOD_PATCH:
+            /* increments create missing items */
+            if (ctx->patch_op == SERVO_PATCH_INCR) {
+                servo_bloom_add(ctx->client_id, req->path);
+                ctx->bloom_added = 1;
+            }
+            rc = state_handle_patch(req, body);
+            if (body != NULL) kore_buf_free(body);
+            break;
+
         case HTTP_METHOD_DELETE:
             rc = state_handle_delete(req);
             break;
@@ -452,6 +1054,8 @@ servo_state_query(struct http_request *req)
                         servo_state_text(req->fsm_state),
                         sql_state_text(ctx->sql.state),
                         servo_state_text(REQ_STATE_WAIT));
+    ctx->ts_query = servo_stats_now();
+    servo_pool_deadline(req, item_time_budget(req));
     /* Wait for IO request completition */    
     req->fsm_state = REQ_STATE_WAIT;
     return (HTTP_STATE_CONTINUE);
@@ -459,6 +1063,7 @@ servo_state_query(struct http_request *req)
 
 int servo_state_wait(struct http_request *req)
 {
+    servo_stats_enter(req);
     return servo_wait(req, REQ_STATE_READ,
                            REQ_STATE_DONE,
                            REQ_STATE_ERROR);
@@ -466,14 +1071,73 @@ int servo_state_wait(struct http_request *req)
 
 int servo_state_read(struct http_request *req)
 {
-    int                      rows;               
+    int                      i, rows, inserted;
     struct servo_context    *ctx;
+    struct servo_quota_usage usage;
     char                    *val;
+    char                     range[48];
     json_error_t            jerr;
 
     ctx = (struct servo_context*)http_state_get(req);
+    servo_stats_enter(req);
+
+    /* deleted rows are returned, their key leaves the filter */
+    if (req->method == HTTP_METHOD_DELETE) {
+        rows = kore_pgsql_ntuples(&ctx->sql);
+        if (rows == 0 && ctx->match != SERVO_MATCH_NONE) {
+            ctx->status = 412;
+            req->fsm_state = REQ_STATE_ERROR;
+            return (HTTP_STATE_CONTINUE);
+        }
+        for (i = 0; i < rows; i++) {
+            servo_bloom_remove(ctx->client_id, req->path);
+            servo_quota_deleted(ctx->client_id, &ctx->sql, i, 1);
+        }
+        kore_pgsql_continue(&ctx->sql);
+        req->fsm_state = REQ_STATE_WAIT;
+        return (HTTP_STATE_CONTINUE);
+    }
+
+    /* writes return the new version, nothing when they didn't apply */
+    if (req->method == HTTP_METHOD_POST || req->method == HTTP_METHOD_PUT) {
+        if (kore_pgsql_ntuples(&ctx->sql) == 0) {
+            if (ctx->match != SERVO_MATCH_NONE) {
+                ctx->status = 412;
+            }
+            else if (req->method == HTTP_METHOD_POST) {
+                ctx->status = 409;
+                ctx->err = kore_strdup("Item already exists");
+            }
+            else
+                ctx->status = 404;
+            req->fsm_state = REQ_STATE_ERROR;
+            return (HTTP_STATE_CONTINUE);
+        }
+
+        val = kore_pgsql_getvalue(&ctx->sql, 0, 0);
+        if (val != NULL)
+            ctx->version = strtoull(val, NULL, 10);
+        ctx->created = req->method == HTTP_METHOD_POST ||
+                       ctx->match == SERVO_MATCH_ABSENT;
+        val = kore_pgsql_getvalue(&ctx->sql, 0, 1);
+        inserted = val != NULL && strcmp(val, "t") == 0;
+        if (ctx->upsert && ctx->match == SERVO_MATCH_NONE)
+            ctx->created = inserted;
+
+        /* an item that was there, expired or not, had its key in the filter */
+        if (!inserted && ctx->bloom_added) {
+            servo_bloom_undo(ctx->client_id, req->path);
+            ctx->bloom_added = 0;
+        }
+        servo_quota_written(ctx->client_id, &ctx->sql, 0, 1,
+                            ctx->in_content_type, ctx->quota_size);
+        kore_pgsql_continue(&ctx->sql);
+        req->fsm_state = REQ_STATE_WAIT;
+        return (HTTP_STATE_CONTINUE);
+    }
 
-    if (req->method != HTTP_METHOD_GET) {
+    if (req->method != HTTP_METHOD_GET &&
+        req->method != HTTP_METHOD_PATCH) {
         kore_log(LOG_ERR, "{%s} %s %s is forbidden", 
                  ctx->client,
                  http_method_text(req->method),
@@ -486,15 +1150,35 @@ int servo_state_read(struct http_request *req)
 
     ctx->val_str = NULL;
     ctx->val_json = NULL;
+    ctx->val_json_text = NULL;
     ctx->val_bin = NULL;
     ctx->val_sz = 0;
 
     rows = kore_pgsql_ntuples(&ctx->sql);
+
+    /* watched item is still at the version the client has */
+    if (ctx->watch && rows <= 1) {
+        val = rows == 1 ? kore_pgsql_getvalue(&ctx->sql, 0, 3) : NULL;
+        ctx->version = val != NULL ? strtoull(val, NULL, 10) : 0;
+        if (ctx->version == ctx->watch_version)
+            return servo_watch_park(req);
+    }
+
+    /* servo_add_items() leaves items other than numbers alone */
+    if (rows == 0 && ctx->patch_op == SERVO_PATCH_INCR) {
+        ctx->status = 409;
+        ctx->err = kore_strdup("Item is not a number");
+        req->fsm_state = REQ_STATE_ERROR;
+        return HTTP_STATE_CONTINUE;
+    }
+
     if (rows == 0) {
         /* item was not found, report 404 */
         kore_log(LOG_DEBUG, "{%s} nothing selected for key '%s'",
                             ctx->client,
                             req->path);
+        if (ctx->bloom_checked)
+            servo_stats_count(STATS_BLOOM_FALSE_POS, 1);
         ctx->status = 404;
         req->fsm_state = REQ_STATE_ERROR;
         return HTTP_STATE_CONTINUE;
@@ -507,8 +1191,15 @@ int servo_state_read(struct http_request *req)
             ctx->val_sz = strlen(val);
         }
 
+        /* binary replies are encoded from the text, not a document */
         val = kore_pgsql_getvalue(&ctx->sql, 0, 1);
-        if (val != NULL && strlen(val) > 0) {
+        if (val != NULL && strlen(val) > 0 &&
+            (ctx->out_content_type == SERVO_CONTENT_CBOR ||
+             ctx->out_content_type == SERVO_CONTENT_MSGPACK)) {
+            ctx->val_json_text = kore_strdup(val);
+            ctx->val_sz = strlen(val);
+        }
+        else if (val != NULL && strlen(val) > 0) {
             ctx->val_json = json_loads(val, JSON_ALLOW_NUL, &jerr);
             if (ctx->val_json == NULL) {
                 kore_log(LOG_ERR, "{%s} malformed json read from database for key '%s'",
@@ -524,15 +1215,62 @@ int servo_state_read(struct http_request *req)
             ctx->val_sz = strlen(ctx->val_bin);
         }
 
+        val = kore_pgsql_getvalue(&ctx->sql, 0, 3);
+        if (val != NULL)
+            ctx->version = strtoull(val, NULL, 10);
+
+        /* replicas can't push back an idle expiry, the primary does */
+        if (ctx->replica) {
+            val = kore_pgsql_getvalue(&ctx->sql, 0, ctx->range ? 6 : 4);
+            if (val != NULL && strlen(val) > 0)
+                servo_expire_touch(ctx->client_id, req->path, ctx->shard);
+        }
+
+        /* a span of a blob, or none when it starts past the end */
+        val = ctx->range ? kore_pgsql_getvalue(&ctx->sql, 0, 4) : NULL;
+        if (val != NULL && strlen(val) > 0) {
+            ctx->range_size = strtoull(val, NULL, 10);
+            val = kore_pgsql_getvalue(&ctx->sql, 0, 5);
+            ctx->range_first = strtoll(val, NULL, 10);
+            if (ctx->val_bin == NULL) {
+                snprintf(range, sizeof(range), "bytes */%llu",
+                         (unsigned long long)ctx->range_size);
+                http_response_header(req, CONTENT_RANGE_HEADER, range);
+                ctx->status = 416;
+                req->fsm_state = REQ_STATE_ERROR;
+                return (HTTP_STATE_CONTINUE);
+            }
+            ctx->range_partial = 1;
+        }
+
+        /* counter was there already, so was its key in the filter */
+        memset(&usage, 0, sizeof(usage));
+        if (ctx->patch_op == SERVO_PATCH_INCR) {
+            val = kore_pgsql_getvalue(&ctx->sql, 0, 4);
+            usage.items = val != NULL && strcmp(val, "t") == 0;
+            if (!usage.items && ctx->bloom_added) {
+                servo_bloom_undo(ctx->client_id, req->path);
+                ctx->bloom_added = 0;
+            }
+            usage.bytes[SERVO_CONTENT_STRING] = usage.items ? ctx->val_sz : 0;
+        }
+
         /* since we've read item, update in_content_type
            because it indicated type we store
          */
         if (ctx->val_str != NULL)
             ctx->in_content_type = SERVO_CONTENT_STRING;
-        if (ctx->val_json != NULL)
+        if (ctx->val_json != NULL || ctx->val_json_text != NULL)
             ctx->in_content_type = SERVO_CONTENT_JSON;
         if (ctx->val_bin != NULL)
             ctx->in_content_type = SERVO_CONTENT_FORMDATA;
+
+        /* a counter created or the body appended adds to the usage */
+        if (ctx->patch_op == SERVO_PATCH_APPEND &&
+            ctx->in_content_type < SERVO_QUOTA_TYPES)
+            usage.bytes[ctx->in_content_type] = ctx->quota_size;
+        if (ctx->patch_op != SERVO_PATCH_NONE)
+            servo_quota_add(ctx->client_id, &usage);
     }
     else {
         kore_log(LOG_ERR, "{%s} selected %d rows for key '%s', but 1 expected",
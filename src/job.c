@@ -0,0 +1,153 @@
+#include "job.h"
+#include "pool.h"
+#include "shard.h"
+#include "stats.h"
+
+/*
+ * Background queries.
+ *
+ * Purges, snapshots and flushes query the primary of a shard with a
+ * connection of their pool class, taken only while no request waits
+ * for one. Flushes of writes already acknowledged go ahead of the
+ * requests, into the connections reserved for them. A job sends its query from send, gets each result in read
+ * and the outcome in done, called outside of the Kore pgsql handler,
+ * as in ws.c, before the connection goes back. Failures are counted
+ * and logged here.
+ *
+ * A sweep runs a job on each shard the worker owns in turn. Shards are
+ * spread over the workers, so each is handled by one of them.
+ */
+
+static void     job_next(struct servo_job *);
+
+void
+servo_job_init(struct servo_job *job, const char *name, int pool,
+               u_int32_t shard, void *arg)
+{
+    memset(job, 0, sizeof(*job));
+    job->name = name;
+    job->pool = pool;
+    job->shard = shard;
+    job->arg = arg;
+}
+
+int
+servo_job_owns(u_int32_t shard)
+{
+    if (worker == NULL || worker_count == 0)
+        return 1;
+    return shard % worker_count == worker->id % worker_count;
+}
+
+static void
+job_release(struct servo_job *job, int failed)
+{
+    int         stay;
+
+    if (failed) {
+        servo_stats_count(STATS_PG_ERRORS, 1);
+        kore_log(LOG_ERR, "%s in shard %u failed: %s", job->name, job->shard,
+                 job->sql.error != NULL ? job->sql.error : "no connection");
+    }
+    stay = job->done != NULL ? job->done(job, failed) : 0;
+
+    kore_pgsql_cleanup(&job->sql);
+    if (job->flush)
+        servo_pool_give_flush(job->pool);
+    else
+        servo_pool_give(job->pool);
+    if (!job->sweep) {
+        job->busy = 0;
+        return;
+    }
+    if (failed || !stay)
+        job->shard++;
+    job_next(job);
+}
+
+static void
+job_done(void *arg, u_int64_t now)
+{
+    struct servo_job    *job = arg;
+
+    (void)now;
+
+    job->completing = 0;
+    job_release(job, job->sql.state == KORE_PGSQL_STATE_ERROR);
+}
+
+/* finished outside of the Kore pgsql handler, as in ws.c */
+static void
+job_result(struct kore_pgsql *sql, void *arg)
+{
+    struct servo_job    *job = arg;
+
+    switch (sql->state) {
+    case KORE_PGSQL_STATE_WAIT:
+    case KORE_PGSQL_STATE_ERROR:
+    case KORE_PGSQL_STATE_COMPLETE:
+        break;
+    case KORE_PGSQL_STATE_RESULT:
+        if (job->read != NULL)
+            job->read(job);
+        kore_pgsql_continue(sql);
+        break;
+    default:
+        kore_pgsql_continue(sql);
+        break;
+    }
+
+    if (!job->completing && (sql->state == KORE_PGSQL_STATE_ERROR ||
+                             sql->state == KORE_PGSQL_STATE_COMPLETE)) {
+        job->completing = 1;
+        kore_timer_add(job_done, 0, job, KORE_TIMER_ONESHOT);
+    }
+}
+
+/* the job's query on its shard, KORE_RESULT_ERROR without a connection */
+int
+servo_job_start(struct servo_job *job)
+{
+    const char  *dbname;
+    int          replica;
+
+    /* requests waiting for connections go first, except for flushes */
+    if (job->flush) {
+        if (!servo_pool_take_flush(job->pool))
+            return (KORE_RESULT_ERROR);
+    } else if (!servo_pool_take(job->pool)) {
+        return (KORE_RESULT_ERROR);
+    }
+
+    job->busy = 1;
+    dbname = servo_shard_pool(job->shard, 0, &replica);
+    kore_pgsql_init(&job->sql);
+    kore_pgsql_bind_callback(&job->sql, job_result, job);
+    if (!kore_pgsql_setup(&job->sql, dbname, KORE_PGSQL_ASYNC) ||
+        !job->send(job))
+        job_release(job, 1);
+    return (KORE_RESULT_OK);
+}
+
+/* the next shard owned, until all are done */
+static void
+job_next(struct servo_job *job)
+{
+    while (job->shard < CONFIG->ndatabases && !servo_job_owns(job->shard))
+        job->shard++;
+
+    if (job->shard >= CONFIG->ndatabases || !servo_job_start(job))
+        job->busy = 0;
+}
+
+/* from the first shard, unless the last sweep is still going */
+void
+servo_job_sweep(struct servo_job *job)
+{
+    if (job->busy)
+        return;
+    job->sweep = 1;
+    job->busy = 1;
+    job->shard = 0;
+    job_next(job);
+}
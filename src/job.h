@@ -0,0 +1,35 @@
+#ifndef _SERVO_JOB_H_
+#define _SERVO_JOB_H_
+
+#include <kore/kore.h>
+#include <kore/pgsql.h>
+
+#include "servo.h"
+
+/* a background query on the primary of a shard, see job.c */
+struct servo_job {
+    const char          *name;      /* as logged, "purge of expired items" */
+    int                  pool;      /* SERVO_POOL_* class */
+    u_int32_t            shard;
+    struct kore_pgsql    sql;
+    void                *arg;
+    int                  busy;
+    int                  completing;
+    int                  sweep;
+    int                  flush;     /* acknowledged writes, ahead of requests */
+
+    /* sends the query on sql, KORE_RESULT_ERROR when it couldn't */
+    int                (*send)(struct servo_job *);
+    /* rows of each result, may be NULL */
+    void               (*read)(struct servo_job *);
+    /* before the connection goes back, nonzero keeps a sweep on the shard */
+    int                (*done)(struct servo_job *, int);
+};
+
+void                 servo_job_init(struct servo_job *, const char *, int,
+                                    u_int32_t, void *);
+int                  servo_job_owns(u_int32_t);
+int                  servo_job_start(struct servo_job *);
+void                 servo_job_sweep(struct servo_job *);
+
+#endif //_SERVO_JOB_H_
@@ -0,0 +1,194 @@
+#include <ctype.h>
+
+#include "origin.h"
+
+/*
+ * Allowed origins of cross-origin requests.
+ *
+ * [filter] origin lists origins like https://app.example.com, a host
+ * of *.example.com stands for any subdomain. They are hashed once into
+ * an open addressing table, so a request probes it for its Origin and
+ * then once per dot of its host for a wildcard, whatever the length of
+ * the list. The matched entry is echoed back as the allowed origin.
+ */
+
+#define ORIGIN_WILDCARD         "*."
+
+struct origin_entry {
+    u_int64_t        hash;
+    char            *origin;
+    size_t           len;
+};
+
+static struct origin_entry  *origin_table = NULL;
+static size_t                origin_mask = 0;
+static size_t                origin_count = 0;
+static int                   origin_any = 0;
+
+static u_int64_t
+origin_hash(const char *s, size_t len)
+{
+    u_int64_t   h = 14695981039346656037ULL;
+    size_t      i;
+
+    /* FNV-1a */
+    for (i = 0; i < len; i++) {
+        h ^= (u_int8_t)s[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static const struct origin_entry *
+origin_lookup(const char *s, size_t len)
+{
+    const struct origin_entry   *e;
+    u_int64_t                    h;
+    size_t                       i;
+
+    h = origin_hash(s, len);
+    for (i = h & origin_mask; ; i = (i + 1) & origin_mask) {
+        e = &origin_table[i];
+        if (e->origin == NULL)
+            return NULL;
+        if (e->hash == h && e->len == len && memcmp(e->origin, s, len) == 0)
+            return e;
+    }
+}
+
+static void
+origin_insert(const char *s)
+{
+    struct origin_entry     *e;
+    size_t                   i, len;
+    u_int64_t                h;
+
+    len = strlen(s);
+    if (origin_lookup(s, len) != NULL)
+        return;
+    h = origin_hash(s, len);
+    for (i = h & origin_mask; origin_table[i].origin != NULL;
+         i = (i + 1) & origin_mask)
+        ;
+    e = &origin_table[i];
+    e->hash = h;
+    e->origin = kore_strdup(s);
+    e->len = len;
+    origin_count++;
+}
+
+int
+servo_origin_init(void)
+{
+    char        *list, *entry, *last, *p;
+    size_t       n, size;
+
+    if (CONFIG->allow_origin == NULL)
+        return (KORE_RESULT_OK);
+
+    /* at most half full */
+    list = kore_strdup(CONFIG->allow_origin);
+    for (n = 1, p = list; *p != '\0'; p++) {
+        if (*p == ',' || *p == ' ')
+            n++;
+    }
+    for (size = 16; size < n * 2; size *= 2)
+        ;
+    origin_table = kore_calloc(size, sizeof(struct origin_entry));
+    origin_mask = size - 1;
+
+    for (entry = strtok_r(list, ", \t", &last); entry != NULL;
+         entry = strtok_r(NULL, ", \t", &last)) {
+        if (strcmp(entry, "*") == 0) {
+            origin_any = 1;
+            continue;
+        }
+        if (strstr(entry, "://") == NULL) {
+            kore_log(LOG_ERR, "invalid origin '%s', a scheme is required",
+                     entry);
+            kore_free(list);
+            return (KORE_RESULT_ERROR);
+        }
+        for (p = entry; *p != '\0'; p++)
+            *p = tolower((unsigned char)*p);
+        origin_insert(entry);
+    }
+    kore_free(list);
+
+    kore_log(LOG_NOTICE, "  allowed origins: %zu%s", origin_count,
+             origin_any ? " and any" : "");
+    return (KORE_RESULT_OK);
+}
+
+/* the entry of an origin, or of a wildcard covering its host */
+static const char *
+origin_match(const char *origin)
+{
+    const struct origin_entry   *e;
+    const char                  *host, *dot;
+    char                         key[256];
+    size_t                       len, scheme;
+
+    len = strlen(origin);
+    if ((e = origin_lookup(origin, len)) != NULL)
+        return e->origin;
+
+    if ((host = strstr(origin, "://")) == NULL)
+        return NULL;
+    host += 3;
+    scheme = host - origin;
+    for (dot = strchr(host, '.'); dot != NULL; dot = strchr(dot + 1, '.')) {
+        if (scheme + strlen(ORIGIN_WILDCARD) + strlen(dot + 1) >= sizeof(key))
+            return NULL;
+        len = snprintf(key, sizeof(key), "%.*s" ORIGIN_WILDCARD "%s",
+                       (int)scheme, origin, dot + 1);
+        if (origin_lookup(key, len) != NULL)
+            return origin;
+    }
+    return NULL;
+}
+
+/*
+ * Origin filter, gives the value of Access-Control-Allow-Origin or NULL
+ * when none is sent: requests without Origin in public mode.
+ */
+int
+servo_origin_check(struct http_request *req, const char **allow)
+{
+    char        *origin = NULL;
+
+    *allow = "*";
+    if (CONFIG->allow_origin == NULL)
+        return (KORE_RESULT_OK);
+
+    if (!http_request_header(req, "Origin", &origin)) {
+        if (CONFIG->public_mode) {
+            *allow = NULL;
+            return (KORE_RESULT_OK);
+        }
+        kore_log(LOG_NOTICE, "%s: disallow access - no 'Origin' header sent",
+                 __FUNCTION__);
+        return (KORE_RESULT_ERROR);
+    }
+
+    if ((*allow = origin_match(origin)) == NULL) {
+        if (origin_any) {
+            *allow = "*";
+            return (KORE_RESULT_OK);
+        }
+        kore_log(LOG_NOTICE, "%s: disallow access - origin %s is not allowed",
+                 __FUNCTION__, origin);
+        return (KORE_RESULT_ERROR);
+    }
+    return (KORE_RESULT_OK);
+}
+
+/* responses differ by origin with a list, caches must know */
+void
+servo_origin_headers(struct http_request *req, const char *allow)
+{
+    if (allow != NULL)
+        http_response_header(req, CORS_ALLOWORIGIN_HEADER, allow);
+    if (CONFIG->allow_origin != NULL)
+        http_response_header(req, VARY_HEADER, "Origin");
+}
@@ -0,0 +1,13 @@
+#ifndef _SERVO_ORIGIN_H_
+#define _SERVO_ORIGIN_H_
+
+#include <kore/kore.h>
+#include <kore/http.h>
+
+#include "servo.h"
+
+int                  servo_origin_init(void);
+int                  servo_origin_check(struct http_request *, const char **);
+void                 servo_origin_headers(struct http_request *, const char *);
+
+#endif //_SERVO_ORIGIN_H_
@@ -0,0 +1,509 @@
+#include "pool.h"
+#include "stats.h"
+#include "util.h"
+
+/*
+ * Admission control in front of the Kore pgsql pool.
+ *
+ * A request that finds all connections busy is parked in a bounded
+ * FIFO queue and put to sleep. Releasing a connection wakes the head
+ * of the queue and keeps the slot reserved for it, so a request never
+ * re-runs its state machine just to find the pool still exhausted.
+ * A full queue, or a request waiting past its deadline, fails fast
+ * with 503 and Retry-After.
+ *
+ * Requests queue by class: reads, writes and bulk work like blob
+ * uploads and background flushes. A released connection goes to the
+ * class with the least service for its weight, a stride scheduler, so
+ * a burst of uploads takes at most its share of wakeups. A class may
+ * hold connections in reserve, the others can't take the last ones
+ * while it uses fewer. Flushes of acknowledged writes skip the queue
+ * and have a reserve of their own, requests can't starve them.
+ *
+ * Queries in flight are tracked against their time budget as well,
+ * the timer cancels overdue ones so the connection comes back to the
+ * pool healthy and the request reports 504. The cancel request is
+ * sent without blocking, its connection polled by the same timer, so
+ * budgets take libpq 17, older ones would block the worker on it. The
+ * timer only runs while requests wait, queries are timed or cancels
+ * are sent.
+ */
+
+#define POOL_TIMER_INTERVAL     10
+#define POOL_STRIDE             (1 << 20)
+
+struct pool_class {
+    TAILQ_HEAD(, servo_waiter)   waiters;
+    size_t                       nwaiting;
+
+    /* connections held or reserved on wakeup */
+    size_t                       used;
+
+    /* virtual time of the next wakeup */
+    u_int64_t                    pass;
+};
+
+static struct pool_class             pool_classes[SERVO_POOL_CLASSES];
+static size_t                        pool_nwaiting = 0;
+static u_int64_t                     pool_vtime = 0;
+
+static const char                   *pool_class_names[] = {
+    "read", "write", "bulk"
+};
+
+/* queries with a time budget */
+static TAILQ_HEAD(, servo_waiter)    pool_inflight;
+
+/* connections held by servo requests */
+static size_t                        pool_active = 0;
+
+/* released connections reserved for woken requests */
+static size_t                        pool_pending = 0;
+
+/* connections held by flushes */
+static size_t                        pool_flushing = 0;
+
+#ifdef LIBPQ_HAS_ASYNC_CANCEL
+/* cancel request being delivered, outliving the request it stops */
+struct pool_cancel {
+    PGcancelConn                    *conn;
+    char                             client[CLIENT_UUID_LEN];
+    TAILQ_ENTRY(pool_cancel)         list;
+};
+
+static TAILQ_HEAD(, pool_cancel)     pool_cancels;
+#endif
+
+static int                           pool_timer_armed = 0;
+
+static void     pool_timer(void *, u_int64_t);
+static void     pool_arm(void);
+
+int
+servo_pool_init(void)
+{
+    size_t      i, reserved;
+
+#ifndef LIBPQ_HAS_ASYNC_CANCEL
+    if (CONFIG->timeout_read > 0 || CONFIG->timeout_write > 0 ||
+        CONFIG->timeout_blob > 0) {
+        kore_log(LOG_ERR, "query time budgets need libpq 17 or later");
+        return (KORE_RESULT_ERROR);
+    }
+#endif
+
+    reserved = 0;
+    for (i = 0; i < SERVO_POOL_CLASSES; i++) {
+        TAILQ_INIT(&pool_classes[i].waiters);
+        if (CONFIG->pool_weight[i] == 0)
+            CONFIG->pool_weight[i] = 1;
+        reserved += CONFIG->pool_reserve[i];
+    }
+    if (CONFIG->counter_flush == 0 && CONFIG->writeback_flush == 0)
+        CONFIG->pool_reserve_flush = 0;
+    reserved += CONFIG->pool_reserve_flush;
+    TAILQ_INIT(&pool_inflight);
+#ifdef LIBPQ_HAS_ASYNC_CANCEL
+    TAILQ_INIT(&pool_cancels);
+#endif
+
+    /* one connection at least is left for any class */
+    if (reserved > 0 && reserved >= pgsql_conn_max) {
+        kore_log(LOG_NOTICE, "%zu reserved of %u connections, ignoring",
+                 reserved, pgsql_conn_max);
+        for (i = 0; i < SERVO_POOL_CLASSES; i++)
+            CONFIG->pool_reserve[i] = 0;
+        CONFIG->pool_reserve_flush = 0;
+    }
+
+    /* every database and replica holds connections of its own */
+    if (pgsql_conn_max < CONFIG->ndatabases + CONFIG->nreplicas) {
+        kore_log(LOG_NOTICE, "pgsql_conn_max %u is below one for each of "
+                 "%zu databases and replicas", pgsql_conn_max,
+                 CONFIG->ndatabases + CONFIG->nreplicas);
+    }
+    return (KORE_RESULT_OK);
+}
+
+/* class of a request, by its method and body */
+static int
+pool_class(struct http_request *req)
+{
+    struct servo_context    *ctx = http_state_get(req);
+
+    if (req->method == HTTP_METHOD_GET)
+        return (SERVO_POOL_READ);
+    if (ctx->in_content_type == SERVO_CONTENT_FORMDATA)
+        return (SERVO_POOL_BULK);
+    return (SERVO_POOL_WRITE);
+}
+
+/* a free connection a class may take, past the reserves of the others */
+static int
+pool_room(int class)
+{
+    size_t      i, reserved;
+
+    reserved = 0;
+    for (i = 0; i < SERVO_POOL_CLASSES; i++) {
+        if ((int)i != class &&
+            CONFIG->pool_reserve[i] > pool_classes[i].used)
+            reserved += CONFIG->pool_reserve[i] - pool_classes[i].used;
+    }
+    if (CONFIG->pool_reserve_flush > pool_flushing)
+        reserved += CONFIG->pool_reserve_flush - pool_flushing;
+    return pool_active + pool_pending + reserved < pgsql_conn_max;
+}
+
+static void
+pool_dequeue(struct servo_context *ctx)
+{
+    struct pool_class   *pc = &pool_classes[ctx->pool_class];
+
+    TAILQ_REMOVE(&pc->waiters, &ctx->waiter, list);
+    pc->nwaiting--;
+    pool_nwaiting--;
+    ctx->pool_queued = 0;
+}
+
+/* waiting class with the least service for its weight */
+static int
+pool_next_class(void)
+{
+    int         i, next;
+
+    next = -1;
+    for (i = 0; i < SERVO_POOL_CLASSES; i++) {
+        if (pool_classes[i].nwaiting == 0 || !pool_room(i))
+            continue;
+        if (next == -1 || pool_classes[i].pass < pool_classes[next].pass)
+            next = i;
+    }
+    if (next != -1) {
+        pool_vtime = pool_classes[next].pass;
+        pool_classes[next].pass += POOL_STRIDE / CONFIG->pool_weight[next];
+    }
+    return next;
+}
+
+static void
+pool_wakeup_next(void)
+{
+    struct servo_waiter     *w;
+    struct servo_context    *ctx;
+    int                      class;
+
+    while ((class = pool_next_class()) != -1) {
+        w = TAILQ_FIRST(&pool_classes[class].waiters);
+        ctx = http_state_get(w->req);
+        pool_dequeue(ctx);
+        ctx->pool_woken = 1;
+        pool_pending++;
+        pool_classes[class].used++;
+        http_request_wakeup(w->req);
+    }
+}
+
+static void
+pool_untrack(struct servo_context *ctx)
+{
+    if (!ctx->query_tracked)
+        return;
+    TAILQ_REMOVE(&pool_inflight, &ctx->inflight, list);
+    ctx->query_tracked = 0;
+}
+
+#ifdef LIBPQ_HAS_ASYNC_CANCEL
+static void
+pool_cancel_free(struct pool_cancel *c)
+{
+    TAILQ_REMOVE(&pool_cancels, c, list);
+    PQcancelFinish(c->conn);
+    kore_free(c);
+}
+
+/* advance cancel requests on their own connections */
+static void
+pool_cancel_poll(void)
+{
+    struct pool_cancel      *c, *next;
+
+    for (c = TAILQ_FIRST(&pool_cancels); c != NULL; c = next) {
+        next = TAILQ_NEXT(c, list);
+        switch (PQcancelPoll(c->conn)) {
+        case PGRES_POLLING_OK:
+            pool_cancel_free(c);
+            break;
+        case PGRES_POLLING_FAILED:
+            kore_log(LOG_ERR, "{%s} failed to cancel query: %s",
+                     c->client, PQcancelErrorMessage(c->conn));
+            pool_cancel_free(c);
+            break;
+        default:
+            break;
+        }
+    }
+}
+
+static void
+pool_cancel(struct servo_context *ctx)
+{
+    struct pool_cancel  *c;
+
+    pool_untrack(ctx);
+    if (ctx->sql.conn == NULL)
+        return;
+
+    kore_log(LOG_NOTICE, "{%s} query is over time budget, cancelling",
+             ctx->client);
+
+    /* the query fails with query_canceled and the connection stays usable */
+    c = kore_calloc(1, sizeof(*c));
+    if ((c->conn = PQcancelCreate(ctx->sql.conn->db)) == NULL) {
+        kore_log(LOG_ERR, "{%s} failed to get cancel handle", ctx->client);
+        kore_free(c);
+        return;
+    }
+    kore_strlcpy(c->client, ctx->client, sizeof(c->client));
+    TAILQ_INSERT_TAIL(&pool_cancels, c, list);
+    pool_arm();
+    if (!PQcancelStart(c->conn)) {
+        kore_log(LOG_ERR, "{%s} failed to cancel query: %s",
+                 ctx->client, PQcancelErrorMessage(c->conn));
+        pool_cancel_free(c);
+        return;
+    }
+
+    ctx->timed_out = 1;
+    servo_stats_count(STATS_QUERY_TIMEOUTS, 1);
+}
+#endif
+
+/* the timer, while requests wait or queries run on a budget */
+static void
+pool_arm(void)
+{
+    if (pool_timer_armed)
+        return;
+#ifdef LIBPQ_HAS_ASYNC_CANCEL
+    if (pool_nwaiting == 0 && TAILQ_EMPTY(&pool_inflight) &&
+        TAILQ_EMPTY(&pool_cancels))
+        return;
+#else
+    if (pool_nwaiting == 0 && TAILQ_EMPTY(&pool_inflight))
+        return;
+#endif
+    pool_timer_armed = 1;
+    kore_timer_add(pool_timer, POOL_TIMER_INTERVAL, NULL, KORE_TIMER_ONESHOT);
+}
+
+static void
+pool_timer(void *arg, u_int64_t now)
+{
+    struct servo_waiter     *w;
+#ifdef LIBPQ_HAS_ASYNC_CANCEL
+    struct servo_waiter     *next;
+#endif
+    struct servo_context    *ctx;
+    size_t                   i;
+
+    (void)arg;
+
+    pool_timer_armed = 0;
+
+    /* budgets are refused at startup without libpq 17 */
+#ifdef LIBPQ_HAS_ASYNC_CANCEL
+    pool_cancel_poll();
+    for (w = TAILQ_FIRST(&pool_inflight); w != NULL; w = next) {
+        next = TAILQ_NEXT(w, list);
+        if (w->deadline <= now)
+            pool_cancel(http_state_get(w->req));
+    }
+#endif
+
+    /* same timeout for everyone, so each queue is ordered by deadline */
+    for (i = 0; i < SERVO_POOL_CLASSES; i++) {
+        while ((w = TAILQ_FIRST(&pool_classes[i].waiters)) != NULL &&
+               w->deadline <= now) {
+            ctx = http_state_get(w->req);
+            pool_dequeue(ctx);
+            ctx->pool_expired = 1;
+            kore_log(LOG_NOTICE, "{%s} gave up waiting for %s connection",
+                     ctx->client, pool_class_names[i]);
+            http_request_wakeup(w->req);
+        }
+    }
+
+    pool_wakeup_next();
+    pool_arm();
+}
+
+static int
+pool_enqueue(struct http_request *req)
+{
+    struct servo_context    *ctx = http_state_get(req);
+    struct pool_class       *pc;
+
+    if (!ctx->pool_queued) {
+        if (pool_nwaiting >= CONFIG->pool_queue_depth) {
+            kore_log(LOG_NOTICE, "{%s} connection queue is full, %zu waiting",
+                     ctx->client, pool_nwaiting);
+            servo_stats_count(STATS_POOL_REJECTED, 1);
+            return (SERVO_POOL_FULL);
+        }
+
+        /* an idle class starts from now, not with credit saved up */
+        pc = &pool_classes[ctx->pool_class];
+        if (pc->nwaiting == 0 && pc->pass < pool_vtime)
+            pc->pass = pool_vtime;
+
+        ctx->waiter.req = req;
+        ctx->waiter.deadline = kore_time_ms() + CONFIG->pool_wait_timeout;
+        TAILQ_INSERT_TAIL(&pc->waiters, &ctx->waiter, list);
+        pc->nwaiting++;
+        pool_nwaiting++;
+        ctx->pool_queued = 1;
+        servo_stats_count(STATS_POOL_QUEUED, 1);
+        pool_arm();
+    }
+
+    http_request_sleep(req);
+    return (SERVO_POOL_WAIT);
+}
+
+int
+servo_pool_acquire(struct http_request *req, const char *dbname)
+{
+    struct servo_context    *ctx = http_state_get(req);
+
+    if (ctx->pool_expired) {
+        servo_stats_count(STATS_POOL_REJECTED, 1);
+        return (SERVO_POOL_FULL);
+    }
+
+    if (ctx->pool_woken) {
+        /* use the connection reserved on wakeup */
+        ctx->pool_woken = 0;
+        pool_pending--;
+        pool_classes[ctx->pool_class].used--;
+    }
+    else {
+        ctx->pool_class = pool_class(req);
+        if (ctx->pool_queued ||
+            pool_classes[ctx->pool_class].nwaiting > 0 ||
+            !pool_room(ctx->pool_class))
+            return pool_enqueue(req);
+    }
+
+    kore_pgsql_cleanup(&ctx->sql);
+    kore_pgsql_init(&ctx->sql);
+    kore_pgsql_bind_request(&ctx->sql, req);
+
+    if (!kore_pgsql_setup(&ctx->sql, dbname, KORE_PGSQL_ASYNC)) {
+        /* connections are busy outside of servo accounting */
+        if (ctx->sql.state == KORE_PGSQL_STATE_INIT) {
+            kore_pgsql_cleanup(&ctx->sql);
+            return pool_enqueue(req);
+        }
+        return (SERVO_POOL_ERROR);
+    }
+
+    ctx->pool_held = 1;
+    pool_active++;
+    pool_classes[ctx->pool_class].used++;
+    return (SERVO_POOL_OK);
+}
+
+void
+servo_pool_deadline(struct http_request *req, u_int64_t budget)
+{
+    struct servo_context    *ctx = http_state_get(req);
+
+    if (budget == 0 || ctx->query_tracked)
+        return;
+
+    ctx->inflight.req = req;
+    ctx->inflight.deadline = kore_time_ms() + budget;
+    TAILQ_INSERT_TAIL(&pool_inflight, &ctx->inflight, list);
+    ctx->query_tracked = 1;
+    pool_arm();
+}
+
+void
+servo_pool_query_done(struct http_request *req)
+{
+    pool_untrack(http_state_get(req));
+}
+
+void
+servo_pool_release(struct http_request *req)
+{
+    struct servo_context    *ctx = http_state_get(req);
+
+    pool_untrack(ctx);
+    kore_pgsql_cleanup(&ctx->sql);
+
+    if (ctx->pool_queued)
+        pool_dequeue(ctx);
+
+    if (ctx->pool_woken) {
+        ctx->pool_woken = 0;
+        pool_pending--;
+        pool_classes[ctx->pool_class].used--;
+    }
+
+    if (ctx->pool_held) {
+        ctx->pool_held = 0;
+        pool_active--;
+        pool_classes[ctx->pool_class].used--;
+    }
+
+    pool_wakeup_next();
+}
+
+/*
+ * Connection slot for work outside of the request state machine, such
+ * as websocket messages. Queued requests go first, the caller retries
+ * on its own.
+ */
+int
+servo_pool_take(int class)
+{
+    if (pool_nwaiting > 0 || !pool_room(class))
+        return (KORE_RESULT_ERROR);
+
+    pool_active++;
+    pool_classes[class].used++;
+    return (KORE_RESULT_OK);
+}
+
+void
+servo_pool_give(int class)
+{
+    pool_active--;
+    pool_classes[class].used--;
+    pool_wakeup_next();
+}
+
+/*
+ * Connection slot for a flush of acknowledged writes, ahead of queued
+ * requests: from the flush reserve, or any connection left free.
+ */
+int
+servo_pool_take_flush(int class)
+{
+    if (pool_active + pool_pending >= pgsql_conn_max)
+        return (KORE_RESULT_ERROR);
+
+    pool_active++;
+    pool_classes[class].used++;
+    pool_flushing++;
+    return (KORE_RESULT_OK);
+}
+
+void
+servo_pool_give_flush(int class)
+{
+    pool_flushing--;
+    servo_pool_give(class);
+}
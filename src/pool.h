@@ -0,0 +1,27 @@
+#ifndef _SERVO_POOL_H_
+#define _SERVO_POOL_H_
+
+#include <kore/kore.h>
+#include <kore/http.h>
+#include <kore/pgsql.h>
+
+#include "servo.h"
+
+/* servo_pool_acquire results */
+#define SERVO_POOL_OK           0
+#define SERVO_POOL_WAIT         1
+#define SERVO_POOL_FULL         2
+#define SERVO_POOL_ERROR        3
+
+int                  servo_pool_init(void);
+int                  servo_pool_acquire(struct http_request *, const char *);
+void                 servo_pool_release(struct http_request *);
+int                  servo_pool_take(int);
+void                 servo_pool_give(int);
+int                  servo_pool_take_flush(int);
+void                 servo_pool_give_flush(int);
+
+void                 servo_pool_deadline(struct http_request *, u_int64_t);
+void                 servo_pool_query_done(struct http_request *);
+
+#endif //_SERVO_POOL_H_
@@ -0,0 +1,511 @@
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+
+#include <libpq-fe.h>
+
+#include "quota.h"
+#include "util.h"
+
+/*
+ * Session usage and quotas.
+ *
+ * Writes report what they changed: an item created, the sizes of the
+ * value replaced and of the new one, deletes and purges the sizes they
+ * removed. The counts are kept per session in shared memory, so the
+ * check before a write is a table lookup, never a COUNT or SUM query.
+ * Only writes that must create their item are held to the item quota,
+ * an upsert may overwrite the session's own keys at the quota and its
+ * item is counted once the database reports it created.
+ *
+ * Counts may drift, a crashed worker or a write racing a check, so one
+ * worker rescans every shard every reconcile seconds and sets the
+ * counts of each session to what the database holds. Sessions it didn't
+ * see and nobody wrote to meanwhile have no items left and are dropped.
+ */
+
+#define QUOTA_RECONCILE_BATCH   5000
+#define QUOTA_RECONCILE_STEP    10
+#define QUOTA_LOCK_SPINS        1024
+
+#define QUOTA_RECONCILE_SQL \
+    "select client, count(*), coalesce(sum(octet_length(str_val)), 0), " \
+    "coalesce(sum(octet_length(json_val::text)), 0), " \
+    "coalesce(sum(coalesce(octet_length(blob_val), " \
+    "servo_blob_size(blob_hash))), 0) from item group by client"
+
+static struct servo_quota_header    *quota = NULL;
+static struct servo_quota_slot      *quota_slots = NULL;
+static size_t                        quota_mask = 0;
+
+/* reconcile progress, in the worker doing it */
+static PGconn                       *quota_conn = NULL;
+static int                           quota_scanning = 0;
+static size_t                        quota_shard = 0;
+static u_int64_t                     quota_scanned = 0;
+static int                           quota_running = 0;
+
+static void     quota_reconcile(void *, u_int64_t);
+static void     quota_reconcile_step(void *, u_int64_t);
+
+int
+servo_quota_init(const char *path)
+{
+    int          fd;
+    size_t       len, nslots;
+    pid_t        main_pid;
+    void        *map;
+
+    if (CONFIG->quota_slots == 0 || path == NULL || worker == NULL) {
+        if (CONFIG->max_sessions > 0 || CONFIG->quota_items > 0 ||
+            CONFIG->quota_bytes > 0)
+            kore_log(LOG_NOTICE, "session quotas need [quota] path and slots");
+        return (KORE_RESULT_OK);
+    }
+
+    /* at most half full with every session allowed */
+    for (nslots = 1024; nslots < CONFIG->quota_slots ||
+         nslots < CONFIG->max_sessions * 2; nslots *= 2)
+        ;
+    len = sizeof(struct servo_quota_header) +
+          nslots * sizeof(struct servo_quota_slot);
+
+    fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd == -1) {
+        kore_log(LOG_ERR, "%s: failed to open '%s': %s",
+                 __FUNCTION__, path, errno_s);
+        return (KORE_RESULT_ERROR);
+    }
+
+    if (flock(fd, LOCK_EX) == -1 || ftruncate(fd, len) == -1) {
+        kore_log(LOG_ERR, "%s: failed to prepare '%s': %s",
+                 __FUNCTION__, path, errno_s);
+        close(fd);
+        return (KORE_RESULT_ERROR);
+    }
+
+    map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        kore_log(LOG_ERR, "%s: failed to map '%s': %s",
+                 __FUNCTION__, path, errno_s);
+        close(fd);
+        return (KORE_RESULT_ERROR);
+    }
+    quota = map;
+    quota_slots = (struct servo_quota_slot *)(quota + 1);
+    quota_mask = nslots - 1;
+
+    /* usage left by a former run is stale */
+    main_pid = getppid();
+    if (quota->owner != main_pid || quota->nslots != nslots) {
+        memset(map, 0, len);
+        quota->nslots = nslots;
+        quota->owner = main_pid;
+    }
+
+    /* reconcile, or take over from a worker that died */
+    if (quota->reconciler == 0 ||
+        (kill(quota->reconciler, 0) == -1 && errno == ESRCH)) {
+        quota->reconciler = getpid();
+        kore_log(LOG_NOTICE, "tracking session usage, %zu slots", nslots);
+        quota_reconcile(NULL, 0);
+        if (CONFIG->quota_reconcile > 0)
+            kore_timer_add(quota_reconcile, CONFIG->quota_reconcile * 1000,
+                           NULL, 0);
+    }
+
+    flock(fd, LOCK_UN);
+    close(fd);
+    return (KORE_RESULT_OK);
+}
+
+static void
+quota_lock(void)
+{
+    pid_t        holder;
+    u_int32_t    spins;
+
+    for (spins = 1; ; spins++) {
+        holder = 0;
+        if (__atomic_compare_exchange_n(&quota->lock, &holder, getpid(), 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            return;
+
+        /* a worker that died holding it leaves it to the others */
+        if (spins % QUOTA_LOCK_SPINS == 0) {
+            if (kill(holder, 0) == -1 && errno == ESRCH)
+                __atomic_compare_exchange_n(&quota->lock, &holder, 0, 0,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED);
+            sched_yield();
+        }
+    }
+}
+
+static void
+quota_unlock(void)
+{
+    __atomic_store_n(&quota->lock, 0, __ATOMIC_RELEASE);
+}
+
+static size_t
+quota_hash(const uuid_t client_id)
+{
+    u_int64_t    h;
+
+    /* random ids, any 8 bytes do */
+    memcpy(&h, client_id, sizeof(h));
+    return (size_t)(h * 0x9e3779b97f4a7c15ULL);
+}
+
+/* slot of a client, a new one if asked and there's room, under lock */
+static struct servo_quota_slot *
+quota_slot(const uuid_t client_id, int create)
+{
+    struct servo_quota_slot     *s;
+    size_t                       i, n;
+
+    for (i = quota_hash(client_id) & quota_mask, n = 0; n <= quota_mask;
+         i = (i + 1) & quota_mask, n++) {
+        s = &quota_slots[i];
+        if (!s->used)
+            break;
+        if (uuid_compare(s->client, client_id) == 0)
+            return s;
+    }
+
+    if (!create || n > quota_mask ||
+        (size_t)quota->sessions * 4 >= quota->nslots * 3)
+        return NULL;
+    memset(s, 0, sizeof(*s));
+    uuid_copy(s->client, client_id);
+    s->used = 1;
+    s->gen = quota->gen;
+    return s;
+}
+
+/* backward shift, so no probe sequence breaks at the hole */
+static void
+quota_slot_free(struct servo_quota_slot *s)
+{
+    size_t       hole, i, home;
+
+    hole = s - quota_slots;
+    for (i = (hole + 1) & quota_mask; quota_slots[i].used;
+         i = (i + 1) & quota_mask) {
+        home = quota_hash(quota_slots[i].client) & quota_mask;
+        if (((i - home) & quota_mask) >= ((i - hole) & quota_mask)) {
+            quota_slots[hole] = quota_slots[i];
+            hole = i;
+        }
+    }
+    memset(&quota_slots[hole], 0, sizeof(struct servo_quota_slot));
+}
+
+/* set a slot to usage, keeping the count of sessions with items */
+static void
+quota_slot_set(struct servo_quota_slot *s,
+               const struct servo_quota_usage *u)
+{
+    if (s->usage.items <= 0 && u->items > 0)
+        quota->sessions++;
+    else if (s->usage.items > 0 && u->items <= 0)
+        quota->sessions--;
+
+    if (u->items <= 0)
+        quota_slot_free(s);
+    else
+        s->usage = *u;
+}
+
+int
+servo_quota_check(const uuid_t client_id, int creates, size_t bytes)
+{
+    struct servo_quota_slot     *s;
+    struct servo_quota_usage     u;
+    int64_t                      total;
+    int                          i, rc;
+
+    if (quota == NULL)
+        return (SERVO_QUOTA_OK);
+
+    quota_lock();
+    memset(&u, 0, sizeof(u));
+    if ((s = quota_slot(client_id, 0)) != NULL)
+        u = s->usage;
+    for (total = 0, i = 0; i < SERVO_QUOTA_TYPES; i++)
+        total += u.bytes[i];
+
+    rc = SERVO_QUOTA_OK;
+    if (creates != SERVO_QUOTA_UPDATES && s == NULL &&
+        CONFIG->max_sessions > 0 &&
+        (size_t)quota->sessions >= CONFIG->max_sessions)
+        rc = SERVO_QUOTA_SESSIONS;
+    else if (creates == SERVO_QUOTA_CREATES && CONFIG->quota_items > 0 &&
+             u.items + 1 > (int64_t)CONFIG->quota_items)
+        rc = SERVO_QUOTA_ITEMS;
+    else if (CONFIG->quota_bytes > 0 &&
+             total + (int64_t)bytes > (int64_t)CONFIG->quota_bytes)
+        rc = SERVO_QUOTA_BYTES;
+    quota_unlock();
+    return rc;
+}
+
+const char *
+servo_quota_text(int rc)
+{
+    switch (rc) {
+    case SERVO_QUOTA_SESSIONS:
+        return "Too many sessions";
+    case SERVO_QUOTA_ITEMS:
+        return "Session quota of items exceeded";
+    case SERVO_QUOTA_BYTES:
+        return "Session quota of bytes exceeded";
+    default:
+        return "";
+    }
+}
+
+void
+servo_quota_add(const uuid_t client_id, const struct servo_quota_usage *delta)
+{
+    struct servo_quota_slot     *s;
+    struct servo_quota_usage     u;
+    int                          i;
+
+    if (quota == NULL)
+        return;
+
+    quota_lock();
+    if ((s = quota_slot(client_id, delta->items > 0)) != NULL) {
+        u = s->usage;
+        u.items += delta->items;
+        for (i = 0; i < SERVO_QUOTA_TYPES; i++) {
+            u.bytes[i] += delta->bytes[i];
+            if (u.bytes[i] < 0)
+                u.bytes[i] = 0;
+        }
+        /* written during a rescan, too late for it to be seen */
+        s->gen = quota->gen;
+        quota_slot_set(s, &u);
+    }
+    quota_unlock();
+}
+
+int
+servo_quota_usage(const uuid_t client_id, struct servo_quota_usage *u)
+{
+    struct servo_quota_slot     *s;
+
+    memset(u, 0, sizeof(*u));
+    if (quota == NULL)
+        return (KORE_RESULT_ERROR);
+
+    quota_lock();
+    if ((s = quota_slot(client_id, 0)) != NULL)
+        *u = s->usage;
+    quota_unlock();
+    return (KORE_RESULT_OK);
+}
+
+static int64_t
+quota_column(struct kore_pgsql *sql, int row, int col)
+{
+    const char  *val;
+
+    val = kore_pgsql_getvalue(sql, row, col);
+    return val != NULL && *val != '\0' ? strtoll(val, NULL, 10) : 0;
+}
+
+/*
+ * Row of a write: whether it created the item, then the sizes of the
+ * value it replaced by kind. The new value is size bytes of type.
+ */
+void
+servo_quota_written(const uuid_t client_id, struct kore_pgsql *sql,
+                    int row, int col, int type, size_t size)
+{
+    struct servo_quota_usage     delta;
+    const char                  *val;
+    int                          i;
+
+    val = kore_pgsql_getvalue(sql, row, col);
+    delta.items = val != NULL && strcmp(val, "t") == 0;
+    for (i = 0; i < SERVO_QUOTA_TYPES; i++)
+        delta.bytes[i] = -quota_column(sql, row, col + 1 + i);
+    if (type >= 0 && type < SERVO_QUOTA_TYPES)
+        delta.bytes[type] += size;
+    servo_quota_add(client_id, &delta);
+}
+
+/* row of a delete, the sizes of the value removed by kind */
+void
+servo_quota_deleted(const uuid_t client_id, struct kore_pgsql *sql,
+                    int row, int col)
+{
+    struct servo_quota_usage     delta;
+    int                          i;
+
+    delta.items = -1;
+    for (i = 0; i < SERVO_QUOTA_TYPES; i++)
+        delta.bytes[i] = -quota_column(sql, row, col + i);
+    servo_quota_add(client_id, &delta);
+}
+
+static void
+quota_reconcile(void *arg, u_int64_t now)
+{
+    (void)arg;
+    (void)now;
+
+    if (quota_running)
+        return;
+
+    quota_running = 1;
+    quota_shard = 0;
+    quota_scanned = 0;
+    quota_lock();
+    quota->gen++;
+    quota_unlock();
+    kore_timer_add(quota_reconcile_step, QUOTA_RECONCILE_STEP, NULL,
+                   KORE_TIMER_ONESHOT);
+}
+
+static void
+quota_reconcile_fail(const char *what)
+{
+    kore_log(LOG_ERR, "session usage reconcile failed to %s: %s",
+             what, quota_conn != NULL ? PQerrorMessage(quota_conn) : "");
+    if (quota_conn != NULL)
+        PQfinish(quota_conn);
+    quota_conn = NULL;
+    quota_scanning = 0;
+    quota_running = 0;
+}
+
+/* drop sessions the pass didn't see, their items are gone */
+static void
+quota_reconcile_end(void)
+{
+    struct servo_quota_slot     *s;
+    size_t                       i;
+
+    quota_lock();
+    for (i = 0; i <= quota_mask; i++) {
+        s = &quota_slots[i];
+        /* the next one is shifted into the hole, look again */
+        while (s->used && s->gen != quota->gen) {
+            if (s->usage.items > 0)
+                quota->sessions--;
+            quota_slot_free(s);
+        }
+    }
+    quota->reconciled = servo_wallclock_ms();
+    quota_unlock();
+
+    quota_running = 0;
+    kore_log(LOG_NOTICE, "session usage reconciled, %llu sessions",
+             (unsigned long long)quota_scanned);
+}
+
+static void
+quota_reconcile_row(PGresult *res)
+{
+    struct servo_quota_slot     *s;
+    struct servo_quota_usage     u;
+    uuid_t                       client_id;
+    int                          i;
+
+    if (uuid_parse(PQgetvalue(res, 0, 0), client_id) != 0)
+        return;
+    u.items = strtoll(PQgetvalue(res, 0, 1), NULL, 10);
+    for (i = 0; i < SERVO_QUOTA_TYPES; i++)
+        u.bytes[i] = strtoll(PQgetvalue(res, 0, 2 + i), NULL, 10);
+
+    quota_lock();
+    if ((s = quota_slot(client_id, 1)) != NULL) {
+        s->gen = quota->gen;
+        quota_slot_set(s, &u);
+    }
+    quota_unlock();
+    quota_scanned++;
+}
+
+/* stream usage of one shard after another in batches */
+static void
+quota_reconcile_step(void *arg, u_int64_t now)
+{
+    PGresult    *res;
+    int          n;
+
+    (void)arg;
+    (void)now;
+
+    if (quota_conn == NULL) {
+        if (quota_shard == CONFIG->ndatabases) {
+            quota_reconcile_end();
+            return;
+        }
+
+        quota_conn = PQconnectStart(CONFIG->databases[quota_shard]);
+        if (quota_conn == NULL || PQstatus(quota_conn) == CONNECTION_BAD) {
+            quota_reconcile_fail("connect");
+            return;
+        }
+    }
+
+    /* connect without blocking the worker, as in watch.c */
+    if (!quota_scanning) {
+        switch (PQconnectPoll(quota_conn)) {
+        case PGRES_POLLING_OK:
+            break;
+        case PGRES_POLLING_FAILED:
+            quota_reconcile_fail("connect");
+            return;
+        default:
+            kore_timer_add(quota_reconcile_step, QUOTA_RECONCILE_STEP, NULL,
+                           KORE_TIMER_ONESHOT);
+            return;
+        }
+        if (!PQsendQuery(quota_conn, QUOTA_RECONCILE_SQL) ||
+            !PQsetSingleRowMode(quota_conn)) {
+            quota_reconcile_fail("query");
+            return;
+        }
+        quota_scanning = 1;
+    }
+
+    if (!PQconsumeInput(quota_conn)) {
+        quota_reconcile_fail("read");
+        return;
+    }
+
+    for (n = 0; n < QUOTA_RECONCILE_BATCH && !PQisBusy(quota_conn); n++) {
+        res = PQgetResult(quota_conn);
+        if (res == NULL) {
+            PQfinish(quota_conn);
+            quota_conn = NULL;
+            quota_scanning = 0;
+            quota_shard++;
+            break;
+        }
+
+        switch (PQresultStatus(res)) {
+        case PGRES_SINGLE_TUPLE:
+            quota_reconcile_row(res);
+            break;
+        case PGRES_TUPLES_OK:
+            break;
+        default:
+            PQclear(res);
+            quota_reconcile_fail("scan");
+            return;
+        }
+        PQclear(res);
+    }
+
+    kore_timer_add(quota_reconcile_step, QUOTA_RECONCILE_STEP, NULL,
+                   KORE_TIMER_ONESHOT);
+}
@@ -0,0 +1,65 @@
+#ifndef _SERVO_QUOTA_H_
+#define _SERVO_QUOTA_H_
+
+#include <sys/types.h>
+
+#include <kore/kore.h>
+#include <kore/http.h>
+#include <kore/pgsql.h>
+
+#include "servo.h"
+
+/* stored value kinds, as SERVO_CONTENT_STRING, JSON, FORMDATA */
+#define SERVO_QUOTA_TYPES       3
+
+/* what a write does to the items of its session */
+#define SERVO_QUOTA_UPDATES     0
+#define SERVO_QUOTA_MAY_CREATE  1   /* upserts, counted once created */
+#define SERVO_QUOTA_CREATES     2
+
+/* what a write would go over */
+#define SERVO_QUOTA_OK          0
+#define SERVO_QUOTA_SESSIONS    1
+#define SERVO_QUOTA_ITEMS       2
+#define SERVO_QUOTA_BYTES       3
+
+struct servo_quota_usage {
+    int64_t              items;
+    int64_t              bytes[SERVO_QUOTA_TYPES];
+};
+
+/*
+ * Usage of every session with items, shared by all workers through a
+ * memory mapped file. Slots are an open addressing table by client id
+ * updated under a lock word holding the pid of its owner.
+ */
+struct servo_quota_slot {
+    uuid_t                       client;
+    u_int32_t                    used;
+    u_int32_t                    gen;
+    struct servo_quota_usage     usage;
+};
+
+struct servo_quota_header {
+    size_t               nslots;
+    pid_t                owner;
+    pid_t                reconciler;
+    pid_t                lock;
+    u_int32_t            gen;
+    int64_t              sessions;
+    u_int64_t            reconciled;
+};
+
+int                  servo_quota_init(const char *);
+int                  servo_quota_check(const uuid_t, int, size_t);
+const char          *servo_quota_text(int);
+void                 servo_quota_add(const uuid_t,
+                                     const struct servo_quota_usage *);
+int                  servo_quota_usage(const uuid_t,
+                                       struct servo_quota_usage *);
+void                 servo_quota_written(const uuid_t, struct kore_pgsql *,
+                                         int, int, int, size_t);
+void                 servo_quota_deleted(const uuid_t, struct kore_pgsql *,
+                                         int, int);
+
+#endif //_SERVO_QUOTA_H_
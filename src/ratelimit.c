@@ -0,0 +1,174 @@
+#include <netinet/in.h>
+
+#include "ratelimit.h"
+#include "stats.h"
+#include "util.h"
+
+/*
+ * Request rate limits.
+ *
+ * Each source address and each session client id has a token bucket
+ * of burst tokens, refilled at rate a second when it's next looked at.
+ * IPv6 addresses share the bucket of their /64 prefix, IPv4 ones mapped
+ * into IPv6 count as IPv4.
+ * A request takes a token or is answered 429 before any database work,
+ * with the seconds until the next token in Retry-After.
+ *
+ * Buckets live in the worker, so the limits hold per worker. The least
+ * recently used bucket makes room for a new one at max_buckets, which
+ * forgets its count.
+ */
+
+#define LIMIT_BUCKETS           1024
+
+static LIST_HEAD(, servo_limit)      limit_buckets[LIMIT_BUCKETS];
+static TAILQ_HEAD(servo_limits, servo_limit) limit_lru;
+static size_t                        limit_count = 0;
+
+void
+servo_ratelimit_init(void)
+{
+    size_t      i;
+
+    for (i = 0; i < LIMIT_BUCKETS; i++)
+        LIST_INIT(&limit_buckets[i]);
+    TAILQ_INIT(&limit_lru);
+
+    /* a second worth of requests at once unless told */
+    if (CONFIG->limit_address_burst == 0)
+        CONFIG->limit_address_burst = CONFIG->limit_address_rate;
+    if (CONFIG->limit_client_burst == 0)
+        CONFIG->limit_client_burst = CONFIG->limit_client_rate;
+}
+
+static u_int64_t
+limit_hash(int kind, const u_int8_t *key, size_t len)
+{
+    u_int64_t   h = 14695981039346656037ULL;
+    size_t      i;
+
+    /* FNV-1a */
+    h ^= (u_int8_t)kind;
+    h *= 1099511628211ULL;
+    for (i = 0; i < len; i++) {
+        h ^= key[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static struct servo_limit *
+limit_get(int kind, const u_int8_t *key, size_t len, size_t burst)
+{
+    struct servo_limit  *l;
+    u_int64_t            hash;
+
+    hash = limit_hash(kind, key, len);
+    LIST_FOREACH(l, &limit_buckets[hash % LIMIT_BUCKETS], list) {
+        if (l->hash == hash && l->kind == kind &&
+            memcmp(l->key, key, len) == 0) {
+            TAILQ_REMOVE(&limit_lru, l, lru);
+            TAILQ_INSERT_HEAD(&limit_lru, l, lru);
+            return l;
+        }
+    }
+
+    if (limit_count >= CONFIG->limit_max_buckets &&
+        (l = TAILQ_LAST(&limit_lru, servo_limits)) != NULL) {
+        LIST_REMOVE(l, list);
+        TAILQ_REMOVE(&limit_lru, l, lru);
+        memset(l, 0, sizeof(*l));
+    }
+    else {
+        l = kore_calloc(1, sizeof(struct servo_limit));
+        limit_count++;
+    }
+
+    l->hash = hash;
+    l->kind = kind;
+    memcpy(l->key, key, len);
+    l->tokens = burst;
+    l->refilled = kore_time_ms();
+    LIST_INSERT_HEAD(&limit_buckets[hash % LIMIT_BUCKETS], l, list);
+    TAILQ_INSERT_HEAD(&limit_lru, l, lru);
+    return l;
+}
+
+/* take a token, or give the seconds until there is one */
+static int
+limit_take(int kind, const u_int8_t *key, size_t len, size_t rate,
+           size_t burst, u_int64_t *retry_after)
+{
+    struct servo_limit  *l;
+    u_int64_t            now;
+
+    l = limit_get(kind, key, len, burst);
+    now = kore_time_ms();
+    if (now > l->refilled) {
+        l->tokens += (double)(now - l->refilled) * rate / 1000;
+        if (l->tokens > burst)
+            l->tokens = burst;
+        l->refilled = now;
+    }
+
+    if (l->tokens >= 1) {
+        l->tokens -= 1;
+        return (KORE_RESULT_OK);
+    }
+
+    servo_stats_count(STATS_RATE_LIMITED, 1);
+    *retry_after = (u_int64_t)((1 - l->tokens) / rate) + 1;
+    return (KORE_RESULT_ERROR);
+}
+
+int
+servo_ratelimit_address(struct connection *c, u_int64_t *retry_after)
+{
+    const u_int8_t  *key;
+    size_t           len;
+
+    if (CONFIG->limit_address_rate == 0)
+        return (KORE_RESULT_OK);
+
+    if (c->addrtype == AF_INET) {
+        key = (const u_int8_t *)&c->addr.ipv4.sin_addr;
+        len = 4;
+    }
+    else if (c->addrtype == AF_INET6 &&
+             IN6_IS_ADDR_V4MAPPED(&c->addr.ipv6.sin6_addr)) {
+        key = (const u_int8_t *)&c->addr.ipv6.sin6_addr + 12;
+        len = 4;
+    }
+    else if (c->addrtype == AF_INET6) {
+        /* hosts pick any address of their /64 */
+        key = (const u_int8_t *)&c->addr.ipv6.sin6_addr;
+        len = 8;
+    }
+    else
+        return (KORE_RESULT_OK);
+
+    return limit_take(SERVO_LIMIT_ADDRESS, key, len,
+                      CONFIG->limit_address_rate,
+                      CONFIG->limit_address_burst, retry_after);
+}
+
+int
+servo_ratelimit_client(const uuid_t client_id, u_int64_t *retry_after)
+{
+    if (CONFIG->limit_client_rate == 0)
+        return (KORE_RESULT_OK);
+
+    return limit_take(SERVO_LIMIT_CLIENT, client_id, sizeof(uuid_t),
+                      CONFIG->limit_client_rate,
+                      CONFIG->limit_client_burst, retry_after);
+}
+
+void
+servo_ratelimit_respond(struct http_request *req, u_int64_t retry_after)
+{
+    char        value[24];
+
+    snprintf(value, sizeof(value), "%llu", (unsigned long long)retry_after);
+    http_response_header(req, RETRY_AFTER_HEADER, value);
+    servo_response_status(req, 429, "Too Many Requests");
+}
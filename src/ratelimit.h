@@ -0,0 +1,33 @@
+#ifndef _SERVO_RATELIMIT_H_
+#define _SERVO_RATELIMIT_H_
+
+#include <sys/queue.h>
+
+#include <kore/kore.h>
+#include <kore/http.h>
+
+#include "servo.h"
+
+/* what a bucket is keyed by */
+#define SERVO_LIMIT_ADDRESS     0
+#define SERVO_LIMIT_CLIENT      1
+
+/* token bucket of a client or an address */
+struct servo_limit {
+    u_int64_t                        hash;
+    int                              kind;
+    u_int8_t                         key[16];
+    double                           tokens;
+    u_int64_t                        refilled;
+
+    LIST_ENTRY(servo_limit)          list;
+    TAILQ_ENTRY(servo_limit)         lru;
+};
+
+void                 servo_ratelimit_init(void);
+int                  servo_ratelimit_address(struct connection *,
+                                             u_int64_t *);
+int                  servo_ratelimit_client(const uuid_t, u_int64_t *);
+void                 servo_ratelimit_respond(struct http_request *, u_int64_t);
+
+#endif //_SERVO_RATELIMIT_H_
@@ -0,0 +1,103 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "ring.h"
+
+/* FNV-1a with a splitmix64 finalizer for better avalanche */
+u_int64_t
+servo_ring_hash(const void *data, size_t len)
+{
+    const u_int8_t  *p = data;
+    u_int64_t        h;
+    size_t           i;
+
+    h = 0xcbf29ce484222325ULL;
+    for (i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h;
+}
+
+static int
+ring_point_cmp(const void *a, const void *b)
+{
+    const struct servo_ring_point *x = a, *y = b;
+
+    if (x->hash != y->hash)
+        return x->hash < y->hash ? -1 : 1;
+    return (int)x->shard - (int)y->shard;
+}
+
+/*
+ * Points depend only on the shard position and the vnode number, so
+ * appending a shard moves roughly 1/n of clients and nothing else.
+ */
+int
+servo_ring_build(struct servo_ring *ring, size_t nshards, size_t vnodes)
+{
+    char        name[64];
+    size_t      s, v, n;
+    int         len;
+
+    ring->npoints = nshards * vnodes;
+    ring->points = calloc(ring->npoints, sizeof(struct servo_ring_point));
+    if (ring->points == NULL) {
+        ring->npoints = 0;
+        return 0;
+    }
+
+    n = 0;
+    for (s = 0; s < nshards; s++) {
+        for (v = 0; v < vnodes; v++) {
+            len = snprintf(name, sizeof(name), "shard-%zu-%zu", s, v);
+            ring->points[n].hash = servo_ring_hash(name, len);
+            ring->points[n].shard = s;
+            n++;
+        }
+    }
+
+    qsort(ring->points, ring->npoints, sizeof(struct servo_ring_point),
+          ring_point_cmp);
+    return 1;
+}
+
+u_int32_t
+servo_ring_lookup(const struct servo_ring *ring, const void *key, size_t len)
+{
+    u_int64_t   h;
+    size_t      lo, hi, mid;
+
+    if (ring->npoints == 0)
+        return 0;
+
+    /* first point clockwise from the key hash */
+    h = servo_ring_hash(key, len);
+    lo = 0;
+    hi = ring->npoints;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (ring->points[mid].hash < h)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo == ring->npoints)
+        lo = 0;
+    return ring->points[lo].shard;
+}
+
+void
+servo_ring_free(struct servo_ring *ring)
+{
+    free(ring->points);
+    ring->points = NULL;
+    ring->npoints = 0;
+}
@@ -0,0 +1,30 @@
+#ifndef _SERVO_RING_H_
+#define _SERVO_RING_H_
+
+#include <sys/types.h>
+#include <stddef.h>
+
+/*
+ * Consistent hash ring of shards with virtual nodes. Kept free of
+ * Kore so tools can place clients exactly like the server does.
+ */
+
+#define SERVO_RING_VNODES       64
+
+struct servo_ring_point {
+    u_int64_t        hash;
+    u_int32_t        shard;
+};
+
+struct servo_ring {
+    struct servo_ring_point     *points;
+    size_t                       npoints;
+};
+
+u_int64_t            servo_ring_hash(const void *, size_t);
+int                  servo_ring_build(struct servo_ring *, size_t, size_t);
+u_int32_t            servo_ring_lookup(const struct servo_ring *,
+                                       const void *, size_t);
+void                 servo_ring_free(struct servo_ring *);
+
+#endif //_SERVO_RING_H_
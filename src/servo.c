@@ -1,5 +1,21 @@
 #include "servo.h"
 #include "util.h"
+#include "stats.h"
+#include "pool.h"
+#include "shard.h"
+#include "flight.h"
+#include "bloom.h"
+#include "watch.h"
+#include "ws.h"
+#include "counter.h"
+#include "expire.h"
+#include "storage.h"
+#include "cidr.h"
+#include "origin.h"
+#include "ratelimit.h"
+#include "quota.h"
+#include "codec.h"
+#include "writeback.h"
 #include "assets.h"
 
 struct servo_config *CONFIG;
@@ -7,6 +23,7 @@ struct servo_config *CONFIG;
 struct http_state   servo_session_states[] = {
 
     { "REQ_STATE_INIT",       servo_state_init  },
+    { "REQ_STATE_CONNECT",    servo_state_connect },
     { "REQ_STATE_QUERY",      servo_state_query },
     { "REQ_STATE_WAIT",       servo_state_wait  },
     { "REQ_STATE_READ",       servo_state_read  },
@@ -15,7 +32,6 @@ struct http_state   servo_session_states[] = {
     { "REQ_STATE_DONE",       state_done  },
 };
 
-static char* DBNAME = "servo-store";
 static char    *SQL_STATE_NAMES[] = {
     "<null>",   // NULL
     "init",     // KORE_PGSQL_STATE_INIT
@@ -54,7 +70,15 @@ servo_delete_context(struct http_request *req)
     struct servo_context    *ctx;
 
     ctx = http_state_get(req);
-    kore_pgsql_cleanup(&ctx->sql);
+    servo_flight_leave(req);
+    servo_watch_end(req);
+    servo_writeback_end(req);
+
+    /* insert definitely failed, take its key back out of the filter */
+    if (ctx->bloom_added && ctx->status >= 400 && ctx->status < 500)
+        servo_bloom_undo(ctx->client_id, req->path);
+    servo_pool_release(req);
+    servo_stats_finish(req);
 
     kore_log(LOG_NOTICE, "{%s} << close session, state: %s, sql: %s",
                          ctx->client,
@@ -62,12 +86,12 @@ servo_delete_context(struct http_request *req)
                          sql_state_text(ctx->sql.state));
     if (ctx->err != NULL)
         kore_free(ctx->err);
-    if (ctx->client != NULL)
-        kore_free(ctx->client);
     if (ctx->val_str != NULL)
         kore_free(ctx->val_str);
     if (ctx->val_json != NULL)
         json_decref(ctx->val_json);
+    if (ctx->val_json_text != NULL)
+        kore_free(ctx->val_json_text);
     if (ctx->val_bin != NULL)
         kore_free(ctx->val_bin);
     if (ctx->token)
@@ -85,15 +109,75 @@ servo_init(int state)
     /* Configuration defaults */
     CONFIG->public_mode = 0;
     CONFIG->session_ttl = 300;
-    CONFIG->max_sessions = 10;
+    CONFIG->max_sessions = 0;
     CONFIG->string_size = 255;
     CONFIG->json_size = 1024;
     CONFIG->blob_size = 4096;
     CONFIG->allow_origin = NULL;
     CONFIG->allow_ipaddr = NULL;
+    CONFIG->allow_ipfile = NULL;
     CONFIG->jwt_key = NULL;
     CONFIG->jwt_key_len = 0;
     CONFIG->jwt_alg = JWT_ALG_NONE;
+    CONFIG->databases = NULL;
+    CONFIG->ndatabases = 0;
+    CONFIG->shard_vnodes = SERVO_RING_VNODES;
+    CONFIG->replicas = NULL;
+    CONFIG->replica_shards = NULL;
+    CONFIG->nreplicas = 0;
+    CONFIG->replica_sticky = 2000;
+    CONFIG->stats_path = kore_strdup("servo.stats");
+    CONFIG->quota_path = kore_strdup("servo.quota");
+    CONFIG->quota_slots = 65536;
+    CONFIG->quota_items = 0;
+    CONFIG->quota_bytes = 0;
+    CONFIG->quota_reconcile = 300;
+    CONFIG->bloom_path = kore_strdup("servo.bloom");
+    CONFIG->bloom_items = 0;
+    CONFIG->bloom_fp_rate = 0.01;
+    CONFIG->pool_queue_depth = 128;
+    CONFIG->pool_wait_timeout = 1000;
+    CONFIG->pool_retry_after = 1;
+    CONFIG->pool_weight[SERVO_POOL_READ] = 8;
+    CONFIG->pool_weight[SERVO_POOL_WRITE] = 4;
+    CONFIG->pool_weight[SERVO_POOL_BULK] = 1;
+    CONFIG->pool_reserve[SERVO_POOL_READ] = 1;
+    CONFIG->pool_reserve[SERVO_POOL_WRITE] = 0;
+    CONFIG->pool_reserve[SERVO_POOL_BULK] = 0;
+    CONFIG->pool_reserve_flush = 1;
+#ifdef LIBPQ_HAS_ASYNC_CANCEL
+    CONFIG->timeout_read = 5000;
+    CONFIG->timeout_write = 10000;
+    CONFIG->timeout_blob = 30000;
+#else
+    /* budgets take a cancel that doesn't block, see pool.c */
+    CONFIG->timeout_read = 0;
+    CONFIG->timeout_write = 0;
+    CONFIG->timeout_blob = 0;
+#endif
+    CONFIG->watch_max = 1024;
+    CONFIG->watch_timeout = 30;
+    CONFIG->watch_max_timeout = 300;
+    CONFIG->ws_max_pending = 64;
+    CONFIG->counter_flush = 0;
+    CONFIG->counter_max = 10000;
+    CONFIG->expire_interval = 1000;
+    CONFIG->expire_batch = 1000;
+    CONFIG->writeback_flush = 0;
+    CONFIG->writeback_max = 10000;
+    CONFIG->writeback_journal = kore_strdup("servo.journal");
+    CONFIG->writeback_durability = SERVO_DURABILITY_FSYNC;
+    CONFIG->writeback_sync = 2;
+    CONFIG->storage_unlogged = 0;
+    CONFIG->storage_snapshot = 60000;
+    CONFIG->storage_durable = NULL;
+    CONFIG->nstorage_durable = 0;
+    CONFIG->preflight_max_age = 600;
+    CONFIG->limit_address_rate = 0;
+    CONFIG->limit_address_burst = 0;
+    CONFIG->limit_client_rate = 0;
+    CONFIG->limit_client_burst = 0;
+    CONFIG->limit_max_buckets = 65536;
 
     if (!servo_read_config(CONFIG)) {
         kore_log(LOG_ERR, "%s: servo is not configured", __FUNCTION__);
@@ -108,6 +192,12 @@ servo_init(int state)
                                               CONFIG->jwt_key_len);
     }
 
+    if (CONFIG->preflight_max_age > 0) {
+        CONFIG->preflight_max_age_hdr = kore_malloc(24);
+        snprintf(CONFIG->preflight_max_age_hdr, 24, "%zu",
+                 CONFIG->preflight_max_age);
+    }
+
     kore_log(LOG_NOTICE, "started worker pid: %d", (int)getpid());
     if (CONFIG->jwt_alg != JWT_ALG_NONE) {
         kore_log(LOG_NOTICE, "  auth key: %s", CONFIG->jwt_key);
@@ -118,29 +208,69 @@ servo_init(int state)
     kore_log(LOG_NOTICE, "  public mode: %s", CONFIG->public_mode != 0 ? "yes" : "no");
     kore_log(LOG_NOTICE, "  session ttl: %zu seconds", CONFIG->session_ttl);
     kore_log(LOG_NOTICE, "  max sessions: %zu", CONFIG->max_sessions);
+    kore_log(LOG_NOTICE, "  session quota: %zu items, %zu bytes",
+             CONFIG->quota_items, CONFIG->quota_bytes);
     if (CONFIG->allow_origin != NULL)
         kore_log(LOG_NOTICE, "  allow origin: %s", CONFIG->allow_origin);
     if (CONFIG->allow_ipaddr != NULL)
         kore_log(LOG_NOTICE, "  allow ip address: %s", CONFIG->allow_ipaddr);
+    if (CONFIG->allow_ipfile != NULL)
+        kore_log(LOG_NOTICE, "  allow ip addresses in: %s", CONFIG->allow_ipfile);
+    if (!servo_cidr_init() || !servo_origin_init())
+        return (KORE_RESULT_ERROR);
     
-    kore_pgsql_register(DBNAME, CONFIG->database);
-    
+    kore_log(LOG_NOTICE, "  connection queue: %zu, wait %llu ms",
+             CONFIG->pool_queue_depth,
+             (unsigned long long)CONFIG->pool_wait_timeout);
+    kore_log(LOG_NOTICE, "  connection weights: read %zu, write %zu, bulk %zu",
+             CONFIG->pool_weight[SERVO_POOL_READ],
+             CONFIG->pool_weight[SERVO_POOL_WRITE],
+             CONFIG->pool_weight[SERVO_POOL_BULK]);
+    kore_log(LOG_NOTICE, "  query timeouts: read %llu, write %llu, blob %llu ms",
+             (unsigned long long)CONFIG->timeout_read,
+             (unsigned long long)CONFIG->timeout_write,
+             (unsigned long long)CONFIG->timeout_blob);
+    if (CONFIG->storage_unlogged)
+        kore_log(LOG_NOTICE, "  storage: unlogged, %zu durable prefixes",
+                 CONFIG->nstorage_durable);
+    if (CONFIG->storage_unlogged && CONFIG->nreplicas > 0) {
+        /* unlogged tables are not replicated */
+        kore_log(LOG_NOTICE, "  replicas unused with unlogged storage");
+        CONFIG->nreplicas = 0;
+    }
+
+    servo_stats_init(CONFIG->stats_path);
+    if (!servo_pool_init())
+        return (KORE_RESULT_ERROR);
+    servo_ratelimit_init();
+    servo_flight_init();
+    if (!servo_writeback_replay() || !servo_shard_init())
+        return (KORE_RESULT_ERROR);
+    servo_bloom_init(CONFIG->bloom_path, CONFIG->bloom_items,
+                     CONFIG->bloom_fp_rate);
+    servo_quota_init(CONFIG->quota_path);
+    servo_watch_init();
+    servo_ws_init();
+    servo_counter_init();
+    servo_writeback_init();
+    servo_expire_init();
+    servo_storage_init();
+
     return (KORE_RESULT_OK);
 }
 
 int
 servo_init_context(struct servo_context *ctx)
 {
-    uuid_t    client_uuid;
-
     // set empty defaults
-    ctx->client = NULL;
+    memset(ctx->client, 0, sizeof(ctx->client));
     ctx->status = 200;
     ctx->err = NULL;
     ctx->token = NULL;
     ctx->val_sz = 0;
     ctx->val_str = NULL;
     ctx->val_json = NULL;
+    ctx->val_json_text = NULL;
     ctx->val_bin = NULL;
 
     /* read and write strings by default */
@@ -148,10 +278,8 @@ servo_init_context(struct servo_context *ctx)
     ctx->out_content_type = SERVO_CONTENT_STRING;
 
     /* Generate new client token and init fresh session */
-    uuid_generate(client_uuid);
-
-    ctx->client = kore_malloc(CLIENT_UUID_LEN);
-    uuid_unparse(client_uuid, ctx->client);
+    uuid_generate(ctx->client_id);
+    uuid_unparse(ctx->client_id, ctx->client);
 
     if (jwt_new(&ctx->token) != 0) {
         kore_log(LOG_ERR, "%s: failed to allocate jwt",
@@ -172,7 +300,7 @@ servo_init_context(struct servo_context *ctx)
             return (KORE_RESULT_ERROR);
         }
 
-    if (jwt_add_grant(ctx->token, "id", ctx->client) != 0) {
+    if (jwt_add_grant(ctx->token, TOKEN_CLIENT_GRANT, ctx->client) != 0) {
         kore_log(LOG_ERR, "%s: failed add grant to jwt",
                  __FUNCTION__);
         jwt_free(ctx->token);
@@ -203,15 +331,28 @@ servo_write_context_token(struct http_request *req)
     kore_buf_free(token_hdr);
 }
 
+/*
+ * Stamp the session token with the time of a write, so following
+ * reads of the session stay on the primary until replicas caught up.
+ */
+void
+servo_mark_context_write(struct servo_context *ctx)
+{
+    ctx->last_write = servo_wallclock_ms();
+    jwt_del_grants(ctx->token, TOKEN_WRITE_GRANT);
+    if (jwt_add_grant_int(ctx->token, TOKEN_WRITE_GRANT,
+                          (long)ctx->last_write) != 0) {
+        kore_log(LOG_ERR, "{%s} failed to add write grant to jwt",
+                          ctx->client);
+    }
+}
+
 int
 servo_read_context_token(struct http_request *req)
 {
-    int                      n;
-    struct servo_context    *ctx;
+    int                      n, rc;
     char                    *t, *token_hdr,
                             *hdr_parts[3];
-    const char              *client_id;
-    jwt_t                   *token;    
 
     if (!http_request_header(req, AUTH_HEADER, &t)) {
         return (KORE_RESULT_ERROR);
@@ -219,41 +360,61 @@ servo_read_context_token(struct http_request *req)
 
     token_hdr = kore_strdup(t);
     n = kore_split_string(token_hdr, " ", hdr_parts, 3);
-    kore_free(token_hdr);
     if (n != 2) {
         kore_log(LOG_ERR, "%s: invalid header format, n=%d - '%s'",
                           __FUNCTION__,
                           n, t);
+        kore_free(token_hdr);
         return (KORE_RESULT_ERROR);
     }
+
+    rc = servo_load_context_token(http_state_get(req), hdr_parts[1]);
+    kore_free(token_hdr);
+    return rc;
+}
+
+int
+servo_load_context_token(struct servo_context *ctx, const char *encoded)
+{
+    const char              *client_id;
+    jwt_t                   *token;    
+
     /* parse and verify json web token */
     if (jwt_decode(&token, 
-                   hdr_parts[1],
+                   encoded,
                    (const unsigned char *)CONFIG->jwt_key,
                    CONFIG->jwt_key_len) != 0) {
         kore_log(LOG_ERR, "%s: invalid json web token received: '%s'",
                  __FUNCTION__,
-                 hdr_parts[1]);
+                 encoded);
         return (KORE_RESULT_ERROR);
     }
 
-    client_id = jwt_get_grant(token, "id");
+    client_id = jwt_get_grant(token, TOKEN_CLIENT_GRANT);
     if (client_id == NULL) {
         kore_log(LOG_ERR, "%s: failed to get client id from token",
                  __FUNCTION__);
+        jwt_free(token);
         return (KORE_RESULT_ERROR);
     }
 
-    /* get and set http state from token */
-    ctx = (struct servo_context *)http_state_get(req);
-    if (ctx != NULL && (ctx->token != NULL || ctx->client != NULL)) {
+    /* set session state from token */
+    if (ctx->token != NULL || ctx->client[0] != '\0') {
         kore_log(LOG_ERR, "{%s}: trying reset context with {%s}",
                           ctx->client,
                           client_id);
+        jwt_free(token);
+        return (KORE_RESULT_ERROR);
+    }
+    if (uuid_parse(client_id, ctx->client_id) != 0) {
+        kore_log(LOG_ERR, "%s: malformed client id in token: '%s'",
+                 __FUNCTION__, client_id);
+        jwt_free(token);
         return (KORE_RESULT_ERROR);
     }
     ctx->token = token;
-    ctx->client = kore_strdup(client_id);
+    ctx->last_write = (u_int64_t)jwt_get_grant_int(token, TOKEN_WRITE_GRANT);
+    uuid_unparse(ctx->client_id, ctx->client);
 
     kore_log(LOG_NOTICE, "{%s} >> existing session", ctx->client);
     return (KORE_RESULT_OK);
@@ -264,6 +425,7 @@ servo_start(struct http_request *req)
 {
     if (!http_state_exists(req)) {
         http_state_create(req, sizeof(struct servo_context));
+        servo_stats_start(req);
     }
     return (http_state_run(servo_session_states, servo_session_states_size, req));
 }
@@ -274,18 +436,36 @@ servo_render_stats(struct http_request *req)
     int                      rc;
     json_t                  *stats;
     struct servo_context    *ctx;
-    time_t                   last_read, last_write;
+    struct servo_quota_usage usage;
+    time_t                   last_write;
 
     rc = KORE_RESULT_OK;
     ctx = (struct servo_context *)http_state_get(req);
-    // FIXME: real stats here
-    last_read = time(NULL);
-    last_write = time(NULL);    
-    stats = json_pack("{s:s s:s s:s s:i}",
+    stats = json_pack("{s:s s:i}",
               "client",      ctx->client,
-              "last_read",   servo_format_date(&last_read),
-              "last_write",  servo_format_date(&last_write),
               "session_ttl", CONFIG->session_ttl);
+
+    /* as stamped in the token, sessions that never wrote have none */
+    if (ctx->last_write != 0) {
+        last_write = (time_t)(ctx->last_write / 1000);
+        json_object_set_new(stats, "last_write",
+                            json_string(servo_format_date(&last_write)));
+    }
+
+    /* usage as last counted, limits of 0 are off */
+    if (servo_quota_usage(ctx->client_id, &usage)) {
+        json_object_set_new(stats, "usage",
+            json_pack("{s:I s:{s:I s:I s:I}}",
+                      "items", (json_int_t)usage.items,
+                      "bytes",
+                      "text", (json_int_t)usage.bytes[SERVO_CONTENT_STRING],
+                      "json", (json_int_t)usage.bytes[SERVO_CONTENT_JSON],
+                      "blob", (json_int_t)usage.bytes[SERVO_CONTENT_FORMDATA]));
+        json_object_set_new(stats, "quota",
+            json_pack("{s:I s:I}",
+                      "items", (json_int_t)CONFIG->quota_items,
+                      "bytes", (json_int_t)CONFIG->quota_bytes));
+    }
     servo_response_json(req, 200, stats);
     json_decref(stats);
     
@@ -297,29 +477,60 @@ int
 servo_connect_db(struct http_request *req, int retry_step, int success_step, int error_step)
 {
     struct servo_context    *ctx = http_state_get(req);
-    
-    kore_pgsql_cleanup(&ctx->sql);
-    kore_pgsql_init(&ctx->sql);
-    kore_pgsql_bind_request(&ctx->sql, req);
+    char                     retry_after[16];
+
+    if (ctx->ts_connect == 0)
+        ctx->ts_connect = servo_stats_now();
 
     kore_log(LOG_DEBUG, "{%s} connecting, sql: %s",
                         ctx->client,
                         sql_state_text(ctx->sql.state));
 
-    if (!kore_pgsql_setup(&ctx->sql, DBNAME, KORE_PGSQL_ASYNC)) {
-        kore_pgsql_logerror(&ctx->sql);
+    if (ctx->dbname == NULL)
+        ctx->dbname = servo_shard_dbname(ctx, 0);
 
-        /* If the state was still INIT, we'll try again later. */
-        if (ctx->sql.state == KORE_PGSQL_STATE_INIT) {
-            req->fsm_state = retry_step;
-            kore_log(LOG_ERR, "{%s} retrying connection, sql: %s",
-                              ctx->client,
-                              sql_state_text(ctx->sql.state));
-            return (HTTP_STATE_RETRY);
-        }
+    switch (servo_pool_acquire(req, ctx->dbname)) {
+    case SERVO_POOL_OK:
+        kore_log(LOG_DEBUG, "{%s} connected, state: %s, sql: %s, next: %s",
+                            ctx->client,
+                            servo_state_text(req->fsm_state),
+                            sql_state_text(ctx->sql.state),
+                            servo_state_text(success_step));
+        servo_stats_record(STATS_HIST_PG_CONNECT,
+                           servo_stats_now() - ctx->ts_connect);
+        req->fsm_state = success_step;
+        break;
 
-        /* Different state means error */
+    case SERVO_POOL_WAIT:
+        /* sleeping until a connection is released */
+        req->fsm_state = retry_step;
+        servo_stats_count(STATS_PG_RETRIES, 1);
+        kore_log(LOG_DEBUG, "{%s} waiting for connection, sql: %s",
+                            ctx->client,
+                            sql_state_text(ctx->sql.state));
+        return (HTTP_STATE_RETRY);
+
+    case SERVO_POOL_FULL:
+        /* shed load, the client should come back later */
+        snprintf(retry_after, sizeof(retry_after), "%d",
+                 CONFIG->pool_retry_after);
+        http_response_header(req, RETRY_AFTER_HEADER, retry_after);
+        ctx->status = 503;
+        req->fsm_state = error_step;
+        break;
+
+    default:
         kore_pgsql_logerror(&ctx->sql);
+        servo_stats_count(STATS_PG_ERRORS, 1);
+        if (ctx->replica) {
+            /* replica is down, the primary serves the read */
+            kore_log(LOG_NOTICE, "{%s} replica %s failed, using primary",
+                                 ctx->client, ctx->dbname);
+            ctx->replica = 0;
+            ctx->dbname = servo_shard_dbname(ctx, 0);
+            return servo_connect_db(req, retry_step, success_step,
+                                    error_step);
+        }
         ctx->status = 500;
         req->fsm_state = error_step;
         kore_log(LOG_ERR, "{%s} failed to connect to database, sql: %s",
@@ -327,14 +538,7 @@ servo_connect_db(struct http_request *req, int retry_step, int success_step, int
             sql_state_text(ctx->sql.state));
         kore_log(LOG_NOTICE,
             "hint: check database connection string in the configuration file.");
-    }
-    else {
-        kore_log(LOG_DEBUG, "{%s} connected, state: %s, sql: %s, next: %s",
-                            ctx->client,
-                            servo_state_text(req->fsm_state),
-                            sql_state_text(ctx->sql.state),
-                            servo_state_text(success_step));
-        req->fsm_state = success_step;
+        break;
     }
 
     return (HTTP_STATE_CONTINUE);
@@ -352,6 +556,21 @@ servo_handle_pg_error(struct http_request *req)
         ctx->status = 409; // Conflict
     }
 
+    /* servo_append_item() refusals */
+    if (strstr(ctx->sql.error, "item does not take appends") != NULL)
+        ctx->status = 409;
+    if (strstr(ctx->sql.error, "item is too large") != NULL)
+        ctx->status = 403;
+    if (strstr(ctx->sql.error, "invalid input syntax") != NULL)
+        ctx->status = 400;
+
+    /* cancelled by us for running over the time budget */
+    if (ctx->timed_out) {
+        ctx->status = 504;
+        if (ctx->err == NULL)
+            ctx->err = kore_strdup("Query time budget exceeded");
+    }
+
     if (ctx->err == NULL) {
         ctx->err = kore_strdup(ctx->sql.error);
     }
@@ -372,6 +591,9 @@ servo_wait(struct http_request *req, int read_step, int complete_step, int error
         return (HTTP_STATE_RETRY);
 
     case KORE_PGSQL_STATE_COMPLETE:
+        servo_pool_query_done(req);
+        servo_stats_record(STATS_HIST_PG_QUERY,
+                           servo_stats_now() - ctx->ts_query);
         req->fsm_state = complete_step;
         kore_log(LOG_DEBUG, "{%s} io complete, state: %s, sql: %s",
                             ctx->client,
@@ -388,6 +610,10 @@ servo_wait(struct http_request *req, int read_step, int complete_step, int error
         break;
 
     case KORE_PGSQL_STATE_ERROR:
+        servo_pool_query_done(req);
+        servo_stats_record(STATS_HIST_PG_QUERY,
+                           servo_stats_now() - ctx->ts_query);
+        servo_stats_count(STATS_PG_ERRORS, 1);
         req->fsm_state = error_step;
         kore_log(LOG_ERR, "{%s} io failed, state: %s, sql: %s, sql error: %s",
             ctx->client,
@@ -416,6 +642,8 @@ int state_error(struct http_request *req)
     struct servo_context    *ctx = http_state_get(req);
     const char              *msg;
 
+    servo_stats_enter(req);
+
     /* Handle redirect */
     if (servo_is_redirect(ctx)) {
         msg = http_status_text(ctx->status);
@@ -459,15 +687,32 @@ int state_done(struct http_request *req)
 {
     struct servo_context    *ctx = http_state_get(req);
     const char              *output;
+    char                     etag[32], range[64];
+    void                    *bytes;
+    size_t                   len;
+    struct kore_buf         *buf;
+
+    servo_stats_enter(req);
 
     ctx->status = 200;
     if (req->method == HTTP_METHOD_POST ||
         req->method == HTTP_METHOD_PUT) 
     {
-        /* reply 201 Created on POSTs */
-        if (req->method == HTTP_METHOD_POST)
+        /* reply 201 Created on POSTs and PUTs creating the item */
+        if (ctx->created)
             ctx->status = 201;
 
+        /* written behind, 202 Accepted without a version yet */
+        if (ctx->behind)
+            ctx->status = 202;
+
+        /* new version, for If-Match of the next write */
+        if (ctx->version != 0) {
+            snprintf(etag, sizeof(etag), "\"%llu\"",
+                     (unsigned long long)ctx->version);
+            http_response_header(req, ETAG_HEADER, etag);
+        }
+
         output = http_status_text(ctx->status);
         switch(ctx->out_content_type) {
             default:
@@ -489,8 +734,44 @@ int state_done(struct http_request *req)
                  ctx->val_sz,
                  SERVO_CONTENT_NAMES[ctx->in_content_type]);
     }
+    else if (servo_is_item_request(req) && ctx->range_partial) {
+
+        /* span of a blob as stored, of the version in the ETag */
+        snprintf(etag, sizeof(etag), "\"%llu\"",
+                 (unsigned long long)ctx->version);
+        http_response_header(req, ETAG_HEADER, etag);
+
+        ctx->status = 206;
+        bytes = servo_item_to_bytes(ctx, &len);
+        snprintf(range, sizeof(range), "bytes %lld-%lld/%llu",
+                 (long long)ctx->range_first,
+                 (long long)(ctx->range_first + len - 1),
+                 (unsigned long long)ctx->range_size);
+        http_response_header(req, CONTENT_RANGE_HEADER, range);
+        http_response_header(req, CONTENT_TYPE_HEADER, CONTENT_TYPE_OCTETS);
+        http_response(req, ctx->status, bytes, len);
+        servo_stats_bytes_out(SERVO_CONTENT_FORMDATA, len);
+        kore_free(bytes);
+
+        kore_log(LOG_DEBUG, "{%s} wrote %s of item %llu bytes",
+                 ctx->client,
+                 range,
+                 (unsigned long long)ctx->range_size);
+    }
     else if (servo_is_item_request(req)) {
 
+        /* item version, watches wait for it to change, none for a
+           value written behind */
+        if (ctx->version != 0) {
+            snprintf(etag, sizeof(etag), "\"%llu\"",
+                     (unsigned long long)ctx->version);
+            http_response_header(req, ETAG_HEADER, etag);
+        }
+
+        /* blobs may be read in byte ranges */
+        if (ctx->in_content_type == SERVO_CONTENT_FORMDATA)
+            http_response_header(req, ACCEPT_RANGES_HEADER, "bytes");
+
         switch(ctx->out_content_type) {
             default:
             case SERVO_CONTENT_STRING:
@@ -499,6 +780,8 @@ int state_done(struct http_request *req)
                 http_response(req, ctx->status, 
                               output == NULL ? "" : output,
                               output == NULL ? 0 : strlen(output));
+                servo_stats_bytes_out(SERVO_CONTENT_STRING,
+                                      output == NULL ? 0 : strlen(output));
                 break;
 
             case SERVO_CONTENT_JSON:
@@ -507,6 +790,8 @@ int state_done(struct http_request *req)
                 http_response(req, ctx->status,
                               output == NULL ? "" : output,
                               output == NULL ? 0 : strlen(output));
+                servo_stats_bytes_out(SERVO_CONTENT_JSON,
+                                      output == NULL ? 0 : strlen(output));
                 break;
 
             case SERVO_CONTENT_FORMDATA:
@@ -514,6 +799,22 @@ int state_done(struct http_request *req)
                 servo_response_status(req, 403, http_status_text(403));
                 break;
 
+            case SERVO_CONTENT_CBOR:
+            case SERVO_CONTENT_MSGPACK:
+                buf = servo_codec_item(ctx, ctx->out_content_type);
+                if (buf == NULL) {
+                    ctx->status = 500;
+                    servo_response_status(req, ctx->status,
+                                          http_status_text(ctx->status));
+                    break;
+                }
+                http_response_header(req, CONTENT_TYPE_HEADER,
+                                     SERVO_CONTENT_NAMES[ctx->out_content_type]);
+                http_response(req, ctx->status, buf->data, buf->offset);
+                servo_stats_bytes_out(ctx->out_content_type, buf->offset);
+                kore_buf_free(buf);
+                break;
+
         };
 
         kore_log(LOG_DEBUG, "{%s} wrote item %zu bytes, src type: %s, dst type: %s",
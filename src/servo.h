@@ -12,11 +12,13 @@
 /* States */
 
 #define REQ_STATE_INIT          0
-#define REQ_STATE_QUERY         1
-#define REQ_STATE_WAIT          2
-#define REQ_STATE_READ          3
-#define REQ_STATE_ERROR         4
-#define REQ_STATE_DONE          5
+#define REQ_STATE_CONNECT       1
+#define REQ_STATE_QUERY         2
+#define REQ_STATE_WAIT          3
+#define REQ_STATE_READ          4
+#define REQ_STATE_ERROR         5
+#define REQ_STATE_DONE          6
+#define REQ_STATE_COUNT         7
 
 /* Common */
 
@@ -34,19 +36,42 @@
 #define CORS_ALLOWORIGIN_HEADER "access-control-allow-origin"
 #define CORS_EXPOSE_HEADER      "access-control-expose-headers"
 #define CORS_ALLOW_HEADER       "access-control-allow-headers"
+#define CORS_ALLOW_METHODS_HEADER "access-control-allow-methods"
+#define CORS_MAX_AGE_HEADER     "access-control-max-age"
+#define CORS_ALLOW_METHODS      "GET, POST, PUT, PATCH, DELETE, OPTIONS"
+#define CORS_ALLOW_HEADERS      "authorization, content-type, if-match, if-none-match, range, if-range"
+#define RETRY_AFTER_HEADER      "retry-after"
+#define ETAG_HEADER             "etag"
+#define VARY_HEADER             "vary"
+#define IF_MATCH_HEADER         "if-match"
+#define IF_NONE_MATCH_HEADER    "if-none-match"
+#define RANGE_HEADER            "range"
+#define IF_RANGE_HEADER         "if-range"
+#define CONTENT_RANGE_HEADER    "content-range"
+#define ACCEPT_RANGES_HEADER    "accept-ranges"
+
+/* session token grants */
+#define TOKEN_CLIENT_GRANT      "id"
+#define TOKEN_WRITE_GRANT       "w"
 
 #define CONTENT_TYPE_STRING     "text/plain"
 #define CONTENT_TYPE_JSON       "application/json"
 #define CONTENT_TYPE_FORMDATA   "multipart/form-data"
 #define CONTENT_TYPE_BASE64     "application/base64"
+#define CONTENT_TYPE_OCTETS     "application/octet-stream"
 #define CONTENT_TYPE_HTML       "text/html"
+#define CONTENT_TYPE_CBOR       "application/cbor"
+#define CONTENT_TYPE_MSGPACK    "application/msgpack"
+#define CONTENT_TYPE_METRICS    "text/plain; version=0.0.4"
 
 static char    *SERVO_CONTENT_NAMES[] = {
     CONTENT_TYPE_STRING,
     CONTENT_TYPE_JSON,
     CONTENT_TYPE_FORMDATA,
     CONTENT_TYPE_BASE64,
-    CONTENT_TYPE_HTML
+    CONTENT_TYPE_HTML,
+    CONTENT_TYPE_CBOR,
+    CONTENT_TYPE_MSGPACK
 };
 
 #define SERVO_CONTENT_STRING    0
@@ -54,10 +79,45 @@ static char    *SERVO_CONTENT_NAMES[] = {
 #define SERVO_CONTENT_FORMDATA  2
 #define SERVO_CONTENT_BASE64    3
 #define SERVO_CONTENT_HTML      4
+#define SERVO_CONTENT_CBOR      5
+#define SERVO_CONTENT_MSGPACK   6
+#define SERVO_CONTENT_COUNT     7
+
+/* PATCH /key?op= operations */
+#define SERVO_PATCH_NONE        0
+#define SERVO_PATCH_INCR        1
+#define SERVO_PATCH_APPEND      2
+
+/* classes of connection users, scheduled by weight */
+#define SERVO_POOL_READ         0
+#define SERVO_POOL_WRITE        1
+#define SERVO_POOL_BULK         2   /* blob uploads, background work */
+#define SERVO_POOL_CLASSES      3
+
+/* If-Match, If-None-Match preconditions of writes */
+#define SERVO_MATCH_NONE        0
+#define SERVO_MATCH_ANY         1   /* If-Match: *, the item exists */
+#define SERVO_MATCH_VERSION     2   /* If-Match: "n", at version n */
+#define SERVO_MATCH_ABSENT      3   /* If-None-Match: *, no item yet */
+
+/* what a PUT acknowledged before it is written survives */
+#define SERVO_DURABILITY_MEMORY     0   /* nothing, kept in the worker */
+#define SERVO_DURABILITY_JOURNAL    1   /* the worker, written to the journal */
+#define SERVO_DURABILITY_FSYNC      2   /* the host, synced before replying */
 
 struct servo_config {
 
-    char        *database;
+    /* one or more shards */
+    char       **databases;
+    size_t       ndatabases;
+    size_t       shard_vnodes;
+
+    /* read replicas, each serves the database listed above it */
+    char       **replicas;
+    u_int32_t   *replica_shards;
+    size_t       nreplicas;
+    u_int64_t    replica_sticky;
+
     int          public_mode;
     size_t       session_ttl;
     size_t       max_sessions;
@@ -72,9 +132,91 @@ struct servo_config {
 
     /* filtering */
     char         *allow_origin;
-    char         *allow_ipaddr;
+    char         *allow_ipaddr;     /* address ranges, comma separated */
+    char         *allow_ipfile;     /* ranges a line, reloaded on change */
+
+    /* requests a second and at once per worker, 0 disables */
+    size_t        limit_address_rate;
+    size_t        limit_address_burst;
+    size_t        limit_client_rate;
+    size_t        limit_client_burst;
+    size_t        limit_max_buckets;
+
+    /* sec browsers may cache preflights, as header value */
+    size_t        preflight_max_age;
+    char         *preflight_max_age_hdr;
+
+    /* metrics shared between workers */
+    char         *stats_path;
+
+    /* session usage shared between workers, limits of 0 are off */
+    char         *quota_path;
+    size_t        quota_slots;
+    size_t        quota_items;
+    size_t        quota_bytes;
+    u_int64_t     quota_reconcile;
+
+    /* negative lookup filter, off without expected items */
+    char         *bloom_path;
+    size_t        bloom_items;
+    double        bloom_fp_rate;
+
+    /* connection admission */
+    size_t        pool_queue_depth;
+    u_int64_t     pool_wait_timeout;
+    int           pool_retry_after;
+    size_t        pool_weight[SERVO_POOL_CLASSES];
+    size_t        pool_reserve[SERVO_POOL_CLASSES];
+    size_t        pool_reserve_flush;
+
+    /* query time budgets, msec */
+    u_int64_t     timeout_read;
+    u_int64_t     timeout_write;
+    u_int64_t     timeout_blob;
+
+    /* long-poll watches per worker, timeouts in sec */
+    size_t        watch_max;
+    u_int64_t     watch_timeout;
+    u_int64_t     watch_max_timeout;
+
+    /* websocket messages queued per connection */
+    size_t        ws_max_pending;
+
+    /* increments are summed up and written every msec, 0 writes each,
+       for up to max_pending items at a time */
+    u_int64_t     counter_flush;
+    size_t        counter_max;
+
+    /* expired items purged every msec in batches, 0 leaves them */
+    u_int64_t     expire_interval;
+    size_t        expire_batch;
+
+    /* PUTs written behind every msec, 0 writes each, from a journal
+       synced every sync msec, up to max_pending at a time */
+    u_int64_t     writeback_flush;
+    size_t        writeback_max;
+    char         *writeback_journal;
+    int           writeback_durability;
+    u_int64_t     writeback_sync;
+
+    /* item and blob tables unlogged, items under the durable key
+       prefixes copied to a logged table every snapshot msec */
+    int           storage_unlogged;
+    u_int64_t     storage_snapshot;
+    char        **storage_durable;
+    size_t        nstorage_durable;
 };
 
+/* request waiting for a pgsql connection or query with a deadline */
+struct servo_waiter {
+    struct http_request             *req;
+    u_int64_t                        deadline;
+    TAILQ_ENTRY(servo_waiter)        list;
+};
+
+struct servo_flight;
+struct servo_writeback;
+
 /* shared config instance */
 extern struct servo_config *CONFIG;
 
@@ -84,27 +226,115 @@ struct servo_context {
     int                  status;
     char                *err;
 
-    // PgSQL engine
+    // PgSQL engine, shard of the client and the pool picked in it
     struct kore_pgsql    sql;
+    u_int32_t            shard;
+    const char          *dbname;
+    int                  replica;
+
+    // Connection admission
+    struct servo_waiter  waiter;
+    int                  pool_queued;
+    int                  pool_woken;
+    int                  pool_expired;
+    int                  pool_held;
+    int                  pool_class;
+
+    // Query time budget
+    struct servo_waiter  inflight;
+    int                  query_tracked;
+    int                  timed_out;
+
+    // Read shared with identical concurrent reads
+    struct servo_flight *flight;
+    struct servo_waiter  follower;
+    int                  flight_joined;
+    int                  flight_follows;
+    int                  flight_landed;
+
+    // Key filter consulted on read, counted on insert
+    int                  bloom_checked;
+    int                  bloom_added;
 
-    // Client ID and web token
-    char                *client;
+    // Long-poll for the item to change from a version
+    struct servo_waiter  watcher;
+    u_int64_t            watch_version;
+    int                  watch;
+    int                  watch_checked;
+    int                  watch_parked;
+    int                  watch_notified;
+    int                  watch_expired;
+
+    // Item update in place
+    int                  patch_op;
+    int64_t              patch_delta;
+
+    // Item expiry in sec, fixed and pushed back on access, 0 keeps it
+    u_int64_t            ttl;
+    u_int64_t            idle_ttl;
+
+    // Write precondition, PUT creating missing items
+    int                  match;
+    u_int64_t            match_version;
+    int                  upsert;
+    int                  created;
+
+    // Byte range of a blob read, first < 0 counts from the end, len 0
+    // to the end, only while the item is at the If-Range version
+    int                  range;
+    int                  range_checked;
+    int                  range_if;
+    int                  range_partial;
+    int64_t              range_first;
+    int64_t              range_len;
+    u_int64_t            range_version;
+    u_int64_t            range_size;
+
+    // PUT acknowledged before it is written, waiting for the journal
+    // sync, or a request waiting for the key's write to be flushed
+    struct servo_writeback *behind_entry;
+    struct servo_waiter  behind_waiter;
+    int                  behind;
+    int                  behind_checked;
+    int                  behind_parked;
+
+    // Bytes the write adds to the session's usage
+    size_t               quota_size;
+
+    // Client ID, its printable form and web token
+    uuid_t               client_id;
+    char                 client[CLIENT_UUID_LEN];
     jwt_t               *token;
 
+    // Wall clock msec of the last write, carried in the token
+    u_int64_t            last_write;
+
     // in/out content-type
     int                  in_content_type;
     int                  out_content_type;
 
     // Current item data
+    u_int64_t            version;
     char                *val_str;
     json_t              *val_json;
+    char                *val_json_text;     // kept as read for CBOR, MessagePack
     void                *val_bin;
     size_t               val_sz;
+
+    // Timings for metrics, usec
+    u_int64_t            ts_start;
+    u_int64_t            ts_state;
+    u_int64_t            ts_connect;
+    u_int64_t            ts_query;
+    int                  stats_state;
 };
 
 int                      servo_init_context(struct servo_context *);
 int                      servo_read_context_token(struct http_request *);
+int                      servo_load_context_token(struct servo_context *,
+                                                  const char *);
 void                     servo_write_context_token(struct http_request *);
+void                     servo_mark_context_write(struct servo_context *);
 void                     servo_delete_context(struct http_request *);
 
 int                      servo_put_context(struct servo_context *);
@@ -115,6 +345,7 @@ int                      servo_start(struct http_request *);
 int                      servo_render_stats(struct http_request *);
 
 int                      servo_state_init(struct http_request *);
+int                      servo_state_connect(struct http_request *);
 int                      servo_state_query(struct http_request *);
 int                      servo_state_wait(struct http_request *);
 int                      servo_state_read(struct http_request *);
@@ -125,6 +356,7 @@ int                      state_handle_get(struct http_request *);
 int                      state_handle_post(struct http_request *, struct kore_buf *, struct http_file *);
 int                      state_handle_put(struct http_request *, struct kore_buf *, struct http_file *);
 int                      state_handle_delete(struct http_request *);
+int                      state_handle_patch(struct http_request *, struct kore_buf *);
 int                      state_handle_head(struct http_request *);
 
 #endif //_SERVO_H_
@@ -0,0 +1,102 @@
+#include "shard.h"
+#include "util.h"
+
+/*
+ * Sessions are spread over the configured databases by a consistent
+ * hash of the client id. Each database is its own Kore pgsql pool,
+ * and so is each of its read replicas.
+ */
+
+static struct servo_shard   *shards = NULL;
+static size_t                nshards = 0;
+static struct servo_ring     ring;
+
+int
+servo_shard_init(void)
+{
+    char                 name[48];
+    size_t               i;
+    u_int32_t            n;
+    struct servo_shard  *s;
+
+    if (CONFIG->ndatabases == 0) {
+        kore_log(LOG_ERR, "%s: no database configured", __FUNCTION__);
+        return (KORE_RESULT_ERROR);
+    }
+
+    nshards = CONFIG->ndatabases;
+    shards = kore_calloc(nshards, sizeof(struct servo_shard));
+    for (i = 0; i < nshards; i++) {
+        snprintf(name, sizeof(name), "servo-store-%zu", i);
+        shards[i].name = kore_strdup(name);
+        shards[i].database = CONFIG->databases[i];
+        kore_pgsql_register(shards[i].name, shards[i].database);
+    }
+
+    for (i = 0; i < CONFIG->nreplicas; i++) {
+        n = CONFIG->replica_shards[i];
+        s = &shards[n];
+        snprintf(name, sizeof(name), "servo-replica-%u-%zu", n, s->nreplicas);
+        s->replicas = kore_realloc(s->replicas,
+                                   (s->nreplicas + 1) * sizeof(char *));
+        s->replicas[s->nreplicas++] = kore_strdup(name);
+        kore_pgsql_register(name, CONFIG->replicas[i]);
+    }
+
+    if (!servo_ring_build(&ring, nshards, CONFIG->shard_vnodes)) {
+        kore_log(LOG_ERR, "%s: failed to build shard ring", __FUNCTION__);
+        return (KORE_RESULT_ERROR);
+    }
+
+    if (nshards > 1)
+        kore_log(LOG_NOTICE, "  shards: %zu, %zu virtual nodes each",
+                 nshards, CONFIG->shard_vnodes);
+    if (CONFIG->nreplicas > 0)
+        kore_log(LOG_NOTICE, "  replicas: %zu, sticky for %llu ms after writes",
+                 CONFIG->nreplicas,
+                 (unsigned long long)CONFIG->replica_sticky);
+    return (KORE_RESULT_OK);
+}
+
+size_t
+servo_shard_count(void)
+{
+    return nshards;
+}
+
+struct servo_shard *
+servo_shard_get(size_t i)
+{
+    return &shards[i];
+}
+
+u_int32_t
+servo_shard_lookup(const uuid_t client_id)
+{
+    if (nshards == 1)
+        return 0;
+    return servo_ring_lookup(&ring, client_id, sizeof(uuid_t));
+}
+
+/*
+ * Pool name for a shard. Reads are spread round-robin over replicas of
+ * the shard when it has any.
+ */
+const char *
+servo_shard_pool(u_int32_t shard, int readonly, int *replica)
+{
+    struct servo_shard  *s = &shards[shard];
+
+    *replica = readonly && s->nreplicas > 0;
+    if (!*replica)
+        return s->name;
+    return s->replicas[s->next_replica++ % s->nreplicas];
+}
+
+/* Pool name for the client's shard */
+const char *
+servo_shard_dbname(struct servo_context *ctx, int readonly)
+{
+    ctx->shard = servo_shard_lookup(ctx->client_id);
+    return servo_shard_pool(ctx->shard, readonly, &ctx->replica);
+}
@@ -0,0 +1,24 @@
+#ifndef _SERVO_SHARD_H_
+#define _SERVO_SHARD_H_
+
+#include "servo.h"
+#include "ring.h"
+
+/* PostgreSQL node holding a share of sessions, and its replicas */
+struct servo_shard {
+    char            *name;
+    char            *database;
+
+    char           **replicas;
+    size_t           nreplicas;
+    size_t           next_replica;
+};
+
+int                  servo_shard_init(void);
+size_t               servo_shard_count(void);
+struct servo_shard  *servo_shard_get(size_t);
+u_int32_t            servo_shard_lookup(const uuid_t);
+const char          *servo_shard_pool(u_int32_t, int, int *);
+const char          *servo_shard_dbname(struct servo_context *, int);
+
+#endif //_SERVO_SHARD_H_
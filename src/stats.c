@@ -0,0 +1,456 @@
+#include <sys/mman.h>
+#include <fcntl.h>
+
+#include "stats.h"
+#include "bloom.h"
+#include "util.h"
+
+/* per-worker slots in the shared mapping */
+static struct servo_stats   *stats_slots = NULL;
+static size_t                stats_nslots = 0;
+
+/* this worker's slot */
+static struct servo_stats   *STATS = NULL;
+
+#define STATS_SLOTS_EXTRA   2
+
+/* initial size of a Prometheus scrape; kore_buf grows past it */
+#define STATS_SCRAPE_SIZE   4096
+
+u_int64_t
+servo_stats_now(void)
+{
+    struct timespec     ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((u_int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000);
+}
+
+int
+servo_stats_init(const char *path)
+{
+    int          fd;
+    size_t       len, id;
+    struct stat  st;
+
+    /* one slot per worker, ids may start from zero or one */
+    stats_nslots = worker_count + STATS_SLOTS_EXTRA;
+    len = stats_nslots * sizeof(struct servo_stats);
+    id = worker != NULL ? worker->id : 0;
+    if (id >= stats_nslots)
+        id = stats_nslots - 1;
+
+    stats_slots = MAP_FAILED;
+    if (path != NULL) {
+        fd = open(path, O_RDWR | O_CREAT, 0600);
+        if (fd == -1) {
+            kore_log(LOG_ERR, "%s: failed to open '%s': %s",
+                     __FUNCTION__, path, errno_s);
+        }
+        else {
+            if (fstat(fd, &st) == 0 && (size_t)st.st_size < len &&
+                ftruncate(fd, len) == -1) {
+                kore_log(LOG_ERR, "%s: failed to resize '%s': %s",
+                         __FUNCTION__, path, errno_s);
+            }
+            else {
+                stats_slots = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                                   MAP_SHARED, fd, 0);
+            }
+            close(fd);
+        }
+    }
+
+    if (stats_slots == MAP_FAILED) {
+        /* still collect, but metrics will cover this worker only */
+        kore_log(LOG_NOTICE, "metrics are not shared between workers");
+        stats_slots = kore_calloc(stats_nslots, sizeof(struct servo_stats));
+    }
+
+    STATS = &stats_slots[id];
+    memset(STATS, 0, sizeof(struct servo_stats));
+    STATS->size = sizeof(struct servo_stats);
+    STATS->pid = getpid();
+    STATS->started = time(NULL);
+
+    return (KORE_RESULT_OK);
+}
+
+static size_t
+hist_index(u_int64_t v)
+{
+    int          msb, shift;
+    size_t       idx;
+
+    if (v < STATS_HIST_SUB)
+        return (size_t)v;
+
+    msb = 63 - __builtin_clzll(v);
+    shift = msb - STATS_HIST_SUB_BITS;
+    idx = (shift + 1) * STATS_HIST_SUB +
+          ((v >> shift) & (STATS_HIST_SUB - 1));
+
+    if (idx >= STATS_HIST_BUCKETS)
+        idx = STATS_HIST_BUCKETS - 1;
+    return idx;
+}
+
+static u_int64_t
+hist_upper(size_t idx)
+{
+    size_t       shift, sub;
+
+    if (idx < STATS_HIST_SUB)
+        return idx;
+
+    shift = idx / STATS_HIST_SUB - 1;
+    sub = idx % STATS_HIST_SUB;
+    return (((u_int64_t)(STATS_HIST_SUB + sub + 1) << shift) - 1);
+}
+
+static void
+hist_add(struct servo_histogram *h, u_int64_t v)
+{
+    h->count++;
+    h->sum += v;
+    if (v > h->max)
+        h->max = v;
+    h->buckets[hist_index(v)]++;
+}
+
+static void
+hist_merge(struct servo_histogram *dst, const struct servo_histogram *src)
+{
+    size_t       i;
+
+    dst->count += src->count;
+    dst->sum += src->sum;
+    if (src->max > dst->max)
+        dst->max = src->max;
+    for (i = 0; i < STATS_HIST_BUCKETS; i++)
+        dst->buckets[i] += src->buckets[i];
+}
+
+static u_int64_t
+hist_quantile(const struct servo_histogram *h, double q)
+{
+    size_t       i;
+    u_int64_t    rank, seen;
+
+    if (h->count == 0)
+        return 0;
+
+    rank = (u_int64_t)(q * h->count);
+    if (rank >= h->count)
+        rank = h->count - 1;
+
+    seen = 0;
+    for (i = 0; i < STATS_HIST_BUCKETS; i++) {
+        seen += h->buckets[i];
+        if (seen > rank)
+            return MIN(hist_upper(i), h->max);
+    }
+    return h->max;
+}
+
+void
+servo_stats_count(int counter, u_int64_t n)
+{
+    if (STATS == NULL)
+        return;
+    STATS->counters[counter] += n;
+}
+
+void
+servo_stats_bytes_in(int content_type, size_t n)
+{
+    if (STATS == NULL)
+        return;
+    STATS->bytes_in[content_type] += n;
+}
+
+void
+servo_stats_bytes_out(int content_type, size_t n)
+{
+    if (STATS == NULL)
+        return;
+    STATS->bytes_out[content_type] += n;
+}
+
+void
+servo_stats_record(int hist, u_int64_t usec)
+{
+    if (STATS == NULL)
+        return;
+    hist_add(&STATS->hist[hist], usec);
+}
+
+void
+servo_stats_start(struct http_request *req)
+{
+    struct servo_context    *ctx = http_state_get(req);
+
+    ctx->ts_start = servo_stats_now();
+    ctx->ts_state = ctx->ts_start;
+    ctx->stats_state = req->fsm_state;
+    servo_stats_count(STATS_REQUESTS, 1);
+}
+
+void
+servo_stats_enter(struct http_request *req)
+{
+    struct servo_context    *ctx = http_state_get(req);
+    u_int64_t                now;
+
+    /* retries of the same state accumulate into one sample */
+    if (STATS == NULL || ctx->stats_state == req->fsm_state)
+        return;
+
+    now = servo_stats_now();
+    hist_add(&STATS->states[ctx->stats_state], now - ctx->ts_state);
+    ctx->stats_state = req->fsm_state;
+    ctx->ts_state = now;
+}
+
+void
+servo_stats_finish(struct http_request *req)
+{
+    struct servo_context    *ctx = http_state_get(req);
+    u_int64_t                now;
+
+    if (STATS == NULL || ctx->ts_start == 0)
+        return;
+
+    now = servo_stats_now();
+    hist_add(&STATS->states[ctx->stats_state], now - ctx->ts_state);
+    hist_add(&STATS->hist[STATS_HIST_REQUEST], now - ctx->ts_start);
+    if (req->status < STATS_STATUS_MAX)
+        STATS->status[req->status]++;
+    ctx->ts_start = 0;
+}
+
+static void
+stats_aggregate(struct servo_stats *total, int *workers)
+{
+    size_t       i, n;
+    int          j;
+
+    memset(total, 0, sizeof(struct servo_stats));
+    *workers = 0;
+
+    for (i = 0; i < stats_nslots; i++) {
+        const struct servo_stats *s = &stats_slots[i];
+
+        /* empty slot or one left by an older layout */
+        if (s->pid == 0 || s->size != sizeof(struct servo_stats))
+            continue;
+        (*workers)++;
+
+        for (n = 0; n < STATS_COUNTER_COUNT; n++)
+            total->counters[n] += s->counters[n];
+        for (n = 0; n < STATS_STATUS_MAX; n++)
+            total->status[n] += s->status[n];
+        for (j = 0; j < SERVO_CONTENT_COUNT; j++) {
+            total->bytes_in[j] += s->bytes_in[j];
+            total->bytes_out[j] += s->bytes_out[j];
+        }
+        for (j = 0; j < REQ_STATE_COUNT; j++)
+            hist_merge(&total->states[j], &s->states[j]);
+        for (j = 0; j < STATS_HIST_COUNT; j++)
+            hist_merge(&total->hist[j], &s->hist[j]);
+    }
+}
+
+static void
+prom_histogram(struct kore_buf *buf, const char *name,
+               const char *label, const struct servo_histogram *h)
+{
+    size_t       i;
+    u_int64_t    cumulative;
+    const char  *sep;
+
+    sep = label[0] != '\0' ? "," : "";
+    cumulative = 0;
+    for (i = 0; i < STATS_HIST_BUCKETS; i++) {
+        if (h->buckets[i] == 0)
+            continue;
+        cumulative += h->buckets[i];
+        kore_buf_appendf(buf, "%s_bucket{%s%sle=\"%.6f\"} %llu\n",
+                         name, label, sep,
+                         (double)hist_upper(i) / 1000000,
+                         (unsigned long long)cumulative);
+    }
+    kore_buf_appendf(buf, "%s_bucket{%s%sle=\"+Inf\"} %llu\n",
+                     name, label, sep, (unsigned long long)h->count);
+    kore_buf_appendf(buf, "%s_sum{%s} %.6f\n",
+                     name, label, (double)h->sum / 1000000);
+    kore_buf_appendf(buf, "%s_count{%s} %llu\n",
+                     name, label, (unsigned long long)h->count);
+}
+
+static void
+render_prometheus(struct kore_buf *buf, const struct servo_stats *total,
+                  int workers)
+{
+    char         label[64];
+    int          i, ready;
+    u_int64_t    items;
+    double       fp_rate;
+
+    kore_buf_appendf(buf, "# TYPE servo_workers gauge\n");
+    kore_buf_appendf(buf, "servo_workers %d\n", workers);
+
+    if (servo_bloom_estimate(&ready, &items, &fp_rate)) {
+        kore_buf_appendf(buf, "# TYPE servo_bloom_ready gauge\n");
+        kore_buf_appendf(buf, "servo_bloom_ready %d\n", ready);
+        kore_buf_appendf(buf, "# TYPE servo_bloom_items gauge\n");
+        kore_buf_appendf(buf, "servo_bloom_items %llu\n",
+                         (unsigned long long)items);
+        kore_buf_appendf(buf, "# TYPE servo_bloom_false_positive_rate gauge\n");
+        kore_buf_appendf(buf, "servo_bloom_false_positive_rate %.6f\n",
+                         fp_rate);
+    }
+
+    for (i = 0; i < STATS_COUNTER_COUNT; i++) {
+        kore_buf_appendf(buf, "# TYPE servo_%s_total counter\n",
+                         SERVO_COUNTER_NAMES[i]);
+        kore_buf_appendf(buf, "servo_%s_total %llu\n",
+                         SERVO_COUNTER_NAMES[i],
+                         (unsigned long long)total->counters[i]);
+    }
+
+    kore_buf_appendf(buf, "# TYPE servo_responses_total counter\n");
+    for (i = 0; i < STATS_STATUS_MAX; i++) {
+        if (total->status[i] == 0)
+            continue;
+        kore_buf_appendf(buf, "servo_responses_total{code=\"%d\"} %llu\n",
+                         i, (unsigned long long)total->status[i]);
+    }
+
+    kore_buf_appendf(buf, "# TYPE servo_bytes_in_total counter\n");
+    for (i = 0; i < SERVO_CONTENT_COUNT; i++)
+        kore_buf_appendf(buf, "servo_bytes_in_total{type=\"%s\"} %llu\n",
+                         SERVO_CONTENT_NAMES[i],
+                         (unsigned long long)total->bytes_in[i]);
+
+    kore_buf_appendf(buf, "# TYPE servo_bytes_out_total counter\n");
+    for (i = 0; i < SERVO_CONTENT_COUNT; i++)
+        kore_buf_appendf(buf, "servo_bytes_out_total{type=\"%s\"} %llu\n",
+                         SERVO_CONTENT_NAMES[i],
+                         (unsigned long long)total->bytes_out[i]);
+
+    kore_buf_appendf(buf, "# TYPE servo_state_seconds histogram\n");
+    for (i = 0; i < REQ_STATE_COUNT; i++) {
+        snprintf(label, sizeof(label), "state=\"%s\"", servo_state_text(i));
+        prom_histogram(buf, "servo_state_seconds", label, &total->states[i]);
+    }
+
+    for (i = 0; i < STATS_HIST_COUNT; i++) {
+        snprintf(label, sizeof(label), "servo_%s_seconds",
+                 SERVO_HIST_NAMES[i]);
+        kore_buf_appendf(buf, "# TYPE %s histogram\n", label);
+        prom_histogram(buf, label, "", &total->hist[i]);
+    }
+}
+
+static json_t *
+json_histogram(const struct servo_histogram *h)
+{
+    return json_pack("{s:I s:I s:I s:I s:I s:I}",
+                     "count", (json_int_t)h->count,
+                     "sum_us", (json_int_t)h->sum,
+                     "max_us", (json_int_t)h->max,
+                     "p50_us", (json_int_t)hist_quantile(h, 0.50),
+                     "p99_us", (json_int_t)hist_quantile(h, 0.99),
+                     "p999_us", (json_int_t)hist_quantile(h, 0.999));
+}
+
+static json_t *
+render_json(const struct servo_stats *total, int workers)
+{
+    json_t      *root, *obj;
+    char         code[8];
+    int          i, ready;
+    u_int64_t    items;
+    double       fp_rate;
+
+    root = json_object();
+    json_object_set_new(root, "workers", json_integer(workers));
+
+    if (servo_bloom_estimate(&ready, &items, &fp_rate))
+        json_object_set_new(root, "bloom",
+            json_pack("{s:b s:I s:f}",
+                      "ready", ready,
+                      "items", (json_int_t)items,
+                      "false_positive_rate", fp_rate));
+
+    obj = json_object();
+    for (i = 0; i < STATS_COUNTER_COUNT; i++)
+        json_object_set_new(obj, SERVO_COUNTER_NAMES[i],
+                            json_integer(total->counters[i]));
+    json_object_set_new(root, "counters", obj);
+
+    obj = json_object();
+    for (i = 0; i < STATS_STATUS_MAX; i++) {
+        if (total->status[i] == 0)
+            continue;
+        snprintf(code, sizeof(code), "%d", i);
+        json_object_set_new(obj, code, json_integer(total->status[i]));
+    }
+    json_object_set_new(root, "responses", obj);
+
+    obj = json_object();
+    for (i = 0; i < SERVO_CONTENT_COUNT; i++)
+        json_object_set_new(obj, SERVO_CONTENT_NAMES[i],
+            json_pack("{s:I s:I}",
+                      "in", (json_int_t)total->bytes_in[i],
+                      "out", (json_int_t)total->bytes_out[i]));
+    json_object_set_new(root, "bytes", obj);
+
+    obj = json_object();
+    for (i = 0; i < REQ_STATE_COUNT; i++)
+        json_object_set_new(obj, servo_state_text(i),
+                            json_histogram(&total->states[i]));
+    json_object_set_new(root, "states", obj);
+
+    for (i = 0; i < STATS_HIST_COUNT; i++)
+        json_object_set_new(root, SERVO_HIST_NAMES[i],
+                            json_histogram(&total->hist[i]));
+
+    return root;
+}
+
+int
+servo_metrics(struct http_request *req)
+{
+    struct servo_stats  *total;
+    struct kore_buf     *buf;
+    json_t              *data;
+    char                *accept;
+    int                  workers;
+
+    if (!servo_filter_ipaddr(req)) {
+        servo_response_status(req, 403, "Client Access Denied");
+        return (KORE_RESULT_OK);
+    }
+
+    total = kore_malloc(sizeof(struct servo_stats));
+    stats_aggregate(total, &workers);
+
+    if (http_request_header(req, "accept", &accept) &&
+        strstr(accept, CONTENT_TYPE_JSON) != NULL) {
+        data = render_json(total, workers);
+        servo_response_json(req, 200, data);
+        json_decref(data);
+    }
+    else {
+        buf = kore_buf_alloc(STATS_SCRAPE_SIZE);
+        render_prometheus(buf, total, workers);
+        http_response_header(req, CONTENT_TYPE_HEADER, CONTENT_TYPE_METRICS);
+        http_response(req, 200, buf->data, buf->offset);
+        kore_buf_free(buf);
+    }
+
+    kore_free(total);
+    return (KORE_RESULT_OK);
+}
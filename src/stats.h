@@ -0,0 +1,121 @@
+#ifndef _SERVO_STATS_H_
+#define _SERVO_STATS_H_
+
+#include <sys/types.h>
+
+#include <kore/kore.h>
+#include <kore/http.h>
+
+#include "servo.h"
+
+/*
+ * Latency histograms are HDR-style log-linear: every power of two
+ * is split into STATS_HIST_SUB linear buckets, so any recorded value
+ * is off by at most 1/STATS_HIST_SUB. Values are in microseconds.
+ */
+#define STATS_HIST_SUB_BITS     3
+#define STATS_HIST_SUB          (1 << STATS_HIST_SUB_BITS)
+#define STATS_HIST_MAGNITUDES   30
+#define STATS_HIST_BUCKETS      (STATS_HIST_MAGNITUDES * STATS_HIST_SUB)
+
+/* Histograms besides per-state ones */
+#define STATS_HIST_REQUEST      0
+#define STATS_HIST_PG_CONNECT   1
+#define STATS_HIST_PG_QUERY     2
+#define STATS_HIST_COUNT        3
+
+static char    *SERVO_HIST_NAMES[] = {
+    "request",
+    "pgsql_connect_wait",
+    "pgsql_query"
+};
+
+/* Plain counters */
+#define STATS_REQUESTS          0
+#define STATS_PG_RETRIES        1
+#define STATS_PG_ERRORS         2
+#define STATS_CACHE_HITS        3
+#define STATS_CACHE_MISSES      4
+#define STATS_POOL_QUEUED       5
+#define STATS_POOL_REJECTED     6
+#define STATS_QUERY_TIMEOUTS    7
+#define STATS_REPLICA_READS     8
+#define STATS_COALESCED         9
+#define STATS_BLOOM_NEGATIVES   10
+#define STATS_BLOOM_FALSE_POS   11
+#define STATS_WS_MESSAGES       12
+#define STATS_INCR_AGGREGATED   13
+#define STATS_INCR_FLUSHES      14
+#define STATS_ITEMS_EXPIRED     15
+#define STATS_RATE_LIMITED      16
+#define STATS_WRITES_BEHIND     17
+#define STATS_WRITEBACK_FLUSHES 18
+#define STATS_ITEMS_RESTORED    19
+#define STATS_COUNTER_COUNT     20
+
+static char    *SERVO_COUNTER_NAMES[] = {
+    "requests",
+    "pgsql_connect_retries",
+    "pgsql_errors",
+    "cache_hits",
+    "cache_misses",
+    "pgsql_connect_queued",
+    "pgsql_connect_rejected",
+    "pgsql_query_timeouts",
+    "pgsql_replica_reads",
+    "requests_coalesced",
+    "bloom_negatives",
+    "bloom_false_positives",
+    "websocket_messages",
+    "increments_aggregated",
+    "increment_flushes",
+    "items_expired",
+    "requests_rate_limited",
+    "writes_behind",
+    "writeback_flushes",
+    "items_restored"
+};
+
+#define STATS_STATUS_MAX        600
+
+struct servo_histogram {
+    u_int64_t    count;
+    u_int64_t    sum;
+    u_int64_t    max;
+    u_int64_t    buckets[STATS_HIST_BUCKETS];
+};
+
+/*
+ * Per-worker statistics slot. Every worker writes only into its own
+ * slot of the shared mapping, readers sum all slots on scrape, so the
+ * hot path needs neither locks nor atomics.
+ */
+struct servo_stats {
+    size_t                   size;
+    pid_t                    pid;
+    u_int64_t                started;
+
+    u_int64_t                counters[STATS_COUNTER_COUNT];
+    u_int64_t                status[STATS_STATUS_MAX];
+    u_int64_t                bytes_in[SERVO_CONTENT_COUNT];
+    u_int64_t                bytes_out[SERVO_CONTENT_COUNT];
+
+    struct servo_histogram   states[REQ_STATE_COUNT];
+    struct servo_histogram   hist[STATS_HIST_COUNT];
+};
+
+int                  servo_stats_init(const char *);
+u_int64_t            servo_stats_now(void);
+
+void                 servo_stats_count(int, u_int64_t);
+void                 servo_stats_bytes_in(int, size_t);
+void                 servo_stats_bytes_out(int, size_t);
+void                 servo_stats_record(int, u_int64_t);
+
+void                 servo_stats_start(struct http_request *);
+void                 servo_stats_enter(struct http_request *);
+void                 servo_stats_finish(struct http_request *);
+
+int                  servo_metrics(struct http_request *);
+
+#endif //_SERVO_STATS_H_
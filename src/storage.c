@@ -0,0 +1,122 @@
+#include "storage.h"
+#include "job.h"
+#include "pool.h"
+#include "stats.h"
+#include "bloom.h"
+#include "assets.h"
+
+/*
+ * Snapshots of durable items.
+ *
+ * With [storage] unlogged the item and blob tables skip the WAL, see
+ * tools/storage, and a crash of the database empties them. Items under
+ * the durable key prefixes are copied to the logged item_durable table
+ * every snapshot interval, each shard by one worker, see job.c.
+ * The first snapshot after a crash restores the copies instead of
+ * taking the missing items for deletes, writes since the last snapshot
+ * are lost and deletes since then undone. Restored keys go back into
+ * the filter, the quota usage is left to its reconcile.
+ */
+
+static struct servo_job      storage_job;
+static char                 *storage_prefixes;
+static size_t                storage_rows;
+
+static void     storage_timer(void *, u_int64_t);
+static int      storage_send(struct servo_job *);
+static void     storage_read(struct servo_job *);
+static int      storage_done(struct servo_job *, int);
+
+/* array literal of the durable prefixes, quoted */
+static char *
+storage_array(void)
+{
+    struct kore_buf *buf;
+    const char      *p;
+    char            *array;
+    size_t           i;
+
+    buf = kore_buf_alloc(64);
+    kore_buf_append(buf, "{", 1);
+    for (i = 0; i < CONFIG->nstorage_durable; i++) {
+        if (i > 0)
+            kore_buf_append(buf, ",", 1);
+        kore_buf_append(buf, "\"", 1);
+        for (p = CONFIG->storage_durable[i]; *p != '\0'; p++) {
+            if (*p == '"' || *p == '\\')
+                kore_buf_append(buf, "\\", 1);
+            kore_buf_append(buf, p, 1);
+        }
+        kore_buf_append(buf, "\"", 1);
+    }
+    kore_buf_append(buf, "}", 1);
+    array = kore_strdup(kore_buf_stringify(buf, NULL));
+    kore_buf_free(buf);
+    return (array);
+}
+
+void
+servo_storage_init(void)
+{
+    if (!CONFIG->storage_unlogged || CONFIG->storage_snapshot == 0)
+        return;
+
+    storage_prefixes = storage_array();
+    servo_job_init(&storage_job, "snapshot of durable items", SERVO_POOL_BULK,
+                   0, NULL);
+    storage_job.send = storage_send;
+    storage_job.read = storage_read;
+    storage_job.done = storage_done;
+
+    /* a crash is restored from right away */
+    kore_timer_add(storage_timer, 0, NULL, KORE_TIMER_ONESHOT);
+    kore_timer_add(storage_timer, CONFIG->storage_snapshot, NULL, 0);
+}
+
+/* items restored after a crash */
+static void
+storage_read(struct servo_job *job)
+{
+    uuid_t      client_id;
+    int         i, rows;
+
+    rows = kore_pgsql_ntuples(&job->sql);
+    for (i = 0; i < rows; i++) {
+        if (uuid_parse(kore_pgsql_getvalue(&job->sql, i, 0), client_id) != 0)
+            continue;
+        servo_bloom_add(client_id, kore_pgsql_getvalue(&job->sql, i, 1));
+    }
+    storage_rows += rows;
+    servo_stats_count(STATS_ITEMS_RESTORED, rows);
+}
+
+static int
+storage_done(struct servo_job *job, int failed)
+{
+    if (!failed && storage_rows > 0) {
+        kore_log(LOG_NOTICE, "restored %zu durable items in shard %u",
+                 storage_rows, job->shard);
+    }
+    return 0;
+}
+
+static int
+storage_send(struct servo_job *job)
+{
+    storage_rows = 0;
+    return kore_pgsql_query_params(&job->sql,
+                                   (const char *)asset_snapshot_items_sql,
+                                   PGSQL_FORMAT_TEXT,
+                                   1,
+                                   storage_prefixes, strlen(storage_prefixes),
+                                   PGSQL_FORMAT_TEXT);
+}
+
+static void
+storage_timer(void *arg, u_int64_t now)
+{
+    (void)arg;
+    (void)now;
+
+    servo_job_sweep(&storage_job);
+}
@@ -0,0 +1,11 @@
+#ifndef _SERVO_STORAGE_H_
+#define _SERVO_STORAGE_H_
+
+#include <kore/kore.h>
+#include <kore/pgsql.h>
+
+#include "servo.h"
+
+void                 servo_storage_init(void);
+
+#endif //_SERVO_STORAGE_H_
@@ -1,6 +1,9 @@
 #include "util.h"
 #include "assets.h"
 #include "servo.h"
+#include "stats.h"
+#include "ring.h"
+#include "cidr.h"
 #include "ini.h"
 
 char   *servo_config_paths[] = {
@@ -20,9 +23,29 @@ static int servo_read_config_handler(void* user, const char* section, const char
     if (MATCH("servo", "public_mode")) {
         cfg->public_mode = atoi(value);
     } else if (MATCH("servo", "database")) {
-        cfg->database = kore_strdup(value);
+        cfg->databases = kore_realloc(cfg->databases,
+                                      (cfg->ndatabases + 1) * sizeof(char *));
+        cfg->databases[cfg->ndatabases++] = kore_strdup(value);
+    } else if (MATCH("servo", "replica")) {
+        if (cfg->ndatabases == 0) {
+            kore_log(LOG_ERR, "replica \"%s\" must follow its database",
+                              value);
+            return 1;
+        }
+        cfg->replicas = kore_realloc(cfg->replicas,
+                                     (cfg->nreplicas + 1) * sizeof(char *));
+        cfg->replica_shards = kore_realloc(cfg->replica_shards,
+                                     (cfg->nreplicas + 1) * sizeof(u_int32_t));
+        cfg->replicas[cfg->nreplicas] = kore_strdup(value);
+        cfg->replica_shards[cfg->nreplicas++] = cfg->ndatabases - 1;
+    } else if (MATCH("replica", "sticky")) {
+        cfg->replica_sticky = atoi(value);
+    } else if (MATCH("shard", "vnodes")) {
+        cfg->shard_vnodes = atoi(value);
     } else if (MATCH("session", "ttl")) {
         cfg->session_ttl = atoi(value);
+    } else if (MATCH("session", "max_sessions")) {
+        cfg->max_sessions = atoi(value);
     } else if (MATCH("session", "string_size")) {
         cfg->string_size = atoi(value);
     } else if (MATCH("session", "json_size")) {
@@ -31,8 +54,112 @@ static int servo_read_config_handler(void* user, const char* section, const char
         cfg->blob_size = atoi(value);
     } else if (MATCH("filter", "origin")) {
         cfg->allow_origin = kore_strdup(value);
+    } else if (MATCH("filter", "preflight_max_age")) {
+        cfg->preflight_max_age = atoi(value);
+    } else if (MATCH("limit", "address_rate")) {
+        cfg->limit_address_rate = atoi(value);
+    } else if (MATCH("limit", "address_burst")) {
+        cfg->limit_address_burst = atoi(value);
+    } else if (MATCH("limit", "client_rate")) {
+        cfg->limit_client_rate = atoi(value);
+    } else if (MATCH("limit", "client_burst")) {
+        cfg->limit_client_burst = atoi(value);
+    } else if (MATCH("limit", "max_buckets")) {
+        cfg->limit_max_buckets = atoi(value);
+    } else if (MATCH("filter", "ip_file")) {
+        cfg->allow_ipfile = kore_strdup(value);
     } else if (MATCH("filter", "ip_address")) {
         cfg->allow_ipaddr = kore_strdup(value);
+    } else if (MATCH("stats", "path")) {
+        kore_free(cfg->stats_path);
+        cfg->stats_path = strlen(value) > 0 ? kore_strdup(value) : NULL;
+    } else if (MATCH("quota", "path")) {
+        kore_free(cfg->quota_path);
+        cfg->quota_path = strlen(value) > 0 ? kore_strdup(value) : NULL;
+    } else if (MATCH("quota", "sessions")) {
+        cfg->quota_slots = atoi(value);
+    } else if (MATCH("quota", "items")) {
+        cfg->quota_items = atoi(value);
+    } else if (MATCH("quota", "bytes")) {
+        cfg->quota_bytes = atoi(value);
+    } else if (MATCH("quota", "reconcile")) {
+        cfg->quota_reconcile = atoi(value);
+    } else if (MATCH("bloom", "path")) {
+        kore_free(cfg->bloom_path);
+        cfg->bloom_path = strlen(value) > 0 ? kore_strdup(value) : NULL;
+    } else if (MATCH("bloom", "items")) {
+        cfg->bloom_items = atoi(value);
+    } else if (MATCH("bloom", "fp_rate")) {
+        cfg->bloom_fp_rate = atof(value);
+    } else if (MATCH("pool", "queue_depth")) {
+        cfg->pool_queue_depth = atoi(value);
+    } else if (MATCH("pool", "wait_timeout")) {
+        cfg->pool_wait_timeout = atoi(value);
+    } else if (MATCH("pool", "retry_after")) {
+        cfg->pool_retry_after = atoi(value);
+    } else if (MATCH("pool", "weight_read")) {
+        cfg->pool_weight[SERVO_POOL_READ] = atoi(value);
+    } else if (MATCH("pool", "weight_write")) {
+        cfg->pool_weight[SERVO_POOL_WRITE] = atoi(value);
+    } else if (MATCH("pool", "weight_bulk")) {
+        cfg->pool_weight[SERVO_POOL_BULK] = atoi(value);
+    } else if (MATCH("pool", "reserve_read")) {
+        cfg->pool_reserve[SERVO_POOL_READ] = atoi(value);
+    } else if (MATCH("pool", "reserve_write")) {
+        cfg->pool_reserve[SERVO_POOL_WRITE] = atoi(value);
+    } else if (MATCH("pool", "reserve_bulk")) {
+        cfg->pool_reserve[SERVO_POOL_BULK] = atoi(value);
+    } else if (MATCH("pool", "reserve_flush")) {
+        cfg->pool_reserve_flush = atoi(value);
+    } else if (MATCH("timeout", "read")) {
+        cfg->timeout_read = atoi(value);
+    } else if (MATCH("timeout", "write")) {
+        cfg->timeout_write = atoi(value);
+    } else if (MATCH("timeout", "blob")) {
+        cfg->timeout_blob = atoi(value);
+    } else if (MATCH("watch", "max_watchers")) {
+        cfg->watch_max = atoi(value);
+    } else if (MATCH("watch", "timeout")) {
+        cfg->watch_timeout = atoi(value);
+    } else if (MATCH("watch", "max_timeout")) {
+        cfg->watch_max_timeout = atoi(value);
+    } else if (MATCH("websocket", "max_pending")) {
+        cfg->ws_max_pending = atoi(value);
+    } else if (MATCH("counter", "flush")) {
+        cfg->counter_flush = atoi(value);
+    } else if (MATCH("counter", "max_pending")) {
+        cfg->counter_max = atoi(value);
+    } else if (MATCH("writeback", "flush")) {
+        cfg->writeback_flush = atoi(value);
+    } else if (MATCH("writeback", "max_pending")) {
+        cfg->writeback_max = atoi(value);
+    } else if (MATCH("writeback", "journal")) {
+        kore_free(cfg->writeback_journal);
+        cfg->writeback_journal = strlen(value) > 0 ? kore_strdup(value) : NULL;
+    } else if (MATCH("writeback", "durability")) {
+        if (strcmp(value, "memory") == 0)
+            cfg->writeback_durability = SERVO_DURABILITY_MEMORY;
+        else if (strcmp(value, "journal") == 0)
+            cfg->writeback_durability = SERVO_DURABILITY_JOURNAL;
+        else if (strcmp(value, "fsync") == 0)
+            cfg->writeback_durability = SERVO_DURABILITY_FSYNC;
+        else
+            kore_log(LOG_ERR, "unknown durability \"%s\", one of "
+                              "memory, journal or fsync", value);
+    } else if (MATCH("writeback", "sync")) {
+        cfg->writeback_sync = atoi(value);
+    } else if (MATCH("storage", "unlogged")) {
+        cfg->storage_unlogged = atoi(value);
+    } else if (MATCH("storage", "snapshot")) {
+        cfg->storage_snapshot = atoi(value);
+    } else if (MATCH("storage", "durable")) {
+        cfg->storage_durable = kore_realloc(cfg->storage_durable,
+                                            (cfg->nstorage_durable + 1) * sizeof(char *));
+        cfg->storage_durable[cfg->nstorage_durable++] = kore_strdup(value);
+    } else if (MATCH("expire", "interval")) {
+        cfg->expire_interval = atoi(value);
+    } else if (MATCH("expire", "batch")) {
+        cfg->expire_batch = atoi(value);
     } else if (MATCH("auth", "key")) {
         cfg->jwt_key = kore_strdup(value);
         cfg->jwt_key_len = strlen(value);
@@ -169,6 +296,7 @@ void servo_response_json(struct http_request * req,
 
     http_response_header(req, CONTENT_TYPE_HEADER, CONTENT_TYPE_JSON);
     http_response(req, http_code, buf->data, buf->offset);
+    servo_stats_bytes_out(SERVO_CONTENT_JSON, buf->offset);
     kore_buf_free(buf);
     free(json);
 }
@@ -231,6 +359,27 @@ servo_read_body(struct http_request *req)
     return buf;
 }
 
+int
+servo_filter_ipaddr(struct http_request *req)
+{
+    char                     saddr[INET6_ADDRSTRLEN];
+
+    if (servo_cidr_allowed(req->owner))
+        return (KORE_RESULT_OK);
+
+    /* the address is only formatted for the log */
+    memset(saddr, 0, sizeof(saddr));
+    if (req->owner->addrtype == AF_INET) {
+        inet_ntop(AF_INET, &req->owner->addr.ipv4.sin_addr, saddr, sizeof(saddr));
+    }
+    if (req->owner->addrtype == AF_INET6) {
+        inet_ntop(AF_INET6, &req->owner->addr.ipv6.sin6_addr, saddr, sizeof(saddr));
+    }
+    kore_log(LOG_NOTICE, "%s: disallow access - Client IP %s not allowed",
+        __FUNCTION__, saddr);
+    return (KORE_RESULT_ERROR);
+}
+
 int
 servo_is_item_request(struct http_request *req)
 {
@@ -249,6 +398,78 @@ servo_format_date(time_t* epoch)
     return sdate;
 }
 
+/* Hash of a session's item, for per-worker tables of items */
+u_int64_t
+servo_item_hash(const uuid_t client_id, const char *key)
+{
+    return servo_ring_hash(client_id, sizeof(uuid_t)) ^
+           servo_ring_hash(key, strlen(key));
+}
+
+/*
+ * Numeric argument of the query string. Dynamic item routes carry no
+ * Kore validators, so arguments are read from it directly.
+ */
+int
+servo_query_number(struct http_request *req, const char *name, u_int64_t *out)
+{
+    char            *p, *end;
+    size_t           len;
+    u_int64_t        v;
+
+    len = strlen(name);
+    for (p = req->query_string; p != NULL && *p != '\0'; ) {
+        if (strncmp(p, name, len) == 0 && p[len] == '=') {
+            errno = 0;
+            v = strtoull(p + len + 1, &end, 10);
+            if (errno != 0 || end == p + len + 1 ||
+                (*end != '\0' && *end != '&'))
+                return (KORE_RESULT_ERROR);
+            *out = v;
+            return (KORE_RESULT_OK);
+        }
+        if ((p = strchr(p, '&')) != NULL)
+            p++;
+    }
+    return (KORE_RESULT_ERROR);
+}
+
+/* Raw value of a query parameter, no url decoding */
+char *
+servo_query_string(struct http_request *req, const char *name)
+{
+    char            *p, *end, *v;
+    size_t           len;
+
+    len = strlen(name);
+    for (p = req->query_string; p != NULL && *p != '\0'; ) {
+        if (strncmp(p, name, len) == 0 && p[len] == '=') {
+            p += len + 1;
+            if ((end = strchr(p, '&')) == NULL)
+                end = p + strlen(p);
+            if (end == p)
+                return NULL;
+            v = kore_malloc(end - p + 1);
+            memcpy(v, p, end - p);
+            v[end - p] = '\0';
+            return v;
+        }
+        if ((p = strchr(p, '&')) != NULL)
+            p++;
+    }
+    return NULL;
+}
+
+/* Wall clock msec, comparable between workers and hosts */
+u_int64_t
+servo_wallclock_ms(void)
+{
+    struct timespec     ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ((u_int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
 void
 servo_read_content_types(struct http_request *req)
 {
@@ -259,7 +480,11 @@ servo_read_content_types(struct http_request *req)
     ctx = (struct servo_context*)http_state_get(req);
 
     if (http_request_header(req, CONTENT_TYPE_HEADER, &content_type)) {
-        if (strstr(content_type, CONTENT_TYPE_HTML) != NULL)
+        if (strstr(content_type, CONTENT_TYPE_CBOR) != NULL)
+            ctx->in_content_type = SERVO_CONTENT_CBOR;
+        else if (strstr(content_type, CONTENT_TYPE_MSGPACK) != NULL)
+            ctx->in_content_type = SERVO_CONTENT_MSGPACK;
+        else if (strstr(content_type, CONTENT_TYPE_HTML) != NULL)
             ctx->in_content_type = SERVO_CONTENT_HTML;
         else if (strstr(content_type, CONTENT_TYPE_JSON) != NULL)
             ctx->in_content_type = SERVO_CONTENT_JSON;
@@ -271,8 +496,13 @@ servo_read_content_types(struct http_request *req)
             ctx->in_content_type = SERVO_CONTENT_STRING;
     }
 
+    /* binary types first, clients naming them prefer them */
     if (http_request_header(req, "accept", &accept)) {
-        if (strstr(accept, CONTENT_TYPE_HTML) != NULL)
+        if (strstr(accept, CONTENT_TYPE_CBOR) != NULL)
+            ctx->out_content_type = SERVO_CONTENT_CBOR;
+        else if (strstr(accept, CONTENT_TYPE_MSGPACK) != NULL)
+            ctx->out_content_type = SERVO_CONTENT_MSGPACK;
+        else if (strstr(accept, CONTENT_TYPE_HTML) != NULL)
             ctx->out_content_type = SERVO_CONTENT_HTML;
         else if (strstr(accept, CONTENT_TYPE_JSON) != NULL)
             ctx->out_content_type = SERVO_CONTENT_JSON;
@@ -331,6 +561,8 @@ servo_item_to_string(struct servo_context *ctx)
         case SERVO_CONTENT_STRING:
             return ctx->val_str;
         case SERVO_CONTENT_JSON:
+            if (ctx->val_json == NULL)
+                return ctx->val_json_text;
             return json_dumps(ctx->val_json, JSON_INDENT(2));
         case SERVO_CONTENT_FORMDATA:
             kore_base64_encode(ctx->val_bin, ctx->val_sz, &b64);
@@ -345,4 +577,31 @@ servo_item_to_json(struct servo_context *ctx)
 {
     /* FIXME: apply json selectors here */
     return servo_item_to_string(ctx);
+}
+
+/* blob value as stored, from the hex output of bytea */
+void *
+servo_item_to_bytes(struct servo_context *ctx, size_t *len)
+{
+    const char  *hex = ctx->val_bin;
+    u_int8_t    *out;
+    size_t       i;
+    int          hi, lo;
+
+    *len = 0;
+    if (hex == NULL || strncmp(hex, "\\x", 2) != 0)
+        return NULL;
+    hex += 2;
+
+    out = kore_malloc(strlen(hex) / 2 + 1);
+    for (i = 0; isxdigit((unsigned char)hex[0]) &&
+                isxdigit((unsigned char)hex[1]); i++, hex += 2) {
+        hi = isdigit((unsigned char)hex[0]) ? hex[0] - '0'
+                                            : (hex[0] | 0x20) - 'a' + 10;
+        lo = isdigit((unsigned char)hex[1]) ? hex[1] - '0'
+                                            : (hex[1] | 0x20) - 'a' + 10;
+        out[i] = (u_int8_t)(hi << 4 | lo);
+    }
+    *len = i;
+    return out;
 }
\ No newline at end of file
@@ -24,6 +24,7 @@
 int                  servo_read_config(struct servo_config *);
 
 int                  servo_is_item_request(struct http_request *);
+int                  servo_filter_ipaddr(struct http_request *);
 struct kore_buf     *servo_read_body(struct http_request *);
 struct kore_buf     *servo_read_file(struct http_file *);
 void                 servo_read_content_types(struct http_request *);
@@ -39,9 +40,15 @@ void                 servo_handle_pg_error(struct http_request *);
 
 char                 *servo_item_to_string(struct servo_context *);
 char                 *servo_item_to_json(struct servo_context *);
+void                 *servo_item_to_bytes(struct servo_context *, size_t *);
 
 char                 *servo_random_string(char *, size_t);
 char                 *servo_format_date(time_t*);
+u_int64_t             servo_wallclock_ms(void);
+u_int64_t             servo_item_hash(const uuid_t, const char *);
+int                   servo_query_number(struct http_request *, const char *,
+                                         u_int64_t *);
+char                 *servo_query_string(struct http_request *, const char *);
 
 const char           *servo_state_text(int s);
 const char           *sql_state_text(int s);
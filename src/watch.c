@@ -0,0 +1,336 @@
+#include <libpq-fe.h>
+
+#include "watch.h"
+#include "pool.h"
+#include "shard.h"
+#include "util.h"
+
+/*
+ * Long-poll watches of items.
+ *
+ * GET /key?wait=<version>&timeout=<sec> reads the item as usual. When
+ * its version still equals the given one, the request releases its
+ * pgsql connection and sleeps. A trigger notifies every write to an
+ * item, and each worker listens on every shard with a connection of
+ * its own, polled by a timer. A notification wakes the item's watchers
+ * to read it again, a watcher past its timeout wakes up to 304. With
+ * nothing watched the connections are only drained every second, and
+ * once more before the first watch.
+ *
+ * Watchers are registered before their first read, so a write that
+ * commits while the read is in flight marks them instead of being
+ * missed, and they read once more right away.
+ *
+ * Subscriptions are the same without a request: their callback runs
+ * on every notification of the item, until they are removed.
+ */
+
+#define WATCH_BUCKETS           1024
+#define WATCH_TIMER_INTERVAL    20
+#define WATCH_RECONNECT         1000
+#define WATCH_IDLE_INTERVAL     1000
+
+static TAILQ_HEAD(servo_watchers, servo_waiter) watch_buckets[WATCH_BUCKETS];
+static size_t                       watch_count = 0;
+
+static TAILQ_HEAD(servo_watch_subs, servo_watch_sub) watch_subs[WATCH_BUCKETS];
+static size_t                       watch_nsubs = 0;
+
+/* LISTEN connection per shard */
+static PGconn                     **watch_conns = NULL;
+static int                         *watch_listening = NULL;
+static u_int64_t                   *watch_retry = NULL;
+static u_int64_t                    watch_drained = 0;
+
+static void     watch_timer(void *, u_int64_t);
+static void     watch_drain(u_int64_t);
+
+void
+servo_watch_init(void)
+{
+    size_t      i;
+
+    if (CONFIG->watch_max == 0)
+        return;
+
+    for (i = 0; i < WATCH_BUCKETS; i++) {
+        TAILQ_INIT(&watch_buckets[i]);
+        TAILQ_INIT(&watch_subs[i]);
+    }
+
+    watch_conns = kore_calloc(CONFIG->ndatabases, sizeof(PGconn *));
+    watch_listening = kore_calloc(CONFIG->ndatabases, sizeof(int));
+    watch_retry = kore_calloc(CONFIG->ndatabases, sizeof(u_int64_t));
+    kore_timer_add(watch_timer, WATCH_TIMER_INTERVAL, NULL, 0);
+}
+
+static struct servo_watchers *
+watch_bucket(const uuid_t client_id, const char *key)
+{
+    return &watch_buckets[servo_item_hash(client_id, key) % WATCH_BUCKETS];
+}
+
+int
+servo_watch_begin(struct http_request *req)
+{
+    struct servo_context    *ctx = http_state_get(req);
+    u_int64_t                version, timeout;
+
+    if (watch_conns == NULL || !servo_query_number(req, "wait", &version))
+        return (SERVO_WATCH_NONE);
+
+    if (watch_count + watch_nsubs >= CONFIG->watch_max)
+        return (SERVO_WATCH_FULL);
+    if (watch_count + watch_nsubs == 0)
+        watch_drain(kore_time_ms());
+
+    if (!servo_query_number(req, "timeout", &timeout))
+        timeout = CONFIG->watch_timeout;
+    timeout = MIN(timeout, CONFIG->watch_max_timeout);
+
+    ctx->watch = 1;
+    ctx->watch_version = version;
+    ctx->watcher.req = req;
+    ctx->watcher.deadline = kore_time_ms() + timeout * 1000;
+    TAILQ_INSERT_TAIL(watch_bucket(ctx->client_id, req->path),
+                      &ctx->watcher, list);
+    watch_count++;
+
+    kore_log(LOG_DEBUG, "{%s} watching '%s' from version %llu",
+                        ctx->client,
+                        req->path,
+                        (unsigned long long)version);
+    return (SERVO_WATCH_OK);
+}
+
+int
+servo_watch_park(struct http_request *req)
+{
+    struct servo_context    *ctx = http_state_get(req);
+
+    servo_pool_release(req);
+    ctx->ts_connect = 0;
+    req->fsm_state = REQ_STATE_CONNECT;
+
+    /* changed while reading or out of time, no need to sleep */
+    if (ctx->watch_notified || ctx->watch_expired) {
+        ctx->watch_notified = 0;
+        return (HTTP_STATE_CONTINUE);
+    }
+
+    ctx->watch_parked = 1;
+    http_request_sleep(req);
+    return (HTTP_STATE_RETRY);
+}
+
+void
+servo_watch_end(struct http_request *req)
+{
+    struct servo_context    *ctx = http_state_get(req);
+
+    if (!ctx->watch)
+        return;
+
+    TAILQ_REMOVE(watch_bucket(ctx->client_id, req->path),
+                 &ctx->watcher, list);
+    watch_count--;
+    ctx->watch = 0;
+}
+
+int
+servo_watch_subscribe(struct servo_watch_sub *sub)
+{
+    if (watch_conns == NULL || watch_count + watch_nsubs >= CONFIG->watch_max)
+        return (KORE_RESULT_ERROR);
+    if (watch_count + watch_nsubs == 0)
+        watch_drain(kore_time_ms());
+
+    TAILQ_INSERT_TAIL(&watch_subs[servo_item_hash(sub->client_id, sub->key) %
+                                  WATCH_BUCKETS], sub, list);
+    watch_nsubs++;
+    return (KORE_RESULT_OK);
+}
+
+void
+servo_watch_unsubscribe(struct servo_watch_sub *sub)
+{
+    TAILQ_REMOVE(&watch_subs[servo_item_hash(sub->client_id, sub->key) %
+                             WATCH_BUCKETS], sub, list);
+    watch_nsubs--;
+}
+
+static void
+watch_wakeup(struct servo_context *ctx)
+{
+    if (ctx->watch_parked) {
+        ctx->watch_parked = 0;
+        http_request_wakeup(ctx->watcher.req);
+    }
+    else {
+        ctx->watch_notified = 1;
+    }
+}
+
+/* payload is "<client> <key>" */
+static void
+watch_notify(const char *payload)
+{
+    struct servo_waiter     *w;
+    struct servo_watch_sub  *sub;
+    struct servo_context    *ctx;
+    char                     client[CLIENT_UUID_LEN];
+    uuid_t                   client_id;
+    const char              *key;
+    u_int64_t                hash;
+
+    if (strlen(payload) < CLIENT_UUID_LEN ||
+        payload[CLIENT_UUID_LEN - 1] != ' ')
+        return;
+
+    memcpy(client, payload, CLIENT_UUID_LEN - 1);
+    client[CLIENT_UUID_LEN - 1] = '\0';
+    if (uuid_parse(client, client_id) != 0)
+        return;
+    key = payload + CLIENT_UUID_LEN;
+    hash = servo_item_hash(client_id, key);
+
+    TAILQ_FOREACH(w, &watch_buckets[hash % WATCH_BUCKETS], list) {
+        ctx = http_state_get(w->req);
+        if (uuid_compare(ctx->client_id, client_id) == 0 &&
+            strcmp(w->req->path, key) == 0)
+            watch_wakeup(ctx);
+    }
+
+    TAILQ_FOREACH(sub, &watch_subs[hash % WATCH_BUCKETS], list) {
+        if (uuid_compare(sub->client_id, client_id) == 0 &&
+            strcmp(sub->key, key) == 0)
+            sub->notify(sub);
+    }
+}
+
+/* notifications of the shard may have been missed */
+static void
+watch_wakeup_shard(size_t shard)
+{
+    struct servo_waiter     *w;
+    struct servo_watch_sub  *sub;
+    struct servo_context    *ctx;
+    size_t                   i;
+
+    for (i = 0; i < WATCH_BUCKETS; i++) {
+        TAILQ_FOREACH(w, &watch_buckets[i], list) {
+            ctx = http_state_get(w->req);
+            if (ctx->shard == shard)
+                watch_wakeup(ctx);
+        }
+        TAILQ_FOREACH(sub, &watch_subs[i], list) {
+            if (servo_shard_lookup(sub->client_id) == shard)
+                sub->notify(sub);
+        }
+    }
+}
+
+static void
+watch_drop(size_t shard, const char *what)
+{
+    kore_log(LOG_ERR, "watch connection to shard %zu failed to %s: %s",
+             shard, what, PQerrorMessage(watch_conns[shard]));
+    PQfinish(watch_conns[shard]);
+    watch_conns[shard] = NULL;
+    if (watch_listening[shard])
+        watch_wakeup_shard(shard);
+    watch_listening[shard] = 0;
+}
+
+static void
+watch_poll(size_t shard, u_int64_t now)
+{
+    PGconn      *conn;
+    PGresult    *res;
+    PGnotify    *n;
+
+    conn = watch_conns[shard];
+    if (conn == NULL) {
+        if (now < watch_retry[shard])
+            return;
+        watch_retry[shard] = now + WATCH_RECONNECT;
+        if ((conn = PQconnectStart(CONFIG->databases[shard])) == NULL)
+            return;
+        watch_conns[shard] = conn;
+    }
+
+    /* connect without blocking the worker */
+    if (!watch_listening[shard]) {
+        switch (PQconnectPoll(conn)) {
+        case PGRES_POLLING_OK:
+            break;
+        case PGRES_POLLING_FAILED:
+            watch_drop(shard, "connect");
+            return;
+        default:
+            return;
+        }
+        if (!PQsendQuery(conn, "listen " WATCH_CHANNEL)) {
+            watch_drop(shard, "listen");
+            return;
+        }
+        watch_listening[shard] = 1;
+        watch_wakeup_shard(shard);
+    }
+
+    if (!PQconsumeInput(conn)) {
+        watch_drop(shard, "read");
+        return;
+    }
+
+    while (!PQisBusy(conn) && (res = PQgetResult(conn)) != NULL) {
+        if (PQresultStatus(res) != PGRES_COMMAND_OK)
+            kore_log(LOG_ERR, "watch connection to shard %zu: %s",
+                     shard, PQresultErrorMessage(res));
+        PQclear(res);
+    }
+
+    while ((n = PQnotifies(conn)) != NULL) {
+        watch_notify(n->extra);
+        PQfreemem(n);
+    }
+}
+
+/* notifications since the last poll, of every shard */
+static void
+watch_drain(u_int64_t now)
+{
+    size_t      i;
+
+    watch_drained = now;
+    for (i = 0; i < CONFIG->ndatabases; i++)
+        watch_poll(i, now);
+}
+
+static void
+watch_timer(void *arg, u_int64_t now)
+{
+    struct servo_waiter     *w;
+    struct servo_context    *ctx;
+    size_t                   i;
+
+    (void)arg;
+
+    /* nobody to wake, only keep the backlog short */
+    if (watch_count + watch_nsubs > 0 ||
+        now >= watch_drained + WATCH_IDLE_INTERVAL)
+        watch_drain(now);
+
+    if (watch_count == 0)
+        return;
+
+    for (i = 0; i < WATCH_BUCKETS; i++) {
+        TAILQ_FOREACH(w, &watch_buckets[i], list) {
+            ctx = http_state_get(w->req);
+            if (w->deadline > now || ctx->watch_expired)
+                continue;
+            ctx->watch_expired = 1;
+            watch_wakeup(ctx);
+        }
+    }
+}
@@ -0,0 +1,33 @@
+#ifndef _SERVO_WATCH_H_
+#define _SERVO_WATCH_H_
+
+#include <kore/kore.h>
+#include <kore/http.h>
+
+#include "servo.h"
+
+/* channel item writes are notified on, see tools/create-db.sql */
+#define WATCH_CHANNEL           "servo_item"
+
+/* servo_watch_begin results */
+#define SERVO_WATCH_NONE        0
+#define SERVO_WATCH_OK          1
+#define SERVO_WATCH_FULL        2
+
+/* watch of an item outside of a request, see ws.c */
+struct servo_watch_sub {
+    uuid_t                          client_id;
+    char                           *key;
+    void                          (*notify)(struct servo_watch_sub *);
+    void                           *arg;
+    TAILQ_ENTRY(servo_watch_sub)    list;
+};
+
+void                 servo_watch_init(void);
+int                  servo_watch_begin(struct http_request *);
+int                  servo_watch_park(struct http_request *);
+void                 servo_watch_end(struct http_request *);
+int                  servo_watch_subscribe(struct servo_watch_sub *);
+void                 servo_watch_unsubscribe(struct servo_watch_sub *);
+
+#endif //_SERVO_WATCH_H_
@@ -0,0 +1,1264 @@
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <fcntl.h>
+
+#include <libpq-fe.h>
+
+#include "writeback.h"
+#include "job.h"
+#include "pool.h"
+#include "shard.h"
+#include "ring.h"
+#include "stats.h"
+#include "flight.h"
+#include "bloom.h"
+#include "util.h"
+#include "assets.h"
+
+/*
+ * Write behind.
+ *
+ * A PUT ?upsert=1 without preconditions is appended to the worker's
+ * journal, kept in a table of pending writes and answered 202 before
+ * PostgreSQL sees it. Plain PUTs, which must not create the item, wait
+ * for its flush like other writes. Every flush interval the writes of
+ * a shard go out in one statement, servo_put_items(), upserting each
+ * in the order they came.
+ * GETs of the key in the worker are answered from the table, other
+ * requests for it wait for its flush, so a session on one connection
+ * reads its own writes. Past max_pending writes new ones get 503, the
+ * flushes take connections ahead of queued requests to drain them.
+ *
+ * Durability decides what an acknowledged write survives. With memory
+ * there is no journal, journal writes it before replying, fsync waits
+ * for it to reach the disk too, one sync for the writes of a window.
+ * Those only become pending once synced. A failed sync fails them all
+ * and cuts their records off the journal.
+ * A starting worker replays its journal into the databases before the
+ * pools are registered, along with the journals numbered past this
+ * run's workers that no process holds anymore. What they still leave
+ * pending is moved into its own journal. The journal starts over once
+ * nothing is pending, a crash right before may replay a write already
+ * flushed.
+ */
+
+#define WRITEBACK_BUCKETS       256
+#define WRITEBACK_BATCH         500
+#define WRITEBACK_COLUMNS       7
+#define WRITEBACK_ATTEMPTS      3                   /* of a write alone */
+#define WRITEBACK_COMPACT       (64 * 1024 * 1024)  /* journal bytes */
+
+/* journal record, key and value follow */
+struct writeback_record {
+    u_int32_t                        sum;
+    u_int32_t                        key_len;
+    u_int32_t                        value_len;
+    u_int32_t                        type;
+    u_int32_t                        ttl;
+    u_int32_t                        idle_ttl;
+    uuid_t                           client_id;
+};
+
+TAILQ_HEAD(servo_writebacks, servo_writeback);
+
+/* flush in flight of a shard */
+struct writeback_flush {
+    struct servo_job                 job;
+    struct servo_writebacks          batch;
+    int                              single;    /* after a refused batch */
+};
+
+static LIST_HEAD(, servo_writeback)  writeback_buckets[WRITEBACK_BUCKETS];
+static struct servo_writebacks      *writeback_pending = NULL;
+static struct servo_writebacks       writeback_replayed;
+static struct writeback_flush       *writeback_flushes = NULL;
+static struct servo_ring             writeback_ring;
+static size_t                        writeback_count = 0;
+static size_t                        writeback_waiting = 0;
+
+/* journal of the worker, replies waiting for its sync */
+static int                           writeback_fd = -1;
+static char                         *writeback_path = NULL;
+static off_t                         writeback_size = 0;
+static struct servo_writebacks       writeback_unsynced;
+static off_t                         writeback_unsynced_at = 0;
+static size_t                        writeback_nunsynced = 0;
+static int                           writeback_sync_armed = 0;
+
+/* journals of workers gone, held until moved into the worker's own */
+struct writeback_orphan {
+    int                              fd;
+    char                            *path;
+};
+
+static struct writeback_orphan      *writeback_orphans = NULL;
+static size_t                        writeback_norphans = 0;
+
+static void     writeback_flush(void *, u_int64_t);
+static void     writeback_sync(void *, u_int64_t);
+static int      writeback_send(struct servo_job *);
+static void     writeback_read(struct servo_job *);
+static int      writeback_done(struct servo_job *, int);
+
+static u_int32_t
+writeback_shard(const uuid_t client_id)
+{
+    if (CONFIG->ndatabases == 1)
+        return 0;
+    return servo_ring_lookup(&writeback_ring, client_id, sizeof(uuid_t));
+}
+
+/* FNV-1a of a record past its sum */
+static u_int32_t
+writeback_sum(const u_int8_t *p, size_t len)
+{
+    u_int32_t   h = 2166136261U;
+
+    while (len-- > 0) {
+        h ^= *p++;
+        h *= 16777619U;
+    }
+    return h;
+}
+
+/* bytes the value takes in the database, blobs are hex */
+static size_t
+writeback_value_size(const struct servo_writeback *n)
+{
+    if (n->type == SERVO_CONTENT_FORMDATA)
+        return n->len >= 2 ? (n->len - 2) / 2 : 0;
+    return n->len;
+}
+
+/* the newest pending write of a key */
+static struct servo_writeback *
+writeback_lookup(u_int64_t hash, const uuid_t client_id, const char *key)
+{
+    struct servo_writeback  *n;
+
+    LIST_FOREACH(n, &writeback_buckets[hash % WRITEBACK_BUCKETS], list) {
+        if (n->hash == hash &&
+            uuid_compare(n->client_id, client_id) == 0 &&
+            strcmp(n->key, key) == 0)
+            return n;
+    }
+    return NULL;
+}
+
+static struct servo_writeback *
+writeback_insert(const uuid_t client_id, const char *key, int type,
+                 const char *value, size_t len,
+                 u_int64_t ttl, u_int64_t idle_ttl)
+{
+    struct servo_writeback  *n;
+    u_int64_t                hash;
+
+    /* replaces a write not sent yet, a write being sent goes first */
+    hash = servo_item_hash(client_id, key);
+    if ((n = writeback_lookup(hash, client_id, key)) != NULL && !n->sending) {
+        kore_free(n->value);
+    }
+    else {
+        /* the flush may create the item, count it before like inserts do */
+        servo_bloom_add(client_id, key);
+
+        n = kore_calloc(1, sizeof(struct servo_writeback));
+        n->hash = hash;
+        uuid_copy(n->client_id, client_id);
+        n->key = kore_strdup(key);
+        n->shard = writeback_shard(client_id);
+        TAILQ_INIT(&n->waiters);
+        LIST_INSERT_HEAD(&writeback_buckets[hash % WRITEBACK_BUCKETS], n, list);
+        TAILQ_INSERT_TAIL(&writeback_pending[n->shard], n, pending);
+        writeback_count++;
+    }
+
+    n->type = type;
+    n->value = kore_malloc(len + 1);
+    memcpy(n->value, value, len);
+    n->value[len] = '\0';
+    n->len = len;
+
+    /* a PUT without expiry keeps the one given before */
+    if (ttl != 0 || idle_ttl != 0) {
+        n->ttl = ttl;
+        n->idle_ttl = idle_ttl;
+    }
+    return n;
+}
+
+/* out of the table, requests held back for the write go on */
+static void
+writeback_forget(struct servo_writeback *n)
+{
+    struct servo_waiter     *w;
+    struct servo_context    *ctx;
+
+    LIST_REMOVE(n, list);
+    writeback_count--;
+
+    while ((w = TAILQ_FIRST(&n->waiters)) != NULL) {
+        TAILQ_REMOVE(&n->waiters, w, list);
+        writeback_waiting--;
+        ctx = http_state_get(w->req);
+        ctx->behind_entry = NULL;
+        ctx->behind_parked = 0;
+        ctx->behind_checked = 0;
+        http_request_wakeup(w->req);
+    }
+}
+
+static void
+writeback_free(struct servo_writeback *n)
+{
+    kore_free(n->key);
+    kore_free(n->value);
+    kore_free(n);
+}
+
+static void
+writeback_record(struct kore_buf *buf, const uuid_t client_id,
+                 const char *key, int type, const char *value, size_t len,
+                 u_int64_t ttl, u_int64_t idle_ttl)
+{
+    struct writeback_record  rec;
+    size_t                   start;
+
+    memset(&rec, 0, sizeof(rec));
+    rec.key_len = strlen(key);
+    rec.value_len = len;
+    rec.type = type;
+    rec.ttl = ttl;
+    rec.idle_ttl = idle_ttl;
+    uuid_copy(rec.client_id, client_id);
+
+    start = buf->offset;
+    kore_buf_append(buf, &rec, sizeof(rec));
+    kore_buf_append(buf, key, rec.key_len);
+    kore_buf_append(buf, value, len);
+    rec.sum = writeback_sum(buf->data + start + sizeof(rec.sum),
+                            buf->offset - start - sizeof(rec.sum));
+    memcpy(buf->data + start, &rec.sum, sizeof(rec.sum));
+}
+
+static int
+writeback_write(int fd, const u_int8_t *p, size_t len)
+{
+    ssize_t      r;
+
+    while (len > 0) {
+        if ((r = write(fd, p, len)) == -1) {
+            if (errno == EINTR)
+                continue;
+            return (KORE_RESULT_ERROR);
+        }
+        p += r;
+        len -= r;
+    }
+    return (KORE_RESULT_OK);
+}
+
+static int
+writeback_append(struct kore_buf *buf)
+{
+    if (!writeback_write(writeback_fd, buf->data, buf->offset)) {
+        kore_log(LOG_ERR, "%s: failed to write '%s': %s",
+                 __FUNCTION__, writeback_path, errno_s);
+        /* no torn record in front of the next ones */
+        if (ftruncate(writeback_fd, writeback_size) == -1)
+            kore_log(LOG_ERR, "%s: failed to truncate '%s': %s",
+                     __FUNCTION__, writeback_path, errno_s);
+        return (KORE_RESULT_ERROR);
+    }
+    writeback_size += buf->offset;
+    return (KORE_RESULT_OK);
+}
+
+/* the pending writes only, oldest first, in place of the journal */
+static int
+writeback_compact(void)
+{
+    struct servo_writeback  *n;
+    struct kore_buf         *buf;
+    char                     tmp[PATH_MAX];
+    size_t                   i;
+    int                      fd;
+
+    buf = kore_buf_alloc(4096);
+    for (i = 0; i < CONFIG->ndatabases; i++) {
+        TAILQ_FOREACH(n, &writeback_flushes[i].batch, pending)
+            writeback_record(buf, n->client_id, n->key, n->type,
+                             n->value, n->len, n->ttl, n->idle_ttl);
+        TAILQ_FOREACH(n, &writeback_pending[i], pending)
+            writeback_record(buf, n->client_id, n->key, n->type,
+                             n->value, n->len, n->ttl, n->idle_ttl);
+    }
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", writeback_path);
+    fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0600);
+    if (fd == -1 || flock(fd, LOCK_EX) == -1 ||
+        !writeback_write(fd, buf->data, buf->offset) ||
+        fdatasync(fd) == -1 || rename(tmp, writeback_path) == -1) {
+        kore_log(LOG_ERR, "%s: failed to rewrite '%s': %s",
+                 __FUNCTION__, writeback_path, errno_s);
+        if (fd != -1)
+            close(fd);
+        unlink(tmp);
+        kore_buf_free(buf);
+        return (KORE_RESULT_ERROR);
+    }
+
+    kore_log(LOG_NOTICE, "journal %s compacted from %lld to %zu bytes",
+             writeback_path, (long long)writeback_size, buf->offset);
+    close(writeback_fd);
+    writeback_fd = fd;
+    writeback_size = buf->offset;
+    kore_buf_free(buf);
+    return (KORE_RESULT_OK);
+}
+
+/* once nothing is pending the journal starts over */
+static void
+writeback_settle(void)
+{
+    /* records waiting for their sync are in no table yet */
+    if (writeback_fd == -1 || writeback_size == 0 ||
+        !TAILQ_EMPTY(&writeback_unsynced))
+        return;
+
+    if (writeback_count > 0) {
+        /* a sync due covers the old file only */
+        if (writeback_size > WRITEBACK_COMPACT && !writeback_sync_armed)
+            writeback_compact();
+        return;
+    }
+
+    if (ftruncate(writeback_fd, 0) == -1 ||
+        (CONFIG->writeback_durability == SERVO_DURABILITY_FSYNC &&
+         fdatasync(writeback_fd) == -1)) {
+        kore_log(LOG_ERR, "%s: failed to truncate '%s': %s",
+                 __FUNCTION__, writeback_path, errno_s);
+        return;
+    }
+    writeback_size = 0;
+}
+
+/* array literal element, or NULL */
+static void
+writeback_quote(struct kore_buf *buf, const char *sep,
+                const char *value, size_t len)
+{
+    const char  *p, *q, *end;
+
+    if (value == NULL) {
+        kore_buf_appendf(buf, "%sNULL", sep);
+        return;
+    }
+
+    kore_buf_appendf(buf, "%s\"", sep);
+    end = value + len;
+    for (p = value; p < end; p = q + 1) {
+        for (q = p; q < end && *q != '"' && *q != '\\'; q++)
+            ;
+        kore_buf_append(buf, p, q - p);
+        if (q == end)
+            break;
+        kore_buf_append(buf, "\\", 1);
+        kore_buf_append(buf, q, 1);
+    }
+    kore_buf_append(buf, "\"", 1);
+}
+
+static void
+writeback_number(struct kore_buf *buf, const char *sep, u_int64_t value)
+{
+    if (value == 0)
+        kore_buf_appendf(buf, "%sNULL", sep);
+    else
+        kore_buf_appendf(buf, "%s%llu", sep, (unsigned long long)value);
+}
+
+/* next writes of the shard into the batch, a column an array literal */
+static size_t
+writeback_batch(struct writeback_flush *f, struct kore_buf **cols)
+{
+    struct servo_writeback  *n;
+    char                     client[CLIENT_UUID_LEN];
+    const char              *sep;
+    size_t                   i, count, max;
+
+    max = f->single ? 1 : WRITEBACK_BATCH;
+    sep = "{";
+    for (count = 0; count < max &&
+         (n = TAILQ_FIRST(&writeback_pending[f->job.shard])) != NULL; count++) {
+        TAILQ_REMOVE(&writeback_pending[f->job.shard], n, pending);
+        TAILQ_INSERT_TAIL(&f->batch, n, pending);
+        n->sending = 1;
+        n->inserted = 0;
+
+        uuid_unparse(n->client_id, client);
+        kore_buf_appendf(cols[0], "%s%s", sep, client);
+        writeback_quote(cols[1], sep, n->key, strlen(n->key));
+        writeback_quote(cols[2], sep,
+                        n->type == SERVO_CONTENT_STRING ? n->value : NULL,
+                        n->len);
+        writeback_quote(cols[3], sep,
+                        n->type == SERVO_CONTENT_JSON ? n->value : NULL,
+                        n->len);
+        writeback_quote(cols[4], sep,
+                        n->type == SERVO_CONTENT_FORMDATA ? n->value : NULL,
+                        n->len);
+        writeback_number(cols[5], sep, n->ttl);
+        writeback_number(cols[6], sep, n->idle_ttl);
+        sep = ",";
+    }
+    for (i = 0; i < WRITEBACK_COLUMNS; i++)
+        kore_buf_append(cols[i], "}", 2);
+    return count;
+}
+
+/*
+ * A failed batch goes back ahead of later writes. Writes then go out
+ * one at a time until one is stored, and a write the database refused
+ * on its own a few times is dropped, so it holds up no others.
+ */
+static void
+writeback_restore(struct writeback_flush *f, int refused)
+{
+    struct servo_writeback  *n;
+
+    if (refused && f->single && (n = TAILQ_FIRST(&f->batch)) != NULL &&
+        ++n->failures >= WRITEBACK_ATTEMPTS) {
+        kore_log(LOG_ERR, "dropped write behind of '%s', refused %d times",
+                 n->key, n->failures);
+        return;
+    }
+    if (refused)
+        f->single = 1;
+
+    while ((n = TAILQ_LAST(&f->batch, servo_writebacks)) != NULL) {
+        TAILQ_REMOVE(&f->batch, n, pending);
+        n->sending = 0;
+        TAILQ_INSERT_HEAD(&writeback_pending[f->job.shard], n, pending);
+    }
+}
+
+/* a row a write, in the order sent */
+static void
+writeback_read(struct servo_job *job)
+{
+    struct writeback_flush  *f = job->arg;
+    struct servo_writeback  *n;
+    const char              *val;
+    int                      i, rows;
+
+    rows = kore_pgsql_ntuples(&job->sql);
+    n = TAILQ_FIRST(&f->batch);
+    for (i = 0; i < rows && n != NULL; i++, n = TAILQ_NEXT(n, pending)) {
+        val = kore_pgsql_getvalue(&job->sql, i, 3);
+        n->inserted = val != NULL && strcmp(val, "t") == 0;
+        servo_quota_written(n->client_id, &job->sql, i, 3, n->type,
+                            writeback_value_size(n));
+    }
+}
+
+static int
+writeback_done(struct servo_job *job, int failed)
+{
+    struct writeback_flush  *f = job->arg;
+    struct servo_writeback  *n;
+    int                      refused;
+
+    if (failed) {
+        /* by the database, not lost with the connection */
+        refused = job->sql.conn != NULL &&
+                  PQstatus(job->sql.conn->db) == CONNECTION_OK;
+        writeback_restore(f, refused);
+    }
+    else
+        f->single = 0;
+
+    while ((n = TAILQ_FIRST(&f->batch)) != NULL) {
+        TAILQ_REMOVE(&f->batch, n, pending);
+        if (!n->inserted)
+            servo_bloom_undo(n->client_id, n->key);
+        servo_flight_forget(n->client_id, n->key);
+        writeback_forget(n);
+        writeback_free(n);
+    }
+
+    writeback_settle();
+    return 0;
+}
+
+static int
+writeback_send(struct servo_job *job)
+{
+    struct writeback_flush  *f = job->arg;
+    struct kore_buf         *cols[WRITEBACK_COLUMNS];
+    size_t                   i, count;
+    int                      rc;
+
+    for (i = 0; i < WRITEBACK_COLUMNS; i++)
+        cols[i] = kore_buf_alloc(WRITEBACK_BATCH * 32);
+    count = writeback_batch(f, cols);
+
+    rc = kore_pgsql_query_params(&job->sql,
+                                 (const char *)asset_put_items_sql,
+                                 PGSQL_FORMAT_TEXT,
+                                 WRITEBACK_COLUMNS,
+                                 cols[0]->data, cols[0]->offset - 1,
+                                 PGSQL_FORMAT_TEXT,
+                                 cols[1]->data, cols[1]->offset - 1,
+                                 PGSQL_FORMAT_TEXT,
+                                 cols[2]->data, cols[2]->offset - 1,
+                                 PGSQL_FORMAT_TEXT,
+                                 cols[3]->data, cols[3]->offset - 1,
+                                 PGSQL_FORMAT_TEXT,
+                                 cols[4]->data, cols[4]->offset - 1,
+                                 PGSQL_FORMAT_TEXT,
+                                 cols[5]->data, cols[5]->offset - 1,
+                                 PGSQL_FORMAT_TEXT,
+                                 cols[6]->data, cols[6]->offset - 1,
+                                 PGSQL_FORMAT_TEXT);
+    if (rc) {
+        servo_stats_count(STATS_WRITEBACK_FLUSHES, 1);
+        kore_log(LOG_DEBUG, "flushing %zu writes behind to shard %u",
+                 count, job->shard);
+    }
+
+    for (i = 0; i < WRITEBACK_COLUMNS; i++)
+        kore_buf_free(cols[i]);
+    return rc;
+}
+
+/* requests waiting for a write that doesn't go through, as in pool.c */
+static void
+writeback_expire(u_int64_t now)
+{
+    struct servo_writeback  *n;
+    struct servo_waiter     *w, *next;
+    struct servo_context    *ctx;
+    char                     retry_after[16];
+    size_t                   i;
+
+    snprintf(retry_after, sizeof(retry_after), "%d", CONFIG->pool_retry_after);
+    for (i = 0; i < WRITEBACK_BUCKETS; i++) {
+        LIST_FOREACH(n, &writeback_buckets[i], list) {
+            for (w = TAILQ_FIRST(&n->waiters); w != NULL; w = next) {
+                next = TAILQ_NEXT(w, list);
+                if (w->deadline > now)
+                    continue;
+                TAILQ_REMOVE(&n->waiters, w, list);
+                writeback_waiting--;
+                ctx = http_state_get(w->req);
+                ctx->behind_entry = NULL;
+                ctx->behind_parked = 0;
+                ctx->status = 503;
+                http_response_header(w->req, RETRY_AFTER_HEADER, retry_after);
+                w->req->fsm_state = REQ_STATE_ERROR;
+                http_request_wakeup(w->req);
+            }
+        }
+    }
+}
+
+static void
+writeback_flush(void *arg, u_int64_t now)
+{
+    struct writeback_flush  *f;
+    size_t                   i;
+
+    (void)arg;
+
+    if (writeback_waiting > 0)
+        writeback_expire(now);
+
+    for (i = 0; i < CONFIG->ndatabases; i++) {
+        f = &writeback_flushes[i];
+        if (f->job.busy || TAILQ_EMPTY(&writeback_pending[i]))
+            continue;
+        if (!servo_job_start(&f->job))
+            return;
+    }
+}
+
+/* one sync for the writes of the window, then their replies */
+static void
+writeback_sync(void *arg, u_int64_t now)
+{
+    struct servo_writeback  *n;
+    struct servo_context    *ctx;
+    int                      failed;
+
+    (void)arg;
+    (void)now;
+
+    writeback_sync_armed = 0;
+    failed = fdatasync(writeback_fd) == -1;
+    if (failed) {
+        kore_log(LOG_ERR, "%s: failed to sync '%s': %s",
+                 __FUNCTION__, writeback_path, errno_s);
+        /* failed writes are not replayed either */
+        if (ftruncate(writeback_fd, writeback_unsynced_at) == -1)
+            kore_log(LOG_ERR, "%s: failed to truncate '%s': %s",
+                     __FUNCTION__, writeback_path, errno_s);
+        else
+            writeback_size = writeback_unsynced_at;
+    }
+
+    while ((n = TAILQ_FIRST(&writeback_unsynced)) != NULL) {
+        TAILQ_REMOVE(&writeback_unsynced, n, pending);
+        writeback_nunsynced--;
+        if (!failed) {
+            writeback_insert(n->client_id, n->key, n->type, n->value,
+                             n->len, n->ttl, n->idle_ttl);
+        }
+        if (n->syncer != NULL) {
+            ctx = http_state_get(n->syncer);
+            ctx->behind_entry = NULL;
+            ctx->behind_parked = 0;
+            if (failed) {
+                ctx->status = 500;
+                ctx->err = kore_strdup("Failed to sync the journal");
+                n->syncer->fsm_state = REQ_STATE_ERROR;
+            }
+            http_request_wakeup(n->syncer);
+        }
+        writeback_free(n);
+    }
+    writeback_settle();
+}
+
+static int
+writeback_open(void)
+{
+    size_t      len;
+
+    len = strlen(CONFIG->writeback_journal) + 8;
+    writeback_path = kore_malloc(len);
+    snprintf(writeback_path, len, "%s.%u", CONFIG->writeback_journal,
+             (unsigned int)worker->id);
+
+    writeback_fd = open(writeback_path, O_RDWR | O_CREAT | O_APPEND, 0600);
+    if (writeback_fd == -1) {
+        kore_log(LOG_ERR, "%s: failed to open '%s': %s",
+                 __FUNCTION__, writeback_path, errno_s);
+        return (KORE_RESULT_ERROR);
+    }
+    if (flock(writeback_fd, LOCK_EX | LOCK_NB) == -1) {
+        kore_log(LOG_ERR, "%s: failed to lock '%s': %s",
+                 __FUNCTION__, writeback_path, errno_s);
+        close(writeback_fd);
+        writeback_fd = -1;
+        return (KORE_RESULT_ERROR);
+    }
+    return (KORE_RESULT_OK);
+}
+
+/* writes of a former run, up to a record torn by its end */
+static int
+writeback_load(int fd, const char *path, off_t *loaded)
+{
+    struct writeback_record  rec;
+    struct stat              st;
+    u_int8_t                *data;
+    char                     key[ITEM_KEY_MAX + 1];
+    size_t                   off, size, len, count;
+    ssize_t                  r;
+
+    if (fstat(fd, &st) == -1) {
+        kore_log(LOG_ERR, "%s: failed to stat '%s': %s",
+                 __FUNCTION__, path, errno_s);
+        return (KORE_RESULT_ERROR);
+    }
+    if ((size = st.st_size) == 0)
+        return (KORE_RESULT_OK);
+
+    data = kore_malloc(size);
+    for (off = 0; off < size; off += r) {
+        if ((r = pread(fd, data + off, size - off, off)) > 0)
+            continue;
+        if (r == -1 && errno == EINTR) {
+            r = 0;
+            continue;
+        }
+        kore_log(LOG_ERR, "%s: failed to read '%s': %s",
+                 __FUNCTION__, path,
+                 r == 0 ? "short read" : errno_s);
+        kore_free(data);
+        return (KORE_RESULT_ERROR);
+    }
+
+    count = 0;
+    for (off = 0; size - off >= sizeof(rec); off += len) {
+        memcpy(&rec, data + off, sizeof(rec));
+        len = sizeof(rec) + (size_t)rec.key_len + rec.value_len;
+        if (rec.key_len == 0 || rec.key_len > ITEM_KEY_MAX ||
+            rec.type > SERVO_CONTENT_FORMDATA || len > size - off ||
+            writeback_sum(data + off + sizeof(rec.sum),
+                          len - sizeof(rec.sum)) != rec.sum)
+            break;
+
+        memcpy(key, data + off + sizeof(rec), rec.key_len);
+        key[rec.key_len] = '\0';
+        writeback_insert(rec.client_id, key, rec.type,
+                         (const char *)data + off + sizeof(rec) + rec.key_len,
+                         rec.value_len, rec.ttl, rec.idle_ttl);
+        count++;
+    }
+    kore_free(data);
+
+    if (off < size) {
+        kore_log(LOG_NOTICE, "journal %s: dropped %zu bytes of a torn write",
+                 path, size - off);
+        if (ftruncate(fd, off) == -1) {
+            kore_log(LOG_ERR, "%s: failed to truncate '%s': %s",
+                     __FUNCTION__, path, errno_s);
+            return (KORE_RESULT_ERROR);
+        }
+    }
+    *loaded = off;
+
+    kore_log(LOG_NOTICE, "journal %s: replaying %zu writes of %zu items",
+             path, count, writeback_count);
+    return (KORE_RESULT_OK);
+}
+
+/* journals numbered past the workers of this run, their owners gone */
+static void
+writeback_adopt(void)
+{
+    struct writeback_orphan *o;
+    struct dirent           *dp;
+    struct stat              st;
+    DIR                     *dir;
+    char                    *copy, *bname, *end, path[PATH_MAX];
+    const char              *dname;
+    size_t                   blen;
+    unsigned long            id;
+    off_t                    loaded;
+    int                      fd;
+
+    copy = kore_strdup(CONFIG->writeback_journal);
+    if ((bname = strrchr(copy, '/')) != NULL) {
+        *bname++ = '\0';
+        dname = copy[0] != '\0' ? copy : "/";
+    }
+    else {
+        bname = copy;
+        dname = ".";
+    }
+    blen = strlen(bname);
+
+    if ((dir = opendir(dname)) == NULL) {
+        kore_log(LOG_ERR, "%s: failed to open '%s': %s",
+                 __FUNCTION__, dname, errno_s);
+        kore_free(copy);
+        return;
+    }
+
+    while ((dp = readdir(dir)) != NULL) {
+        if (strncmp(dp->d_name, bname, blen) != 0 ||
+            dp->d_name[blen] != '.' || dp->d_name[blen + 1] == '\0')
+            continue;
+        errno = 0;
+        id = strtoul(dp->d_name + blen + 1, &end, 10);
+        if (*end != '\0' || errno != 0 || id < worker_count)
+            continue;
+
+        snprintf(path, sizeof(path), "%s%s", CONFIG->writeback_journal,
+                 dp->d_name + blen);
+        if ((fd = open(path, O_RDWR)) == -1)
+            continue;
+
+        /* held by a live process, or taken and removed by another worker */
+        if (flock(fd, LOCK_EX | LOCK_NB) == -1 || fstat(fd, &st) == -1 ||
+            st.st_nlink == 0 || !writeback_load(fd, path, &loaded)) {
+            close(fd);
+            continue;
+        }
+
+        writeback_orphans = kore_realloc(writeback_orphans,
+            (writeback_norphans + 1) * sizeof(struct writeback_orphan));
+        o = &writeback_orphans[writeback_norphans++];
+        o->fd = fd;
+        o->path = kore_strdup(path);
+    }
+    closedir(dir);
+    kore_free(copy);
+}
+
+/* the writes adopted are replayed or in the worker's journal now */
+static void
+writeback_disown(void)
+{
+    size_t      i;
+    int         moved;
+
+    if (writeback_norphans == 0)
+        return;
+
+    moved = writeback_count == 0 || writeback_compact();
+    for (i = 0; i < writeback_norphans; i++) {
+        if (moved && unlink(writeback_orphans[i].path) == -1) {
+            kore_log(LOG_ERR, "%s: failed to remove '%s': %s",
+                     __FUNCTION__, writeback_orphans[i].path, errno_s);
+        }
+        close(writeback_orphans[i].fd);
+        kore_free(writeback_orphans[i].path);
+    }
+    kore_free(writeback_orphans);
+    writeback_orphans = NULL;
+    writeback_norphans = 0;
+}
+
+/* replayed, the filter and the usage count them once they are there */
+static void
+writeback_replayed_rows(struct writeback_flush *f, PGresult *res)
+{
+    struct servo_writeback  *n;
+    int                      i, j, rows;
+
+    rows = PQntuples(res);
+    n = TAILQ_FIRST(&f->batch);
+    for (i = 0; i < rows && n != NULL; i++, n = TAILQ_NEXT(n, pending)) {
+        n->inserted = strcmp(PQgetvalue(res, i, 3), "t") == 0;
+        n->usage.items = n->inserted;
+        for (j = 0; j < SERVO_QUOTA_TYPES; j++)
+            n->usage.bytes[j] = -strtoll(PQgetvalue(res, i, 4 + j), NULL, 10);
+        if (n->type < SERVO_QUOTA_TYPES)
+            n->usage.bytes[n->type] += writeback_value_size(n);
+    }
+
+    while ((n = TAILQ_FIRST(&f->batch)) != NULL) {
+        TAILQ_REMOVE(&f->batch, n, pending);
+        writeback_forget(n);
+        TAILQ_INSERT_TAIL(&writeback_replayed, n, pending);
+    }
+}
+
+/* synchronously, the pools are not there yet */
+static int
+writeback_replay_shard(u_int32_t shard)
+{
+    struct writeback_flush  *f = &writeback_flushes[shard];
+    struct kore_buf         *cols[WRITEBACK_COLUMNS];
+    const char              *params[WRITEBACK_COLUMNS];
+    PGconn                  *conn;
+    PGresult                *res;
+    size_t                   i;
+    int                      rc;
+
+    conn = PQconnectdb(CONFIG->databases[shard]);
+    if (PQstatus(conn) != CONNECTION_OK) {
+        kore_log(LOG_ERR, "journal %s: failed to connect to shard %u: %s",
+                 writeback_path, shard, PQerrorMessage(conn));
+        PQfinish(conn);
+        return (KORE_RESULT_ERROR);
+    }
+
+    rc = KORE_RESULT_OK;
+    while (rc == KORE_RESULT_OK && !TAILQ_EMPTY(&writeback_pending[shard])) {
+        for (i = 0; i < WRITEBACK_COLUMNS; i++)
+            cols[i] = kore_buf_alloc(WRITEBACK_BATCH * 32);
+        writeback_batch(f, cols);
+        for (i = 0; i < WRITEBACK_COLUMNS; i++)
+            params[i] = (const char *)cols[i]->data;
+
+        res = PQexecParams(conn, (const char *)asset_put_items_sql,
+                           WRITEBACK_COLUMNS, NULL, params, NULL, NULL, 0);
+        if (PQresultStatus(res) != PGRES_TUPLES_OK) {
+            kore_log(LOG_ERR, "journal %s: replay to shard %u failed: %s",
+                     writeback_path, shard, PQresultErrorMessage(res));
+            writeback_restore(f, 0);
+            rc = KORE_RESULT_ERROR;
+        }
+        else
+            writeback_replayed_rows(f, res);
+
+        PQclear(res);
+        for (i = 0; i < WRITEBACK_COLUMNS; i++)
+            kore_buf_free(cols[i]);
+    }
+
+    PQfinish(conn);
+    return rc;
+}
+
+int
+servo_writeback_replay(void)
+{
+    size_t      i;
+
+    /* workers only, each has its journal */
+    if (CONFIG->writeback_flush == 0 || CONFIG->ndatabases == 0 ||
+        worker == NULL)
+        return (KORE_RESULT_OK);
+
+    for (i = 0; i < WRITEBACK_BUCKETS; i++)
+        LIST_INIT(&writeback_buckets[i]);
+    TAILQ_INIT(&writeback_replayed);
+    TAILQ_INIT(&writeback_unsynced);
+
+    writeback_pending = kore_calloc(CONFIG->ndatabases,
+                                    sizeof(struct servo_writebacks));
+    writeback_flushes = kore_calloc(CONFIG->ndatabases,
+                                    sizeof(struct writeback_flush));
+    for (i = 0; i < CONFIG->ndatabases; i++) {
+        TAILQ_INIT(&writeback_pending[i]);
+        TAILQ_INIT(&writeback_flushes[i].batch);
+        servo_job_init(&writeback_flushes[i].job, "flush of writes behind",
+                       SERVO_POOL_WRITE, i, &writeback_flushes[i]);
+        writeback_flushes[i].job.flush = 1;
+        writeback_flushes[i].job.send = writeback_send;
+        writeback_flushes[i].job.read = writeback_read;
+        writeback_flushes[i].job.done = writeback_done;
+    }
+
+    /* placed like servo_shard_lookup() does, before the shards are set up */
+    if (!servo_ring_build(&writeback_ring, CONFIG->ndatabases,
+                          CONFIG->shard_vnodes)) {
+        kore_log(LOG_ERR, "%s: failed to build shard ring", __FUNCTION__);
+        return (KORE_RESULT_ERROR);
+    }
+
+    if (CONFIG->writeback_journal == NULL)
+        CONFIG->writeback_durability = SERVO_DURABILITY_MEMORY;
+    kore_log(LOG_NOTICE, "  write behind: every %llu ms, durability %s",
+             (unsigned long long)CONFIG->writeback_flush,
+             CONFIG->writeback_durability == SERVO_DURABILITY_FSYNC ? "fsync" :
+             CONFIG->writeback_durability == SERVO_DURABILITY_JOURNAL ?
+             "journal" : "memory");
+    if (CONFIG->writeback_durability == SERVO_DURABILITY_MEMORY)
+        return (KORE_RESULT_OK);
+
+    if (!writeback_open() ||
+        !writeback_load(writeback_fd, writeback_path, &writeback_size))
+        return (KORE_RESULT_ERROR);
+    writeback_adopt();
+
+    /* what fails is left to the flushes */
+    for (i = 0; i < CONFIG->ndatabases; i++) {
+        if (!TAILQ_EMPTY(&writeback_pending[i]))
+            writeback_replay_shard(i);
+    }
+    writeback_disown();
+    writeback_settle();
+    return (KORE_RESULT_OK);
+}
+
+void
+servo_writeback_init(void)
+{
+    struct servo_writeback  *n;
+    size_t                   i;
+
+    if (writeback_pending == NULL)
+        return;
+
+    /* replayed before the filter and the usage were there */
+    while ((n = TAILQ_FIRST(&writeback_replayed)) != NULL) {
+        TAILQ_REMOVE(&writeback_replayed, n, pending);
+        if (n->inserted)
+            servo_bloom_add(n->client_id, n->key);
+        servo_quota_add(n->client_id, &n->usage);
+        writeback_free(n);
+    }
+    for (i = 0; i < WRITEBACK_BUCKETS; i++) {
+        LIST_FOREACH(n, &writeback_buckets[i], list)
+            servo_bloom_add(n->client_id, n->key);
+    }
+
+    kore_timer_add(writeback_flush, CONFIG->writeback_flush, NULL, 0);
+}
+
+int
+servo_writeback_enabled(void)
+{
+    return writeback_pending != NULL;
+}
+
+static void
+writeback_park(struct http_request *req, struct servo_writeback *n)
+{
+    struct servo_context    *ctx = http_state_get(req);
+
+    ctx->behind_entry = n;
+    ctx->behind_parked = 1;
+    /* its own write is waited for in the sync, others in their flush */
+    if (n->syncer != req) {
+        ctx->behind_waiter.req = req;
+        ctx->behind_waiter.deadline = kore_time_ms() +
+            CONFIG->pool_wait_timeout + CONFIG->timeout_write;
+        TAILQ_INSERT_TAIL(&n->waiters, &ctx->behind_waiter, list);
+        writeback_waiting++;
+    }
+    http_request_sleep(req);
+}
+
+/*
+ * Requests for a key with a write pending in the worker wait for its
+ * flush, but for plain GETs answered from it and PUTs written behind.
+ */
+int
+servo_writeback_wait(struct http_request *req)
+{
+    struct servo_context    *ctx = http_state_get(req);
+    struct servo_writeback  *n;
+    char                    *value;
+    u_int64_t                version;
+
+    if (writeback_pending == NULL)
+        return 0;
+    if (req->method == HTTP_METHOD_GET &&
+        !http_request_header(req, RANGE_HEADER, &value) &&
+        !servo_query_number(req, "wait", &version))
+        return 0;
+    /* upserts are written behind themselves, in order */
+    if (req->method == HTTP_METHOD_PUT &&
+        servo_query_number(req, "upsert", &version) && version != 0 &&
+        !http_request_header(req, IF_MATCH_HEADER, &value) &&
+        !http_request_header(req, IF_NONE_MATCH_HEADER, &value))
+        return 0;
+
+    n = writeback_lookup(servo_item_hash(ctx->client_id, req->path),
+                         ctx->client_id, req->path);
+    if (n == NULL)
+        return 0;
+
+    kore_log(LOG_DEBUG, "{%s} %s %s waits for the write behind",
+                        ctx->client,
+                        http_method_text(req->method),
+                        req->path);
+    writeback_park(req, n);
+    return 1;
+}
+
+/* the value of the newest write, without version until it is flushed */
+int
+servo_writeback_read(struct http_request *req)
+{
+    struct servo_context    *ctx = http_state_get(req);
+    struct servo_writeback  *n;
+    json_error_t             jerr;
+
+    if (writeback_pending == NULL || req->method != HTTP_METHOD_GET)
+        return 0;
+
+    n = writeback_lookup(servo_item_hash(ctx->client_id, req->path),
+                         ctx->client_id, req->path);
+    if (n == NULL) {
+        servo_stats_count(STATS_CACHE_MISSES, 1);
+        return 0;
+    }
+
+    switch (n->type) {
+    case SERVO_CONTENT_JSON:
+        /* binary replies are encoded from the text, as read */
+        if (ctx->out_content_type == SERVO_CONTENT_CBOR ||
+            ctx->out_content_type == SERVO_CONTENT_MSGPACK)
+            ctx->val_json_text = kore_strdup(n->value);
+        else if ((ctx->val_json = json_loads(n->value, JSON_ALLOW_NUL,
+                                             &jerr)) == NULL)
+            return 0;
+        break;
+    case SERVO_CONTENT_FORMDATA:
+        ctx->val_bin = kore_strdup(n->value);
+        break;
+    default:
+        ctx->val_str = kore_strdup(n->value);
+        break;
+    }
+    ctx->val_sz = n->len;
+    ctx->in_content_type = n->type;
+    ctx->version = 0;
+
+    servo_stats_count(STATS_CACHE_HITS, 1);
+    req->fsm_state = REQ_STATE_DONE;
+    return 1;
+}
+
+/* \x hex of an upload, the input of bytea */
+static char *
+writeback_hex(const u_int8_t *data, size_t len, size_t *out)
+{
+    static const char    digits[] = "0123456789abcdef";
+    char                *hex, *p;
+    size_t               i;
+
+    hex = kore_malloc(len * 2 + 3);
+    p = hex;
+    *p++ = '\\';
+    *p++ = 'x';
+    for (i = 0; i < len; i++) {
+        *p++ = digits[data[i] >> 4];
+        *p++ = digits[data[i] & 0x0f];
+    }
+    *p = '\0';
+    *out = p - hex;
+    return hex;
+}
+
+int
+servo_writeback_put(struct http_request *req, struct kore_buf *body,
+                    struct http_file *file)
+{
+    struct servo_context    *ctx = http_state_get(req);
+    struct servo_writeback  *n;
+    struct kore_buf         *record, *raw;
+    const char              *value;
+    char                    *hex;
+    json_error_t             jerr;
+    json_t                  *json;
+    size_t                   len;
+    int                      rc, need_sync;
+    char                     retry_after[16];
+
+    /* past the cap only writes replacing one not sent yet are taken */
+    if (CONFIG->writeback_max > 0 &&
+        writeback_count + writeback_nunsynced >= CONFIG->writeback_max) {
+        n = writeback_lookup(servo_item_hash(ctx->client_id, req->path),
+                             ctx->client_id, req->path);
+        if (n == NULL || n->sending) {
+            kore_log(LOG_NOTICE, "{%s} %zu writes behind pending, refusing",
+                     ctx->client, writeback_count + writeback_nunsynced);
+            snprintf(retry_after, sizeof(retry_after), "%d",
+                     CONFIG->pool_retry_after);
+            http_response_header(req, RETRY_AFTER_HEADER, retry_after);
+            ctx->status = 503;
+            ctx->err = kore_strdup("Too many writes pending");
+            req->fsm_state = REQ_STATE_ERROR;
+            return (HTTP_STATE_CONTINUE);
+        }
+    }
+
+    hex = NULL;
+    switch (ctx->in_content_type) {
+    case SERVO_CONTENT_JSON:
+        /* refused now, a broken value would fail its whole batch */
+        json = json_loadb((const char *)body->data, body->offset,
+                          JSON_ALLOW_NUL, &jerr);
+        if (json == NULL) {
+            ctx->err = kore_malloc(512);
+            snprintf(ctx->err, 512, "%s at line: %d, column: %d, pos: %d",
+                     jerr.text, jerr.line, jerr.column, jerr.position);
+            kore_log(LOG_ERR, "{%s} broken json - %s", ctx->client, ctx->err);
+            ctx->status = 400;
+            req->fsm_state = REQ_STATE_ERROR;
+            return (HTTP_STATE_CONTINUE);
+        }
+        json_decref(json);
+        value = (const char *)body->data;
+        len = body->offset;
+        break;
+
+    case SERVO_CONTENT_FORMDATA:
+        /* CBOR and MessagePack byte strings are hex already */
+        if (file == NULL) {
+            value = (const char *)body->data;
+            len = body->offset;
+            break;
+        }
+        if ((raw = servo_read_file(file)) == NULL) {
+            kore_log(LOG_ERR, "{%s} failed to read file contents",
+                              ctx->client);
+            ctx->status = 400;
+            req->fsm_state = REQ_STATE_ERROR;
+            return (HTTP_STATE_CONTINUE);
+        }
+        hex = writeback_hex(raw->data, raw->offset, &len);
+        value = hex;
+        kore_buf_free(raw);
+        break;
+
+    default:
+        /* text stops at a NUL, as when written through */
+        value = (const char *)body->data;
+        len = strnlen(value, body->offset);
+        break;
+    }
+
+    need_sync = writeback_fd != -1 &&
+                CONFIG->writeback_durability == SERVO_DURABILITY_FSYNC;
+    if (need_sync && TAILQ_EMPTY(&writeback_unsynced))
+        writeback_unsynced_at = writeback_size;
+
+    if (writeback_fd != -1) {
+        record = kore_buf_alloc(sizeof(struct writeback_record) +
+                                strlen(req->path) + len);
+        writeback_record(record, ctx->client_id, req->path,
+                         ctx->in_content_type, value, len,
+                         ctx->ttl, ctx->idle_ttl);
+        rc = writeback_append(record);
+        kore_buf_free(record);
+        if (!rc) {
+            kore_free(hex);
+            ctx->status = 500;
+            ctx->err = kore_strdup("Failed to write the journal");
+            req->fsm_state = REQ_STATE_ERROR;
+            return (HTTP_STATE_CONTINUE);
+        }
+    }
+
+    servo_stats_count(STATS_WRITES_BEHIND, 1);
+    ctx->val_sz = len;
+    req->fsm_state = REQ_STATE_DONE;
+
+    if (!need_sync) {
+        writeback_insert(ctx->client_id, req->path, ctx->in_content_type,
+                         value, len, ctx->ttl, ctx->idle_ttl);
+        kore_free(hex);
+        kore_log(LOG_DEBUG, "{%s} writing '%s' behind, %zu pending",
+                            ctx->client,
+                            req->path,
+                            writeback_count);
+        return (HTTP_STATE_CONTINUE);
+    }
+
+    /* pending once synced, it may fail until then */
+    n = kore_calloc(1, sizeof(struct servo_writeback));
+    uuid_copy(n->client_id, ctx->client_id);
+    n->key = kore_strdup(req->path);
+    n->type = ctx->in_content_type;
+    n->value = kore_malloc(len + 1);
+    memcpy(n->value, value, len);
+    n->value[len] = '\0';
+    n->len = len;
+    n->ttl = ctx->ttl;
+    n->idle_ttl = ctx->idle_ttl;
+    n->syncer = req;
+    TAILQ_INIT(&n->waiters);
+    TAILQ_INSERT_TAIL(&writeback_unsynced, n, pending);
+    writeback_nunsynced++;
+    kore_free(hex);
+
+    /* replied to after one sync for the writes of the window */
+    if (!writeback_sync_armed) {
+        writeback_sync_armed = 1;
+        kore_timer_add(writeback_sync, CONFIG->writeback_sync, NULL,
+                       KORE_TIMER_ONESHOT);
+    }
+    writeback_park(req, n);
+    return (HTTP_STATE_RETRY);
+}
+
+void
+servo_writeback_end(struct http_request *req)
+{
+    struct servo_context    *ctx = http_state_get(req);
+
+    if (!ctx->behind_parked)
+        return;
+
+    /* a write gone with its request is still synced and kept */
+    if (ctx->behind_entry->syncer == req)
+        ctx->behind_entry->syncer = NULL;
+    else {
+        TAILQ_REMOVE(&ctx->behind_entry->waiters, &ctx->behind_waiter, list);
+        writeback_waiting--;
+    }
+    ctx->behind_entry = NULL;
+    ctx->behind_parked = 0;
+}
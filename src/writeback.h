@@ -0,0 +1,45 @@
+#ifndef _SERVO_WRITEBACK_H_
+#define _SERVO_WRITEBACK_H_
+
+#include <sys/queue.h>
+
+#include <kore/kore.h>
+#include <kore/http.h>
+#include <kore/pgsql.h>
+
+#include "servo.h"
+#include "quota.h"
+
+/* PUT acknowledged and not written yet, the newest of a key first */
+struct servo_writeback {
+    u_int64_t                        hash;
+    uuid_t                           client_id;
+    char                            *key;
+    u_int32_t                        shard;
+    int                              type;      /* STRING, JSON, FORMDATA */
+    char                            *value;     /* blobs as \x hex */
+    size_t                           len;
+    u_int64_t                        ttl;
+    u_int64_t                        idle_ttl;
+    int                              sending;
+    int                              inserted;
+    int                              failures;
+    struct servo_quota_usage         usage;     /* of a write replayed */
+    struct http_request             *syncer;    /* waiting for its sync */
+
+    TAILQ_HEAD(, servo_waiter)       waiters;
+    LIST_ENTRY(servo_writeback)      list;
+    TAILQ_ENTRY(servo_writeback)     pending;
+};
+
+int                  servo_writeback_replay(void);
+void                 servo_writeback_init(void);
+int                  servo_writeback_enabled(void);
+int                  servo_writeback_wait(struct http_request *);
+int                  servo_writeback_read(struct http_request *);
+int                  servo_writeback_put(struct http_request *,
+                                         struct kore_buf *,
+                                         struct http_file *);
+void                 servo_writeback_end(struct http_request *);
+
+#endif //_SERVO_WRITEBACK_H_
@@ -0,0 +1,923 @@
+#include "ws.h"
+#include "pool.h"
+#include "shard.h"
+#include "stats.h"
+#include "flight.h"
+#include "bloom.h"
+#include "util.h"
+#include "origin.h"
+#include "ratelimit.h"
+#include "quota.h"
+#include "assets.h"
+
+/*
+ * Websocket session channel.
+ *
+ * The session is authenticated once, on upgrade, from the usual token
+ * in the Authorization header or in the token query parameter, since
+ * browsers can't set headers on websockets. Every text frame is then a
+ * JSON message for one item of the session:
+ *
+ *   {"id": 1, "op": "get|post|put|delete|watch|unwatch", "key": "/foo",
+ *    "value": ...}
+ *
+ * and is answered with {"id": 1, "status": 200, ...}. Operations of a
+ * connection run one at a time, in order, each with a pgsql connection
+ * of the pool taken for just that query. A watched item pushes
+ * {"event": "change", "key": "/foo", ...} with its new value whenever
+ * it's written.
+ */
+
+#define WS_TIMER_INTERVAL       10
+
+static TAILQ_HEAD(, servo_ws)       ws_waiting;
+static size_t                       ws_nwaiting = 0;
+
+static void     ws_run(struct servo_ws *);
+static void     ws_timer(void *, u_int64_t);
+
+static const char  *ws_op_names[] = {
+    "get", "post", "put", "delete", "watch", "unwatch", NULL
+};
+
+void
+servo_ws_init(void)
+{
+    TAILQ_INIT(&ws_waiting);
+    kore_timer_add(ws_timer, WS_TIMER_INTERVAL, NULL, 0);
+}
+
+static int
+ws_filter(struct http_request *req)
+{
+    const char  *allow;
+
+    if (!servo_origin_check(req, &allow))
+        return (KORE_RESULT_ERROR);
+    return servo_filter_ipaddr(req);
+}
+
+static int
+ws_read_token(struct http_request *req)
+{
+    char    *token;
+    int      rc;
+
+    if (http_request_header(req, AUTH_HEADER, &token))
+        return servo_read_context_token(req);
+
+    if ((token = servo_query_string(req, "token")) == NULL)
+        return (KORE_RESULT_ERROR);
+    rc = servo_load_context_token(http_state_get(req), token);
+    kore_free(token);
+    return rc;
+}
+
+int
+servo_ws_connect(struct http_request *req)
+{
+    struct servo_context    *ctx;
+    struct servo_ws         *ws;
+    char                    *hdr, *token;
+    u_int64_t                retry_after;
+
+    if (!ws_filter(req)) {
+        servo_response_status(req, 403, "Client Access Denied");
+        return (KORE_RESULT_OK);
+    }
+    if (!servo_ratelimit_address(req->owner, &retry_after)) {
+        servo_ratelimit_respond(req, retry_after);
+        return (KORE_RESULT_OK);
+    }
+
+    if (!http_request_header(req, "upgrade", &hdr) ||
+        strcasecmp(hdr, "websocket") != 0 ||
+        !http_request_header(req, "sec-websocket-key", &hdr)) {
+        servo_response_status(req, 400, "Websocket upgrade expected");
+        return (KORE_RESULT_OK);
+    }
+
+    ctx = http_state_create(req, sizeof(struct servo_context));
+    if (!ws_read_token(req) && !servo_init_context(ctx)) {
+        http_state_cleanup(req);
+        servo_response_status(req, 500, http_status_text(500));
+        return (KORE_RESULT_OK);
+    }
+
+    ws = kore_calloc(1, sizeof(struct servo_ws));
+    uuid_copy(ws->client_id, ctx->client_id);
+    memcpy(ws->client, ctx->client, sizeof(ws->client));
+    ws->last_write = ctx->last_write;
+    TAILQ_INIT(&ws->ops);
+    LIST_INIT(&ws->watches);
+
+    token = jwt_encode_str(ctx->token);
+    ws->token = kore_malloc(strlen(AUTH_TYPE_PREFIX) + strlen(token) + 1);
+    sprintf(ws->token, "%s%s", AUTH_TYPE_PREFIX, token);
+    free(token);
+
+    jwt_free(ctx->token);
+    http_state_cleanup(req);
+
+    req->owner->hdlr_extra = ws;
+    kore_websocket_handshake(req, "servo_ws_onconnect",
+                                  "servo_ws_onmessage",
+                                  "servo_ws_ondisconnect");
+    return (KORE_RESULT_OK);
+}
+
+static void
+ws_send(struct servo_ws *ws, json_t *msg)
+{
+    char    *data;
+
+    if (ws->c != NULL && (data = json_dumps(msg, JSON_COMPACT)) != NULL) {
+        kore_websocket_send(ws->c, WEBSOCKET_OP_TEXT, data, strlen(data));
+        servo_stats_bytes_out(SERVO_CONTENT_JSON, strlen(data));
+        free(data);
+    }
+    json_decref(msg);
+}
+
+/* answer to an operation, or a change event for a watched item */
+static json_t *
+ws_message(const struct servo_ws_op *op, int status, const char *err)
+{
+    json_t  *msg;
+
+    msg = json_object();
+    if (op->op == WS_OP_CHANGE) {
+        json_object_set_new(msg, "event", json_string("change"));
+        json_object_set_new(msg, "key", json_string(op->key));
+    }
+    else if (op->id != NULL) {
+        json_object_set(msg, "id", op->id);
+    }
+    json_object_set_new(msg, "status", json_integer(status));
+    if (err != NULL)
+        json_object_set_new(msg, "error", json_string(err));
+    return msg;
+}
+
+static void
+ws_reply(struct servo_ws *ws, const struct servo_ws_op *op, int status,
+         const char *err)
+{
+    ws_send(ws, ws_message(op, status, err));
+}
+
+static void
+ws_op_free(struct servo_ws_op *op)
+{
+    if (op->id != NULL)
+        json_decref(op->id);
+    if (op->value != NULL)
+        json_decref(op->value);
+    kore_free(op->key);
+    kore_free(op);
+}
+
+static void
+ws_dequeue(struct servo_ws *ws, struct servo_ws_op *op)
+{
+    TAILQ_REMOVE(&ws->ops, op, list);
+    ws->nops--;
+}
+
+static void
+ws_enqueue(struct servo_ws *ws, struct servo_ws_op *op)
+{
+    op->queued = kore_time_ms();
+    TAILQ_INSERT_TAIL(&ws->ops, op, list);
+    ws->nops++;
+    ws_run(ws);
+}
+
+static void
+ws_free(struct servo_ws *ws)
+{
+    if (ws->result != NULL)
+        json_decref(ws->result);
+    kore_free(ws->token);
+    kore_free(ws);
+}
+
+static void
+ws_watch_notify(struct servo_watch_sub *sub)
+{
+    struct servo_ws_watch   *w = sub->arg;
+    struct servo_ws_op      *op;
+
+    /* a read of the item still queued will see this write as well */
+    TAILQ_FOREACH(op, &w->ws->ops, list) {
+        if (op->op == WS_OP_CHANGE && strcmp(op->key, sub->key) == 0)
+            return;
+    }
+
+    op = kore_calloc(1, sizeof(struct servo_ws_op));
+    op->op = WS_OP_CHANGE;
+    op->key = kore_strdup(sub->key);
+    ws_enqueue(w->ws, op);
+}
+
+static struct servo_ws_watch *
+ws_watch_lookup(struct servo_ws *ws, const char *key)
+{
+    struct servo_ws_watch   *w;
+
+    LIST_FOREACH(w, &ws->watches, list) {
+        if (strcmp(w->sub.key, key) == 0)
+            return w;
+    }
+    return NULL;
+}
+
+static void
+ws_unwatch(struct servo_ws_watch *w)
+{
+    servo_watch_unsubscribe(&w->sub);
+    LIST_REMOVE(w, list);
+    kore_free(w->sub.key);
+    kore_free(w);
+}
+
+static void
+ws_watch(struct servo_ws *ws, struct servo_ws_op *op)
+{
+    struct servo_ws_watch   *w;
+
+    if ((w = ws_watch_lookup(ws, op->key)) != NULL) {
+        if (op->op == WS_OP_UNWATCH)
+            ws_unwatch(w);
+        ws_reply(ws, op, 200, NULL);
+        return;
+    }
+
+    if (op->op == WS_OP_UNWATCH) {
+        ws_reply(ws, op, 404, "Not watching");
+        return;
+    }
+
+    w = kore_calloc(1, sizeof(struct servo_ws_watch));
+    uuid_copy(w->sub.client_id, ws->client_id);
+    w->sub.key = kore_strdup(op->key);
+    w->sub.notify = ws_watch_notify;
+    w->sub.arg = w;
+    w->ws = ws;
+    if (!servo_watch_subscribe(&w->sub)) {
+        kore_free(w->sub.key);
+        kore_free(w);
+        ws_reply(ws, op, 503, "Too many watches");
+        return;
+    }
+    LIST_INSERT_HEAD(&ws->watches, w, list);
+    ws_reply(ws, op, 200, NULL);
+}
+
+static int
+ws_query(struct servo_ws *ws, struct servo_ws_op *op)
+{
+    const char  *asset, *val_str = NULL;
+    char        *val_json = NULL;
+    char         ttl[24], idle_ttl[24], version[24];
+    int          rc;
+
+    snprintf(version, sizeof(version), "%llu",
+             (unsigned long long)op->match_version);
+    if (op->op == WS_OP_DELETE) {
+        return kore_pgsql_query_params(&ws->sql,
+                                       (const char *)asset_delete_item_sql,
+                                       PGSQL_FORMAT_TEXT,
+                                       3,
+                                       ws->client_id,
+                                       sizeof(ws->client_id),
+                                       PGSQL_FORMAT_BINARY,
+                                       op->key,
+                                       strlen(op->key),
+                                       PGSQL_FORMAT_TEXT,
+                                       op->match ? version : NULL,
+                                       op->match ? strlen(version) : 0,
+                                       PGSQL_FORMAT_TEXT);
+    }
+
+    if (op->op == WS_OP_GET || op->op == WS_OP_CHANGE) {
+        if (ws->replica)
+            asset = (const char *)asset_get_item_ro_sql;
+        else
+            asset = (const char *)asset_get_item_sql;
+        return kore_pgsql_query_params(&ws->sql,
+                                       asset,
+                                       PGSQL_FORMAT_TEXT,
+                                       2,
+                                       ws->client_id,
+                                       sizeof(ws->client_id),
+                                       PGSQL_FORMAT_BINARY,
+                                       op->key,
+                                       strlen(op->key),
+                                       PGSQL_FORMAT_TEXT);
+    }
+
+    /* strings are stored as text, anything else as json */
+    if (json_is_string(op->value))
+        val_str = json_string_value(op->value);
+    else
+        val_json = json_dumps(op->value, JSON_ENCODE_ANY);
+
+    snprintf(ttl, sizeof(ttl), "%llu", (unsigned long long)op->ttl);
+    snprintf(idle_ttl, sizeof(idle_ttl), "%llu",
+             (unsigned long long)op->idle_ttl);
+
+    /* versioned puts take the expected version as 8th argument */
+    if (op->op == WS_OP_POST)
+        asset = (const char *)asset_post_item_sql;
+    else if (op->upsert && !op->match)
+        asset = (const char *)asset_upsert_item_sql;
+    else
+        asset = (const char *)asset_put_item_sql;
+    rc = kore_pgsql_query_params(&ws->sql,
+                                 asset,
+                                 PGSQL_FORMAT_TEXT,
+                                 asset == (const char *)asset_put_item_sql ? 8 : 7,
+                                 ws->client_id,
+                                 sizeof(ws->client_id),
+                                 PGSQL_FORMAT_BINARY,
+                                 op->key,
+                                 strlen(op->key),
+                                 PGSQL_FORMAT_TEXT,
+                                 val_str,
+                                 val_str != NULL ? strlen(val_str) : 0,
+                                 PGSQL_FORMAT_TEXT,
+                                 val_json,
+                                 val_json != NULL ? strlen(val_json) : 0,
+                                 PGSQL_FORMAT_TEXT,
+                                 NULL, 0,
+                                 PGSQL_FORMAT_TEXT,
+                                 op->ttl != 0 ? ttl : NULL,
+                                 op->ttl != 0 ? strlen(ttl) : 0,
+                                 PGSQL_FORMAT_TEXT,
+                                 op->idle_ttl != 0 ? idle_ttl : NULL,
+                                 op->idle_ttl != 0 ? strlen(idle_ttl) : 0,
+                                 PGSQL_FORMAT_TEXT,
+                                 op->match ? version : NULL,
+                                 op->match ? strlen(version) : 0,
+                                 PGSQL_FORMAT_TEXT);
+    free(val_json);
+    return rc;
+}
+
+/* reads queue with reads for a connection, anything else with writes */
+static int
+ws_pool_class(const struct servo_ws_op *op)
+{
+    if (op->op == WS_OP_GET || op->op == WS_OP_CHANGE)
+        return (SERVO_POOL_READ);
+    return (SERVO_POOL_WRITE);
+}
+
+/* item row of get_item.sql into the value sent to the client */
+static void
+ws_read(struct servo_ws *ws)
+{
+    struct servo_ws_op  *op = ws->op;
+    json_error_t         jerr;
+    char                *val, *b64;
+    int                  i, rows;
+
+    rows = kore_pgsql_ntuples(&ws->sql);
+    if (op->op == WS_OP_DELETE) {
+        if (rows == 0 && op->match)
+            ws->status = 412;
+        for (i = 0; i < rows; i++) {
+            servo_bloom_remove(ws->client_id, op->key);
+            servo_quota_deleted(ws->client_id, &ws->sql, i, 1);
+        }
+        return;
+    }
+
+    /* writes return the new version, nothing when they didn't apply */
+    if (op->op == WS_OP_POST || op->op == WS_OP_PUT) {
+        if (rows == 0) {
+            if (op->match)
+                ws->status = 412;
+            else
+                ws->status = op->op == WS_OP_POST ? 409 : 404;
+            return;
+        }
+        val = kore_pgsql_getvalue(&ws->sql, 0, 0);
+        if (val != NULL)
+            ws->version = strtoull(val, NULL, 10);
+        /* an item that was there, expired or not, had its key in the filter */
+        if (op->bloom_added) {
+            val = kore_pgsql_getvalue(&ws->sql, 0, 1);
+            if (val == NULL || strcmp(val, "t") != 0) {
+                servo_bloom_undo(ws->client_id, op->key);
+                op->bloom_added = 0;
+            }
+        }
+        servo_quota_written(ws->client_id, &ws->sql, 0, 1,
+                            json_is_string(op->value) ? SERVO_CONTENT_STRING
+                                                      : SERVO_CONTENT_JSON,
+                            op->size);
+        return;
+    }
+    if (op->op != WS_OP_GET && op->op != WS_OP_CHANGE)
+        return;
+
+    if (rows != 1) {
+        ws->status = rows == 0 ? 404 : 500;
+        return;
+    }
+
+    val = kore_pgsql_getvalue(&ws->sql, 0, 0);
+    if (val != NULL && strlen(val) > 0)
+        ws->result = json_string(val);
+
+    val = kore_pgsql_getvalue(&ws->sql, 0, 1);
+    if (val != NULL && strlen(val) > 0) {
+        ws->result = json_loads(val, JSON_ALLOW_NUL, &jerr);
+        if (ws->result == NULL) {
+            kore_log(LOG_ERR, "{%s} malformed json read from database for key '%s'",
+                              ws->client,
+                              op->key);
+            ws->status = 500;
+        }
+    }
+
+    val = kore_pgsql_getvalue(&ws->sql, 0, 2);
+    if (val != NULL && strlen(val) > 0 &&
+        kore_base64_encode(val, strlen(val), &b64)) {
+        ws->result = json_string(b64);
+        kore_free(b64);
+    }
+
+    val = kore_pgsql_getvalue(&ws->sql, 0, 3);
+    if (val != NULL)
+        ws->version = strtoull(val, NULL, 10);
+}
+
+/* send the result of the operation in flight and release its connection */
+static void
+ws_finish(struct servo_ws *ws)
+{
+    struct servo_ws_op  *op = ws->op;
+    json_t              *msg;
+
+    if (ws->sql.state == KORE_PGSQL_STATE_ERROR) {
+        servo_stats_count(STATS_PG_ERRORS, 1);
+        kore_log(LOG_ERR, "{%s} websocket %s '%s' failed: %s",
+                          ws->client,
+                          op->op == WS_OP_CHANGE ? "read" : ws_op_names[op->op],
+                          op->key,
+                          ws->sql.error);
+        ws->status = 500;
+        if (strstr(ws->sql.error, "duplicate key value violates unique constraint") != NULL)
+            ws->status = 409;
+    }
+
+    /* insert definitely failed, take its key back out of the filter */
+    if (op->bloom_added && ws->status >= 400 && ws->status < 500)
+        servo_bloom_undo(ws->client_id, op->key);
+
+    if (ws->status == 404 && op->op == WS_OP_GET && servo_bloom_ready())
+        servo_stats_count(STATS_BLOOM_FALSE_POS, 1);
+
+    msg = ws_message(op, ws->status,
+                     ws->sql.state == KORE_PGSQL_STATE_ERROR ? ws->sql.error
+                                                             : NULL);
+    if (ws->status == 200 && ws->result != NULL) {
+        json_object_set_new(msg, "version", json_integer(ws->version));
+        json_object_set(msg, "value", ws->result);
+    }
+    else if (ws->status == 200 && ws->version != 0) {
+        json_object_set_new(msg, "version", json_integer(ws->version));
+    }
+    ws_send(ws, msg);
+
+    kore_pgsql_cleanup(&ws->sql);
+    servo_pool_give(ws_pool_class(op));
+    if (ws->result != NULL)
+        json_decref(ws->result);
+    ws->result = NULL;
+    ws->op = NULL;
+    ws_op_free(op);
+}
+
+static void
+ws_complete(void *arg, u_int64_t now)
+{
+    struct servo_ws     *ws = arg;
+
+    (void)now;
+
+    ws->completing = 0;
+    ws_finish(ws);
+    if (ws->c == NULL) {
+        ws_free(ws);
+        return;
+    }
+    ws_run(ws);
+}
+
+/*
+ * Runs inside of the Kore pgsql handler. The operation is finished
+ * outside of it, on the next turn of the event loop, like a woken up
+ * request would be.
+ */
+static void
+ws_pgsql_result(struct kore_pgsql *sql, void *arg)
+{
+    struct servo_ws     *ws = arg;
+
+    switch (sql->state) {
+    case KORE_PGSQL_STATE_WAIT:
+        break;
+    case KORE_PGSQL_STATE_RESULT:
+        ws_read(ws);
+        kore_pgsql_continue(sql);
+        break;
+    case KORE_PGSQL_STATE_ERROR:
+    case KORE_PGSQL_STATE_COMPLETE:
+        break;
+    default:
+        kore_pgsql_continue(sql);
+        break;
+    }
+
+    if (!ws->completing && (sql->state == KORE_PGSQL_STATE_ERROR ||
+                            sql->state == KORE_PGSQL_STATE_COMPLETE)) {
+        ws->completing = 1;
+        kore_timer_add(ws_complete, 0, ws, KORE_TIMER_ONESHOT);
+    }
+}
+
+/* wait for a connection, retried by the timer */
+static void
+ws_park(struct servo_ws *ws)
+{
+    if (ws->waiting)
+        return;
+    TAILQ_INSERT_TAIL(&ws_waiting, ws, list);
+    ws_nwaiting++;
+    ws->waiting = 1;
+}
+
+static void
+ws_unpark(struct servo_ws *ws)
+{
+    if (!ws->waiting)
+        return;
+    TAILQ_REMOVE(&ws_waiting, ws, list);
+    ws_nwaiting--;
+    ws->waiting = 0;
+}
+
+static int
+ws_connect(struct servo_ws *ws, struct servo_ws_op *op)
+{
+    const char  *dbname;
+    int          readonly;
+
+    /* watched items are read from the primary, notifications come from it */
+    readonly = op->op == WS_OP_GET &&
+               ws->last_write + CONFIG->replica_sticky <= servo_wallclock_ms();
+    dbname = servo_shard_pool(servo_shard_lookup(ws->client_id), readonly,
+                              &ws->replica);
+
+    kore_pgsql_init(&ws->sql);
+    kore_pgsql_bind_callback(&ws->sql, ws_pgsql_result, ws);
+    if (!kore_pgsql_setup(&ws->sql, dbname, KORE_PGSQL_ASYNC)) {
+        if (ws->sql.state == KORE_PGSQL_STATE_INIT) {
+            /* connections are busy outside of servo accounting */
+            kore_pgsql_cleanup(&ws->sql);
+            return (SERVO_POOL_WAIT);
+        }
+        kore_pgsql_logerror(&ws->sql);
+        kore_pgsql_cleanup(&ws->sql);
+        return (SERVO_POOL_ERROR);
+    }
+    if (ws->replica)
+        servo_stats_count(STATS_REPLICA_READS, 1);
+    return (SERVO_POOL_OK);
+}
+
+static void
+ws_run(struct servo_ws *ws)
+{
+    struct servo_ws_op  *op;
+
+    while (ws->op == NULL && (op = TAILQ_FIRST(&ws->ops)) != NULL) {
+        /* definite miss, no need to ask the database */
+        if (op->op == WS_OP_GET &&
+            !servo_bloom_maybe(ws->client_id, op->key)) {
+            servo_stats_count(STATS_BLOOM_NEGATIVES, 1);
+            ws_dequeue(ws, op);
+            ws_reply(ws, op, 404, NULL);
+            ws_op_free(op);
+            continue;
+        }
+
+        if (kore_time_ms() - op->queued > CONFIG->pool_wait_timeout) {
+            kore_log(LOG_NOTICE, "{%s} gave up waiting for connection",
+                     ws->client);
+            servo_stats_count(STATS_POOL_REJECTED, 1);
+            ws_dequeue(ws, op);
+            ws_reply(ws, op, 503, "Database is busy");
+            ws_op_free(op);
+            continue;
+        }
+
+        if (!servo_pool_take(ws_pool_class(op))) {
+            ws_park(ws);
+            return;
+        }
+
+        switch (ws_connect(ws, op)) {
+        case SERVO_POOL_WAIT:
+            servo_pool_give(ws_pool_class(op));
+            ws_park(ws);
+            return;
+        case SERVO_POOL_ERROR:
+            servo_pool_give(ws_pool_class(op));
+            ws_dequeue(ws, op);
+            ws_reply(ws, op, 500, "Database connection failed");
+            ws_op_free(op);
+            continue;
+        }
+        ws_unpark(ws);
+        ws_dequeue(ws, op);
+
+        if (op->op == WS_OP_POST || op->op == WS_OP_PUT ||
+            op->op == WS_OP_DELETE) {
+            ws->last_write = servo_wallclock_ms();
+            servo_flight_forget(ws->client_id, op->key);
+        }
+        if (op->op == WS_OP_POST ||
+            (op->op == WS_OP_PUT && op->upsert && !op->match)) {
+            servo_bloom_add(ws->client_id, op->key);
+            op->bloom_added = 1;
+        }
+
+        ws->op = op;
+        ws->status = 200;
+        ws->version = 0;
+        if (!ws_query(ws, op)) {
+            ws_finish(ws);
+            continue;
+        }
+    }
+}
+
+static void
+ws_timer(void *arg, u_int64_t now)
+{
+    struct servo_ws     *ws;
+    size_t               n;
+
+    (void)arg;
+    (void)now;
+
+    /* the ones still without a connection go back to the tail */
+    for (n = ws_nwaiting; n > 0; n--) {
+        ws = TAILQ_FIRST(&ws_waiting);
+        ws_unpark(ws);
+        ws_run(ws);
+    }
+}
+
+void
+servo_ws_onconnect(struct connection *c)
+{
+    struct servo_ws     *ws = c->hdlr_extra;
+    json_t              *msg;
+
+    ws->c = c;
+    kore_log(LOG_NOTICE, "{%s} >> websocket session", ws->client);
+
+    msg = json_pack("{s:s s:s s:s}",
+                    "event",  "session",
+                    "client", ws->client,
+                    "token",  ws->token);
+    ws_send(ws, msg);
+}
+
+static int
+ws_valid_key(const char *key)
+{
+    const char  *p;
+
+    if (key == NULL || key[0] != '/' || strlen(key) > ITEM_KEY_MAX ||
+        strcmp(key, ROOT_PATH) == 0 || strcmp(key, CONSOLE_JS_PATH) == 0)
+        return 0;
+
+    /* same keys as the item route takes */
+    for (p = key; *p != '\0'; p++) {
+        if (!isalnum((unsigned char)*p) && strchr("/_-", *p) == NULL)
+            return 0;
+    }
+    return 1;
+}
+
+/* status to answer a bad value with, 0 when fine */
+static int
+ws_check_value(const json_t *value, size_t *size, const char **err)
+{
+    char    *data;
+    size_t   len, limit;
+
+    if (value == NULL) {
+        *err = "No value given";
+        return 400;
+    }
+
+    /* text or json items, like the Content-Type of requests tells */
+    if (json_is_string(value)) {
+        len = strlen(json_string_value(value));
+        limit = CONFIG->string_size;
+    }
+    else if (json_is_object(value) || json_is_array(value)) {
+        data = json_dumps(value, JSON_ENCODE_ANY);
+        len = data != NULL ? strlen(data) : 0;
+        limit = CONFIG->json_size;
+        free(data);
+    }
+    else {
+        *err = "Value must be a string, object or array";
+        return 400;
+    }
+
+    if (len > limit) {
+        *err = "Request is too large";
+        return 403;
+    }
+    *size = len;
+    return 0;
+}
+
+/* optional "version" a put or delete expects, like If-Match */
+static int
+ws_check_version(const json_t *value, struct servo_ws_op *op)
+{
+    json_int_t  v;
+
+    if (value == NULL)
+        return (KORE_RESULT_OK);
+    if (!json_is_integer(value) || (v = json_integer_value(value)) < 0)
+        return (KORE_RESULT_ERROR);
+    op->match = 1;
+    op->match_version = (u_int64_t)v;
+    return (KORE_RESULT_OK);
+}
+
+/* optional "ttl" and "idle" of writes, seconds */
+static int
+ws_check_expiry(const json_t *value, u_int64_t *out)
+{
+    json_int_t  v;
+
+    *out = 0;
+    if (value == NULL)
+        return (KORE_RESULT_OK);
+    if (!json_is_integer(value))
+        return (KORE_RESULT_ERROR);
+    v = json_integer_value(value);
+    if (v <= 0 || v > INT32_MAX)
+        return (KORE_RESULT_ERROR);
+    *out = (u_int64_t)v;
+    return (KORE_RESULT_OK);
+}
+
+void
+servo_ws_onmessage(struct connection *c, u_int8_t op, void *data, size_t len)
+{
+    struct servo_ws         *ws = c->hdlr_extra;
+    struct servo_ws_op       bad, *o;
+    json_t                  *msg;
+    json_error_t             jerr;
+    const char              *name, *key, *err;
+    u_int64_t                ttl, idle_ttl, retry_after;
+    size_t                   size = 0;
+    int                      code, status, quota;
+
+    servo_stats_count(STATS_WS_MESSAGES, 1);
+    servo_stats_bytes_in(SERVO_CONTENT_JSON, len);
+
+    memset(&bad, 0, sizeof(bad));
+    msg = NULL;
+    if (op != WEBSOCKET_OP_TEXT ||
+        (msg = json_loadb(data, len, 0, &jerr)) == NULL ||
+        !json_is_object(msg)) {
+        ws_reply(ws, &bad, 400, "Malformed message");
+        if (msg != NULL)
+            json_decref(msg);
+        return;
+    }
+
+    bad.id = json_object_get(msg, "id");
+    name = json_string_value(json_object_get(msg, "op"));
+    key = json_string_value(json_object_get(msg, "key"));
+
+    for (code = 0; name != NULL && ws_op_names[code] != NULL; code++) {
+        if (strcmp(name, ws_op_names[code]) == 0)
+            break;
+    }
+    if (name == NULL || ws_op_names[code] == NULL) {
+        ws_reply(ws, &bad, 400, "Unknown operation");
+        json_decref(msg);
+        return;
+    }
+    if (!ws_valid_key(key)) {
+        ws_reply(ws, &bad, 400, "Invalid item key");
+        json_decref(msg);
+        return;
+    }
+    if ((code == WS_OP_POST || code == WS_OP_PUT) &&
+        (status = ws_check_value(json_object_get(msg, "value"), &size,
+                                 &err)) != 0) {
+        ws_reply(ws, &bad, status, err);
+        json_decref(msg);
+        return;
+    }
+    if (!ws_check_expiry(json_object_get(msg, "ttl"), &ttl) ||
+        !ws_check_expiry(json_object_get(msg, "idle"), &idle_ttl)) {
+        ws_reply(ws, &bad, 400, "Invalid TTL");
+        json_decref(msg);
+        return;
+    }
+    /* each message counts as a request of the session */
+    if (!servo_ratelimit_client(ws->client_id, &retry_after)) {
+        ws_reply(ws, &bad, 429, "Too many requests");
+        json_decref(msg);
+        return;
+    }
+    if (ws->nops >= CONFIG->ws_max_pending) {
+        ws_reply(ws, &bad, 503, "Too many pending operations");
+        json_decref(msg);
+        return;
+    }
+
+    o = kore_calloc(1, sizeof(struct servo_ws_op));
+    o->op = code;
+    o->key = kore_strdup(key);
+    if (bad.id != NULL)
+        o->id = json_incref(bad.id);
+    if (code == WS_OP_POST || code == WS_OP_PUT) {
+        o->value = json_incref(json_object_get(msg, "value"));
+        o->ttl = ttl;
+        o->idle_ttl = idle_ttl;
+    }
+    if (code == WS_OP_PUT)
+        o->upsert = json_is_true(json_object_get(msg, "upsert"));
+    if ((code == WS_OP_PUT || code == WS_OP_DELETE) &&
+        !ws_check_version(json_object_get(msg, "version"), o)) {
+        ws_reply(ws, o, 400, "Invalid version");
+        ws_op_free(o);
+        json_decref(msg);
+        return;
+    }
+    json_decref(msg);
+
+    /* session quotas, the new value counts on top of the usage */
+    o->size = size;
+    if ((code == WS_OP_POST || code == WS_OP_PUT) &&
+        (quota = servo_quota_check(ws->client_id,
+                                   code == WS_OP_POST ? SERVO_QUOTA_CREATES :
+                                   o->upsert && !o->match ?
+                                   SERVO_QUOTA_MAY_CREATE :
+                                   SERVO_QUOTA_UPDATES,
+                                   size)) != SERVO_QUOTA_OK) {
+        ws_reply(ws, o, 403, servo_quota_text(quota));
+        ws_op_free(o);
+        return;
+    }
+
+    if (code == WS_OP_WATCH || code == WS_OP_UNWATCH) {
+        ws_watch(ws, o);
+        ws_op_free(o);
+        return;
+    }
+    ws_enqueue(ws, o);
+}
+
+void
+servo_ws_ondisconnect(struct connection *c)
+{
+    struct servo_ws         *ws = c->hdlr_extra;
+    struct servo_ws_op      *op;
+    struct servo_ws_watch   *w;
+
+    c->hdlr_extra = NULL;
+    ws->c = NULL;
+    kore_log(LOG_NOTICE, "{%s} << close websocket session", ws->client);
+
+    while ((w = LIST_FIRST(&ws->watches)) != NULL)
+        ws_unwatch(w);
+    while ((op = TAILQ_FIRST(&ws->ops)) != NULL) {
+        ws_dequeue(ws, op);
+        ws_op_free(op);
+    }
+    ws_unpark(ws);
+
+    /* the query in flight frees it when done */
+    if (ws->op == NULL)
+        ws_free(ws);
+}
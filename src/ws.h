@@ -0,0 +1,82 @@
+#ifndef _SERVO_WS_H_
+#define _SERVO_WS_H_
+
+#include <sys/queue.h>
+
+#include <kore/kore.h>
+#include <kore/http.h>
+#include <kore/pgsql.h>
+
+#include "servo.h"
+#include "watch.h"
+
+/* message operations */
+#define WS_OP_GET               0
+#define WS_OP_POST              1
+#define WS_OP_PUT               2
+#define WS_OP_DELETE            3
+#define WS_OP_WATCH             4
+#define WS_OP_UNWATCH           5
+#define WS_OP_CHANGE            6   /* read of a watched item, internal */
+
+/* item operation queued on a websocket */
+struct servo_ws_op {
+    int                              op;
+    json_t                          *id;
+    char                            *key;
+    json_t                          *value;
+    u_int64_t                        ttl;
+    u_int64_t                        idle_ttl;
+    int                              match;
+    u_int64_t                        match_version;
+    int                              upsert;
+    int                              bloom_added;
+    size_t                           size;
+    u_int64_t                        queued;
+
+    TAILQ_ENTRY(servo_ws_op)         list;
+};
+
+struct servo_ws;
+
+struct servo_ws_watch {
+    struct servo_watch_sub           sub;
+    struct servo_ws                 *ws;
+
+    LIST_ENTRY(servo_ws_watch)       list;
+};
+
+/* session bound to a websocket connection */
+struct servo_ws {
+    struct connection               *c;
+    uuid_t                           client_id;
+    char                             client[CLIENT_UUID_LEN];
+    char                            *token;
+    u_int64_t                        last_write;
+
+    struct kore_pgsql                sql;
+    struct servo_ws_op              *op;
+    int                              replica;
+    int                              waiting;
+    int                              completing;
+
+    /* result of the operation in flight */
+    int                              status;
+    json_t                          *result;
+    u_int64_t                        version;
+
+    TAILQ_HEAD(, servo_ws_op)        ops;
+    size_t                           nops;
+    LIST_HEAD(, servo_ws_watch)      watches;
+
+    TAILQ_ENTRY(servo_ws)            list;
+};
+
+void                 servo_ws_init(void);
+int                  servo_ws_connect(struct http_request *);
+void                 servo_ws_onconnect(struct connection *);
+void                 servo_ws_onmessage(struct connection *, u_int8_t,
+                                        void *, size_t);
+void                 servo_ws_ondisconnect(struct connection *);
+
+#endif //_SERVO_WS_H_
@@ -4,23 +4,520 @@ create database servodb encoding 'UTF8';
 
 create table item (
 	key			varchar(255),
-	client		varchar(36),
+	client		uuid,
 	last_read	timestamp not null,
 	last_write	timestamp not null,
 	str_val		text,
 	json_val	json,
 	blob_val	bytea,
+	version		bigint not null default 1,
+	idle_ttl	integer,
+	expires_at	timestamp,
+	blob_hash	bytea,
 	primary key(key, client)
 );
 
-create function servo_get_item(c varchar(36), k varchar(255))
-	returns table(str_val text, json_val json, blob_val bytea) as $$
+-- expired items are purged in ranges of this index, see src/expire.c
+create index item_expires_at on item(expires_at) where expires_at is not null;
+
+-- blob values stored once by content, items refer to them by hash
+create table blob (
+	hash		bytea primary key,
+	data		bytea not null,
+	refs		bigint not null default 0
+);
+
+-- kept uncompressed, so byte ranges read only the chunks they span
+alter table blob alter column data set storage external;
+
+-- unreferenced blobs are purged along with expired items
+create index blob_unused on blob(hash) where refs <= 0;
+
+create function servo_blob_size(h bytea)
+	returns integer as $$
+	select octet_length(b.data) from blob b where b.hash = h;
+$$ language sql stable;
+
+-- moves a blob value written to an item into the blob table
+create function servo_blob_store()
+	returns trigger as $$
+declare
+	h	bytea;
+begin
+	if new.blob_val is null then
+		new.blob_hash := null;
+		return new;
+	end if;
+	h := sha256(new.blob_val);
+	loop
+		-- known content is not written again
+		insert into blob (hash, data) values (h, new.blob_val)
+			on conflict (hash) do nothing;
+		-- kept from the purge until servo_blob_refs() counts the item,
+		-- locked for that update already, so writers of the same
+		-- content queue here rather than deadlock upgrading a share lock
+		perform 1 from blob b where b.hash = h for no key update;
+		exit when found;
+	end loop;
+	new.blob_hash := h;
+	new.blob_val := null;
+	return new;
+end;
+$$ language plpgsql;
+
+create function servo_blob_refs()
+	returns trigger as $$
+begin
+	if tg_op <> 'DELETE' and new.blob_hash is not null and
+	   (tg_op = 'INSERT' or new.blob_hash is distinct from old.blob_hash) then
+		update blob set refs = refs + 1 where hash = new.blob_hash;
+	end if;
+	if tg_op <> 'INSERT' and old.blob_hash is not null and
+	   (tg_op = 'DELETE' or new.blob_hash is distinct from old.blob_hash) then
+		update blob set refs = refs - 1 where hash = old.blob_hash;
+	end if;
+	return null;
+end;
+$$ language plpgsql;
+
+create trigger item_blob_store before insert or update of blob_val on item
+	for each row execute procedure servo_blob_store();
+
+create trigger item_blob_refs after insert or delete or update of blob_val, blob_hash on item
+	for each row execute procedure servo_blob_refs();
+
+create function servo_get_item(c uuid, k varchar(255))
+	returns table(str_val text, json_val json, blob_val bytea, version bigint) as $$
+begin
+	-- reads push back the expiry of items with an idle ttl
+	update item i set last_read = now(),
+		expires_at = coalesce(now() + i.idle_ttl * interval '1 second', i.expires_at)
+		where i.key = k and i.client = c and (i.expires_at is null or i.expires_at > now());
+	return query select i.str_val, i.json_val,
+		coalesce(i.blob_val, (select b.data from blob b where b.hash = i.blob_hash)),
+		i.version from item i
+		where i.key = k and i.client = c and (i.expires_at is null or i.expires_at > now());
+end;
+$$ language plpgsql;
+
+-- a byte range of a blob item, see Range requests in src/item.c:
+-- f is the first byte, or minus a suffix length, n the length or null
+-- for the rest. size and first are null when the whole value is due,
+-- for other items or blobs not at If-Range version v, and blob_val is
+-- null when the range starts past the end.
+create function servo_item_range(c uuid, k varchar(255), f bigint, n bigint, v bigint)
+	returns table(str_val text, json_val json, blob_val bytea, version bigint,
+	              size bigint, first bigint) as $$
+	select i.str_val, i.json_val,
+		case when r.first is null then d.data
+			when r.first < r.size then substring(d.data from r.first + 1
+				for least(coalesce(n, r.size), r.size - r.first))
+		end,
+		i.version, r.size, r.first
+	from item i
+	cross join lateral (select coalesce(i.blob_val,
+		(select b.data from blob b where b.hash = i.blob_hash)) as data) d
+	left join lateral (select octet_length(d.data)::bigint as size,
+		case when f < 0 then greatest(octet_length(d.data) + f, 0) else f end as first
+		where d.data is not null and (v is null or i.version = v)) r on true
+	where i.key = k and i.client = c and (i.expires_at is null or i.expires_at > now());
+$$ language sql stable;
+
+create function servo_get_item_range(c uuid, k varchar(255), f bigint, n bigint, v bigint)
+	returns table(str_val text, json_val json, blob_val bytea, version bigint,
+	              size bigint, first bigint) as $$
+begin
+	update item i set last_read = now(),
+		expires_at = coalesce(now() + i.idle_ttl * interval '1 second', i.expires_at)
+		where i.key = k and i.client = c and (i.expires_at is null or i.expires_at > now());
+	return query select * from servo_item_range(c, k, f, n, v);
+end;
+$$ language plpgsql;
+
+
+-- item writes, see src/item.c: each returns the version written,
+-- whether it created the item and the sizes of the value it replaced,
+-- read under the row lock before the write, see src/quota.c
+create function servo_put_item(c uuid, k varchar(255), s text, j json, b bytea,
+                               t integer, d integer, v bigint)
+	returns table(version bigint, inserted boolean,
+	              str_size integer, json_size integer, blob_size integer) as $$
+#variable_conflict use_column
+begin
+	select octet_length(i.str_val), octet_length(i.json_val::text),
+		coalesce(octet_length(i.blob_val), servo_blob_size(i.blob_hash))
+		into str_size, json_size, blob_size
+		from item i where i.client = c and i.key = k for update;
+	update item i set str_val = s, json_val = j, blob_val = b, last_write = now(),
+		version = i.version + 1,
+		idle_ttl = case when t is null then coalesce(d, i.idle_ttl) else d end,
+		expires_at = coalesce(now() + coalesce(t, d, i.idle_ttl) * interval '1 second',
+			i.expires_at)
+		where i.client = c and i.key = k and (i.expires_at is null or i.expires_at > now())
+			and (v is null or i.version = v)
+		returning i.version, false into version, inserted;
+	if found then
+		return next;
+	end if;
+end;
+$$ language plpgsql;
+
+create function servo_upsert_item(c uuid, k varchar(255), s text, j json, b bytea,
+                                  t integer, d integer)
+	returns table(version bigint, inserted boolean,
+	              str_size integer, json_size integer, blob_size integer) as $$
+#variable_conflict use_column
+begin
+	select octet_length(i.str_val), octet_length(i.json_val::text),
+		coalesce(octet_length(i.blob_val), servo_blob_size(i.blob_hash))
+		into str_size, json_size, blob_size
+		from item i where i.client = c and i.key = k for update;
+	insert into item as i (client, key, last_read, last_write, str_val, json_val,
+			blob_val, idle_ttl, expires_at)
+		values (c, k, now(), now(), s, j, b, d,
+			now() + coalesce(t, d) * interval '1 second')
+		on conflict (key, client) do update set last_write = now(),
+			str_val = excluded.str_val, json_val = excluded.json_val,
+			blob_val = excluded.blob_val, version = i.version + 1,
+			idle_ttl = case
+				when i.expires_at <= now() or t is not null then excluded.idle_ttl
+				else coalesce(excluded.idle_ttl, i.idle_ttl)
+				end,
+			expires_at = case
+				when i.expires_at <= now() then excluded.expires_at
+				else coalesce(now() + coalesce(t, d, i.idle_ttl) * interval '1 second',
+					i.expires_at)
+				end
+		returning i.version, i.xmax::text = '0' into version, inserted;
+	return next;
+end;
+$$ language plpgsql;
+
+-- creates the item, or takes the key of an expired one
+create function servo_post_item(c uuid, k varchar(255), s text, j json, b bytea,
+                                t integer, d integer)
+	returns table(version bigint, inserted boolean,
+	              str_size integer, json_size integer, blob_size integer) as $$
+#variable_conflict use_column
 begin
-	update item i set last_read = now() where i.key = k and i.client = c;
-	return query select i.str_val, i.json_val, i.blob_val from item i where i.key = k and i.client = c;
+	select octet_length(i.str_val), octet_length(i.json_val::text),
+		coalesce(octet_length(i.blob_val), servo_blob_size(i.blob_hash))
+		into str_size, json_size, blob_size
+		from item i where i.client = c and i.key = k and i.expires_at <= now()
+		for update;
+	insert into item as i (client, key, last_read, last_write, str_val, json_val,
+			blob_val, idle_ttl, expires_at)
+		values (c, k, now(), now(), s, j, b, d,
+			now() + coalesce(t, d) * interval '1 second')
+		on conflict (key, client) do update set last_read = now(), last_write = now(),
+			str_val = excluded.str_val, json_val = excluded.json_val,
+			blob_val = excluded.blob_val, idle_ttl = excluded.idle_ttl,
+			expires_at = excluded.expires_at, version = i.version + 1
+			where i.expires_at <= now()
+		returning i.version, i.xmax::text = '0' into version, inserted;
+	if found then
+		return next;
+	end if;
 end;
 $$ language plpgsql;
 
+-- pushes back the idle expiry of items read from replicas, see
+-- src/expire.c, items expired in between stay expired
+create function servo_touch_items(c uuid[], k varchar(255)[])
+	returns void as $$
+	update item i set last_read = now(),
+		expires_at = now() + i.idle_ttl * interval '1 second'
+		from unnest(c, k) t(client, key)
+		where i.client = t.client and i.key = t.key and i.idle_ttl is not null
+			and i.expires_at > now();
+$$ language sql;
+
+
+-- wakes watches of an item, see src/watch.c
+create function servo_item_notify()
+	returns trigger as $$
+declare
+	r	item;
+begin
+	if tg_op = 'DELETE' then
+		r := old;
+	else
+		r := new;
+	end if;
+	perform pg_notify('servo_item', r.client || ' ' || r.key);
+	return null;
+end;
+$$ language plpgsql;
+
+create trigger item_notify after insert or delete or update of version on item
+	for each row execute procedure servo_item_notify();
+
+
+-- atomic counters, see src/counter.c
+create function servo_add_items(c uuid[], k varchar(255)[], d bigint[])
+	returns table(client uuid, key varchar(255), str_val text, json_val json,
+	              blob_val bytea, version bigint, inserted boolean) as $$
+	insert into item as i (key, client, last_read, last_write, str_val)
+		select t.k, t.c, now(), now(), t.d::text from unnest(c, k, d) as t(c, k, d)
+	on conflict (key, client) do update set
+		-- an expired item starts over
+		str_val = case
+			when i.expires_at <= now() then excluded.str_val
+			when i.json_val is null then
+				(coalesce(nullif(i.str_val, ''), '0')::numeric + excluded.str_val::numeric)::text
+			end,
+		json_val = case
+			when i.expires_at <= now() then null
+			when i.json_val is not null then
+				to_json(i.json_val::text::numeric + excluded.str_val::numeric)
+			end,
+		blob_val = null,
+		idle_ttl = case when i.expires_at <= now() then null else i.idle_ttl end,
+		expires_at = case
+			when i.expires_at <= now() then null
+			else coalesce(now() + i.idle_ttl * interval '1 second', i.expires_at)
+			end,
+		last_write = now(),
+		version = i.version + 1
+		-- anything but a number is left alone and not returned
+		where i.expires_at <= now() or
+			(i.blob_val is null and i.blob_hash is null and (json_typeof(i.json_val) = 'number' or
+			 (i.json_val is null and coalesce(nullif(i.str_val, ''), '0') ~ '^-?[0-9]+$')))
+	returning i.client, i.key, i.str_val, i.json_val, i.blob_val, i.version,
+		i.xmax::text = '0';
+$$ language sql;
+
+create function servo_append_item(c uuid, k varchar(255), v text,
+                                  str_max integer, json_max integer)
+	returns table(str_val text, json_val json, blob_val bytea, version bigint) as $$
+declare
+	r	item;
+begin
+	select * into r from item i where i.key = k and i.client = c
+		and (i.expires_at is null or i.expires_at > now()) for update;
+	if not found then
+		return;
+	end if;
+
+	if r.blob_val is not null or r.blob_hash is not null or
+	   (r.json_val is not null and json_typeof(r.json_val) <> 'array') then
+		raise exception 'item does not take appends' using errcode = 'wrong_object_type';
+	end if;
+
+	if r.json_val is not null then
+		r.json_val := (r.json_val::jsonb || jsonb_build_array(v::jsonb))::json;
+		if length(r.json_val::text) > json_max then
+			raise exception 'item is too large' using errcode = 'program_limit_exceeded';
+		end if;
+	else
+		r.str_val := coalesce(r.str_val, '') || v;
+		if length(r.str_val) > str_max then
+			raise exception 'item is too large' using errcode = 'program_limit_exceeded';
+		end if;
+	end if;
+
+	update item i set str_val = r.str_val, json_val = r.json_val,
+		last_write = now(), version = i.version + 1,
+		expires_at = coalesce(now() + i.idle_ttl * interval '1 second', i.expires_at)
+		where i.key = k and i.client = c
+		returning i.version into r.version;
+	return query select r.str_val, r.json_val, r.blob_val, r.version;
+end;
+$$ language plpgsql;
+
+
+-- writes behind, see src/writeback.c: upserts in order, each as
+-- upsert_item.sql, returning whether it created the item and the sizes
+-- of the value it replaced
+create function servo_put_items(c uuid[], k varchar(255)[], s text[], j json[],
+                                b bytea[], t integer[], d integer[])
+	returns table(client uuid, key varchar(255), version bigint, inserted boolean,
+	              str_size integer, json_size integer, blob_size integer) as $$
+#variable_conflict use_column
+declare
+	n	integer;
+begin
+	for n in 1 .. coalesce(array_length(c, 1), 0) loop
+		client := c[n];
+		key := k[n];
+		str_size := null;
+		json_size := null;
+		blob_size := null;
+		select octet_length(i.str_val), octet_length(i.json_val::text),
+			coalesce(octet_length(i.blob_val), servo_blob_size(i.blob_hash))
+			into str_size, json_size, blob_size
+			from item i where i.client = c[n] and i.key = k[n] for update;
+		insert into item as i (client, key, last_read, last_write, str_val, json_val,
+				blob_val, idle_ttl, expires_at)
+			values (c[n], k[n], now(), now(), s[n], j[n], b[n], d[n],
+				now() + coalesce(t[n], d[n]) * interval '1 second')
+			on conflict (key, client) do update set last_write = now(),
+				str_val = excluded.str_val, json_val = excluded.json_val,
+				blob_val = excluded.blob_val, version = i.version + 1,
+				idle_ttl = case
+					when i.expires_at <= now() or t[n] is not null then excluded.idle_ttl
+					else coalesce(excluded.idle_ttl, i.idle_ttl)
+					end,
+				expires_at = case
+					when i.expires_at <= now() then excluded.expires_at
+					else coalesce(now() + coalesce(t[n], d[n], i.idle_ttl) * interval '1 second',
+						i.expires_at)
+					end
+			returning i.version, i.xmax::text = '0' into version, inserted;
+		return next;
+	end loop;
+end;
+$$ language plpgsql;
+
+
+-- durable copies of items under selected key prefixes, see src/storage.c:
+-- with tools/storage the item and blob tables may be unlogged, a crash
+-- empties them and the durable items are restored from this table
+create table item_durable (like item including defaults, primary key(key, client));
+
+-- emptied by a crash along with unlogged items, marks them restored
+create unlogged table item_restored (
+	restored_at	timestamp not null
+);
+
+create function servo_restore_copies()
+	returns table(client uuid, key varchar(255)) as $$
+	insert into item as i select * from item_durable d
+		where d.expires_at is null or d.expires_at > now()
+		on conflict do nothing
+		returning i.client, i.key;
+$$ language sql;
+
+-- once after each crash of a database with unlogged items, returns the
+-- items restored
+create function servo_restore_items()
+	returns table(client uuid, key varchar(255)) as $$
+begin
+	lock table item_restored in exclusive mode;
+	if exists (select 1 from item_restored) or
+			(select c.relpersistence from pg_class c
+				where c.oid = 'item'::regclass) <> 'u' then
+		return;
+	end if;
+	insert into item_restored values (now());
+	return query select * from servo_restore_copies();
+end;
+$$ language plpgsql;
+
+-- copies items under prefixes p written since the last snapshot, with
+-- their blobs, and drops copies of items gone. An item table emptied by
+-- a crash is restored first rather than taken for deletes.
+create function servo_snapshot_items(p text[])
+	returns table(client uuid, key varchar(255)) as $$
+#variable_conflict use_column
+begin
+	return query select * from servo_restore_items();
+	delete from item_durable d where not exists (select 1 from item i
+			where i.key = d.key and i.client = d.client
+				and (i.expires_at is null or i.expires_at > now()))
+		or not exists (select 1 from unnest(p) x where left(d.key, length(x)) = x);
+	insert into item_durable as d
+		select i.key, i.client, i.last_read, i.last_write, i.str_val, i.json_val,
+			coalesce(i.blob_val, b.data), i.version, i.idle_ttl, i.expires_at, null
+		from item i left join blob b on b.hash = i.blob_hash
+		where exists (select 1 from unnest(p) x where left(i.key, length(x)) = x)
+			and (i.expires_at is null or i.expires_at > now())
+			and not exists (select 1 from item_durable c
+				where c.key = i.key and c.client = i.client
+					and c.version = i.version and c.last_write = i.last_write)
+		on conflict (key, client) do update set last_read = excluded.last_read,
+			last_write = excluded.last_write, str_val = excluded.str_val,
+			json_val = excluded.json_val, blob_val = excluded.blob_val,
+			version = excluded.version, idle_ttl = excluded.idle_ttl,
+			expires_at = excluded.expires_at;
+end;
+$$ language plpgsql;
+
+
+-- moving sessions between shards, see tools/rebalance.c
+create function servo_export_items(c uuid[])
+	returns json as $$
+	-- blobs go along with their items, the other shard stores them again
+	select coalesce(json_agg(to_jsonb(i) - 'blob_hash' ||
+		jsonb_build_object('blob_val', coalesce(i.blob_val, b.data))), '[]')
+		from item i left join blob b on b.hash = i.blob_hash
+		where i.client = any(c);
+$$ language sql;
+
+create function servo_import_items(data json)
+	returns integer as $$
+declare
+	r	item;
+	n	integer := 0;
+begin
+	for r in select * from json_populate_recordset(null::item, data) loop
+		-- newer copy wins, so copying twice picks up late writes
+		delete from item i where i.key = r.key and i.client = r.client
+			and i.last_write < r.last_write;
+		insert into item values (r.*) on conflict do nothing;
+		if found then
+			n := n + 1;
+		end if;
+	end loop;
+	return n;
+end;
+$$ language plpgsql;
+
+-- deletes while sessions move, carried to their new shard by the last
+-- copy, recorded from the first copy until the purge
+create table item_tombstone (
+	client		uuid,
+	key			varchar(255),
+	deleted_at	timestamp not null,
+	primary key(client, key)
+);
+
+create table rebalance (
+	active		boolean not null
+);
+insert into rebalance values (false);
+
+create function servo_item_tombstone()
+	returns trigger as $$
+begin
+	if (select r.active from rebalance r) then
+		insert into item_tombstone values (old.client, old.key, now())
+			on conflict (client, key) do update set deleted_at = excluded.deleted_at;
+	end if;
+	return null;
+end;
+$$ language plpgsql;
+
+create trigger item_deletes after delete on item
+	for each row execute procedure servo_item_tombstone();
+
+-- starts recording deletes, or stops and forgets them
+create function servo_rebalance(a boolean)
+	returns void as $$
+	update rebalance set active = a;
+	delete from item_tombstone where not a;
+$$ language sql;
+
+create function servo_export_tombstones(c uuid[])
+	returns json as $$
+	select coalesce(json_agg(t), '[]') from item_tombstone t where t.client = any(c);
+$$ language sql;
+
+-- drops copies of items deleted since, a write after the delete stays
+create function servo_import_tombstones(data json)
+	returns integer as $$
+	with d as (delete from item i
+		using json_populate_recordset(null::item_tombstone, data) t
+		where i.client = t.client and i.key = t.key and i.last_write < t.deleted_at
+		returning 1)
+	select count(*)::integer from d;
+$$ language sql;
+
 
 create user servo with password 'test';
-grant all privileges on table item to servo;
\ No newline at end of file
+grant all privileges on table item to servo;
+grant all privileges on table blob to servo;
+grant all privileges on table item_durable to servo;
+grant all privileges on table item_restored to servo;
+grant all privileges on table item_tombstone to servo;
+grant all privileges on table rebalance to servo;
\ No newline at end of file
@@ -0,0 +1,15 @@
+-- Store client ids as 16 byte uuid instead of varchar(36)
+
+\connect servodb;
+
+drop function if exists servo_get_item(varchar(36), varchar(255));
+
+alter table item alter column client type uuid using client::uuid;
+
+create function servo_get_item(c uuid, k varchar(255))
+	returns table(str_val text, json_val json, blob_val bytea) as $$
+begin
+	update item i set last_read = now() where i.key = k and i.client = c;
+	return query select i.str_val, i.json_val, i.blob_val from item i where i.key = k and i.client = c;
+end;
+$$ language plpgsql;
@@ -0,0 +1,27 @@
+-- Functions used by servo-rebalance to move sessions between shards
+
+\connect servodb;
+
+create function servo_export_items(c uuid[])
+	returns json as $$
+	select coalesce(json_agg(i), '[]') from item i where i.client = any(c);
+$$ language sql;
+
+create function servo_import_items(data json)
+	returns integer as $$
+declare
+	r	item;
+	n	integer := 0;
+begin
+	for r in select * from json_populate_recordset(null::item, data) loop
+		-- newer copy wins, so copying twice picks up late writes
+		delete from item i where i.key = r.key and i.client = r.client
+			and i.last_write < r.last_write;
+		insert into item values (r.*) on conflict do nothing;
+		if found then
+			n := n + 1;
+		end if;
+	end loop;
+	return n;
+end;
+$$ language plpgsql;
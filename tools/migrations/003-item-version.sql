@@ -0,0 +1,33 @@
+-- Item versions and change notifications for long-poll watches
+
+\connect servodb;
+
+alter table item add column version bigint not null default 1;
+
+drop function if exists servo_get_item(uuid, varchar(255));
+
+create function servo_get_item(c uuid, k varchar(255))
+	returns table(str_val text, json_val json, blob_val bytea, version bigint) as $$
+begin
+	update item i set last_read = now() where i.key = k and i.client = c;
+	return query select i.str_val, i.json_val, i.blob_val, i.version from item i where i.key = k and i.client = c;
+end;
+$$ language plpgsql;
+
+create function servo_item_notify()
+	returns trigger as $$
+declare
+	r	item;
+begin
+	if tg_op = 'DELETE' then
+		r := old;
+	else
+		r := new;
+	end if;
+	perform pg_notify('servo_item', r.client || ' ' || r.key);
+	return null;
+end;
+$$ language plpgsql;
+
+create trigger item_notify after insert or delete or update of version on item
+	for each row execute procedure servo_item_notify();
@@ -0,0 +1,91 @@
+-- Per-item expiry, fixed or pushed back by reads and writes
+
+\connect servodb;
+
+alter table item add column idle_ttl integer;
+alter table item add column expires_at timestamp;
+
+create index item_expires_at on item(expires_at) where expires_at is not null;
+
+create or replace function servo_get_item(c uuid, k varchar(255))
+	returns table(str_val text, json_val json, blob_val bytea, version bigint) as $$
+begin
+	-- reads push back the expiry of items with an idle ttl
+	update item i set last_read = now(),
+		expires_at = coalesce(now() + i.idle_ttl * interval '1 second', i.expires_at)
+		where i.key = k and i.client = c and (i.expires_at is null or i.expires_at > now());
+	return query select i.str_val, i.json_val, i.blob_val, i.version from item i
+		where i.key = k and i.client = c and (i.expires_at is null or i.expires_at > now());
+end;
+$$ language plpgsql;
+
+create or replace function servo_add_items(c uuid[], k varchar(255)[], d bigint[])
+	returns table(client uuid, key varchar(255), str_val text, json_val json,
+	              blob_val bytea, version bigint, inserted boolean) as $$
+	insert into item as i (key, client, last_read, last_write, str_val)
+		select t.k, t.c, now(), now(), t.d::text from unnest(c, k, d) as t(c, k, d)
+	on conflict (key, client) do update set
+		-- an expired item starts over
+		str_val = case
+			when i.expires_at <= now() then excluded.str_val
+			when i.json_val is null then
+				(coalesce(nullif(i.str_val, ''), '0')::numeric + excluded.str_val::numeric)::text
+			end,
+		json_val = case
+			when i.expires_at <= now() then null
+			when i.json_val is not null then
+				to_json(i.json_val::text::numeric + excluded.str_val::numeric)
+			end,
+		blob_val = null,
+		idle_ttl = case when i.expires_at <= now() then null else i.idle_ttl end,
+		expires_at = case
+			when i.expires_at <= now() then null
+			else coalesce(now() + i.idle_ttl * interval '1 second', i.expires_at)
+			end,
+		last_write = now(),
+		version = i.version + 1
+		-- anything but a number is left alone and not returned
+		where i.expires_at <= now() or
+			(i.blob_val is null and (json_typeof(i.json_val) = 'number' or
+			 (i.json_val is null and coalesce(nullif(i.str_val, ''), '0') ~ '^-?[0-9]+$')))
+	returning i.client, i.key, i.str_val, i.json_val, i.blob_val, i.version,
+		i.xmax::text = '0';
+$$ language sql;
+
+create or replace function servo_append_item(c uuid, k varchar(255), v text,
+                                  str_max integer, json_max integer)
+	returns table(str_val text, json_val json, blob_val bytea, version bigint) as $$
+declare
+	r	item;
+begin
+	select * into r from item i where i.key = k and i.client = c
+		and (i.expires_at is null or i.expires_at > now()) for update;
+	if not found then
+		return;
+	end if;
+
+	if r.blob_val is not null or
+	   (r.json_val is not null and json_typeof(r.json_val) <> 'array') then
+		raise exception 'item does not take appends' using errcode = 'wrong_object_type';
+	end if;
+
+	if r.json_val is not null then
+		r.json_val := (r.json_val::jsonb || jsonb_build_array(v::jsonb))::json;
+		if length(r.json_val::text) > json_max then
+			raise exception 'item is too large' using errcode = 'program_limit_exceeded';
+		end if;
+	else
+		r.str_val := coalesce(r.str_val, '') || v;
+		if length(r.str_val) > str_max then
+			raise exception 'item is too large' using errcode = 'program_limit_exceeded';
+		end if;
+	end if;
+
+	update item i set str_val = r.str_val, json_val = r.json_val,
+		last_write = now(), version = i.version + 1,
+		expires_at = coalesce(now() + i.idle_ttl * interval '1 second', i.expires_at)
+		where i.key = k and i.client = c
+		returning i.version into r.version;
+	return query select r.str_val, r.json_val, r.blob_val, r.version;
+end;
+$$ language plpgsql;
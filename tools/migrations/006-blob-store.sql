@@ -0,0 +1,168 @@
+-- Blob values stored once by content in the blob table
+-- needs PostgreSQL 11 or later for sha256()
+
+\connect servodb;
+
+alter table item add column blob_hash bytea;
+
+-- blob values stored once by content, items refer to them by hash
+create table blob (
+	hash		bytea primary key,
+	data		bytea not null,
+	refs		bigint not null default 0
+);
+
+-- unreferenced blobs are purged along with expired items
+create index blob_unused on blob(hash) where refs <= 0;
+
+create function servo_blob_size(h bytea)
+	returns integer as $$
+	select octet_length(b.data) from blob b where b.hash = h;
+$$ language sql stable;
+
+-- moves a blob value written to an item into the blob table
+create function servo_blob_store()
+	returns trigger as $$
+declare
+	h	bytea;
+begin
+	if new.blob_val is null then
+		new.blob_hash := null;
+		return new;
+	end if;
+	h := sha256(new.blob_val);
+	loop
+		-- known content is not written again
+		insert into blob (hash, data) values (h, new.blob_val)
+			on conflict (hash) do nothing;
+		-- kept from the purge until servo_blob_refs() counts the item,
+		-- locked for that update already, so writers of the same
+		-- content queue here rather than deadlock upgrading a share lock
+		perform 1 from blob b where b.hash = h for no key update;
+		exit when found;
+	end loop;
+	new.blob_hash := h;
+	new.blob_val := null;
+	return new;
+end;
+$$ language plpgsql;
+
+create function servo_blob_refs()
+	returns trigger as $$
+begin
+	if tg_op <> 'DELETE' and new.blob_hash is not null and
+	   (tg_op = 'INSERT' or new.blob_hash is distinct from old.blob_hash) then
+		update blob set refs = refs + 1 where hash = new.blob_hash;
+	end if;
+	if tg_op <> 'INSERT' and old.blob_hash is not null and
+	   (tg_op = 'DELETE' or new.blob_hash is distinct from old.blob_hash) then
+		update blob set refs = refs - 1 where hash = old.blob_hash;
+	end if;
+	return null;
+end;
+$$ language plpgsql;
+
+create trigger item_blob_store before insert or update of blob_val on item
+	for each row execute procedure servo_blob_store();
+
+create trigger item_blob_refs after insert or delete or update of blob_val, blob_hash on item
+	for each row execute procedure servo_blob_refs();
+
+create or replace function servo_get_item(c uuid, k varchar(255))
+	returns table(str_val text, json_val json, blob_val bytea, version bigint) as $$
+begin
+	-- reads push back the expiry of items with an idle ttl
+	update item i set last_read = now(),
+		expires_at = coalesce(now() + i.idle_ttl * interval '1 second', i.expires_at)
+		where i.key = k and i.client = c and (i.expires_at is null or i.expires_at > now());
+	return query select i.str_val, i.json_val,
+		coalesce(i.blob_val, (select b.data from blob b where b.hash = i.blob_hash)),
+		i.version from item i
+		where i.key = k and i.client = c and (i.expires_at is null or i.expires_at > now());
+end;
+$$ language plpgsql;
+
+create or replace function servo_add_items(c uuid[], k varchar(255)[], d bigint[])
+	returns table(client uuid, key varchar(255), str_val text, json_val json,
+	              blob_val bytea, version bigint, inserted boolean) as $$
+	insert into item as i (key, client, last_read, last_write, str_val)
+		select t.k, t.c, now(), now(), t.d::text from unnest(c, k, d) as t(c, k, d)
+	on conflict (key, client) do update set
+		-- an expired item starts over
+		str_val = case
+			when i.expires_at <= now() then excluded.str_val
+			when i.json_val is null then
+				(coalesce(nullif(i.str_val, ''), '0')::numeric + excluded.str_val::numeric)::text
+			end,
+		json_val = case
+			when i.expires_at <= now() then null
+			when i.json_val is not null then
+				to_json(i.json_val::text::numeric + excluded.str_val::numeric)
+			end,
+		blob_val = null,
+		idle_ttl = case when i.expires_at <= now() then null else i.idle_ttl end,
+		expires_at = case
+			when i.expires_at <= now() then null
+			else coalesce(now() + i.idle_ttl * interval '1 second', i.expires_at)
+			end,
+		last_write = now(),
+		version = i.version + 1
+		-- anything but a number is left alone and not returned
+		where i.expires_at <= now() or
+			(i.blob_val is null and i.blob_hash is null and (json_typeof(i.json_val) = 'number' or
+			 (i.json_val is null and coalesce(nullif(i.str_val, ''), '0') ~ '^-?[0-9]+$')))
+	returning i.client, i.key, i.str_val, i.json_val, i.blob_val, i.version,
+		i.xmax::text = '0';
+$$ language sql;
+
+create or replace function servo_append_item(c uuid, k varchar(255), v text,
+                                  str_max integer, json_max integer)
+	returns table(str_val text, json_val json, blob_val bytea, version bigint) as $$
+declare
+	r	item;
+begin
+	select * into r from item i where i.key = k and i.client = c
+		and (i.expires_at is null or i.expires_at > now()) for update;
+	if not found then
+		return;
+	end if;
+
+	if r.blob_val is not null or r.blob_hash is not null or
+	   (r.json_val is not null and json_typeof(r.json_val) <> 'array') then
+		raise exception 'item does not take appends' using errcode = 'wrong_object_type';
+	end if;
+
+	if r.json_val is not null then
+		r.json_val := (r.json_val::jsonb || jsonb_build_array(v::jsonb))::json;
+		if length(r.json_val::text) > json_max then
+			raise exception 'item is too large' using errcode = 'program_limit_exceeded';
+		end if;
+	else
+		r.str_val := coalesce(r.str_val, '') || v;
+		if length(r.str_val) > str_max then
+			raise exception 'item is too large' using errcode = 'program_limit_exceeded';
+		end if;
+	end if;
+
+	update item i set str_val = r.str_val, json_val = r.json_val,
+		last_write = now(), version = i.version + 1,
+		expires_at = coalesce(now() + i.idle_ttl * interval '1 second', i.expires_at)
+		where i.key = k and i.client = c
+		returning i.version into r.version;
+	return query select r.str_val, r.json_val, r.blob_val, r.version;
+end;
+$$ language plpgsql;
+
+create or replace function servo_export_items(c uuid[])
+	returns json as $$
+	-- blobs go along with their items, the other shard stores them again
+	select coalesce(json_agg(to_jsonb(i) - 'blob_hash' ||
+		jsonb_build_object('blob_val', coalesce(i.blob_val, b.data))), '[]')
+		from item i left join blob b on b.hash = i.blob_hash
+		where i.client = any(c);
+$$ language sql;
+
+-- blobs already stored move to the blob table
+update item set blob_val = blob_val where blob_val is not null;
+
+grant all privileges on table blob to servo;
@@ -0,0 +1,41 @@
+-- Byte ranges of blob items read only the span from storage
+-- blobs stored before keep their compression and are read whole
+-- for a range, blobs written from now on are stored uncompressed
+
+\connect servodb;
+
+alter table blob alter column data set storage external;
+
+-- a byte range of a blob item, see Range requests in src/item.c:
+-- f is the first byte, or minus a suffix length, n the length or null
+-- for the rest. size and first are null when the whole value is due,
+-- for other items or blobs not at If-Range version v, and blob_val is
+-- null when the range starts past the end.
+create function servo_item_range(c uuid, k varchar(255), f bigint, n bigint, v bigint)
+	returns table(str_val text, json_val json, blob_val bytea, version bigint,
+	              size bigint, first bigint) as $$
+	select i.str_val, i.json_val,
+		case when r.first is null then d.data
+			when r.first < r.size then substring(d.data from r.first + 1
+				for least(coalesce(n, r.size), r.size - r.first))
+		end,
+		i.version, r.size, r.first
+	from item i
+	cross join lateral (select coalesce(i.blob_val,
+		(select b.data from blob b where b.hash = i.blob_hash)) as data) d
+	left join lateral (select octet_length(d.data)::bigint as size,
+		case when f < 0 then greatest(octet_length(d.data) + f, 0) else f end as first
+		where d.data is not null and (v is null or i.version = v)) r on true
+	where i.key = k and i.client = c and (i.expires_at is null or i.expires_at > now());
+$$ language sql stable;
+
+create function servo_get_item_range(c uuid, k varchar(255), f bigint, n bigint, v bigint)
+	returns table(str_val text, json_val json, blob_val bytea, version bigint,
+	              size bigint, first bigint) as $$
+begin
+	update item i set last_read = now(),
+		expires_at = coalesce(now() + i.idle_ttl * interval '1 second', i.expires_at)
+		where i.key = k and i.client = c and (i.expires_at is null or i.expires_at > now());
+	return query select * from servo_item_range(c, k, f, n, v);
+end;
+$$ language plpgsql;
@@ -0,0 +1,46 @@
+-- Write behind: PUTs acknowledged from a journal and written in batches
+
+\connect servodb;
+
+-- writes behind, see src/writeback.c: upserts in order, each as
+-- upsert_item.sql, returning whether it created the item and the sizes
+-- of the value it replaced
+create function servo_put_items(c uuid[], k varchar(255)[], s text[], j json[],
+                                b bytea[], t integer[], d integer[])
+	returns table(client uuid, key varchar(255), version bigint, inserted boolean,
+	              str_size integer, json_size integer, blob_size integer) as $$
+#variable_conflict use_column
+declare
+	n	integer;
+begin
+	for n in 1 .. coalesce(array_length(c, 1), 0) loop
+		client := c[n];
+		key := k[n];
+		str_size := null;
+		json_size := null;
+		blob_size := null;
+		select octet_length(i.str_val), octet_length(i.json_val::text),
+			coalesce(octet_length(i.blob_val), servo_blob_size(i.blob_hash))
+			into str_size, json_size, blob_size
+			from item i where i.client = c[n] and i.key = k[n] for update;
+		insert into item as i (client, key, last_read, last_write, str_val, json_val,
+				blob_val, idle_ttl, expires_at)
+			values (c[n], k[n], now(), now(), s[n], j[n], b[n], d[n],
+				now() + coalesce(t[n], d[n]) * interval '1 second')
+			on conflict (key, client) do update set last_write = now(),
+				str_val = excluded.str_val, json_val = excluded.json_val,
+				blob_val = excluded.blob_val, version = i.version + 1,
+				idle_ttl = case
+					when i.expires_at <= now() or t[n] is not null then excluded.idle_ttl
+					else coalesce(excluded.idle_ttl, i.idle_ttl)
+					end,
+				expires_at = case
+					when i.expires_at <= now() then excluded.expires_at
+					else coalesce(now() + coalesce(t[n], d[n], i.idle_ttl) * interval '1 second',
+						i.expires_at)
+					end
+			returning i.version, i.xmax::text = '0' into version, inserted;
+		return next;
+	end loop;
+end;
+$$ language plpgsql;
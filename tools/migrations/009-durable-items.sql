@@ -0,0 +1,70 @@
+-- Durable copies of items, restored after a crash with unlogged items
+-- see tools/storage to switch the item and blob tables to unlogged
+
+\connect servodb;
+
+-- durable copies of items under selected key prefixes, see src/storage.c:
+-- with tools/storage the item and blob tables may be unlogged, a crash
+-- empties them and the durable items are restored from this table
+create table item_durable (like item including defaults, primary key(key, client));
+
+-- emptied by a crash along with unlogged items, marks them restored
+create unlogged table item_restored (
+	restored_at	timestamp not null
+);
+
+create function servo_restore_copies()
+	returns table(client uuid, key varchar(255)) as $$
+	insert into item as i select * from item_durable d
+		where d.expires_at is null or d.expires_at > now()
+		on conflict do nothing
+		returning i.client, i.key;
+$$ language sql;
+
+-- once after each crash of a database with unlogged items, returns the
+-- items restored
+create function servo_restore_items()
+	returns table(client uuid, key varchar(255)) as $$
+begin
+	lock table item_restored in exclusive mode;
+	if exists (select 1 from item_restored) or
+			(select c.relpersistence from pg_class c
+				where c.oid = 'item'::regclass) <> 'u' then
+		return;
+	end if;
+	insert into item_restored values (now());
+	return query select * from servo_restore_copies();
+end;
+$$ language plpgsql;
+
+-- copies items under prefixes p written since the last snapshot, with
+-- their blobs, and drops copies of items gone. An item table emptied by
+-- a crash is restored first rather than taken for deletes.
+create function servo_snapshot_items(p text[])
+	returns table(client uuid, key varchar(255)) as $$
+#variable_conflict use_column
+begin
+	return query select * from servo_restore_items();
+	delete from item_durable d where not exists (select 1 from item i
+			where i.key = d.key and i.client = d.client
+				and (i.expires_at is null or i.expires_at > now()))
+		or not exists (select 1 from unnest(p) x where left(d.key, length(x)) = x);
+	insert into item_durable as d
+		select i.key, i.client, i.last_read, i.last_write, i.str_val, i.json_val,
+			coalesce(i.blob_val, b.data), i.version, i.idle_ttl, i.expires_at, null
+		from item i left join blob b on b.hash = i.blob_hash
+		where exists (select 1 from unnest(p) x where left(i.key, length(x)) = x)
+			and (i.expires_at is null or i.expires_at > now())
+			and not exists (select 1 from item_durable c
+				where c.key = i.key and c.client = i.client
+					and c.version = i.version and c.last_write = i.last_write)
+		on conflict (key, client) do update set last_read = excluded.last_read,
+			last_write = excluded.last_write, str_val = excluded.str_val,
+			json_val = excluded.json_val, blob_val = excluded.blob_val,
+			version = excluded.version, idle_ttl = excluded.idle_ttl,
+			expires_at = excluded.expires_at;
+end;
+$$ language plpgsql;
+
+grant all privileges on table item_durable to servo;
+grant all privileges on table item_restored to servo;
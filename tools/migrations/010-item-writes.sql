@@ -0,0 +1,90 @@
+-- Item writes read the sizes of the value they replace under the row
+-- lock, before the write, for the session quotas
+
+\connect servodb;
+
+-- item writes, see src/item.c: each returns the version written,
+-- whether it created the item and the sizes of the value it replaced,
+-- read under the row lock before the write, see src/quota.c
+create function servo_put_item(c uuid, k varchar(255), s text, j json, b bytea,
+                               t integer, d integer, v bigint)
+	returns table(version bigint, inserted boolean,
+	              str_size integer, json_size integer, blob_size integer) as $$
+#variable_conflict use_column
+begin
+	select octet_length(i.str_val), octet_length(i.json_val::text),
+		coalesce(octet_length(i.blob_val), servo_blob_size(i.blob_hash))
+		into str_size, json_size, blob_size
+		from item i where i.client = c and i.key = k for update;
+	update item i set str_val = s, json_val = j, blob_val = b, last_write = now(),
+		version = i.version + 1,
+		idle_ttl = case when t is null then coalesce(d, i.idle_ttl) else d end,
+		expires_at = coalesce(now() + coalesce(t, d, i.idle_ttl) * interval '1 second',
+			i.expires_at)
+		where i.client = c and i.key = k and (i.expires_at is null or i.expires_at > now())
+			and (v is null or i.version = v)
+		returning i.version, false into version, inserted;
+	if found then
+		return next;
+	end if;
+end;
+$$ language plpgsql;
+
+create function servo_upsert_item(c uuid, k varchar(255), s text, j json, b bytea,
+                                  t integer, d integer)
+	returns table(version bigint, inserted boolean,
+	              str_size integer, json_size integer, blob_size integer) as $$
+#variable_conflict use_column
+begin
+	select octet_length(i.str_val), octet_length(i.json_val::text),
+		coalesce(octet_length(i.blob_val), servo_blob_size(i.blob_hash))
+		into str_size, json_size, blob_size
+		from item i where i.client = c and i.key = k for update;
+	insert into item as i (client, key, last_read, last_write, str_val, json_val,
+			blob_val, idle_ttl, expires_at)
+		values (c, k, now(), now(), s, j, b, d,
+			now() + coalesce(t, d) * interval '1 second')
+		on conflict (key, client) do update set last_write = now(),
+			str_val = excluded.str_val, json_val = excluded.json_val,
+			blob_val = excluded.blob_val, version = i.version + 1,
+			idle_ttl = case
+				when i.expires_at <= now() or t is not null then excluded.idle_ttl
+				else coalesce(excluded.idle_ttl, i.idle_ttl)
+				end,
+			expires_at = case
+				when i.expires_at <= now() then excluded.expires_at
+				else coalesce(now() + coalesce(t, d, i.idle_ttl) * interval '1 second',
+					i.expires_at)
+				end
+		returning i.version, i.xmax::text = '0' into version, inserted;
+	return next;
+end;
+$$ language plpgsql;
+
+-- creates the item, or takes the key of an expired one
+create function servo_post_item(c uuid, k varchar(255), s text, j json, b bytea,
+                                t integer, d integer)
+	returns table(version bigint, inserted boolean,
+	              str_size integer, json_size integer, blob_size integer) as $$
+#variable_conflict use_column
+begin
+	select octet_length(i.str_val), octet_length(i.json_val::text),
+		coalesce(octet_length(i.blob_val), servo_blob_size(i.blob_hash))
+		into str_size, json_size, blob_size
+		from item i where i.client = c and i.key = k and i.expires_at <= now()
+		for update;
+	insert into item as i (client, key, last_read, last_write, str_val, json_val,
+			blob_val, idle_ttl, expires_at)
+		values (c, k, now(), now(), s, j, b, d,
+			now() + coalesce(t, d) * interval '1 second')
+		on conflict (key, client) do update set last_read = now(), last_write = now(),
+			str_val = excluded.str_val, json_val = excluded.json_val,
+			blob_val = excluded.blob_val, idle_ttl = excluded.idle_ttl,
+			expires_at = excluded.expires_at, version = i.version + 1
+			where i.expires_at <= now()
+		returning i.version, i.xmax::text = '0' into version, inserted;
+	if found then
+		return next;
+	end if;
+end;
+$$ language plpgsql;
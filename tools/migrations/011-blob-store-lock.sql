@@ -0,0 +1,31 @@
+-- Writers of the same blob content lock its row for the refs update
+-- right away, for databases that applied 006-blob-store before the fix
+
+\connect servodb;
+
+-- moves a blob value written to an item into the blob table
+create or replace function servo_blob_store()
+	returns trigger as $$
+declare
+	h	bytea;
+begin
+	if new.blob_val is null then
+		new.blob_hash := null;
+		return new;
+	end if;
+	h := sha256(new.blob_val);
+	loop
+		-- known content is not written again
+		insert into blob (hash, data) values (h, new.blob_val)
+			on conflict (hash) do nothing;
+		-- kept from the purge until servo_blob_refs() counts the item,
+		-- locked for that update already, so writers of the same
+		-- content queue here rather than deadlock upgrading a share lock
+		perform 1 from blob b where b.hash = h for no key update;
+		exit when found;
+	end loop;
+	new.blob_hash := h;
+	new.blob_val := null;
+	return new;
+end;
+$$ language plpgsql;
@@ -0,0 +1,14 @@
+-- Reads from replicas push back the idle expiry on the primary
+
+\connect servodb;
+
+-- pushes back the idle expiry of items read from replicas, see
+-- src/expire.c, items expired in between stay expired
+create function servo_touch_items(c uuid[], k varchar(255)[])
+	returns void as $$
+	update item i set last_read = now(),
+		expires_at = now() + i.idle_ttl * interval '1 second'
+		from unnest(c, k) t(client, key)
+		where i.client = t.client and i.key = t.key and i.idle_ttl is not null
+			and i.expires_at > now();
+$$ language sql;
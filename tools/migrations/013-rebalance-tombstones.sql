@@ -0,0 +1,56 @@
+-- Deletes while sessions move between shards, see tools/rebalance.c
+
+\connect servodb;
+
+-- deletes while sessions move, carried to their new shard by the last
+-- copy, recorded from the first copy until the purge
+create table item_tombstone (
+	client		uuid,
+	key			varchar(255),
+	deleted_at	timestamp not null,
+	primary key(client, key)
+);
+
+create table rebalance (
+	active		boolean not null
+);
+insert into rebalance values (false);
+
+create function servo_item_tombstone()
+	returns trigger as $$
+begin
+	if (select r.active from rebalance r) then
+		insert into item_tombstone values (old.client, old.key, now())
+			on conflict (client, key) do update set deleted_at = excluded.deleted_at;
+	end if;
+	return null;
+end;
+$$ language plpgsql;
+
+create trigger item_deletes after delete on item
+	for each row execute procedure servo_item_tombstone();
+
+-- starts recording deletes, or stops and forgets them
+create function servo_rebalance(a boolean)
+	returns void as $$
+	update rebalance set active = a;
+	delete from item_tombstone where not a;
+$$ language sql;
+
+create function servo_export_tombstones(c uuid[])
+	returns json as $$
+	select coalesce(json_agg(t), '[]') from item_tombstone t where t.client = any(c);
+$$ language sql;
+
+-- drops copies of items deleted since, a write after the delete stays
+create function servo_import_tombstones(data json)
+	returns integer as $$
+	with d as (delete from item i
+		using json_populate_recordset(null::item_tombstone, data) t
+		where i.client = t.client and i.key = t.key and i.last_write < t.deleted_at
+		returning 1)
+	select count(*)::integer from d;
+$$ language sql;
+
+grant all privileges on table item_tombstone to servo;
+grant all privileges on table rebalance to servo;
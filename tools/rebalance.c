@@ -0,0 +1,249 @@
+/*
+ * servo-rebalance moves sessions to the shard the ring assigns them
+ * to after shards were appended to the [servo] database list. Give it
+ * all shard connection strings in configuration order:
+ *
+ *   servo-rebalance copy  "host=db0 ..." "host=db1 ..." "host=db2 ..."
+ *   (restart servo with the new database list)
+ *   servo-rebalance copy  ...     picks up writes made in the meantime
+ *   (restart servo again if it keeps a bloom filter)
+ *   servo-rebalance purge ...     drops moved sessions from old shards
+ *
+ * Copies are merged by last_write, so running copy twice is safe.
+ * From the first copy until the purge the shards record deletes, and
+ * each copy drops the moved items deleted since on the old shard.
+ */
+
+#include <sys/types.h>
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <libpq-fe.h>
+#include <uuid/uuid.h>
+
+#include "../src/ring.h"
+
+#define BATCH_SIZE          256
+#define FETCH_SIZE          "1000"
+
+struct batch {
+    char        *buf;
+    size_t       len;
+    size_t       cap;
+    size_t       count;
+};
+
+static PGconn           **conns;
+static size_t             nconns;
+static struct servo_ring  ring;
+static int                dry_run = 0;
+static int                purge = 0;
+static long               moved = 0;
+static long               dropped = 0;
+
+static void
+fatal(PGconn *conn, const char *what)
+{
+    fprintf(stderr, "servo-rebalance: %s: %s\n", what,
+            conn != NULL ? PQerrorMessage(conn) : "");
+    exit(1);
+}
+
+static PGresult *
+query(PGconn *conn, const char *sql, const char *param, ExecStatusType ok)
+{
+    PGresult    *res;
+
+    res = PQexecParams(conn, sql, param != NULL ? 1 : 0, NULL,
+                       param != NULL ? &param : NULL, NULL, NULL, 0);
+    if (PQresultStatus(res) != ok)
+        fatal(conn, sql);
+    return res;
+}
+
+static void
+batch_add(struct batch *b, const char *client)
+{
+    size_t  need;
+
+    need = b->len + strlen(client) + 3;
+    if (need > b->cap) {
+        b->cap = need * 2;
+        if ((b->buf = realloc(b->buf, b->cap)) == NULL)
+            fatal(NULL, "out of memory");
+    }
+
+    b->len += sprintf(b->buf + b->len, "%c%s", b->count ? ',' : '{', client);
+    b->count++;
+}
+
+static void
+batch_flush(size_t src, size_t dst, struct batch *b)
+{
+    PGresult    *exported, *res;
+
+    if (b->count == 0)
+        return;
+    b->len += sprintf(b->buf + b->len, "}");
+
+    if (dry_run) {
+        moved += b->count;
+    }
+    else if (purge) {
+        res = query(conns[src], "delete from item where client = any($1::uuid[])",
+                    b->buf, PGRES_COMMAND_OK);
+        moved += atol(PQcmdTuples(res));
+        PQclear(res);
+    }
+    else {
+        exported = query(conns[src], "select servo_export_items($1::uuid[])",
+                         b->buf, PGRES_TUPLES_OK);
+        res = query(conns[dst], "select servo_import_items($1::json)",
+                    PQgetvalue(exported, 0, 0), PGRES_TUPLES_OK);
+        moved += atol(PQgetvalue(res, 0, 0));
+        PQclear(res);
+        PQclear(exported);
+
+        exported = query(conns[src], "select servo_export_tombstones($1::uuid[])",
+                         b->buf, PGRES_TUPLES_OK);
+        res = query(conns[dst], "select servo_import_tombstones($1::json)",
+                    PQgetvalue(exported, 0, 0), PGRES_TUPLES_OK);
+        dropped += atol(PQgetvalue(res, 0, 0));
+        PQclear(res);
+        PQclear(exported);
+    }
+
+    b->len = 0;
+    b->count = 0;
+}
+
+static void
+rebalance_shard(size_t src, struct batch *batches)
+{
+    PGresult    *res;
+    uuid_t       client;
+    const char  *value;
+    u_int32_t    dst;
+    int          i, rows;
+    long         before, before_dropped;
+
+    before = moved;
+    before_dropped = dropped;
+    PQclear(query(conns[src], "begin", NULL, PGRES_COMMAND_OK));
+    PQclear(query(conns[src],
+                  "declare clients no scroll cursor for "
+                  "select distinct client from item",
+                  NULL, PGRES_COMMAND_OK));
+
+    do {
+        res = query(conns[src], "fetch " FETCH_SIZE " from clients",
+                    NULL, PGRES_TUPLES_OK);
+        rows = PQntuples(res);
+        for (i = 0; i < rows; i++) {
+            value = PQgetvalue(res, i, 0);
+            if (uuid_parse(value, client) != 0)
+                continue;
+            dst = servo_ring_lookup(&ring, client, sizeof(uuid_t));
+            if (dst == src)
+                continue;
+            batch_add(&batches[dst], value);
+            if (batches[dst].count == BATCH_SIZE)
+                batch_flush(src, dst, &batches[dst]);
+        }
+        PQclear(res);
+    } while (rows > 0);
+
+    for (dst = 0; dst < nconns; dst++)
+        batch_flush(src, dst, &batches[dst]);
+
+    PQclear(query(conns[src], "close clients", NULL, PGRES_COMMAND_OK));
+    PQclear(query(conns[src], "commit", NULL, PGRES_COMMAND_OK));
+
+    printf("shard %zu: %s %ld %s", src,
+           dry_run ? "would move" : purge ? "purged" : "copied",
+           moved - before, dry_run ? "sessions" : "rows");
+    if (!dry_run && !purge)
+        printf(", dropped %ld deleted", dropped - before_dropped);
+    printf("\n");
+}
+
+static void
+usage(void)
+{
+    fprintf(stderr, "usage: servo-rebalance [-n] [-v vnodes] copy|purge "
+                    "<conninfo> ...\n");
+    exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct batch    *batches;
+    size_t           i, vnodes;
+    int              ch;
+
+    vnodes = SERVO_RING_VNODES;
+    while ((ch = getopt(argc, argv, "nv:h")) != -1) {
+        switch (ch) {
+        case 'n':
+            dry_run = 1;
+            break;
+        case 'v':
+            vnodes = strtoul(optarg, NULL, 10);
+            break;
+        default:
+            usage();
+        }
+    }
+    argc -= optind;
+    argv += optind;
+
+    if (argc < 2 || vnodes == 0)
+        usage();
+    if (strcmp(argv[0], "purge") == 0)
+        purge = 1;
+    else if (strcmp(argv[0], "copy") != 0)
+        usage();
+
+    nconns = argc - 1;
+    conns = calloc(nconns, sizeof(PGconn *));
+    batches = calloc(nconns, sizeof(struct batch));
+    if (conns == NULL || batches == NULL)
+        fatal(NULL, "out of memory");
+
+    for (i = 0; i < nconns; i++) {
+        conns[i] = PQconnectdb(argv[i + 1]);
+        if (PQstatus(conns[i]) != CONNECTION_OK)
+            fatal(conns[i], argv[i + 1]);
+    }
+
+    if (!servo_ring_build(&ring, nconns, vnodes))
+        fatal(NULL, "failed to build ring");
+
+    /* deletes are recorded until the purge, which forgets them */
+    for (i = 0; i < nconns && !dry_run; i++) {
+        PQclear(query(conns[i], "select servo_rebalance($1::boolean)",
+                      purge ? "false" : "true", PGRES_TUPLES_OK));
+    }
+
+    for (i = 0; i < nconns; i++)
+        rebalance_shard(i, batches);
+
+    /* the filter only counts keys written through servo */
+    if (!dry_run && !purge)
+        printf("restart servo if it keeps a bloom filter, so the keys "
+               "copied are in it\n");
+
+    for (i = 0; i < nconns; i++) {
+        free(batches[i].buf);
+        PQfinish(conns[i]);
+    }
+    free(batches);
+    free(conns);
+    servo_ring_free(&ring);
+
+    return 0;
+}